@@ -0,0 +1,306 @@
+/*
+ * breaker.cpp - A circuit breaker per Cassandra node
+ * CSC 652 - 2014
+ *
+ * Every response to a client's request is counted against the node that answered it, in windows of breaker_window_ms. It is a
+ * failure if it is an UNAVAILABLE, OVERLOADED, IS_BOOTSTRAPPING, READ_TIMEOUT or WRITE_TIMEOUT error, if it took longer than
+ * breaker_slow_ms, or if the request timed out in the gateway (see timeout.cpp). Once breaker_failure_percent of at least
+ * breaker_min_requests in a window have failed, the node's breaker opens:
+ *
+ *  - the node gets no new client connections, as if it had been ejected (see upstream.cpp);
+ *  - reads for it (which the client's driver may retry, since they are idempotent) go to a healthy node on one of the session's
+ *    routes (see ring.cpp) if there is one ready for them, and EXECUTEs routed to it go to the session's own node if that is
+ *    healthy. Other requests of sessions already connected to it still go to it, since they can't be moved.
+ *
+ * After breaker_open_ms the breaker goes half-open with the next request routed to the node. Then up to breaker_probes requests
+ * at a time are let through to it as probes, and other requests are kept away from it as while it was open. breaker_probes probes
+ * answered in time close the breaker, while a single failed one opens it again. Only probes count while it is half-open, nothing
+ * is counted against a node while its breaker is open, nor is a response that is dropped (its request timed out, or was a hedged
+ * read answered first by the other node).
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include <vector>
+
+#include "breaker.hpp"
+#include "config.hpp"
+#include "log.hpp"
+#include "stats.hpp"
+
+static pthread_mutex_t breaker_mutex = PTHREAD_MUTEX_INITIALIZER; // protects the nodes' breakers
+static uint64_t rerouted = 0; // requests sent to another node than intended because its breaker was open
+
+bool BreakerEnabled() {
+    return gateway_config.breaker_failure_percent > 0;
+}
+
+/*
+ * Opens a node's breaker. Called with breaker_mutex held.
+ */
+static void trip(cql_node_t *n, uint64_t now) {
+    n->breaker = BREAKER_OPEN;
+    n->breaker_opened_us = now;
+    n->trips++;
+}
+
+/*
+ * Counts a request answered by a node, or timed out, towards its breaker. probe is whether it was let through as one.
+ */
+static void record(cql_node_t *n, bool failed, bool probe) {
+    uint64_t now = StatsNowUs();
+    int changed = -1; // BREAKER_* it was moved to, if any
+    uint32_t requests = 0;
+    uint32_t failures = 0;
+
+    pthread_mutex_lock(&breaker_mutex);
+    if (probe && n->probes_in_flight > 0) {
+        n->probes_in_flight--;
+    }
+    if (n->breaker == BREAKER_CLOSED) {
+        if (now - n->window_start_us >= (uint64_t)gateway_config.breaker_window_ms * 1000) {
+            n->window_start_us = now;
+            n->window_requests = 0;
+            n->window_failures = 0;
+        }
+        n->window_requests++;
+        if (failed) {
+            n->window_failures++;
+        }
+        requests = n->window_requests;
+        failures = n->window_failures;
+        if (requests >= gateway_config.breaker_min_requests && (uint64_t)failures * 100 >= (uint64_t)gateway_config.breaker_failure_percent * requests) {
+            trip(n, now);
+            changed = BREAKER_OPEN;
+        }
+    }
+    else if (n->breaker == BREAKER_HALF_OPEN && probe) {
+        if (failed) {
+            trip(n, now);
+            changed = BREAKER_OPEN;
+        }
+        else if (++n->probes >= gateway_config.breaker_probes) {
+            n->breaker = BREAKER_CLOSED;
+            n->window_start_us = now;
+            n->window_requests = 0;
+            n->window_failures = 0;
+            changed = BREAKER_CLOSED;
+        }
+    }
+    pthread_mutex_unlock(&breaker_mutex);
+
+    if (changed == BREAKER_OPEN && requests > 0) {
+        LOG(LOG_WARN, "Cassandra node %s failed %u of its last %u requests, opening its circuit breaker.\n", n->name, failures, requests);
+    }
+    else if (changed == BREAKER_OPEN) {
+        LOG(LOG_WARN, "Cassandra node %s failed a request while its circuit breaker was half-open, opening it again.\n", n->name);
+    }
+    else if (changed == BREAKER_CLOSED) {
+        LOG(LOG_WARN, "Cassandra node %s answered %u requests in time, closing its circuit breaker.\n", n->name, gateway_config.breaker_probes);
+    }
+}
+
+/*
+ * Gives back the slot of a probe whose answer won't be counted.
+ */
+static void releaseProbe(cql_node_t *n) {
+    pthread_mutex_lock(&breaker_mutex);
+    if (n->probes_in_flight > 0) {
+        n->probes_in_flight--;
+    }
+    pthread_mutex_unlock(&breaker_mutex);
+}
+
+/*
+ * Whether a node's breaker has been open for breaker_open_ms. Called with breaker_mutex held.
+ */
+static bool openLongEnough(cql_node_t *n) {
+    return StatsNowUs() - n->breaker_opened_us >= (uint64_t)gateway_config.breaker_open_ms * 1000;
+}
+
+/*
+ * Whether a node may be given new connections and requests: its breaker is closed, half-open with room for another probe, or has
+ * been open long enough to go half-open. Only looks; the breaker changes state on the way of a request, see admit().
+ */
+bool BreakerAllows(cql_node_t *n) {
+    if (!BreakerEnabled()) {
+        return true;
+    }
+
+    pthread_mutex_lock(&breaker_mutex);
+    bool allows = n->breaker == BREAKER_CLOSED ||
+                  (n->breaker == BREAKER_HALF_OPEN && n->probes_in_flight < gateway_config.breaker_probes) ||
+                  (n->breaker == BREAKER_OPEN && openLongEnough(n));
+    pthread_mutex_unlock(&breaker_mutex);
+
+    return allows;
+}
+
+/*
+ * Lets the request on an upstream stream be sent to a node, or not. A breaker that has been open for breaker_open_ms goes
+ * half-open here, and while it is half-open the request is let through as a probe if fewer than breaker_probes are waiting on the
+ * node. Marks the request as a probe or not.
+ */
+static bool admit(cql_thread_t *session, int8_t upstream, cql_node_t *n) {
+    bool half_opened = false;
+    bool probe = false;
+    pthread_mutex_lock(&breaker_mutex);
+    if (n->breaker == BREAKER_OPEN && openLongEnough(n)) {
+        n->breaker = BREAKER_HALF_OPEN;
+        n->probes = 0;
+        half_opened = true;
+    }
+    bool admitted = n->breaker == BREAKER_CLOSED;
+    if (n->breaker == BREAKER_HALF_OPEN && n->probes_in_flight < gateway_config.breaker_probes) {
+        n->probes_in_flight++;
+        admitted = probe = true;
+    }
+    pthread_mutex_unlock(&breaker_mutex);
+    __atomic_store_n(&session->inflight[upstream].probe, probe, __ATOMIC_RELAXED);
+
+    if (half_opened) {
+        LOG(LOG_WARN, "Cassandra node %s's circuit breaker is half-open, giving it requests again.\n", n->name);
+    }
+    return admitted;
+}
+
+/*
+ * Returns the route a request about to be sent on route (or on the session's own connection, if NULL) should go on instead, if the
+ * node it is for has its breaker open, or half-open with as many probes as it takes. An EXECUTE routed to its partition's owner
+ * goes back to the session's own node, and a read goes to the least busy healthy node the session has a route ready for. Anything
+ * else, or a read with nowhere else to go, is sent as it was going to be. This is where breakers go half-open and probes are let
+ * through, since the request is then sent.
+ */
+cql_route_t* BreakerReroute(cql_thread_t *session, cql_packet_t *packet, cql_route_t *route) {
+    if (!BreakerEnabled()) {
+        return route;
+    }
+
+    cql_node_t *n = (route != NULL) ? route->node : session->cassandra_node;
+    if (admit(session, packet->stream, n)) {
+        return route;
+    }
+
+    cql_route_t *to = route;
+    if (route != NULL && admit(session, packet->stream, session->cassandra_node)) {
+        to = NULL;
+    }
+    else if (RingIsRead(packet)) {
+        cql_route_t *spare = RingSpareRoute(session, packet, n); // Only ever a node whose breaker allows it
+        if (spare != NULL && admit(session, packet->stream, spare->node)) {
+            to = spare;
+        }
+    }
+
+    if (to != route) {
+        __atomic_add_fetch(&rerouted, 1, __ATOMIC_RELAXED);
+        SESSION_LOG(session, LOG_DEBUG, "%u: Circuit breaker of Cassandra node %s keeps it out, sending request on stream %d to %s.\n",
+                    session->id, n->name, packet->stream, (to != NULL) ? to->node->name : session->cassandra_node->name);
+    }
+    return to;
+}
+
+/*
+ * Counts a response from Cassandra to a client's request, read on the given upstream stream, against the node it was sent to.
+ * Must be called before the response is matched to its request, while the request's in-flight state is still there.
+ */
+void BreakerResponse(cql_thread_t *session, int8_t upstream, cql_packet_t *packet) {
+    if (!BreakerEnabled()) {
+        return;
+    }
+
+    cql_inflight_t *f = &session->inflight[upstream];
+    bool probe = __atomic_exchange_n(&f->probe, false, __ATOMIC_RELAXED); // Unless the timeout thread got to it first
+    pthread_mutex_lock(&session->mutex);
+    bool dropped = session->client_stream[upstream] < 0;
+    pthread_mutex_unlock(&session->mutex);
+    if (dropped || f->sent_us == 0) {
+        if (probe) {
+            releaseProbe(f->sent_node);
+        }
+        return;
+    }
+
+    bool failed = false;
+    if (packet->opcode == CQL_OPCODE_ERROR && ntohl(packet->length) >= 4) {
+        int32_t code = 0;
+        memcpy(&code, (char *)packet + sizeof(cql_packet_t), 4);
+        code = ntohl(code);
+        failed = code == CQL_ERROR_UNAVAILABLE_EXCEPTION || code == CQL_ERROR_OVERLOADED || code == CQL_ERROR_IS_BOOTSTRAPPING ||
+                 code == CQL_ERROR_READ_TIMEOUT || code == CQL_ERROR_WRITE_TIMEOUT;
+    }
+    if (!failed && gateway_config.breaker_slow_ms > 0) {
+        failed = StatsNowUs() - f->sent_us > (uint64_t)gateway_config.breaker_slow_ms * 1000;
+    }
+
+    record(f->sent_node, failed, probe);
+}
+
+/*
+ * Counts a request sent to a node that timed out in the gateway as a failure of the node. probe is whether it was let through as
+ * one, see admit().
+ */
+void BreakerTimedOut(cql_node_t *n, bool probe) {
+    if (BreakerEnabled() && n != NULL) {
+        record(n, true, probe);
+    }
+}
+
+/*
+ * Gives back the slots of a closing session's probes, which will never be answered. Must be called once its Cassandra thread
+ * and timeouts are done with it.
+ */
+void BreakerSessionClosed(cql_thread_t *session) {
+    if (!BreakerEnabled()) {
+        return;
+    }
+
+    for (int i = 0; i < CQL_MAX_STREAMS; i++) {
+        if (__atomic_exchange_n(&session->inflight[i].probe, false, __ATOMIC_RELAXED)) {
+            releaseProbe(session->inflight[i].sent_node);
+        }
+    }
+}
+
+/*
+ * Returns the state of every node's breaker in the Prometheus text format, for the stats endpoint.
+ */
+std::string BreakerRender() {
+    if (!BreakerEnabled()) {
+        return "";
+    }
+
+    uint32_t count;
+    cql_node_t *nodes = UpstreamNodes(&count);
+    std::vector<int> states(count);
+    std::vector<uint64_t> trips(count);
+    pthread_mutex_lock(&breaker_mutex);
+    for (uint32_t i = 0; i < count; i++) {
+        states[i] = nodes[i].breaker;
+        trips[i] = nodes[i].trips;
+    }
+    pthread_mutex_unlock(&breaker_mutex);
+
+    std::string out = "# HELP cql_gateway_upstream_breaker_state State of the node's circuit breaker: 0 closed, 1 open, 2 half-open.\n"
+                      "# TYPE cql_gateway_upstream_breaker_state gauge\n";
+    char line[160];
+    for (uint32_t i = 0; i < count; i++) {
+        snprintf(line, sizeof(line), "cql_gateway_upstream_breaker_state{node=\"%s\"} %d\n", nodes[i].name, states[i]);
+        out += line;
+    }
+    out += "# HELP cql_gateway_upstream_breaker_trips_total Times the node's circuit breaker opened.\n"
+           "# TYPE cql_gateway_upstream_breaker_trips_total counter\n";
+    for (uint32_t i = 0; i < count; i++) {
+        snprintf(line, sizeof(line), "cql_gateway_upstream_breaker_trips_total{node=\"%s\"} %lu\n", nodes[i].name, (unsigned long)trips[i]);
+        out += line;
+    }
+    out += "# HELP cql_gateway_breaker_rerouted_total Requests sent to another node because of an open circuit breaker.\n"
+           "# TYPE cql_gateway_breaker_rerouted_total counter\n";
+    snprintf(line, sizeof(line), "cql_gateway_breaker_rerouted_total %lu\n", (unsigned long)__atomic_load_n(&rerouted, __ATOMIC_RELAXED));
+    out += line;
+
+    return out;
+}
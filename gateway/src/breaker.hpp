@@ -0,0 +1,25 @@
+#ifndef _BREAKER_H
+#define _BREAKER_H
+
+#include <stdint.h>
+
+#include <string>
+
+#include "gateway.hpp"
+#include "ring.hpp"
+#include "upstream.hpp"
+
+// States of a node's circuit breaker, see breaker.cpp
+#define BREAKER_CLOSED    0 // the node is used as usual
+#define BREAKER_OPEN      1 // the node failed too many requests: it gets no new connections, and reads are sent elsewhere
+#define BREAKER_HALF_OPEN 2 // the node is being given requests again, to see whether it has recovered
+
+bool BreakerEnabled();
+bool BreakerAllows(cql_node_t *n);
+cql_route_t* BreakerReroute(cql_thread_t *session, cql_packet_t *packet, cql_route_t *route);
+void BreakerResponse(cql_thread_t *session, int8_t upstream, cql_packet_t *packet);
+void BreakerTimedOut(cql_node_t *n, bool probe);
+void BreakerSessionClosed(cql_thread_t *session);
+std::string BreakerRender();
+
+#endif
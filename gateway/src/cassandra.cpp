@@ -4,65 +4,56 @@
  */
 
 #include "cassandra.hpp"
+#include "config.hpp"
 #include "gateway.hpp"
+#include "log.hpp"
 
 using boost::shared_ptr;
 // This function is called asynchronously every time an event is logged
 void
 log_callback(const cql::cql_short_t, const std::string& message)
 {
-    std::cout << "LOG: " << message << std::endl;
+    LOG(LOG_DEBUG, "LOG: %s", message.c_str());
 }
 
 
 shared_ptr<cql::cql_builder_t> initCassandraBuilder(bool use_ssl){
     using namespace cql;
     using boost::shared_ptr;
-    #if DEBUG
-        std::cout << "[cassandra.cpp initCassandraBuilder] Init CQL.\n";
-    #endif
+    LOG(LOG_DEBUG, "[cassandra.cpp initCassandraBuilder] Init CQL.\n");
     // Init CQL
     cql_initialize();
-    #if DEBUG
-        std::cout << "[cassandra.cpp initCassandraBuilder] CQL Init Success.\n";
-    #endif    
+    LOG(LOG_DEBUG, "[cassandra.cpp initCassandraBuilder] CQL Init Success.\n");
     try{
         // listening at default port plus one (9042 + 1).
         shared_ptr<cql::cql_builder_t> builder = cql::cql_cluster_t::builder();
-        #if DEBUG
-            std::cout << "[cassandra.cpp initCassandraBuilder] CQL Builder Created.\n";
+        LOG(LOG_DEBUG, "[cassandra.cpp initCassandraBuilder] CQL Builder Created.\n");
+        if (__atomic_load_n(&log_level, __ATOMIC_RELAXED) >= LOG_DEBUG) {
             builder->with_log_callback(&log_callback); // Only log when debugging
-        #endif
-        builder->add_contact_point(boost::asio::ip::address::from_string(CASSANDRA_IP), CASSANDRA_PORT + 1);
-        #if DEBUG
-            std::cout << "[cassandra.cpp initCassandraBuilder] Builder Cluster Contact point Created.\n";
-        #endif
+        }
+        for (size_t i = 0; i < gateway_config.cassandra_nodes.size(); i++) {
+            struct sockaddr_in *addr = &gateway_config.cassandra_nodes[i];
+            builder->add_contact_point(boost::asio::ip::address_v4(ntohl(addr->sin_addr.s_addr)), ntohs(addr->sin_port));
+        }
+        LOG(LOG_DEBUG, "[cassandra.cpp initCassandraBuilder] Builder Cluster Contact point Created.\n");
 
         builder->with_credentials(CASSANDRA_ROOT_USERNAME, CASSANDRA_ROOT_PASSWORD);
-        #if DEBUG
-            std::cout << "[cassandra.cpp initCassandraBuilder] Set 'root' username and password for Cassandra.\n";
-        #endif
+        LOG(LOG_DEBUG, "[cassandra.cpp initCassandraBuilder] Set 'root' username and password for Cassandra.\n");
 
         if (use_ssl) {
             builder->with_ssl();
-            #if DEBUG
-                std::cout << "[cassandra.cpp initCassandraBuilder] SSL Enabled.\n";
-            #endif
+            LOG(LOG_DEBUG, "[cassandra.cpp initCassandraBuilder] SSL Enabled.\n");
         }
-        #if DEBUG
         else{
-            std::cout << "[cassandra.cpp initCassandraBuilder] SSL Disabled.\n";
+            LOG(LOG_DEBUG, "[cassandra.cpp initCassandraBuilder] SSL Disabled.\n");
         }
-        #endif
 
 	        
         return builder;
     }
     catch (std::exception& e)
     {
-        #if DEBUG
-            std::cout << "[cassandra.cpp initCassandraBuilder] **Exception Fail**.\n";
-        #endif
+        LOG(LOG_DEBUG, "[cassandra.cpp initCassandraBuilder] **Exception Fail**.\n");
         std::cout << "Exception: " << e.what() << std::endl;
         exit(1);
     }
@@ -88,50 +79,36 @@ bool checkToken(char *inToken, char *internalToken, bool use_ssl){
     }
     
     try{
-    #if DEBUG
-        std::cout << "[cassandra.cpp checkToken] Create Cluster.\n";
-    #endif
+    LOG(LOG_DEBUG, "[cassandra.cpp checkToken] Create Cluster.\n");
     
         shared_ptr<cql::cql_cluster_t> cluster(initCassandraBuilder(use_ssl)->build());
 		
-    #if DEBUG
-        std::cout << "[cassandra.cpp checkToken] Create Session.\n";
-    #endif
+    LOG(LOG_DEBUG, "[cassandra.cpp checkToken] Create Session.\n");
     
         shared_ptr<cql::cql_session_t> session(cluster->connect());	
         
-    #if DEBUG
-        std::cout << "[cassandra.cpp checkToken] Cluster and Session Created.\n";
-    #endif	
+    LOG(LOG_DEBUG, "[cassandra.cpp checkToken] Cluster and Session Created.\n");
     	
         if (session) {
-            #if DEBUG
-                std::cout << "[cassandra.cpp checkToken] Query - USE multiTenantCassandra.\n";
-            #endif
+            LOG(LOG_DEBUG, "[cassandra.cpp checkToken] Query - USE multiTenantCassandra.\n");
             shared_ptr<cql::cql_query_t> use_system(
             new cql::cql_query_t("USE multiTenantCassandra;", cql::CQL_CONSISTENCY_ONE));
             
             // send the query to Cassandra
             boost::shared_future<cql::cql_future_result_t> future = session->query(use_system);
-            #if DEBUG
-                std::cout << "[cassandra.cpp checkToken] Executing Query.\n";
-            #endif            
+            LOG(LOG_DEBUG, "[cassandra.cpp checkToken] Executing Query.\n");
             // wait for the query to execute
             future.wait();
-            #if DEBUG
-                std::cout << "[cassandra.cpp checkToken] Query Execution Returned.\n";
-            #endif            
+            LOG(LOG_DEBUG, "[cassandra.cpp checkToken] Query Execution Returned.\n");
             if(future.get().error.is_err()){
                 // Alert of error?
-                printf("'USE multiTenantCassandra' failed: '%s'\n", future.get().error.message.c_str());
+                LOG(LOG_ERROR, "'USE multiTenantCassandra' failed: '%s'\n", future.get().error.message.c_str());
                 internalToken = NULL;
                 session->close();
                 cluster->shutdown();
                 return false;
             }
-            #if DEBUG
-                std::cout << "[cassandra.cpp checkToken] Query - Attempt to find user token, prepare, send, compile.\n";
-            #endif            
+            LOG(LOG_DEBUG, "[cassandra.cpp checkToken] Query - Attempt to find user token, prepare, send, compile.\n");
             // Execute a query where we attempt to find an internal token
             shared_ptr<cql::cql_query_t> select_internal(
                 new cql::cql_query_t("SELECT internalToken, expiration FROM tokenTable WHERE userToken=?;", cql::CQL_CONSISTENCY_ONE));
@@ -140,12 +117,10 @@ bool checkToken(char *inToken, char *internalToken, bool use_ssl){
              // compile the parametrized query on the server
             future = session->prepare(select_internal);
             future.wait();
-            #if DEBUG
-                std::cout << "[cassandra.cpp checkToken] Attempt to find user token prepared statement compile return.\n";
-            #endif            
+            LOG(LOG_DEBUG, "[cassandra.cpp checkToken] Attempt to find user token prepared statement compile return.\n");
             if(future.get().error.is_err()){
                 // Alert of error?
-                printf("Statement prepare failed: '%s'\n", future.get().error.message.c_str());
+                LOG(LOG_ERROR, "Statement prepare failed: '%s'\n", future.get().error.message.c_str());
                 internalToken = NULL;
                 session->close();
                 cluster->shutdown();
@@ -161,28 +136,20 @@ bool checkToken(char *inToken, char *internalToken, bool use_ssl){
             
             // bind the query with concrete parameter, which was passed to function
             bound->push_back(inToken);
-            #if DEBUG
-                std::cout << "[cassandra.cpp checkToken] Push inToken to prepared statement.\n";
-            #endif
+            LOG(LOG_DEBUG, "[cassandra.cpp checkToken] Push inToken to prepared statement.\n");
             future = session->execute(bound);
-            #if DEBUG
-                std::cout << "[cassandra.cpp checkToken] Prepared statement - token check - Passed to execution.\n";
-            #endif
+            LOG(LOG_DEBUG, "[cassandra.cpp checkToken] Prepared statement - token check - Passed to execution.\n");
             future.wait();
-            #if DEBUG
-                std::cout << "[cassandra.cpp checkToken] Prepared statement - token check - returned from exectution.\n";
-            #endif            
+            LOG(LOG_DEBUG, "[cassandra.cpp checkToken] Prepared statement - token check - returned from exectution.\n");
             if(future.get().error.is_err()){
                 // Alert of error?
-                printf("User token query failed: '%s'\n", future.get().error.message.c_str());
+                LOG(LOG_ERROR, "User token query failed: '%s'\n", future.get().error.message.c_str());
                 internalToken = NULL;
                 session->close();
                 cluster->shutdown();
                 return false;               
             }
-            #if DEBUG
-                std::cout << "[cassandra.cpp checkToken] Computing query result.\n";
-            #endif
+            LOG(LOG_DEBUG, "[cassandra.cpp checkToken] Computing query result.\n");
 
             if (future.get().result) {
                 if ((*future.get().result).row_count() == 1) {
@@ -223,21 +190,18 @@ bool checkToken(char *inToken, char *internalToken, bool use_ssl){
                 cluster->shutdown();
                 return false;
             }
-            #if DEBUG
-            std::cout << "[cassandra.cpp checkToken] Close the session.\n";
-            #endif
+            LOG(LOG_DEBUG, "[cassandra.cpp checkToken] Close the session.\n");
             session->close();
         }
-        #if DEBUG
-        std::cout << "[cassandra.cpp checkToken] Shutdown cluster.\n";
-        #endif
+        LOG(LOG_DEBUG, "[cassandra.cpp checkToken] Shutdown cluster.\n");
         cluster->shutdown();
 	// TODO: Can I shutdown the cluster? 
 	return true;
     }
     catch (std::exception& e)
     {
-        std::cout << "Exception: " << e.what() << std::endl;
+        LOG(LOG_ERROR, "Exception: %s", e.what());
         return false;
     }
 }
+
@@ -0,0 +1,413 @@
+/*
+ * config.cpp - Reads the gateway's configuration file
+ * CSC 652 - 2014
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "config.hpp"
+#include "gateway.hpp"
+#include "listener.hpp"
+#include "log.hpp"
+#include "overload.hpp"
+
+// Defaults, used for anything not set in the configuration file
+cql_config_t gateway_config;
+
+/*
+ * Parses a node's "<IPv4 address>:<port>". Returns an address with sin_family AF_UNSPEC if it isn't one.
+ */
+static struct sockaddr_in parseNode(const char *s) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+
+    char ip[16];
+    unsigned int port;
+    char end;
+    if (sscanf(s, "%15[0-9.]:%u%c", ip, &port, &end) == 2 && port > 0 && port <= 65535 && inet_aton(ip, &addr.sin_addr) != 0) {
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+    }
+    return addr;
+}
+
+static void initDefaults() {
+    gateway_config.rate_limit_mode = RATE_LIMIT_DELAY;
+    gateway_config.rate_limit_max_delay_ms = 1000;
+    gateway_config.max_in_flight = 0;
+    gateway_config.shed_max_outstanding = 0;
+    gateway_config.shed_max_latency_ms = 0;
+    gateway_config.request_timeout_ms = 0;
+    gateway_config.stats_port = 0;
+    gateway_config.listen_backlog = 128;
+    gateway_config.listen_shards = 1;
+    #if DEBUG
+    gateway_config.log_level = LOG_DEBUG; // Debug builds log everything, as they always have
+    #else
+    gateway_config.log_level = LOG_WARN;
+    #endif
+    gateway_config.log_rate_limit = 100;
+    gateway_config.slow_query_log = "slow_queries.log";
+    gateway_config.slow_query_sample = 1;
+    gateway_config.hitters_window_s = 0;
+    struct sockaddr_in local; // A single node next to the gateway, as before nodes could be configured
+    memset(&local, 0, sizeof(local));
+    local.sin_family = AF_INET;
+    local.sin_addr.s_addr = inet_addr(CASSANDRA_IP);
+    local.sin_port = htons(CASSANDRA_PORT + 1);
+    gateway_config.cassandra_nodes.assign(1, local);
+    gateway_config.health_check_interval_ms = 1000;
+    gateway_config.health_check_failures = 3;
+    gateway_config.upstream_timeout_ms = 1000;
+    gateway_config.ring_refresh_s = 0;
+    gateway_config.breaker_failure_percent = 0;
+    gateway_config.breaker_min_requests = 20;
+    gateway_config.breaker_window_ms = 10000;
+    gateway_config.breaker_slow_ms = 0;
+    gateway_config.breaker_open_ms = 5000;
+    gateway_config.breaker_probes = 5;
+    gateway_config.session_pool_password = "cassandra"; // As generate-user-token.py creates them
+
+    gateway_config.tenant_defaults.requests_per_second = 0;
+    gateway_config.tenant_defaults.bytes_per_second = 0;
+    gateway_config.tenant_defaults.weight = 1;
+    gateway_config.tenant_defaults.priority = 0;
+    gateway_config.tenant_defaults.slow_query_ms = 0;
+    gateway_config.tenant_defaults.hedge_percentile = 0;
+    gateway_config.tenant_defaults.session_pool_size = 0;
+    gateway_config.tenant_defaults.schema_event_window_ms = 0;
+}
+
+// Makes sure the defaults are set before main() runs, whether or not a configuration file is loaded
+static struct cql_config_init {
+    cql_config_init() { initDefaults(); }
+} config_init;
+
+/*
+ * Parses an unsigned number for a setting, exiting with an error if it isn't one.
+ */
+static uint32_t parseNumber(const char *path, int line, const char *key, const char *value) {
+    char *end;
+    errno = 0;
+    unsigned long n = strtoul(value, &end, 10);
+    if (errno != 0 || end == value || *end != '\0' || n > UINT32_MAX) {
+        fprintf(stderr, "%s:%d: '%s' must be a number, not '%s'.\n", path, line, key, value);
+        exit(1);
+    }
+    return (uint32_t)n;
+}
+
+/*
+ * Parses a percentile for a setting, which may have a fraction (99.9), exiting with an error if it isn't from 0 to under 100.
+ */
+static double parsePercentile(const char *path, int line, const char *key, const char *value) {
+    char *end;
+    errno = 0;
+    double p = strtod(value, &end);
+    if (errno != 0 || end == value || *end != '\0' || !(p >= 0 && p < 100)) {
+        fprintf(stderr, "%s:%d: '%s' must be a percentile from 0 to under 100, not '%s'.\n", path, line, key, value);
+        exit(1);
+    }
+    return p;
+}
+
+static char* trim(char *s) {
+    while (isspace((unsigned char)*s)) {
+        s++;
+    }
+    char *end = s + strlen(s);
+    while (end > s && isspace((unsigned char)end[-1])) {
+        end--;
+    }
+    *end = '\0';
+    return s;
+}
+
+/*
+ * Sets one of the settings that can be given per tenant. Returns false if the key isn't one of them.
+ */
+static bool setTenantConfig(cql_tenant_config_t *c, const char *path, int line, const char *key, const char *value) {
+    if (strcmp(key, "requests_per_second") == 0) {
+        c->requests_per_second = parseNumber(path, line, key, value);
+    }
+    else if (strcmp(key, "bytes_per_second") == 0) {
+        c->bytes_per_second = parseNumber(path, line, key, value);
+    }
+    else if (strcmp(key, "weight") == 0) {
+        c->weight = parseNumber(path, line, key, value);
+        if (c->weight == 0 || c->weight > 1000) {
+            fprintf(stderr, "%s:%d: 'weight' must be from 1 to 1000.\n", path, line);
+            exit(1);
+        }
+    }
+    else if (strcmp(key, "priority") == 0) {
+        c->priority = parseNumber(path, line, key, value);
+        if (c->priority > OVERLOAD_MAX_PRIORITY) {
+            fprintf(stderr, "%s:%d: 'priority' must be from 0 to %d.\n", path, line, OVERLOAD_MAX_PRIORITY);
+            exit(1);
+        }
+    }
+    else if (strcmp(key, "slow_query_ms") == 0) {
+        c->slow_query_ms = parseNumber(path, line, key, value);
+    }
+    else if (strcmp(key, "hedge_percentile") == 0) {
+        c->hedge_percentile = parsePercentile(path, line, key, value);
+    }
+    else if (strcmp(key, "session_pool_size") == 0) {
+        c->session_pool_size = parseNumber(path, line, key, value);
+    }
+    else if (strcmp(key, "schema_event_window_ms") == 0) {
+        c->schema_event_window_ms = parseNumber(path, line, key, value);
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Reads "key = value" settings from a file into gateway_config. Blank lines and anything after a '#' are ignored. A line
+ * "[tenant <internal token>]" starts the settings of one tenant, which start out as the defaults given so far. Exits with an
+ * error on an unknown setting or bad value, since running with a configuration other than the one intended would be worse.
+ */
+void LoadConfig(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        fprintf(stderr, "Could not open configuration file '%s': %s\n", path, strerror(errno));
+        exit(1);
+    }
+
+    cql_tenant_config_t *tenant = NULL; // Section being read, NULL before the first one
+
+    char buf[512];
+    int line = 0;
+    while (fgets(buf, sizeof(buf), f) != NULL) {
+        line++;
+
+        char *comment = strchr(buf, '#');
+        if (comment != NULL) {
+            *comment = '\0';
+        }
+        char *s = trim(buf);
+        if (*s == '\0') {
+            continue;
+        }
+
+        if (*s == '[') {
+            char token[TOKEN_LENGTH + 1];
+            char end;
+            if (sscanf(s, "[tenant %20[0-9a-f] %c", token, &end) != 2 || end != ']' || strlen(token) != TOKEN_LENGTH) {
+                fprintf(stderr, "%s:%d: Expected '[tenant <internal token>]'.\n", path, line);
+                exit(1);
+            }
+            if (gateway_config.tenants.count(token) == 0) {
+                gateway_config.tenants[token] = gateway_config.tenant_defaults;
+            }
+            tenant = &gateway_config.tenants[token];
+            continue;
+        }
+
+        char *eq = strchr(s, '=');
+        if (eq == NULL) {
+            fprintf(stderr, "%s:%d: Expected 'key = value'.\n", path, line);
+            exit(1);
+        }
+        *eq = '\0';
+        char *key = trim(s);
+        char *value = trim(eq + 1);
+
+        if (tenant != NULL) {
+            if (!setTenantConfig(tenant, path, line, key, value)) {
+                fprintf(stderr, "%s:%d: '%s' can't be set per tenant.\n", path, line, key);
+                exit(1);
+            }
+        }
+        else if (setTenantConfig(&gateway_config.tenant_defaults, path, line, key, value)) {
+            // A default for every tenant
+        }
+        else if (strcmp(key, "rate_limit_mode") == 0) {
+            if (strcmp(value, "delay") == 0) {
+                gateway_config.rate_limit_mode = RATE_LIMIT_DELAY;
+            }
+            else if (strcmp(value, "reject") == 0) {
+                gateway_config.rate_limit_mode = RATE_LIMIT_REJECT;
+            }
+            else {
+                fprintf(stderr, "%s:%d: 'rate_limit_mode' must be 'delay' or 'reject', not '%s'.\n", path, line, value);
+                exit(1);
+            }
+        }
+        else if (strcmp(key, "rate_limit_max_delay_ms") == 0) {
+            gateway_config.rate_limit_max_delay_ms = parseNumber(path, line, key, value);
+        }
+        else if (strcmp(key, "max_in_flight") == 0) {
+            gateway_config.max_in_flight = parseNumber(path, line, key, value);
+        }
+        else if (strcmp(key, "shed_max_outstanding") == 0) {
+            gateway_config.shed_max_outstanding = parseNumber(path, line, key, value);
+        }
+        else if (strcmp(key, "shed_max_latency_ms") == 0) {
+            gateway_config.shed_max_latency_ms = parseNumber(path, line, key, value);
+        }
+        else if (strcmp(key, "request_timeout_ms") == 0) {
+            gateway_config.request_timeout_ms = parseNumber(path, line, key, value);
+        }
+        else if (strcmp(key, "stats_port") == 0) {
+            gateway_config.stats_port = parseNumber(path, line, key, value);
+            if (gateway_config.stats_port > 65535) {
+                fprintf(stderr, "%s:%d: 'stats_port' must be from 0 to 65535.\n", path, line);
+                exit(1);
+            }
+        }
+        else if (strcmp(key, "listen_backlog") == 0) {
+            gateway_config.listen_backlog = parseNumber(path, line, key, value);
+            if (gateway_config.listen_backlog == 0 || gateway_config.listen_backlog > INT32_MAX) {
+                fprintf(stderr, "%s:%d: 'listen_backlog' must be at least 1.\n", path, line);
+                exit(1);
+            }
+        }
+        else if (strcmp(key, "listen_shards") == 0) {
+            gateway_config.listen_shards = parseNumber(path, line, key, value);
+            if (gateway_config.listen_shards == 0 || gateway_config.listen_shards > LISTENER_MAX_SHARDS) {
+                fprintf(stderr, "%s:%d: 'listen_shards' must be from 1 to %d.\n", path, line, LISTENER_MAX_SHARDS);
+                exit(1);
+            }
+        }
+        else if (strcmp(key, "shard_cpus") == 0) {
+            gateway_config.shard_cpus.clear();
+            for (char *cpu = strtok(value, ","); cpu != NULL; cpu = strtok(NULL, ",")) {
+                uint32_t n = parseNumber(path, line, key, trim(cpu));
+                if (n >= CPU_SETSIZE) {
+                    fprintf(stderr, "%s:%d: 'shard_cpus' must list CPUs from 0 to %d.\n", path, line, CPU_SETSIZE - 1);
+                    exit(1);
+                }
+                gateway_config.shard_cpus.push_back(n);
+            }
+        }
+        else if (strcmp(key, "log_level") == 0) {
+            const char *levels[4] = {"error", "warn", "info", "debug"};
+            gateway_config.log_level = -1;
+            for (int level = LOG_ERROR; level <= LOG_DEBUG; level++) {
+                if (strcmp(value, levels[level]) == 0) {
+                    gateway_config.log_level = level;
+                }
+            }
+            if (gateway_config.log_level < 0) {
+                fprintf(stderr, "%s:%d: 'log_level' must be 'error', 'warn', 'info' or 'debug', not '%s'.\n", path, line, value);
+                exit(1);
+            }
+        }
+        else if (strcmp(key, "log_rate_limit") == 0) {
+            gateway_config.log_rate_limit = parseNumber(path, line, key, value);
+        }
+        else if (strcmp(key, "slow_query_log") == 0) {
+            if (*value == '\0') {
+                fprintf(stderr, "%s:%d: 'slow_query_log' must be a file name.\n", path, line);
+                exit(1);
+            }
+            gateway_config.slow_query_log = value;
+        }
+        else if (strcmp(key, "slow_query_sample") == 0) {
+            gateway_config.slow_query_sample = parseNumber(path, line, key, value);
+            if (gateway_config.slow_query_sample == 0) {
+                fprintf(stderr, "%s:%d: 'slow_query_sample' must be at least 1.\n", path, line);
+                exit(1);
+            }
+        }
+        else if (strcmp(key, "hitters_window_s") == 0) {
+            gateway_config.hitters_window_s = parseNumber(path, line, key, value);
+        }
+        else if (strcmp(key, "cassandra_nodes") == 0) {
+            gateway_config.cassandra_nodes.clear();
+            for (char *node = strtok(value, ","); node != NULL; node = strtok(NULL, ",")) {
+                struct sockaddr_in addr = parseNode(trim(node));
+                if (addr.sin_family != AF_INET) {
+                    fprintf(stderr, "%s:%d: 'cassandra_nodes' must be a list of <IPv4 address>:<port>, not '%s'.\n", path, line, trim(node));
+                    exit(1);
+                }
+                gateway_config.cassandra_nodes.push_back(addr);
+            }
+            if (gateway_config.cassandra_nodes.empty()) {
+                fprintf(stderr, "%s:%d: 'cassandra_nodes' must list at least one node.\n", path, line);
+                exit(1);
+            }
+        }
+        else if (strcmp(key, "health_check_interval_ms") == 0) {
+            gateway_config.health_check_interval_ms = parseNumber(path, line, key, value);
+        }
+        else if (strcmp(key, "health_check_failures") == 0) {
+            gateway_config.health_check_failures = parseNumber(path, line, key, value);
+            if (gateway_config.health_check_failures == 0) {
+                fprintf(stderr, "%s:%d: 'health_check_failures' must be at least 1.\n", path, line);
+                exit(1);
+            }
+        }
+        else if (strcmp(key, "upstream_timeout_ms") == 0) {
+            gateway_config.upstream_timeout_ms = parseNumber(path, line, key, value);
+            if (gateway_config.upstream_timeout_ms == 0) {
+                fprintf(stderr, "%s:%d: 'upstream_timeout_ms' must be at least 1.\n", path, line);
+                exit(1);
+            }
+        }
+        else if (strcmp(key, "ring_refresh_s") == 0) {
+            gateway_config.ring_refresh_s = parseNumber(path, line, key, value);
+        }
+        else if (strcmp(key, "breaker_failure_percent") == 0) {
+            gateway_config.breaker_failure_percent = parseNumber(path, line, key, value);
+            if (gateway_config.breaker_failure_percent > 100) {
+                fprintf(stderr, "%s:%d: 'breaker_failure_percent' must be from 0 to 100.\n", path, line);
+                exit(1);
+            }
+        }
+        else if (strcmp(key, "breaker_min_requests") == 0) {
+            gateway_config.breaker_min_requests = parseNumber(path, line, key, value);
+            if (gateway_config.breaker_min_requests == 0) {
+                fprintf(stderr, "%s:%d: 'breaker_min_requests' must be at least 1.\n", path, line);
+                exit(1);
+            }
+        }
+        else if (strcmp(key, "breaker_window_ms") == 0) {
+            gateway_config.breaker_window_ms = parseNumber(path, line, key, value);
+            if (gateway_config.breaker_window_ms == 0) {
+                fprintf(stderr, "%s:%d: 'breaker_window_ms' must be at least 1.\n", path, line);
+                exit(1);
+            }
+        }
+        else if (strcmp(key, "breaker_slow_ms") == 0) {
+            gateway_config.breaker_slow_ms = parseNumber(path, line, key, value);
+        }
+        else if (strcmp(key, "breaker_open_ms") == 0) {
+            gateway_config.breaker_open_ms = parseNumber(path, line, key, value);
+        }
+        else if (strcmp(key, "breaker_probes") == 0) {
+            gateway_config.breaker_probes = parseNumber(path, line, key, value);
+            if (gateway_config.breaker_probes == 0) {
+                fprintf(stderr, "%s:%d: 'breaker_probes' must be at least 1.\n", path, line);
+                exit(1);
+            }
+        }
+        else if (strcmp(key, "session_pool_password") == 0) {
+            gateway_config.session_pool_password = value;
+        }
+        else {
+            fprintf(stderr, "%s:%d: Unknown setting '%s'.\n", path, line, key);
+            exit(1);
+        }
+    }
+
+    fclose(f);
+}
+
+/*
+ * Returns the settings of a tenant: its own section if there is one, otherwise the defaults.
+ */
+cql_tenant_config_t TenantConfig(const char *token) {
+    std::map<std::string, cql_tenant_config_t>::iterator it = gateway_config.tenants.find(token);
+    return (it != gateway_config.tenants.end()) ? it->second : gateway_config.tenant_defaults;
+}
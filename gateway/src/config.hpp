@@ -0,0 +1,67 @@
+#ifndef _CONFIG_H
+#define _CONFIG_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+// Settings that can be given per tenant, in a "[tenant <internal token>]" section of the configuration file. Settings before any
+// section are the defaults for every tenant.
+typedef struct {
+  uint32_t requests_per_second; // requests forwarded to Cassandra per second, 0 for no limit
+  uint32_t bytes_per_second;    // request bytes forwarded to Cassandra per second, 0 for no limit
+  uint32_t weight;              // share of Cassandra relative to other tenants when requests are scheduled, at least 1
+  uint32_t priority;            // 0 to OVERLOAD_MAX_PRIORITY; when Cassandra falls behind, lower priorities are shed first
+  uint32_t slow_query_ms;       // QUERY and EXECUTE requests taking longer than this go to the slow query log, 0 for none
+  double hedge_percentile;      // reads slower than this percentile of the tenant's are sent to a second node, 0 for none
+  uint32_t session_pool_size;   // connections kept open and logged in as the tenant's user for its next clients, 0 for none
+  uint32_t schema_event_window_ms; // merge bursts of SCHEMA_CHANGE events on a keyspace within this many ms, 0 to send each one
+} cql_tenant_config_t;
+
+// What to do with a request over a tenant's rate limit
+#define RATE_LIMIT_DELAY  0 // hold it until the tenant is back under its limit, up to rate_limit_max_delay_ms
+#define RATE_LIMIT_REJECT 1 // answer it with an OVERLOADED error straight away
+
+// Settings read from the optional configuration file given on the command line. See gateway.conf.example for the file format.
+typedef struct {
+  int rate_limit_mode;             // RATE_LIMIT_*
+  uint32_t rate_limit_max_delay_ms; // longest a request may be held in RATE_LIMIT_DELAY mode before it is rejected instead
+  uint32_t max_in_flight;          // requests waiting on Cassandra at once over all tenants, 0 to send requests without scheduling
+  uint32_t shed_max_outstanding;   // start shedding requests when this many are waiting on Cassandra, 0 for no limit
+  uint32_t shed_max_latency_ms;    // start shedding requests when they take this long on average, 0 for no limit
+  uint32_t request_timeout_ms;     // answer a QUERY or EXECUTE with a timeout error if Cassandra takes longer than this, 0 to wait forever
+  uint32_t stats_port;             // serve stats over HTTP on this port of 127.0.0.1, 0 for none
+  uint32_t listen_backlog;         // client connections the kernel queues for the gateway to accept
+  uint32_t listen_shards;          // listening sockets, each with a thread accepting on it, see listener.cpp
+  std::vector<int> shard_cpus;     // CPUs the shards' threads are pinned to in turn, empty to not pin them
+  int log_level;                   // LOG_* level to start with, see log.hpp
+  uint32_t log_rate_limit;         // messages logged per second from any one place in the code, 0 for no limit
+  std::string slow_query_log;      // file the slow query log is appended to, see slowlog.cpp
+  uint32_t slow_query_sample;      // log one in this many slow requests of each tenant, at least 1
+  uint32_t hitters_window_s;       // count the heaviest tenants and statements over windows this long, 0 to not count them
+  std::vector<struct sockaddr_in> cassandra_nodes; // Cassandra nodes to connect to, see upstream.cpp
+  uint32_t health_check_interval_ms; // send every node an OPTIONS request this often, 0 to not check nodes
+  uint32_t health_check_failures;  // failed checks or connections in a row after which a node gets no new connections
+  uint32_t upstream_timeout_ms;    // give up on connecting to a node, or on its answer to a check, after this long
+  uint32_t ring_refresh_s;         // learn the token ring this often and send EXECUTEs to the node owning the partition, 0 not to
+  uint32_t breaker_failure_percent; // open a node's circuit breaker when this many percent of its requests fail, 0 for no breakers
+  uint32_t breaker_min_requests;   // requests a node must have answered in a window before its breaker can open
+  uint32_t breaker_window_ms;      // length of the windows a node's failures are counted over
+  uint32_t breaker_slow_ms;        // responses slower than this count as failures, 0 to count only errors and timeouts
+  uint32_t breaker_open_ms;        // how long a breaker stays open before the node is tried again
+  uint32_t breaker_probes;         // requests a node must answer in time while half-open for its breaker to close
+  std::string session_pool_password; // password of the tenants' own users, which pooled connections log in as, see pool.cpp
+
+  cql_tenant_config_t tenant_defaults;
+  std::map<std::string, cql_tenant_config_t> tenants; // per-tenant overrides, keyed by internal token
+} cql_config_t;
+
+extern cql_config_t gateway_config;
+
+void LoadConfig(const char *path);
+cql_tenant_config_t TenantConfig(const char *token);
+
+#endif
@@ -0,0 +1,527 @@
+/*
+ * events.cpp - One connection to Cassandra for events, fanned out to the clients that registered for them
+ * CSC 652 - 2014
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include <vector>
+#include <boost/unordered_map.hpp>
+
+#include "config.hpp"
+#include "events.hpp"
+#include "helpers.hpp"
+#include "log.hpp"
+#include "tenant.hpp"
+#include "upstream.hpp"
+
+// Registered clients, grouped by tenant so a schema change is only looked at by that tenant's clients. Clients that registered
+// before authenticating are kept under NULL and only get topology and status changes.
+typedef boost::unordered_map<cql_tenant_t *, std::vector<cql_thread_t *> > cql_subscriber_map_t;
+
+static pthread_mutex_t subscribers_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t subscribers_cond = PTHREAD_COND_INITIALIZER; // signalled when a client has been sent an event
+static cql_subscriber_map_t subscribers;
+
+/*
+ * Opens the event connection to one of the nodes: STARTUP, log in if needed, and REGISTER for every event type. Returns the
+ * socket, with the node in *node, or -1 on error.
+ */
+static int connectEvents(cql_node_t **node) {
+    int sock;
+    *node = UpstreamConnect(&sock);
+    if (*node == NULL) {
+        return -1;
+    }
+
+    if (!UpstreamStartup(sock)) {
+        close(sock);
+        UpstreamRelease(*node);
+        return -1;
+    }
+
+    // [string list] of the event types
+    const char *types[3] = {"TOPOLOGY_CHANGE", "STATUS_CHANGE", "SCHEMA_CHANGE"};
+    char body[64];
+    uint32_t len = 2;
+    uint16_t n = htons(3);
+    memcpy(body, &n, 2);
+    for (int i = 0; i < 3; i++) {
+        n = htons(strlen(types[i]));
+        memcpy(body + len, &n, 2);
+        memcpy(body + len + 2, types[i], strlen(types[i]));
+        len += 2 + strlen(types[i]);
+    }
+
+    if (!UpstreamSendRequest(sock, CQL_OPCODE_REGISTER, body, len) || !UpstreamWaitReady(sock)) {
+        close(sock);
+        UpstreamRelease(*node);
+        return -1;
+    }
+
+    return sock;
+}
+
+/*
+ * Reads a [string] at *offset of an event body, moving the offset past it. Returns false if it runs past the end of the body.
+ */
+static bool readString(const char *body, uint32_t body_len, uint32_t *offset, cql_span_t *out) {
+    if (*offset + 2 > body_len) {
+        return false;
+    }
+    uint16_t len;
+    memcpy(&len, body + *offset, 2);
+    len = ntohs(len);
+    if (*offset + 2 + len > body_len) {
+        return false;
+    }
+    *out = MakeSpan(body + *offset + 2, len);
+    *offset += 2 + len;
+    return true;
+}
+
+static void writeString(char *buf, uint32_t *offset, cql_span_t s) {
+    uint16_t len = htons(s.len);
+    memcpy(buf + *offset, &len, 2);
+    memcpy(buf + *offset + 2, s.data, s.len);
+    *offset += 2 + s.len;
+}
+
+/*
+ * Adds the clients of a list that registered for an event type to "out", and keeps each of them from being freed until it has
+ * been sent the event by sendToSubscribers(). Called with subscribers_mutex held.
+ */
+static void pinSubscribers(std::vector<cql_thread_t *> &sessions, uint8_t mask, std::vector<cql_thread_t *> &out) {
+    for (size_t i = 0; i < sessions.size(); i++) {
+        if (sessions[i]->events & mask) {
+            sessions[i]->events_sending++;
+            out.push_back(sessions[i]);
+        }
+    }
+}
+
+/*
+ * Sends an event to clients pinned by pinSubscribers(). This is done without subscribers_mutex, so that a client that is slow to
+ * read doesn't hold up the others registering or going away.
+ */
+static void sendToSubscribers(std::vector<cql_thread_t *> &sessions, cql_packet_t *event) {
+    for (size_t i = 0; i < sessions.size(); i++) {
+        if (SendToClient(sessions[i], event) < 0) {
+            LOG(LOG_DEBUG, "Error sending event to a client: %s\n", strerror(errno)); // The client's own thread will notice and clean up
+        }
+
+        pthread_mutex_lock(&subscribers_mutex);
+        sessions[i]->events_sending--;
+        pthread_cond_broadcast(&subscribers_cond);
+        pthread_mutex_unlock(&subscribers_mutex);
+    }
+}
+
+/*
+ * Sends a SCHEMA_CHANGE event to the registered clients of a tenant. The keyspace has already had the token stripped.
+ */
+static void sendSchemaEvent(cql_tenant_t *tenant, cql_span_t change, cql_span_t keyspace, cql_span_t table) {
+    static const cql_span_t type = {"SCHEMA_CHANGE", 13};
+
+    cql_packet_t *event = (cql_packet_t *)malloc(sizeof(cql_packet_t) + 8 + type.len + change.len + keyspace.len + table.len);
+    event->version = CQL_V1_RESPONSE;
+    event->flags = CQL_FLAG_NONE;
+    event->stream = -1; // Per spec, events always use stream id -1
+    event->opcode = CQL_OPCODE_EVENT;
+    uint32_t len = 0;
+    writeString((char *)event + sizeof(cql_packet_t), &len, type);
+    writeString((char *)event + sizeof(cql_packet_t), &len, change);
+    writeString((char *)event + sizeof(cql_packet_t), &len, keyspace);
+    writeString((char *)event + sizeof(cql_packet_t), &len, table);
+    event->length = htonl(len);
+
+    LOG(LOG_DEBUG, "Sending %.*s '%.*s'.'%.*s' to the clients of tenant %s.\n", (int)change.len, change.data, (int)keyspace.len, keyspace.data, (int)table.len, table.data, tenant->token);
+
+    std::vector<cql_thread_t *> sessions;
+    pthread_mutex_lock(&subscribers_mutex);
+    cql_subscriber_map_t::iterator it = subscribers.find(tenant);
+    if (it != subscribers.end()) {
+        pinSubscribers(it->second, EVENT_SCHEMA_CHANGE, sessions);
+    }
+    pthread_mutex_unlock(&subscribers_mutex);
+
+    sendToSubscribers(sessions, event);
+
+    free(event);
+}
+
+//
+// Coalescing of schema changes. With the tenant's schema_event_window_ms set, a change is held back until no other change to the same keyspace
+// has arrived for that long (but no longer than EVENT_MAX_WINDOWS windows after the first), and a burst is sent as a single event.
+//
+
+typedef struct {
+  cql_tenant_t *tenant;
+  std::string keyspace; // token already stripped
+  std::string change;   // merged change, see mergeSchemaChange()
+  std::string table;    // merged table, or empty once changes to more than one table were merged
+  uint32_t count;       // number of events merged into this one
+  uint64_t first_ms;
+  uint64_t last_ms;
+} cql_pending_event_t;
+
+static pthread_mutex_t pending_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pending_cond = PTHREAD_COND_INITIALIZER;
+static std::vector<cql_pending_event_t> pending;
+
+static uint64_t nowMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t dueMs(const cql_pending_event_t &e) {
+    uint64_t window = e.tenant->config.schema_event_window_ms;
+    uint64_t quiet = e.last_ms + window;
+    uint64_t limit = e.first_ms + window * EVENT_MAX_WINDOWS;
+    return (quiet < limit) ? quiet : limit;
+}
+
+/*
+ * Folds a newer change into a pending one. Drivers refresh whatever an event names, so the merged event must cover everything:
+ * - changes to one table stay a change to that table, and changes to several become an UPDATED of the whole keyspace
+ * - a keyspace that was dropped last is DROPPED, and one that was created in the burst (and not dropped) is CREATED
+ */
+static void mergeSchemaChange(cql_pending_event_t &e, const std::string &change, const std::string &table) {
+    bool keyspace_level = e.table.empty() || table.empty() || e.table != table;
+    bool dropped = (change == "DROPPED");
+    bool created = (e.change == "CREATED" && e.table.empty()) || (change == "CREATED" && table.empty());
+
+    if (keyspace_level) {
+        e.table.clear();
+        if (dropped && table.empty()) {
+            e.change = "DROPPED";
+        }
+        else if (created) {
+            e.change = "CREATED";
+        }
+        else {
+            e.change = "UPDATED";
+        }
+    }
+    else if (dropped) { // Same table: its last state wins, except that a table both created and dropped is simply dropped
+        e.change = "DROPPED";
+    }
+    else if (e.change != "CREATED") {
+        e.change = change;
+    }
+
+    e.count++;
+}
+
+/*
+ * Queues a schema change for a tenant, merging it with a pending change to the same keyspace if there is one.
+ */
+static void queueSchemaEvent(cql_tenant_t *tenant, cql_span_t change, cql_span_t keyspace, cql_span_t table) {
+    std::string c(change.data, change.len), k(keyspace.data, keyspace.len), t(table.data, table.len);
+    uint64_t now = nowMs();
+
+    pthread_mutex_lock(&pending_mutex);
+    size_t i;
+    for (i = 0; i < pending.size(); i++) {
+        if (pending[i].tenant == tenant && pending[i].keyspace == k) {
+            break;
+        }
+    }
+    if (i < pending.size()) {
+        mergeSchemaChange(pending[i], c, t);
+        pending[i].last_ms = now;
+
+        pthread_mutex_lock(&tenant->cache_lock);
+        tenant->schema_events_merged++;
+        pthread_mutex_unlock(&tenant->cache_lock);
+    }
+    else {
+        cql_pending_event_t e;
+        e.tenant = tenant;
+        e.keyspace = k;
+        e.change = c;
+        e.table = t;
+        e.count = 1;
+        e.first_ms = now;
+        e.last_ms = now;
+        pending.push_back(e);
+    }
+    pthread_cond_signal(&pending_cond);
+    pthread_mutex_unlock(&pending_mutex);
+}
+
+/*
+ * Sends pending schema changes once they are due.
+ */
+static void* HandlePendingEvents(void *arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&pending_mutex);
+    while (1) {
+        if (pending.empty()) {
+            pthread_cond_wait(&pending_cond, &pending_mutex);
+            continue;
+        }
+
+        uint64_t now = nowMs();
+        uint64_t next = UINT64_MAX;
+        std::vector<cql_pending_event_t> due;
+        for (size_t i = 0; i < pending.size(); ) {
+            uint64_t when = dueMs(pending[i]);
+            if (when <= now) {
+                due.push_back(pending[i]);
+                pending[i] = pending.back();
+                pending.pop_back();
+            }
+            else {
+                next = (when < next) ? when : next;
+                i++;
+            }
+        }
+
+        if (!due.empty()) {
+            pthread_mutex_unlock(&pending_mutex); // Don't hold up the event connection while sending to clients
+            for (size_t i = 0; i < due.size(); i++) {
+                LOG(LOG_DEBUG, "Sending %u merged schema changes to keyspace '%s' as one.\n", due[i].count, due[i].keyspace.c_str());
+
+                sendSchemaEvent(due[i].tenant, MakeSpan(due[i].change.data(), due[i].change.size()), MakeSpan(due[i].keyspace.data(), due[i].keyspace.size()), MakeSpan(due[i].table.data(), due[i].table.size()));
+            }
+            pthread_mutex_lock(&pending_mutex);
+            continue; // More may have been queued meanwhile
+        }
+
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        uint64_t wait_ms = next - now;
+        ts.tv_sec += wait_ms / 1000;
+        ts.tv_nsec += (wait_ms % 1000) * 1000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&pending_cond, &pending_mutex, &ts);
+    }
+
+    return NULL;
+}
+
+/*
+ * Handles one EVENT from Cassandra. A schema change is parsed once, drops the owning tenant's cached schema tables, and is sent with
+ * the token stripped to just that tenant's registered clients. Topology and status changes go to every client that asked.
+ */
+static void dispatchEvent(cql_packet_t *packet) {
+    const char *body = (char *)packet + sizeof(cql_packet_t);
+    uint32_t body_len = ntohl(packet->length);
+    uint32_t offset = 0;
+
+    cql_span_t type;
+    if (!readString(body, body_len, &offset, &type)) {
+        return;
+    }
+
+    if (type.len == 13 && memcmp(type.data, "SCHEMA_CHANGE", 13) == 0) {
+        cql_span_t change, keyspace, table;
+        if (!readString(body, body_len, &offset, &change) || !readString(body, body_len, &offset, &keyspace) || !readString(body, body_len, &offset, &table)) {
+            return;
+        }
+
+        cql_tenant_t *tenant = FindTenantByPrefix(keyspace);
+        if (tenant == NULL) { // Only a tenant's own keyspaces are ever sent to its clients
+            return;
+        }
+
+        // Any change, including to a table or to a keyspace's options, makes the tenant's cached schema tables stale
+        TenantInvalidateSchemaCache(tenant);
+
+        pthread_mutex_lock(&tenant->cache_lock);
+        tenant->schema_events++;
+        pthread_mutex_unlock(&tenant->cache_lock);
+
+        keyspace = MakeSpan(keyspace.data + TOKEN_LENGTH, keyspace.len - TOKEN_LENGTH);
+        if (tenant->config.schema_event_window_ms > 0) {
+            queueSchemaEvent(tenant, change, keyspace, table);
+        }
+        else {
+            sendSchemaEvent(tenant, change, keyspace, table);
+        }
+    }
+    else {
+        uint8_t mask = (type.len == 15 && memcmp(type.data, "TOPOLOGY_CHANGE", 15) == 0) ? EVENT_TOPOLOGY_CHANGE : EVENT_STATUS_CHANGE;
+
+        std::vector<cql_thread_t *> sessions;
+        pthread_mutex_lock(&subscribers_mutex);
+        for (cql_subscriber_map_t::iterator it = subscribers.begin(); it != subscribers.end(); it++) {
+            pinSubscribers(it->second, mask, sessions);
+        }
+        pthread_mutex_unlock(&subscribers_mutex);
+
+        sendToSubscribers(sessions, packet);
+    }
+}
+
+/*
+ * Keeps the event connection open for the life of the gateway, reconnecting whenever it drops.
+ */
+static void* HandleEvents(void *arg) {
+    (void)arg;
+
+    while (1) {
+        cql_node_t *n;
+        int sock = connectEvents(&n);
+        if (sock < 0) {
+            LOG(LOG_WARN, "Could not open the event connection to Cassandra.\n");
+            sleep(EVENT_RECONNECT_DELAY);
+            continue;
+        }
+
+        LOG(LOG_INFO, "Event connection to Cassandra node %s is open.\n", n->name);
+
+        // Changes may have been missed while disconnected, so nothing cached can be trusted
+        InvalidateAllSchemaCaches();
+
+        cql_packet_t *packet;
+        while ((packet = UpstreamRecvPacket(sock)) != NULL) {
+            if (packet->opcode == CQL_OPCODE_EVENT) {
+                dispatchEvent(packet);
+            }
+            free(packet);
+        }
+
+        LOG(LOG_WARN, "Event connection to Cassandra node %s was closed, reconnecting.\n", n->name);
+        close(sock);
+        UpstreamRelease(n);
+        UpstreamFailed(n, "event connection closed");
+        sleep(EVENT_RECONNECT_DELAY);
+    }
+
+    return NULL;
+}
+
+/*
+ * Whether any tenant has its schema changes coalesced.
+ */
+static bool coalescing() {
+    bool wanted = gateway_config.tenant_defaults.schema_event_window_ms > 0;
+    std::map<std::string, cql_tenant_config_t>::iterator it;
+    for (it = gateway_config.tenants.begin(); it != gateway_config.tenants.end(); it++) {
+        wanted = wanted || it->second.schema_event_window_ms > 0;
+    }
+    return wanted;
+}
+
+/*
+ * Starts the thread that holds the gateway's single event connection to Cassandra.
+ */
+void StartEventListener() {
+    pthread_t thread;
+
+    if (coalescing()) {
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC); // Deadlines are computed from the monotonic clock
+        pthread_cond_init(&pending_cond, &attr);
+        pthread_condattr_destroy(&attr);
+
+        if (pthread_create(&thread, NULL, HandlePendingEvents, NULL) != 0) {
+            fprintf(stderr, "pthread_create failed for pending event thread.\n");
+            exit(1);
+        }
+        pthread_detach(thread);
+    }
+
+    if (pthread_create(&thread, NULL, HandleEvents, NULL) != 0) {
+        fprintf(stderr, "pthread_create failed for event thread.\n");
+        exit(1);
+    }
+    pthread_detach(thread);
+}
+
+/*
+ * Takes a client off the list of its tenant's registered clients, if it is on it. Called with subscribers_mutex held.
+ */
+static void removeSubscriber(cql_thread_t *session) {
+    cql_subscriber_map_t::iterator it = subscribers.find(session->events_tenant);
+    if (it != subscribers.end()) {
+        std::vector<cql_thread_t *> &sessions = it->second;
+        for (size_t i = 0; i < sessions.size(); i++) {
+            if (sessions[i] == session) {
+                sessions[i] = sessions.back();
+                sessions.pop_back();
+                break;
+            }
+        }
+        if (sessions.empty()) {
+            subscribers.erase(it);
+        }
+    }
+    session->events = 0;
+}
+
+/*
+ * Handles a REGISTER from a client, whose body is the [string list] of event types. The client is answered locally instead of
+ * opening a registration of its own on Cassandra. Returns false if the body is malformed.
+ */
+bool SubscribeEvents(cql_thread_t *session, char *body, uint32_t body_len) {
+    if (body_len < 2) {
+        return false;
+    }
+
+    uint16_t n;
+    memcpy(&n, body, 2);
+    n = ntohs(n);
+
+    uint8_t events = 0;
+    uint32_t offset = 2;
+    for (int i = 0; i < n; i++) {
+        cql_span_t type;
+        if (!readString(body, body_len, &offset, &type)) {
+            return false;
+        }
+        if (type.len == 15 && memcmp(type.data, "TOPOLOGY_CHANGE", 15) == 0) {
+            events |= EVENT_TOPOLOGY_CHANGE;
+        }
+        else if (type.len == 13 && memcmp(type.data, "STATUS_CHANGE", 13) == 0) {
+            events |= EVENT_STATUS_CHANGE;
+        }
+        else if (type.len == 13 && memcmp(type.data, "SCHEMA_CHANGE", 13) == 0) {
+            events |= EVENT_SCHEMA_CHANGE;
+        }
+        else {
+            return false;
+        }
+    }
+
+    pthread_mutex_lock(&subscribers_mutex);
+    removeSubscriber(session); // A client may register more than once, e.g. after it authenticated
+    session->events = events;
+    session->events_tenant = session->tenant;
+    if (events != 0) { // Registering for nothing only undoes an earlier REGISTER
+        subscribers[session->events_tenant].push_back(session);
+    }
+    pthread_mutex_unlock(&subscribers_mutex);
+
+    return true;
+}
+
+/*
+ * Stops sending events to a client, waiting for events already being sent to it. Must be called before the session is freed, and
+ * after its socket was shut down, so that a send to a client that isn't reading can't hold this up.
+ */
+void UnsubscribeEvents(cql_thread_t *session) {
+    pthread_mutex_lock(&subscribers_mutex);
+    removeSubscriber(session);
+    while (session->events_sending > 0) {
+        pthread_cond_wait(&subscribers_cond, &subscribers_mutex);
+    }
+    pthread_mutex_unlock(&subscribers_mutex);
+}
@@ -0,0 +1,21 @@
+#ifndef _EVENTS_H
+#define _EVENTS_H
+
+#include "gateway.hpp"
+
+// Event types a client can REGISTER for, as a mask in cql_thread_t.events
+#define EVENT_TOPOLOGY_CHANGE 0x01
+#define EVENT_STATUS_CHANGE   0x02
+#define EVENT_SCHEMA_CHANGE   0x04
+
+// How long to wait before reconnecting the event connection to Cassandra, in seconds
+#define EVENT_RECONNECT_DELAY 1
+
+// A burst of schema changes is held back at most this many coalescing windows (the tenant's schema_event_window_ms) after its first change
+#define EVENT_MAX_WINDOWS 4
+
+void StartEventListener();
+bool SubscribeEvents(cql_thread_t *session, char *body, uint32_t body_len);
+void UnsubscribeEvents(cql_thread_t *session);
+
+#endif
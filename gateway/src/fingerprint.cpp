@@ -0,0 +1,149 @@
+/*
+ * fingerprint.cpp - Normalizing statements so that the same statement with different values can be grouped
+ * CSC 652 - 2014
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include <algorithm>
+#include <string>
+
+#include "fingerprint.hpp"
+
+static bool isIdentChar(char c) {
+    return isalnum((unsigned char)c) || c == '_';
+}
+
+/*
+ * Appends a '?' for a literal, folding a list of them, as in "IN (1, 2, 3)", into one so that lists of any length match.
+ */
+static void appendLiteral(std::string &out) {
+    size_t end = out.size();
+    while (end > 0 && out[end - 1] == ' ') {
+        end--;
+    }
+    if (end > 0 && out[end - 1] == ',') {
+        size_t before = end - 1;
+        while (before > 0 && out[before - 1] == ' ') {
+            before--;
+        }
+        if (before > 0 && out[before - 1] == '?') {
+            out.resize(before);
+            return;
+        }
+    }
+    out += '?';
+}
+
+/*
+ * Normalizes a query for grouping: string, number, uuid, blob and boolean literals become '?', whitespace is collapsed, and
+ * everything but quoted identifiers is lower cased.
+ */
+std::string NormalizeQuery(const char *q, size_t len) {
+    std::string out;
+    out.reserve(len);
+    size_t i = 0;
+    while (i < len) {
+        char c = q[i];
+        if (isspace((unsigned char)c)) {
+            while (i < len && isspace((unsigned char)q[i])) {
+                i++;
+            }
+            if (!out.empty()) {
+                out += ' ';
+            }
+            continue;
+        }
+        if (c == '\'') { // String literal, where '' is an escaped quote
+            i++;
+            while (i < len && !(q[i] == '\'' && (i + 1 >= len || q[i + 1] != '\''))) {
+                i += (q[i] == '\'') ? 2 : 1;
+            }
+            i++;
+            appendLiteral(out);
+            continue;
+        }
+        if (c == '"') { // Quoted identifier, kept as it is
+            size_t end = i + 1;
+            while (end < len && q[end] != '"') {
+                end++;
+            }
+            out.append(q + i, std::min(end + 1, len) - i);
+            i = end + 1;
+            continue;
+        }
+
+        bool boundary = out.empty() || !isIdentChar(out[out.size() - 1]);
+        size_t word = i;
+        while (word < len && (isIdentChar(q[word]) || q[word] == '-' || q[word] == '.')) {
+            word++;
+        }
+        size_t word_len = word - i;
+
+        // A uuid, or a number (possibly negative, a decimal or a blob), as a whole word
+        bool uuid = boundary && word_len == 36 && q[i + 8] == '-' && q[i + 13] == '-' && q[i + 18] == '-' && q[i + 23] == '-';
+        for (size_t j = 0; uuid && j < 36; j++) {
+            uuid = (j == 8 || j == 13 || j == 18 || j == 23) || isxdigit((unsigned char)q[i + j]);
+        }
+        bool number = boundary && (isdigit((unsigned char)c) || (c == '-' && i + 1 < len && isdigit((unsigned char)q[i + 1])));
+        if (uuid || number) {
+            i = uuid ? word : i + 1;
+            while (!uuid && i < len && (isalnum((unsigned char)q[i]) || q[i] == '.' ||
+                                        ((q[i] == '-' || q[i] == '+') && (q[i - 1] == 'e' || q[i - 1] == 'E')))) {
+                i++;
+            }
+            appendLiteral(out);
+            continue;
+        }
+        if (boundary && ((word_len == 4 && strncasecmp(q + i, "true", 4) == 0) ||
+                         (word_len == 5 && strncasecmp(q + i, "false", 5) == 0))) {
+            i = word;
+            appendLiteral(out);
+            continue;
+        }
+
+        // Keywords and identifiers, up to the next character that could start something else
+        if (isIdentChar(c)) {
+            while (i < len && isIdentChar(q[i])) {
+                out += tolower((unsigned char)q[i]);
+                i++;
+            }
+        }
+        else {
+            out += c;
+            i++;
+        }
+    }
+    while (!out.empty() && (out[out.size() - 1] == ' ' || out[out.size() - 1] == ';')) {
+        out.resize(out.size() - 1);
+    }
+    return out;
+}
+
+/*
+ * Hashes a normalized statement (64-bit FNV-1a), for grouping statements without keeping their text.
+ */
+uint64_t FingerprintOf(const std::string &s) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < s.size(); i++) {
+        h ^= (uint8_t)s[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/*
+ * Normalizes an EXECUTE by the id of its prepared statement, as "execute 0x<id in hex>".
+ */
+std::string NormalizeExecute(const char *id, uint16_t id_len) {
+    std::string out("execute 0x");
+    char hex[3];
+    for (uint16_t i = 0; i < id_len; i++) {
+        snprintf(hex, sizeof(hex), "%02x", (uint8_t)id[i]);
+        out += hex;
+    }
+    return out;
+}
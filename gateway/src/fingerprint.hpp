@@ -0,0 +1,12 @@
+#ifndef _FINGERPRINT_H
+#define _FINGERPRINT_H
+
+#include <stdint.h>
+
+#include <string>
+
+std::string NormalizeQuery(const char *q, size_t len);
+std::string NormalizeExecute(const char *id, uint16_t id_len);
+uint64_t FingerprintOf(const std::string &normalized);
+
+#endif
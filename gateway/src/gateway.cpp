@@ -21,8 +21,26 @@ extern "C" {
 }
 
 #include "cassandra.hpp"
+#include "config.hpp"
 #include "gateway.hpp"
 #include "helpers.hpp"
+#include "tenant.hpp"
+#include "events.hpp"
+#include "sched.hpp"
+#include "overload.hpp"
+#include "timeout.hpp"
+#include "stats.hpp"
+#include "log.hpp"
+#include "probes.hpp"
+#include "slowlog.hpp"
+#include "fingerprint.hpp"
+#include "hitters.hpp"
+#include "upstream.hpp"
+#include "ring.hpp"
+#include "hedge.hpp"
+#include "breaker.hpp"
+#include "pool.hpp"
+#include "listener.hpp"
 
 #include <boost/regex.hpp>
 #include <boost/algorithm/string/regex.hpp>
@@ -35,57 +53,99 @@ using namespace std;
 const char *printable_opcodes[17] = {"ERROR", "STARTUP", "READY", "AUTHENTICATE", "CREDENTIALS", "OPTIONS", "SUPPORTED", "QUERY", "RESULT", "PREPARE", "EXECUTE", "REGISTER", "EVENT", "BATCH", "AUTH_CHALLENGE", "AUTH_RESPONSE", "AUTH_SUCCESS"};
 
 /*
- * Main processing loop of gateway. Spawns individual threads to handle each incoming TCP connection from a client.
- * Return 0 on success (never reached, since it will listen for connections until killed), 1 on error.
-*/
-int main(int argc, char *argv[]) {
-    signal(SIGINT, gracefulExit); // Catch CTRL+C and exit cleanly to properly cleanup memory usage
-
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <IP addr to listen on>\n", argv[0]);
+ * Gives a session its connection to Cassandra, and starts the thread reading Cassandra's responses from it.
+ */
+static void attachUpstream(cql_thread_t *thread_data, int fd, cql_node_t *n) {
+    thread_data->cassandrafd = fd;
+    thread_data->cassandra_node = n;
+    if (pthread_create(&thread_data->cassandra, NULL, HandleConnCassandra, (void *)thread_data) != 0) {
+        fprintf(stderr, "pthread_create failed for Cassandra thread.\n");
         exit(1);
     }
-    if (inet_addr(argv[1]) == INADDR_NONE) {
-        fprintf(stderr, "Please specify a valid IP address to listen on.\n");
-        exit(1);
+}
+
+/*
+ * Answers a request from the client in the gateway, with a response of the given opcode and body.
+ */
+static int answerClient(cql_thread_t *thread_data, int8_t stream, uint8_t opcode, const char *body, uint32_t body_len) {
+    cql_packet_t *p = (cql_packet_t *)malloc(sizeof(cql_packet_t) + body_len);
+    p->version = CQL_V1_RESPONSE;
+    p->flags = CQL_FLAG_NONE;
+    p->stream = stream;
+    p->opcode = opcode;
+    p->length = htonl(body_len);
+    if (body_len > 0) {
+        memcpy((char *)p + sizeof(cql_packet_t), body, body_len);
     }
 
-    #if DEBUG
-    printf("Cassandra gateway starting up on %s:%d.\n", argv[1], CASSANDRA_PORT);
-    #endif
+    int ret = SendToClient(thread_data, p);
+    free(p);
+    return ret;
+}
 
-    // Prep the socket
-    int listenfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (listenfd < 0) {
-        fprintf(stderr, "Socket creation error: %s\n", strerror(errno));
-        exit(1);
+/*
+ * Sends an ERROR built by the gateway to the client, counting it for the stats endpoint. It goes through SendToClient() like any
+ * other response, so it can't interleave with one being written by another thread. Returns the result of send(); if that failed,
+ * the client has gone away, and the caller should stop handling it.
+ */
+static int sendClientError(cql_thread_t *thread_data, uint32_t tid, int8_t stream, uint32_t err, const char *msg) {
+    uint32_t msg_len = strlen(msg);
+    cql_packet_t *p = (cql_packet_t *)malloc(sizeof(cql_packet_t) + 6 + msg_len); // Header + int + short + msg length
+    p->version = CQL_V1_RESPONSE;
+    p->flags = CQL_FLAG_NONE;
+    p->stream = stream;
+    p->opcode = CQL_OPCODE_ERROR;
+    p->length = htonl(6 + msg_len);
+    uint32_t code = htonl(err);
+    memcpy((char *)p + sizeof(cql_packet_t), &code, 4);
+    uint16_t str_len = htons(msg_len);
+    memcpy((char *)p + sizeof(cql_packet_t) + 4, &str_len, 2);
+    memcpy((char *)p + sizeof(cql_packet_t) + 6, msg, msg_len);
+
+    SESSION_LOG(thread_data, LOG_INFO, "%u: Sending error to client: '%s'.\n", tid, msg);
+
+    int ret = SendToClient(thread_data, p);
+    if (ret < 0) {
+        SESSION_LOG(thread_data, LOG_DEBUG, "%u: Error sending error packet to client: %s\n", tid, strerror(errno));
     }
-    
-    // Clear the serv_addr struct
-    struct sockaddr_in serv_addr;
-    memset(&serv_addr, 0, sizeof(serv_addr));
-    
-    serv_addr.sin_family = AF_INET;
-    
-    // Bind to IP address specified on command line
-    serv_addr.sin_addr.s_addr = inet_addr(argv[1]);
-    serv_addr.sin_port = htons(CASSANDRA_PORT);
-    
-    // Bind the socket and port to the name
-    if (bind(listenfd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) {
-        fprintf(stderr, "Socket bind error: %s\n", strerror(errno));
-        exit(1);
+    else {
+        StatsErrorOut(thread_data, err, sizeof(cql_packet_t) + 6 + msg_len);
     }
-    
-    // Listen for connections, with a backlog of 10
-    if (listen(listenfd, 10) == -1) {
-        fprintf(stderr, "Socket listen error: %s\n", strerror(errno));
-        exit(1);
+
+    free(p);
+    return ret;
+}
+
+static void gracefulExit(int sig) {
+    fprintf(stderr, "\nCaught sig %d -- exiting.\n", sig);
+    LogFlush(); // Write out whatever is still waiting to be logged
+
+    exit(0);
+}
+
+/*
+ * Logs the keyspace, table and columns of a result, read by ReadResultMetadata().
+ */
+static void logResultMetadata(cql_thread_t *thread_data, uint32_t tid, cql_result_metadata_t *m) {
+    if (!(m->flags & CQL_RESULT_ROWS_FLAG_GLOBAL_TABLES_SPEC) && m->columns_count <= 0) { // Neither is given without columns
+        return;
     }
 
-    #if DEBUG
-    printf("Setup complete, beginning loop to listen for connections.\n");
-    #endif
+    SESSION_LOG(thread_data, LOG_DEBUG, "%u:       Keyspace is '%s', table is '%s'.\n", tid, m->keyspace, m->table);
+    cql_column_spec_t *curr = m->column;
+    for (int32_t i = 0; i < m->columns_count; i++, curr = curr->next) {
+        SESSION_LOG(thread_data, LOG_DEBUG, "%u:       Column name and type: '%s' %d.\n", tid, curr->name, curr->type);
+    }
+}
+
+/*
+ * Accepts client connections on a shard's listening socket, starting a client thread for each. This thread only accepts
+ * connections and starts their client threads, which connect to Cassandra themselves, so a slow or unreachable node never holds
+ * up accepting other clients.
+ */
+static void* acceptClients(void *arg) {
+    cql_shard_t *shard = (cql_shard_t *)arg;
+    ShardPin(shard); // Inherited by the threads of the shard's connections
 
     // Thread setup for the gateway. There are two threads per connection: one for the client and one for Cassandra
     pthread_attr_t attr;
@@ -94,57 +154,49 @@ int main(int argc, char *argv[]) {
     // Do some quick pthread attr setup
     pthread_attr_init(&attr);
     
-    // Main listen loop
     while (1) {
-        cql_thread_t *thread_data = (cql_thread_t *)malloc(sizeof(cql_thread_t));
-
         // This is a blocking call!
-        thread_data->clientfd = accept(listenfd, (struct sockaddr*)NULL, NULL);
-        #if DEBUG
-        printf("Got a connection from a client in main event loop.\n");
-        #endif
-        
-        // Get a connection to Cassandra
-        // Assumes the real Cassandra instance is listening on CASSANDRA_IP:(CASSANDRA_PORT + 1)
-        #if DEBUG
-        printf("Establishing connection to Cassandra listening on %s:%d.\n", CASSANDRA_IP, CASSANDRA_PORT + 1);
-        #endif
-
-        thread_data->cassandrafd = socket(AF_INET, SOCK_STREAM, 0);
-        if (thread_data->cassandrafd < 0) {
-            fprintf(stderr, "Socket creation error when connecting to Cassandra: %s\n", strerror(errno));
-            exit(1);
-        }
-
-        // Setup sockaddr struct
-        struct sockaddr_in cassandra_addr;
-        memset(&cassandra_addr, 0, sizeof(cassandra_addr));
-        cassandra_addr.sin_family = AF_INET;
-        cassandra_addr.sin_addr.s_addr = inet_addr(CASSANDRA_IP);
-        cassandra_addr.sin_port = htons(CASSANDRA_PORT + 1);
-
-        // Bind the socket and port to the name
-        if (connect(thread_data->cassandrafd, (struct sockaddr*)&cassandra_addr, sizeof(cassandra_addr)) < 0) {
-            fprintf(stderr, "Socket bind error when connecting to Cassandra: %s\n", strerror(errno));
-            exit(1);
+        int clientfd = accept4(shard->fd, (struct sockaddr*)NULL, NULL, SOCK_CLOEXEC);
+        if (clientfd < 0) {
+            ShardAcceptFailed(shard);
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                LOG(LOG_ERROR, "Could not accept a client connection: %s\n", strerror(errno));
+                usleep(ACCEPT_RETRY_MS * 1000); // The connection stays queued, so don't spin on it until resources are freed
+            }
+            continue; // Anything else, like a client that gave up while queued, only loses that connection
         }
+        LOG(LOG_DEBUG, "Got a connection from a client on shard %u.\n", shard->id);
+        ShardAccepted(shard);
 
-        // Finally, set the shared variables in thread_data so the two threads can communicate
+        // Set the shared variables in thread_data so the two threads can communicate
+        cql_thread_t *thread_data = (cql_thread_t *)malloc(sizeof(cql_thread_t));
+        thread_data->clientfd = clientfd;
 
         pthread_mutex_init(&thread_data->mutex, NULL);
+        pthread_mutex_init(&thread_data->send_mutex, NULL);
         thread_data->compression_type = CQL_COMPRESSION_NONE;
         thread_data->token = (char *)malloc(TOKEN_LENGTH + 1);
         memset(thread_data->token, 0, TOKEN_LENGTH + 1);
-        thread_data->interestingPackets = NULL;
+        thread_data->tenant = NULL;
+        thread_data->events = 0;
+        thread_data->events_tenant = NULL;
+        thread_data->events_sending = 0;
+        memset(thread_data->client_stream, STREAM_FREE, sizeof(thread_data->client_stream));
+        memset(thread_data->stream_gen, 0, sizeof(thread_data->stream_gen));
+        thread_data->next_stream = 0;
+        memset(thread_data->inflight, 0, sizeof(thread_data->inflight));
+        thread_data->cassandrafd = -1;
+        thread_data->cassandra_node = NULL;
+        thread_data->startup = NULL;
+        thread_data->writer = NULL;
+        thread_data->shard = shard;
+        RingSessionOpened(thread_data);
+        StatsSessionOpened(thread_data);
         
         if (pthread_create(&thread_client, &attr, HandleConnClient, (void *)thread_data) != 0) {
             fprintf(stderr, "pthread_create failed for client thread.\n");
             exit(1);
         }
-        if (pthread_create(&thread_data->cassandra, &attr, HandleConnCassandra, (void *)thread_data) != 0) {
-            fprintf(stderr, "pthread_create failed for Cassandra thread.\n");
-            exit(1);
-        }
 
         /*
          * Creating the client thread as detached for 2 reasons:
@@ -154,6 +206,72 @@ int main(int argc, char *argv[]) {
         pthread_detach(thread_client);
     }
 
+    return NULL;
+}
+
+/*
+ * Main processing loop of gateway. Spawns individual threads to handle each incoming TCP connection from a client.
+ * Return 0 on success (never reached, since it will listen for connections until killed), 1 on error.
+*/
+int main(int argc, char *argv[]) {
+    signal(SIGINT, gracefulExit); // Catch CTRL+C and exit cleanly to properly cleanup memory usage
+    signal(SIGPIPE, SIG_IGN); // A client that goes away fails the send() to it, rather than killing the gateway
+
+    if (argc != 2 && argc != 3) {
+        fprintf(stderr, "Usage: %s <IP addr to listen on> [config file]\n", argv[0]);
+        exit(1);
+    }
+    if (inet_addr(argv[1]) == INADDR_NONE) {
+        fprintf(stderr, "Please specify a valid IP address to listen on.\n");
+        exit(1);
+    }
+    if (argc == 3) {
+        LoadConfig(argv[2]);
+    }
+
+    // Diagnostics are written out by a thread of their own, at the configured level
+    StartLogger();
+    StartSlowLog();
+    StartHitters();
+
+    // The Cassandra nodes to connect to, and the checks of their health
+    StartUpstream();
+    StartRing();
+
+    LOG(LOG_DEBUG, "Cassandra gateway starting up on %s:%d.\n", argv[1], CASSANDRA_PORT);
+
+    // One connection to Cassandra carries the events for every client that registers for them
+    StartEventListener();
+
+    // Requests from all tenants are sent to Cassandra in a fair order, if configured
+    StartScheduler();
+
+    // Connections kept logged in as each tenant's user for its next clients, if configured
+    StartPool();
+
+    // Requests that Cassandra takes too long to answer are answered with a timeout, if configured
+    StartTimeouts();
+
+    // Counters and latency histograms for monitoring, if configured
+    StartStatsListener();
+
+    // The sockets clients connect to: one, or one per shard (see listener.cpp)
+    uint32_t shard_count = 0;
+    cql_shard_t *shards = OpenListeners(argv[1], &shard_count);
+
+    LOG(LOG_DEBUG, "Setup complete, beginning loop to listen for connections.\n");
+
+    // Every shard but the first accepts on a thread of its own, and the first on this one
+    for (uint32_t i = 1; i < shard_count; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, acceptClients, (void *)&shards[i]) != 0) {
+            fprintf(stderr, "pthread_create failed for shard thread.\n");
+            exit(1);
+        }
+        pthread_detach(thread);
+    }
+    acceptClients(&shards[0]);
+
     // Execution will never reach here, but we need to return a value
     return 0;
 }
@@ -166,23 +284,47 @@ void* HandleConnClient(void* td) {
 
     // Save this thread's ID to prefix all messages with
     pthread_t tid = pthread_self();
+    thread_data->id = (uint32_t)tid;
 
-    #if DEBUG
-    printf("%u: Thread spawned for client.\n", (uint32_t)tid);
-    #endif
+    SESSION_LOG(thread_data, LOG_DEBUG, "%u: Thread spawned for client.\n", (uint32_t)tid);
+    PROBE2(conn_open, thread_data->id, thread_data->clientfd);
 
     uint8_t header_len = sizeof(cql_packet_t); // Length of the header
     uint32_t body_len = 0; // Length of packet body
     cql_packet_t *packet = (cql_packet_t *)malloc(header_len); // Raw packet data
 
-    int recv_ret; // Save the return value of the recv() call below, since we may need to take action in case of error
+    int recv_ret = 1; // Save the return value of the recv() call below, since we may need to take action in case of error
+    uint64_t cpu_ns = StatsThreadCpuNs(); // CPU time used so far, charged to the tenant a frame at a time
+
+    // Get a connection to the least loaded Cassandra node that is up (see upstream.cpp). If none can be reached, only this client
+    // is turned away; its driver will retry. With connection pools, the client is only connected once it has logged in, to a
+    // pooled connection if it can be (see pool.cpp).
+    bool connected = PoolEnabled();
+    if (!connected) {
+        int fd = -1;
+        cql_node_t *n = UpstreamConnect(&fd);
+        if (n != NULL) {
+            attachUpstream(thread_data, fd, n);
+            connected = true;
+        }
+        else {
+            SESSION_LOG(thread_data, LOG_ERROR, "%u: Could not connect to any Cassandra node, closing the client's connection.\n", (uint32_t)tid);
+        }
+    }
 
     // At the top of the loop, we are expecting the start of another CQL packet. If it doesn't look right, send back an error and close the connection.
     // INVARIANT: Before recv() is called, packet will be allocated with (cql_packet_t *)malloc(header_len).
-    while (recv_ret = recv(thread_data->clientfd, packet, 1, 0), recv_ret == 1) { // Read in the first byte of the potential CQL header from the client. A value of 0 indicates clean shutdown, and less than 0 is an error
-        #if DEBUG
-        printf("%u: Processing packet from client.\n", (uint32_t)tid);
-        #endif
+    while (connected && (recv_ret = recv(thread_data->clientfd, packet, 1, 0), recv_ret == 1)) { // Read in the first byte of the potential CQL header from the client. A value of 0 indicates clean shutdown, and less than 0 is an error
+        StatsChargeCpu(thread_data, CPU_CLIENT, &cpu_ns); // For the previous frame, however it left the loop body
+        uint64_t received_us = StatsNowUs(); // For the request's latency
+        uint64_t stage_ns = StatsStageStart(); // For the time spent in each stage, see stats.hpp
+        cql_slow_request_t *slow = NULL; // Kept with the request if it is timed for the slow query log, see slowlog.cpp
+        uint64_t fingerprint = 0; // Of the request's statement, for counting the heaviest ones, see hitters.cpp
+        std::string statement;
+        bool interesting = false; // Its results are to be filtered for the tenant
+        int schema_table = SCHEMA_TABLE_NONE; // A schema table it reads whole, whose filtered result fills the tenant's cache
+
+        SESSION_LOG(thread_data, LOG_DEBUG, "%u: Processing packet from client.\n", (uint32_t)tid);
 
         int protocol_version_in_use = -1; // Currently, the gateway supports v1 only
 
@@ -190,9 +332,7 @@ void* HandleConnClient(void* td) {
 
         // The first byte must be CQL_V1_REQUEST. Version 2 of the CQL protocol isn't supported by our gateway.
         if (packet->version != CQL_V1_REQUEST) {
-            #if DEBUG
-            printf("%u: First byte from client is not CQL_V1_REQUEST, closing connections and killing thread.\n", (uint32_t)tid);
-            #endif
+            SESSION_LOG(thread_data, LOG_DEBUG, "%u: First byte from client is not CQL_V1_REQUEST, closing connections and killing thread.\n", (uint32_t)tid);
 
             break;
         }
@@ -202,21 +342,19 @@ void* HandleConnClient(void* td) {
 
         // Now, read in the remaining 7 bytes of the header.
         if (recv(thread_data->clientfd, ((char *)packet) + 1, 7, 0) < 0) { //The remainder of the CQL header
-            fprintf(stderr, "%u: Error reading remainder of header from client: %s\n", (uint32_t)tid, strerror(errno));
+            SESSION_LOG(thread_data, LOG_WARN, "%u: Error reading remainder of header from client: %s\n", (uint32_t)tid, strerror(errno));
 
             break;
         }
         if (packet->stream < 0) { // Client request stream ids must be postitive
                                   // FIXME the python client library seems to start stream ids with "0", which isn't positive or negative
             char msg[] = "Invalid stream id";
-            SendCQLError(thread_data->clientfd, (uint32_t)tid, CQL_ERROR_PROTOCOL_ERROR, msg);
+            sendClientError(thread_data, (uint32_t)tid, packet->stream, CQL_ERROR_PROTOCOL_ERROR, msg);
 
             break;
         }
 
-        #if DEBUG
-        printf("%u: Header information -- version: %d; flags: %d; stream: %d; opcode: %s; length: %u\n", (uint32_t)tid, packet->version, packet->flags, packet->stream, printable_opcodes[packet->opcode], ntohl(packet->length));
-        #endif
+        SESSION_LOG(thread_data, LOG_DEBUG, "%u: Header information -- version: %d; flags: %d; stream: %d; opcode: %s; length: %u\n", (uint32_t)tid, packet->version, packet->flags, packet->stream, printable_opcodes[packet->opcode], ntohl(packet->length));
 
         body_len = ntohl(packet->length);
 
@@ -236,7 +374,7 @@ void* HandleConnClient(void* td) {
             while (body_bytes_read < body_len) { // Get the rest of the body
                 int32_t bytes_in = recv(thread_data->clientfd, (char *)packet + header_len + body_bytes_read, body_len - body_bytes_read, 0);
                 if (bytes_in < 0) {
-                    fprintf(stderr, "%u: Error reading packet body from client: %s\n", (uint32_t)tid, strerror(errno));
+                    SESSION_LOG(thread_data, LOG_WARN, "%u: Error reading packet body from client: %s\n", (uint32_t)tid, strerror(errno));
 
                     break;
                 }
@@ -246,9 +384,11 @@ void* HandleConnClient(void* td) {
             }
         }
 
-        #if DEBUG
-        printf("%u: Full packet received, beginning processing.\n", (uint32_t)tid);
-        #endif
+        SESSION_LOG(thread_data, LOG_DEBUG, "%u: Full packet received, beginning processing.\n", (uint32_t)tid);
+
+        StatsBytesIn(thread_data, header_len + body_len);
+        StatsStage(thread_data, STAGE_READ, stage_ns);
+        PROBE4(frame_received, thread_data->id, packet->stream, packet->opcode, header_len + body_len);
 
         // If the packet is compressed, decompress the body. Note that we always send uncompressed packets to Cassandra itself, since
         // we're communicating directly on the same host.
@@ -258,34 +398,26 @@ void* HandleConnClient(void* td) {
             exit(1);
             #endif
 
-            #if DEBUG
-            printf("%u:   Packet body is compressed, decompressing.\n", (uint32_t)tid);
-            #endif
+            SESSION_LOG(thread_data, LOG_DEBUG, "%u:   Packet body is compressed, decompressing.\n", (uint32_t)tid);
 
             // Compression type is only ever sent once, at the beginning of the session in the first packet, so we don't need to do anything special to share between threads.
             if (thread_data->compression_type == CQL_COMPRESSION_LZ4) {
-                #if DEBUG
-                printf("%u:   It's lz4 compression!\n", (uint32_t)tid);
-                #endif
+                SESSION_LOG(thread_data, LOG_DEBUG, "%u:   It's lz4 compression!\n", (uint32_t)tid);
 
                 // TODO
             }
             else if (thread_data->compression_type == CQL_COMPRESSION_SNAPPY) {
-                #if DEBUG
-                printf("%u:   It's snappy compression!\n", (uint32_t)tid);
-                #endif
+                SESSION_LOG(thread_data, LOG_DEBUG, "%u:   It's snappy compression!\n", (uint32_t)tid);
 
                 // TODO
             }
             else {
                 // Either the client is trying to use an unsupported compression algorithm, or compression wasn't properly configured when the STARTUP command was sent. Error in either case.
 
-                #if DEBUG
-                printf("%u:   Error - Unknown compression method / compression not negotiated.\n", (uint32_t)tid);
-                #endif
+                SESSION_LOG(thread_data, LOG_DEBUG, "%u:   Error - Unknown compression method / compression not negotiated.\n", (uint32_t)tid);
 
                 char msg[] = "Unknown compression method / compression not negotiated";
-                SendCQLError(thread_data->clientfd, (uint32_t)tid, CQL_ERROR_PROTOCOL_ERROR, msg);
+                sendClientError(thread_data, (uint32_t)tid, packet->stream, CQL_ERROR_PROTOCOL_ERROR, msg);
 
                 break;
             }
@@ -295,29 +427,24 @@ void* HandleConnClient(void* td) {
 
         // Modify packet (if needed)
         if (packet->opcode == CQL_OPCODE_STARTUP) { // Handle STARTUP packet here, since we may need to set variables for the connection regarding compression
+            stage_ns = StatsStageStart();
 
-            #if DEBUG
-            printf("%u:   Handling STARTUP packet to detect whether to enable compression support.\n", (uint32_t)tid);
-            #endif
+            SESSION_LOG(thread_data, LOG_DEBUG, "%u:   Handling STARTUP packet to detect whether to enable compression support.\n", (uint32_t)tid);
 
             cql_string_map_t *sm = ReadStringMap((char *)packet + header_len);
             cql_string_map_t *head = sm;
 
             if (sm == NULL) { // Malformed STARTUP, since there must always be a CQL_VERSION sent. Send back an error
-                #if DEBUG
-                printf("%u:     Error - Malformed STARTUP.\n", (uint32_t)tid);
-                #endif
+                SESSION_LOG(thread_data, LOG_DEBUG, "%u:     Error - Malformed STARTUP.\n", (uint32_t)tid);
 
                 char msg[] = "Malformed STARTUP";
-                SendCQLError(thread_data->clientfd, (uint32_t)tid, CQL_ERROR_PROTOCOL_ERROR, msg);
+                sendClientError(thread_data, (uint32_t)tid, packet->stream, CQL_ERROR_PROTOCOL_ERROR, msg);
 
                 break;
             }
 
             while (sm != NULL) {
-                #if DEBUG
-                printf("%u:     %s -> %s\n", (uint32_t)tid, sm->key, sm->value);
-                #endif
+                SESSION_LOG(thread_data, LOG_DEBUG, "%u:     %s -> %s\n", (uint32_t)tid, sm->key, sm->value);
 
                 if (strcmp(sm->key, "COMPRESSION") == 0) {
                     // Compression is only set in the very first packet of the session, so we can safely write without needing to worry about the other thread
@@ -328,12 +455,10 @@ void* HandleConnClient(void* td) {
                         thread_data->compression_type = CQL_COMPRESSION_SNAPPY;
                     }
                     else {
-                        #if DEBUG
-                        printf("%u:     Error - Unknown compression method '%s'.\n", (uint32_t)tid, sm->value);
-                        #endif
+                        SESSION_LOG(thread_data, LOG_DEBUG, "%u:     Error - Unknown compression method '%s'.\n", (uint32_t)tid, sm->value);
 
                         char msg[] = "Unknown compression method";
-                        SendCQLError(thread_data->clientfd, (uint32_t)tid, CQL_ERROR_PROTOCOL_ERROR, msg);
+                        sendClientError(thread_data, (uint32_t)tid, packet->stream, CQL_ERROR_PROTOCOL_ERROR, msg);
 
                         FreeStringMap(head);
                         head = NULL; // We need to be sneaky and break out the the main processing loop. c++ doesn't allow labels on loops, so use head == NULL as the conditional for another break below.
@@ -365,49 +490,66 @@ void* HandleConnClient(void* td) {
 
             FreeStringMap(head);
 
-            #if DEBUG
-            printf("%u:   Finished with STARTUP, passing to Cassandra.\n", (uint32_t)tid);
-            #endif
+            StatsStage(thread_data, STAGE_AUTH, stage_ns);
+
+            // A session not yet connected to Cassandra is asked for credentials by the gateway, and its STARTUP is kept until it
+            // is known whether it can be given a pooled connection (see pool.cpp)
+            if (thread_data->cassandra_node == NULL) {
+                SESSION_LOG(thread_data, LOG_DEBUG, "%u:   Finished with STARTUP, asking for credentials.\n", (uint32_t)tid);
+
+                free(thread_data->startup);
+                thread_data->startup = packet;
+                packet = (cql_packet_t *)malloc(header_len); // Maintain invariant for top of loop
+
+                char authenticate[2 + sizeof(CQL_AUTHENTICATOR) - 1];
+                uint16_t authenticator_len = htons(sizeof(CQL_AUTHENTICATOR) - 1);
+                memcpy(authenticate, &authenticator_len, 2);
+                memcpy(authenticate + 2, CQL_AUTHENTICATOR, sizeof(CQL_AUTHENTICATOR) - 1);
+                if (answerClient(thread_data, thread_data->startup->stream, CQL_OPCODE_AUTHENTICATE, authenticate, sizeof(authenticate)) < 0) {
+                    SESSION_LOG(thread_data, LOG_WARN, "%u: Error sending AUTHENTICATE to client: %s\n", (uint32_t)tid, strerror(errno));
+
+                    break;
+                }
+                StatsRequestDone(thread_data, CQL_OPCODE_STARTUP, received_us);
+
+                continue;
+            }
+
+            SESSION_LOG(thread_data, LOG_DEBUG, "%u:   Finished with STARTUP, passing to Cassandra.\n", (uint32_t)tid);
         }
         else if (packet->opcode == CQL_OPCODE_CREDENTIALS) { // Modify CREDENTIALS packet to get the instance prefix
+            stage_ns = StatsStageStart();
+
             if (protocol_version_in_use != CQL_V1) { // CREDENTIALS is only used in v1 of the CQL protocol
                 char msg[] = "CREDENTIALS not supported in this version of CQL";
-                SendCQLError(thread_data->clientfd, (uint32_t)tid, CQL_ERROR_PROTOCOL_ERROR, msg);
+                sendClientError(thread_data, (uint32_t)tid, packet->stream, CQL_ERROR_PROTOCOL_ERROR, msg);
 
                 break;
             }
 
-            #if DEBUG
-            printf("%u:   Handling CREDENTIALS packet to get tenant's token.\n", (uint32_t)tid);
-            #endif
+            SESSION_LOG(thread_data, LOG_DEBUG, "%u:   Handling CREDENTIALS packet to get tenant's token.\n", (uint32_t)tid);
 
             cql_string_map_t *sm = ReadStringMap((char *)packet + header_len); // Get the username / password pair
             cql_string_map_t *head = sm;
 
             if (sm == NULL) { // No credentials were provided. Send back an error
-                #if DEBUG
-                printf("%u:     Error - No credentials supplied.\n", (uint32_t)tid);
-                #endif
+                SESSION_LOG(thread_data, LOG_DEBUG, "%u:     Error - No credentials supplied.\n", (uint32_t)tid);
 
                 char msg[] = "No credentials supplied";
-                SendCQLError(thread_data->clientfd, (uint32_t)tid, CQL_ERROR_BAD_CREDENTIALS, msg);
+                sendClientError(thread_data, (uint32_t)tid, packet->stream, CQL_ERROR_BAD_CREDENTIALS, msg);
 
                 break;
             }
 
             while (sm != NULL) {
-                #if DEBUG
-                printf("%u:     %s -> %s\n", (uint32_t)tid, sm->key, sm->value);
-                #endif
+                SESSION_LOG(thread_data, LOG_DEBUG, "%u:     %s -> %s\n", (uint32_t)tid, sm->key, sm->value);
 
                 if (strcmp(sm->key, "username") == 0) {
                     if (strlen(sm->value) <= TOKEN_LENGTH) { // The supplied username must be at least TOKEN_LENGTH + 1 characters long, so we can properly grab the token and still have at least one character remaining to pass on to Cassandra.
-                        #if DEBUG
-                        printf("%u:       Error - Invalid token + username supplied.\n", (uint32_t)tid);
-                        #endif
+                        SESSION_LOG(thread_data, LOG_DEBUG, "%u:       Error - Invalid token + username supplied.\n", (uint32_t)tid);
 
                         char msg[] = "Token + username is too short";
-                        SendCQLError(thread_data->clientfd, (uint32_t)tid, CQL_ERROR_BAD_CREDENTIALS, msg);
+                        sendClientError(thread_data, (uint32_t)tid, packet->stream, CQL_ERROR_BAD_CREDENTIALS, msg);
 
                         FreeStringMap(head);
                         head = NULL; // We need to be sneaky and break out the the main processing loop. c++ doesn't allow labels on loops, so use head == NULL as the conditional for another break below.
@@ -419,32 +561,30 @@ void* HandleConnClient(void* td) {
                         memset(userToken, 0, TOKEN_LENGTH + 1);
                         strncpy(userToken, sm->value, TOKEN_LENGTH); //Copy the token into the variable for user later on
 
-                        #if DEBUG
-                        printf("%u:       Token: %s\n", (uint32_t)tid, userToken);
-                        #endif
+                        SESSION_LOG(thread_data, LOG_DEBUG, "%u:       Token: %s\n", (uint32_t)tid, userToken);
 
                         // Now, validate that the supplied token is valid
                         pthread_mutex_lock(&thread_data->mutex); // Acquire the mutex before changing the token
                         bool isValid = checkToken(userToken, thread_data->token, false); // The checkToken function sets the contents of 'thread_data->token' before returning
+                        if (isValid) {
+                            thread_data->tenant = GetTenant(thread_data->token);
+                        }
                         pthread_mutex_unlock(&thread_data->mutex); // Release mutex
+                        PROBE4(auth_checked, thread_data->id, packet->stream, packet->opcode, isValid);
 
                         free(userToken);
 
                         if (isValid) { // User token is valid
-                            #if DEBUG
-                            printf("%u:       Internal Token: %s\n", (uint32_t)tid, thread_data->token);
-                            #endif
+                            SESSION_LOG(thread_data, LOG_DEBUG, "%u:       Internal Token: %s\n", (uint32_t)tid, thread_data->token);
 
                             // Replace the user-supplied token with the internal one for prefixing the username
                             memcpy(sm->value, thread_data->token, TOKEN_LENGTH); // Safe to copy without mutex
                         }
                         else { // User token is invalid
-                            #if DEBUG
-                            printf("%u:       Error - Token supplied is not valid.\n", (uint32_t)tid);
-                            #endif
+                            SESSION_LOG(thread_data, LOG_DEBUG, "%u:       Error - Token supplied is not valid.\n", (uint32_t)tid);
 
                             char msg[] = "Token supplied is not valid";
-                            SendCQLError(thread_data->clientfd, (uint32_t)tid, CQL_ERROR_BAD_CREDENTIALS, msg);
+                            sendClientError(thread_data, (uint32_t)tid, packet->stream, CQL_ERROR_BAD_CREDENTIALS, msg);
 
                             FreeStringMap(head);
                             head = NULL; // We need to be sneaky and break out the the main processing loop. c++ doesn't allow labels on loops, so use head == NULL as the conditional for another break below.
@@ -452,9 +592,7 @@ void* HandleConnClient(void* td) {
                             break;
                         }
 
-                        #if DEBUG
-                        printf("%u:       Internal username: %s\n", (uint32_t)tid, sm->value);
-                        #endif
+                        SESSION_LOG(thread_data, LOG_DEBUG, "%u:       Internal username: %s\n", (uint32_t)tid, sm->value);
                     }
                 }
 
@@ -472,22 +610,62 @@ void* HandleConnClient(void* td) {
 
             FreeStringMap(head);
 
-            #if DEBUG
-            printf("%u:   Finished with CREDENTIALS, passing to Cassandra.\n", (uint32_t)tid);
-            #endif
+            StatsStage(thread_data, STAGE_AUTH, stage_ns);
+
+            // A session whose STARTUP the gateway answered may be given a connection already logged in as its user
+            int pooledfd = -1;
+            cql_node_t *pooled = (thread_data->startup != NULL) ? PoolTake(thread_data->tenant, thread_data->startup, packet, &pooledfd) : NULL;
+            if (pooled != NULL) {
+                SESSION_LOG(thread_data, LOG_DEBUG, "%u:   Finished with CREDENTIALS, given a pooled connection to Cassandra node %s.\n", (uint32_t)tid, pooled->name);
+
+                RingRequestSent(thread_data, thread_data->startup); // Routes log in the same way
+                RingRequestSent(thread_data, packet);
+                free(thread_data->startup);
+                thread_data->startup = NULL;
+                attachUpstream(thread_data, pooledfd, pooled);
+
+                if (answerClient(thread_data, packet->stream, CQL_OPCODE_READY, NULL, 0) < 0) {
+                    SESSION_LOG(thread_data, LOG_WARN, "%u: Error sending READY to client: %s\n", (uint32_t)tid, strerror(errno));
+
+                    break;
+                }
+                StatsRequestDone(thread_data, CQL_OPCODE_CREDENTIALS, received_us);
+
+                free(packet);
+                packet = (cql_packet_t *)malloc(header_len); // Maintain invariant for top of loop
+
+                continue;
+            }
+
+            SESSION_LOG(thread_data, LOG_DEBUG, "%u:   Finished with CREDENTIALS, passing to Cassandra.\n", (uint32_t)tid);
         }
         else if (packet->opcode == CQL_OPCODE_OPTIONS) { // CQL OPTIONS packet
-            // Nothing to do here
+            // Answered with what the node last told the gateway it supports, if any node has yet (see upstream.cpp). This also
+            // lets a session not yet connected to Cassandra stay that way until it logs in.
+            cql_packet_t *supported = UpstreamCachedSupported(thread_data->cassandra_node, packet->stream);
+            if (supported != NULL) {
+                SESSION_LOG(thread_data, LOG_DEBUG, "%u:   Answering OPTIONS packet from the node's cached SUPPORTED.\n", (uint32_t)tid);
 
-            #if DEBUG
-            printf("%u:   Saw OPTIONS packet.\n", (uint32_t)tid);
-            #endif
+                if (SendToClient(thread_data, supported) < 0) {
+                    SESSION_LOG(thread_data, LOG_WARN, "%u: Error sending SUPPORTED to client: %s\n", (uint32_t)tid, strerror(errno));
+                    free(supported);
+
+                    break;
+                }
+                StatsRequestDone(thread_data, CQL_OPCODE_OPTIONS, received_us);
+
+                free(supported);
+                free(packet);
+                packet = (cql_packet_t *)malloc(header_len); // Maintain invariant for top of loop
+
+                continue;
+            }
+
+            SESSION_LOG(thread_data, LOG_DEBUG, "%u:   Saw OPTIONS packet, passing to Cassandra.\n", (uint32_t)tid);
         }
         else if (packet->opcode == CQL_OPCODE_QUERY) { // Rewrite CQL queries if needed
 
-            #if DEBUG
-            printf("%u:   Handling QUERY packet to (possibly) prepend the internal token.\n", (uint32_t)tid);
-            #endif
+            SESSION_LOG(thread_data, LOG_DEBUG, "%u:   Handling QUERY packet to (possibly) prepend the internal token.\n", (uint32_t)tid);
 
             int32_t query_len;
             memcpy(&query_len, (char *)packet + header_len, 4);
@@ -498,32 +676,61 @@ void* HandleConnClient(void* td) {
             uint16_t consistency;
             memcpy(&consistency, (char *)packet + header_len + 4 + query_len, 2);
 
-            #if DEBUG
-            printf("%u:     Query before rewrite: %s\n", (uint32_t)tid, query);
-            #endif
+            SESSION_LOG(thread_data, LOG_DEBUG, "%u:     Query before rewrite: %s\n", (uint32_t)tid, query);
+
+            // Drivers read the schema tables in full on every connect, so answer those from the tenant's cache when possible.
+            // Only this thread sets the tenant, so it can be read without the mutex.
+            if (thread_data->tenant != NULL && !(packet->flags & CQL_FLAG_TRACING)) { // A traced query needs a real trace from Cassandra
+                schema_table = schemaBootstrapQuery(MakeSpan(query, query_len));
+            }
+            if (schema_table != SCHEMA_TABLE_NONE) {
+                cql_packet_t *cached = TenantCachedSchemaResult(thread_data->tenant, schema_table, packet->stream);
+                if (cached != NULL) {
+                    SESSION_LOG(thread_data, LOG_DEBUG, "%u:     Answering from the tenant's cached copy of the schema table.\n", (uint32_t)tid);
+
+                    if (SendToClient(thread_data, cached) < 0) {
+                        SESSION_LOG(thread_data, LOG_WARN, "%u: Error sending cached result to client: %s\n", (uint32_t)tid, strerror(errno));
+                        free(cached);
+                        free(query);
+
+                        break;
+                    }
+                    StatsRequestDone(thread_data, CQL_OPCODE_QUERY, received_us);
+
+                    free(cached);
+                    free(query);
+                    free(packet);
+                    packet = (cql_packet_t *)malloc(header_len); // Maintain invariant for top of loop
+
+                    continue;
+                }
+            }
+
+            if (HittersEnabled()) {
+                statement = NormalizeQuery(query, query_len);
+                fingerprint = FingerprintOf(statement);
+            }
 
             // Now, fixup the query before passing into Cassandra
+            stage_ns = StatsStageStart();
             pthread_mutex_lock(&thread_data->mutex); // Acquire the mutex before changing the token
             std::string cpp_string = process_cql_cmd(query, thread_data->token);
             pthread_mutex_unlock(&thread_data->mutex); // Release mutex
             const char *new_query = cpp_string.c_str();
+            stage_ns = StatsStage(thread_data, STAGE_REWRITE, stage_ns);
+            PROBE5(query_rewritten, thread_data->id, packet->stream, packet->opcode, query_len, cpp_string.size());
 
-            #if DEBUG
-            printf("%u:     Query after rewrite: %s\n", (uint32_t)tid, new_query);
-            #endif
-                
-            if (interestingPacket(cpp_string)) {
+            SESSION_LOG(thread_data, LOG_DEBUG, "%u:     Query after rewrite: %s\n", (uint32_t)tid, new_query);
                 
-                #if DEBUG
-                printf("%u:       Found interesting packet %d going to cassandra.\n", (uint32_t)tid, packet->stream);
-                #endif
-                    
-                node *interesting_packet = (node *)malloc(sizeof(node));
-                interesting_packet->id = packet->stream;
-                interesting_packet->next = NULL;
-                pthread_mutex_lock(&thread_data->mutex); // Acquire the mutex before changing the linked list
-                thread_data->interestingPackets = addNode(thread_data->interestingPackets, interesting_packet);
-                pthread_mutex_unlock(&thread_data->mutex); // Release mutex
+            interesting = interestingPacket(MakeSpan(cpp_string.data(), cpp_string.size()));
+            StatsStage(thread_data, STAGE_CLASSIFY, stage_ns);
+            if (interesting) {
+                SESSION_LOG(thread_data, LOG_DEBUG, "%u:       Found interesting packet %d going to cassandra.\n", (uint32_t)tid, packet->stream);
+            }
+
+            if (SlowLogWanted(thread_data)) {
+                slow = SlowLogQuery(query, new_query, ntohs(consistency)); // Takes the query, so it isn't freed below
+                query = NULL;
             }
 
             query_len = strlen(new_query);
@@ -541,16 +748,12 @@ void* HandleConnClient(void* td) {
             packet = new_packet;
             free(query);
 
-            #if DEBUG
-            printf("%u:   Finished with QUERY, passing to Cassandra.\n", (uint32_t)tid);
-            #endif
+            SESSION_LOG(thread_data, LOG_DEBUG, "%u:   Finished with QUERY, passing to Cassandra.\n", (uint32_t)tid);
 
         }
         else if (packet->opcode == CQL_OPCODE_PREPARE) { // Rewrite CQL queries if needed
 
-            #if DEBUG
-            printf("%u:   Handling PREPARE packet to (possibly) prepend the internal token.\n", (uint32_t)tid);
-            #endif
+            SESSION_LOG(thread_data, LOG_DEBUG, "%u:   Handling PREPARE packet to (possibly) prepend the internal token.\n", (uint32_t)tid);
 
             int32_t query_len;
             memcpy(&query_len, (char *)packet + header_len, 4);
@@ -559,32 +762,28 @@ void* HandleConnClient(void* td) {
             memset(query, 0, query_len + 1);
             memcpy(query, (char *)packet + header_len + 4, query_len);
 
-            #if DEBUG
-            printf("%u:     Query before rewrite: %s\n", (uint32_t)tid, query);
-            #endif
+            SESSION_LOG(thread_data, LOG_DEBUG, "%u:     Query before rewrite: %s\n", (uint32_t)tid, query);
+
+            if (HittersEnabled()) {
+                statement = NormalizeQuery(query, query_len);
+                fingerprint = FingerprintOf(statement);
+            }
 
             // Now, fixup the query before passing into Cassandra
+            stage_ns = StatsStageStart();
             pthread_mutex_lock(&thread_data->mutex); // Acquire the mutex before changing the token
             std::string cpp_string = process_cql_cmd(query, thread_data->token);
             pthread_mutex_unlock(&thread_data->mutex); // Release mutex
             const char *new_query = cpp_string.c_str();
+            stage_ns = StatsStage(thread_data, STAGE_REWRITE, stage_ns);
+            PROBE5(query_rewritten, thread_data->id, packet->stream, packet->opcode, query_len, cpp_string.size());
 
-            #if DEBUG
-            printf("%u:     Query after rewrite: %s\n", (uint32_t)tid, new_query);
-            #endif
+            SESSION_LOG(thread_data, LOG_DEBUG, "%u:     Query after rewrite: %s\n", (uint32_t)tid, new_query);
 
-            if (interestingPacket(cpp_string)) {
-                
-                #if DEBUG
-                printf("%u:       Found interesting packet %d going to cassandra.\n", (uint32_t)tid, packet->stream);
-                #endif
-                    
-                node *interesting_packet = (node *)malloc(sizeof(node));
-                interesting_packet->id = packet->stream;
-                interesting_packet->next = NULL;
-                pthread_mutex_lock(&thread_data->mutex); // Acquire the mutex before changing the linked list
-                thread_data->interestingPackets = addNode(thread_data->interestingPackets, interesting_packet);
-                pthread_mutex_unlock(&thread_data->mutex); // Release mutex
+            interesting = interestingPacket(MakeSpan(cpp_string.data(), cpp_string.size()));
+            StatsStage(thread_data, STAGE_CLASSIFY, stage_ns);
+            if (interesting) {
+                SESSION_LOG(thread_data, LOG_DEBUG, "%u:       Found interesting packet %d going to cassandra.\n", (uint32_t)tid, packet->stream);
             }
 
             query_len = strlen(new_query);
@@ -601,16 +800,12 @@ void* HandleConnClient(void* td) {
             packet = new_packet;
             free(query);
 
-            #if DEBUG
-            printf("%u:   Finished with PREPARE, passing to Cassandra.\n", (uint32_t)tid);
-            #endif
+            SESSION_LOG(thread_data, LOG_DEBUG, "%u:   Finished with PREPARE, passing to Cassandra.\n", (uint32_t)tid);
 
         }
         else if (packet->opcode == CQL_OPCODE_EXECUTE) { // Verify that this prepared statement belongs to the tenant submitting it
 
-            #if DEBUG
-            printf("%u:   Handling EXECUTE packet to verify user can call prepared method.\n", (uint32_t)tid);
-            #endif
+            SESSION_LOG(thread_data, LOG_DEBUG, "%u:   Handling EXECUTE packet to verify user can call prepared method.\n", (uint32_t)tid);
 
             uint16_t num_bytes = 0;
             memcpy(&num_bytes, (char *)packet + header_len, 2);
@@ -627,128 +822,281 @@ void* HandleConnClient(void* td) {
 
             // After checking the prepared id, we can ignore the rest of the packet, since it's just data being sent to Cassandra
 
+            if (HittersEnabled()) {
+                statement = NormalizeExecute(prepared_id, num_bytes);
+                fingerprint = FingerprintOf(statement);
+            }
+
             free(prepared_id);
 
-            #if DEBUG
-            printf("%u:   Finished with EXECUTE, passing to Cassandra.\n", (uint32_t)tid);
-            #endif
+            if (SlowLogWanted(thread_data)) {
+                slow = SlowLogExecute((char *)packet + header_len, body_len);
+            }
+
+            SESSION_LOG(thread_data, LOG_DEBUG, "%u:   Finished with EXECUTE, passing to Cassandra.\n", (uint32_t)tid);
 
         }
         else if (packet->opcode == CQL_OPCODE_REGISTER) { // CQL REGISTER packet
-            // Nothing to do here
+            SESSION_LOG(thread_data, LOG_DEBUG, "%u:   Handling REGISTER packet, subscribing client to the gateway's events.\n", (uint32_t)tid);
 
-            #if DEBUG
-            printf("%u:   Saw REGISTER packet.\n", (uint32_t)tid);
-            #endif
+            // Events come from the gateway's single event connection (see events.cpp), so REGISTER is answered here
+            if (!SubscribeEvents(thread_data, (char *)packet + header_len, ntohl(packet->length))) {
+                char msg[] = "Malformed REGISTER";
+                sendClientError(thread_data, (uint32_t)tid, packet->stream, CQL_ERROR_PROTOCOL_ERROR, msg);
+
+                break;
+            }
+
+            packet->version = CQL_V1_RESPONSE;
+            packet->opcode = CQL_OPCODE_READY;
+            packet->length = 0;
+            if (SendToClient(thread_data, packet) < 0) {
+                SESSION_LOG(thread_data, LOG_WARN, "%u: Error sending READY to client: %s\n", (uint32_t)tid, strerror(errno));
+
+                break;
+            }
+            StatsRequestDone(thread_data, CQL_OPCODE_REGISTER, received_us);
+
+            free(packet);
+            packet = (cql_packet_t *)malloc(header_len); // Maintain invariant for top of loop
+
+            continue;
         }
         else { // This is an error -- we got an unexpected packet from the client
-            #if DEBUG
-            printf("%u:   Got unexpected packet type %d from client.\n", (uint32_t)tid, packet->opcode);
-            #endif
+            SESSION_LOG(thread_data, LOG_DEBUG, "%u:   Got unexpected packet type %d from client.\n", (uint32_t)tid, packet->opcode);
 
             char msg[] = "Got unexpected packet";
-            SendCQLError(thread_data->clientfd, (uint32_t)tid, CQL_ERROR_PROTOCOL_ERROR, msg);
+            sendClientError(thread_data, (uint32_t)tid, packet->stream, CQL_ERROR_PROTOCOL_ERROR, msg);
 
             break;
         }
 
-        // Send packet to Cassandra (body length may have changed, so re-get value from header)
-        if (send(thread_data->cassandrafd, packet, header_len + ntohl(packet->length), 0) < 0) { // Packet total size is header + body => 8 + packet->length
-            fprintf(stderr, "%u: Error sending packet to Cassandra: %s\n", (uint32_t)tid, strerror(errno));
-            exit(1);
+        HittersRequest(thread_data, fingerprint, statement, header_len + body_len);
+
+        // Turn the request away if Cassandra is falling behind and this tenant is among the first to be shed
+        if (thread_data->tenant != NULL && OverloadShouldShed(thread_data->tenant)) {
+            SESSION_LOG(thread_data, LOG_DEBUG, "%u:   Cassandra is overloaded, shedding packet.\n", (uint32_t)tid);
+
+            SlowLogDiscard(slow);
+
+            if (sendClientError(thread_data, (uint32_t)tid, packet->stream, CQL_ERROR_OVERLOADED, "Cassandra is overloaded, try again later") < 0) {
+                break; // The client is gone
+            }
+
+            free(packet);
+            packet = (cql_packet_t *)malloc(header_len); // Maintain invariant for top of loop
+
+            continue;
         }
 
-        free(packet);
+        // Apply the tenant's rate limits, which are shared by all of its connections. Nothing is limited before authentication.
+        if (thread_data->tenant != NULL) {
+            uint64_t delay_us = 0;
+            if (!TenantAdmitRequest(thread_data->tenant, header_len + ntohl(packet->length), &delay_us)) {
+                SESSION_LOG(thread_data, LOG_DEBUG, "%u:   Tenant is over its rate limit, rejecting packet.\n", (uint32_t)tid);
+
+                SlowLogDiscard(slow);
+
+                if (sendClientError(thread_data, (uint32_t)tid, packet->stream, CQL_ERROR_OVERLOADED, "Request rate limit exceeded") < 0) {
+                    break; // The client is gone
+                }
+
+                free(packet);
+                packet = (cql_packet_t *)malloc(header_len); // Maintain invariant for top of loop
+
+                continue;
+            }
+            if (delay_us > 0) {
+                SESSION_LOG(thread_data, LOG_DEBUG, "%u:   Tenant is over its rate limit, holding packet for %lu us.\n", (uint32_t)tid, (unsigned long)delay_us);
+
+                usleep(delay_us);
+            }
+        }
+
+        // A session not yet connected to Cassandra is connected now, with the STARTUP the gateway answered replayed first
+        if (thread_data->cassandra_node == NULL) {
+            int fd = -1;
+            cql_node_t *n = PoolConnect(thread_data->startup, &fd);
+            if (n == NULL) {
+                SESSION_LOG(thread_data, LOG_ERROR, "%u: Could not connect to any Cassandra node, closing the client's connection.\n", (uint32_t)tid);
+                SlowLogDiscard(slow);
+
+                sendClientError(thread_data, (uint32_t)tid, packet->stream, CQL_ERROR_SERVER_ERROR, "Could not connect to Cassandra");
+
+                break;
+            }
+            if (thread_data->startup != NULL) {
+                RingRequestSent(thread_data, thread_data->startup);
+                free(thread_data->startup);
+                thread_data->startup = NULL;
+            }
+            attachUpstream(thread_data, fd, n);
+        }
+
+        // Send on a stream id of our own, so a response that comes after the client was told of a timeout can be recognized
+        int8_t upstream = TimeoutMapStream(thread_data, packet->stream);
+        if (upstream < 0) {
+            SlowLogDiscard(slow);
+
+            if (sendClientError(thread_data, (uint32_t)tid, packet->stream, CQL_ERROR_OVERLOADED, "Too many requests waiting on Cassandra") < 0) {
+                break; // The client is gone
+            }
+
+            free(packet);
+            packet = (cql_packet_t *)malloc(header_len); // Maintain invariant for top of loop
+
+            continue;
+        }
+        PROBE4(stream_mapped, thread_data->id, packet->stream, packet->opcode, upstream);
+        if (interesting) {
+            PROBE3(interesting_set, thread_data->id, packet->stream, packet->opcode);
+        }
+        packet->stream = upstream;
+        cql_inflight_t *f = &thread_data->inflight[upstream];
+        f->received_us = received_us;
+        f->opcode = packet->opcode;
+        SlowLogDiscard(f->slow); // Left by a request that timed out before it was sent
+        f->slow = slow;
+        f->fingerprint = fingerprint;
+        f->interesting = interesting;
+        f->schema_table = schema_table;
+        f->schema_version = (schema_table != SCHEMA_TABLE_NONE) ? TenantSchemaVersion(thread_data->tenant) : 0;
+
+        // An EXECUTE may go straight to the node owning its partition, if configured (see ring.cpp)
+        RingRequestSent(thread_data, packet);
+        cql_route_t *route = RingRoute(thread_data, packet);
+        route = BreakerReroute(thread_data, packet, route); // Not to a node whose circuit breaker is open, if it can be helped
+        cql_node_t *sent_node = (route != NULL) ? route->node : thread_data->cassandra_node;
+
+        HedgeStart(thread_data, packet, sent_node); // A slow read may go to a second node as well (see hedge.cpp)
+        TimeoutStart(thread_data, packet);
+        OverloadRequestSent(thread_data, packet->stream, sent_node); // Time spent in the scheduler's queues counts towards the latency
+
+        if (thread_data->tenant != NULL && SchedulerEnabled()) {
+            // The scheduler sends the packet when it is the tenant's turn, and frees it
+            SchedulerSubmit(thread_data, packet, route);
+        }
+        else {
+            // Send packet to Cassandra (body length may have changed, so re-get value from header)
+            stage_ns = StatsStageStart();
+            SlowLogForwarding(thread_data, packet->stream);
+            bool sent = (route != NULL) ? RouteSend(route, packet) : send(thread_data->cassandrafd, packet, header_len + ntohl(packet->length), 0) >= 0; // Packet total size is header + body => 8 + packet->length
+            if (!sent) {
+                // The node has gone away, so this client is disconnected and reconnects to another one
+                SESSION_LOG(thread_data, LOG_WARN, "%u: Error sending packet to Cassandra: %s\n", (uint32_t)tid, strerror(errno));
+                UpstreamFailed(sent_node, strerror(errno));
+
+                break;
+            }
+            StatsStage(thread_data, STAGE_SEND_UPSTREAM, stage_ns);
+            PROBE4(frame_forwarded, thread_data->id, packet->stream, packet->opcode, header_len + ntohl(packet->length));
+
+            free(packet);
+        }
         packet = (cql_packet_t *)malloc(header_len); // Maintain invariant for top of loop
 
-        #if DEBUG
-        printf("%u: Packet successfully sent to Cassandra.\n\n", (uint32_t)tid);
-        #endif
+        SESSION_LOG(thread_data, LOG_DEBUG, "%u: Packet successfully sent to Cassandra.\n\n", (uint32_t)tid);
 
     }
 
     if (recv_ret == 0) { // A clean shutdown from the client's end
-        #if DEBUG
-        printf("%u: Client has closed the socket.\n", (uint32_t)tid);
-        #endif
+        SESSION_LOG(thread_data, LOG_DEBUG, "%u: Client has closed the socket.\n", (uint32_t)tid);
     }
     else if (recv_ret == 1) { // Some error occured while processing the packet. An error has been sent to the client or stdout, so clean up things before killing threads.
-        #if DEBUG
-        printf("%u: Client sent the wrong first byte or some other error has already been reported.\n", (uint32_t)tid);
-        #endif
-
-        close(thread_data->clientfd);
+        SESSION_LOG(thread_data, LOG_DEBUG, "%u: Client sent the wrong first byte or some other error has already been reported.\n", (uint32_t)tid);
     }
     else { // Some sort of error occurred (or the recv() timed out) when getting the first byte, so recv_ret < 0
         // TODO -- check if time out or different error
 
-        fprintf(stderr, "%u:   Error/time out reading first byte from client: %s\n", (uint32_t)tid, strerror(errno));
+        SESSION_LOG(thread_data, LOG_WARN, "%u:   Error/time out reading first byte from client: %s\n", (uint32_t)tid, strerror(errno));
     }
 
-    #if DEBUG
-    printf("%u: Client connection terminated, killing self and Cassandra thread.\n", (uint32_t)tid);
-    #endif
+    StatsChargeCpu(thread_data, CPU_CLIENT, &cpu_ns);
+    SESSION_LOG(thread_data, LOG_DEBUG, "%u: Client connection terminated, killing self and Cassandra thread.\n", (uint32_t)tid);
+    PROBE2(conn_close, thread_data->id, thread_data->clientfd);
 
     free(packet);
 
-    // Kill the Cassandra thread
-    pthread_cancel(thread_data->cassandra);
-    pthread_join(thread_data->cassandra, NULL);
+    ShardClosed(thread_data->shard);
 
-    // The client thread takes care of cleaning up shared memory
-    close(thread_data->cassandrafd);
+    // Other threads may be blocked sending to the client, e.g. events. Shutting down the socket fails those sends, so that waiting
+    // on them below can't take long.
+    shutdown(thread_data->clientfd, SHUT_RDWR);
 
-    pthread_mutex_destroy(&thread_data->mutex);
+    // Stop events from being sent to this client before its memory goes away
+    UnsubscribeEvents(thread_data);
 
-    node *head = thread_data->interestingPackets;
-    while (head != NULL) {
-        node *tmp = head->next;
-        free(head);
-        head = tmp;
+    // Kill the Cassandra thread, if the session got as far as connecting to Cassandra
+    if (thread_data->cassandra_node != NULL) {
+        pthread_cancel(thread_data->cassandra);
+        pthread_join(thread_data->cassandra, NULL);
+    }
+    RingStopRoutes(thread_data);
+
+    // Drop anything still waiting to be sent to Cassandra for this client
+    TimeoutSessionClosed(thread_data);
+    HedgeSessionClosed(thread_data);
+    SchedulerCancel(thread_data);
+    BreakerSessionClosed(thread_data);
+    OverloadSessionClosed(thread_data);
+    StatsSessionClosed(thread_data);
+    SlowLogSessionClosed(thread_data);
+
+    // The client thread takes care of cleaning up shared memory. The client's socket is closed only now, however the connection
+    // ended, so that the Cassandra thread can't have written to a reused descriptor.
+    close(thread_data->clientfd);
+    if (thread_data->cassandra_node != NULL) {
+        close(thread_data->cassandrafd);
+        UpstreamRelease(thread_data->cassandra_node);
     }
+    free(thread_data->startup);
+    RingSessionClosed(thread_data);
+
+    pthread_mutex_destroy(&thread_data->mutex);
+    pthread_mutex_destroy(&thread_data->send_mutex);
+
     free(thread_data->token);
     free(thread_data);
 
-    #if DEBUG
-    printf("%u: Both threads are dead and cleaned up.\n", (uint32_t)tid);
-    #endif
+    LOG(LOG_DEBUG, "%u: Both threads are dead and cleaned up.\n", (uint32_t)tid);
 
     return NULL;
 }
 
 /*
- * This method handles packets from Cassandra, processing and rewriting results as needed, and then forwards new packets back to the client.
+ * Reads the responses on the session's own connection to Cassandra, or on one of its routes if route is set.
  */
-void* HandleConnCassandra(void* td) {
-    cql_thread_t *thread_data = (cql_thread_t *)td;
+static void* handleUpstream(cql_thread_t *thread_data, cql_route_t *route) {
+    int fd = (route != NULL) ? route->fd : thread_data->cassandrafd;
+    cql_node_t *upstream_node = (route != NULL) ? route->node : thread_data->cassandra_node;
 
     // Save this thread's ID to prefix all messages with
     pthread_t tid = pthread_self();
 
-    #if DEBUG
-    printf("%u: Thread spawned for Cassandra.\n", (uint32_t)tid);
-    #endif
+    SESSION_LOG(thread_data, LOG_DEBUG, "%u: Thread spawned for Cassandra node %s.\n", (uint32_t)tid, upstream_node->name);
 
     uint8_t header_len = sizeof(cql_packet_t); // Length of the header
     uint32_t body_len = 0; // Length of packet body
     cql_packet_t *packet = (cql_packet_t *)malloc(header_len); // Raw packet data
 
     int recv_ret; // Save the return value of the recv() call below, since we may need to take action in case of error
+    uint64_t cpu_ns = StatsThreadCpuNs(); // CPU time used so far, charged to the tenant a frame at a time
 
     // Setup a callback to free the packet buffer when this thread is killed
     pthread_cleanup_push(cassandra_thread_cleanup_handler, &packet);
 
     // At the top of the loop, we are expecting the start of another CQL packet. We assume Cassandra will always give us properly formed packets.
     // INVARIANT: Before recv() is called, packet will be allocated with (cql_packet_t *)malloc(header_len).
-    while (recv_ret = recv(thread_data->cassandrafd, packet, header_len, 0), recv_ret == header_len) { // Read in the header from Cassandra. A value of 0 indicates clean shutdown, and less than 0 is an error
-        #if DEBUG
-        printf("%u: Processing packet from Cassandra.\n", (uint32_t)tid);
+    while (recv_ret = recv(fd, packet, header_len, 0), recv_ret == header_len) { // Read in the header from Cassandra. A value of 0 indicates clean shutdown, and less than 0 is an error
+        StatsChargeCpu(thread_data, CPU_CASSANDRA, &cpu_ns); // For the previous frame; the last one before the thread is cancelled goes uncharged
+        SESSION_LOG(thread_data, LOG_DEBUG, "%u: Processing packet from Cassandra.\n", (uint32_t)tid);
 
+        #if DEBUG
         assert(packet->version == CQL_V1_RESPONSE); // Currently we only support v1 of the CQL protocol, since that's what the drivers use
-
-        printf("%u: Header information -- version: %d; flags: %d; stream: %d; opcode: %s; length: %u\n", (uint32_t)tid, packet->version, packet->flags, packet->stream, printable_opcodes[packet->opcode], ntohl(packet->length));
         #endif
 
+        SESSION_LOG(thread_data, LOG_DEBUG, "%u: Header information -- version: %d; flags: %d; stream: %d; opcode: %s; length: %u\n", (uint32_t)tid, packet->version, packet->flags, packet->stream, printable_opcodes[packet->opcode], ntohl(packet->length));
+
         body_len = ntohl(packet->length);
 
         if (body_len > 0) {
@@ -765,26 +1113,73 @@ void* HandleConnCassandra(void* td) {
             // Read in body of packet (possibly over more than one recv() call)
             uint32_t body_bytes_read = 0;
             while (body_bytes_read < body_len) { // Get the rest of the body
-                int32_t bytes_in = recv(thread_data->cassandrafd, (char *)packet + header_len + body_bytes_read, body_len - body_bytes_read, 0);
-                if (bytes_in < 0) {
-                    fprintf(stderr, "%u: Error reading packet body from Cassandra: %s\n", (uint32_t)tid, strerror(errno));
-                    exit(1); // Die here, unlike when dealing with a client, since Cassandra shouldn't give bad data
+                int32_t bytes_in = recv(fd, (char *)packet + header_len + body_bytes_read, body_len - body_bytes_read, 0);
+                if (bytes_in <= 0) {
+                    break;
                 }
                 else {
                     body_bytes_read += bytes_in;
                 }
             }
+            if (body_bytes_read < body_len) { // The connection to Cassandra was lost, see below
+                break;
+            }
         }
 
-        #if DEBUG
-        printf("%u: Full packet received, beginning processing.\n", (uint32_t)tid);
-        #endif
+        SESSION_LOG(thread_data, LOG_DEBUG, "%u: Full packet received, beginning processing.\n", (uint32_t)tid);
+
+        if (route != NULL && packet->stream == route->internal_stream) { // Answers the gateway, not the client
+            RouteInternal(route, packet);
+
+            free(packet);
+            packet = (cql_packet_t *)malloc(header_len); // Maintain invariant for top of loop
+
+            continue;
+        }
+
+        int8_t upstream = packet->stream; // The stream id the request was sent on, before it is mapped back to the client's
+        uint64_t received_us = 0; // When the client sent the request this answers
+        uint8_t request_opcode = 0;
+        cql_slow_request_t *slow = NULL;
+        bool interesting = false; // Tagged on the way to Cassandra as having results to filter
+        int schema_table = SCHEMA_TABLE_NONE;
+        uint32_t schema_version = 0;
+        bool read = false; // Timed for its tenant's hedge delay
+        if (packet->stream >= 0) { // Not an event, so it answers a request
+            cql_inflight_t *f = &thread_data->inflight[packet->stream]; // Read before the stream id can be reused
+            received_us = f->received_us;
+            request_opcode = f->opcode;
+            interesting = f->interesting;
+            schema_table = f->schema_table;
+            schema_version = f->schema_version;
+            read = f->read;
+            slow = SlowLogAnswered(thread_data, packet->stream);
+            HittersResponse(thread_data, f->fingerprint, header_len + body_len);
+            BreakerResponse(thread_data, packet->stream, packet); // Counts against the node that answered
+
+            SchedulerComplete(thread_data, packet->stream); // Lets the scheduler send another request, if this one came from it
+            OverloadResponseReceived(thread_data, packet->stream);
+
+            // Back to the client's own stream id
+            int8_t client_stream;
+            if (!TimeoutUnmapStream(thread_data, packet->stream, &client_stream)) {
+                SESSION_LOG(thread_data, LOG_DEBUG, "%u:   Dropping late response on stream %d, the client was already sent a timeout.\n", (uint32_t)tid, packet->stream);
+                SlowLogRequestDone(thread_data, slow, received_us, true);
+
+                free(packet);
+                packet = (cql_packet_t *)malloc(header_len); // Maintain invariant for top of loop
+
+                continue;
+            }
+            packet->stream = client_stream;
+            if (read) {
+                HedgeAnswered(thread_data, received_us);
+            }
+        }
 
         // Modify packet (if needed)
         if (packet->opcode == CQL_OPCODE_ERROR) { // CQL ERROR packet
-            #if DEBUG
-            printf("%u:   Handling ERROR packet from Cassandra.\n", (uint32_t)tid);
-            #endif
+            SESSION_LOG(thread_data, LOG_DEBUG, "%u:   Handling ERROR packet from Cassandra.\n", (uint32_t)tid);
 
             int32_t error_code = 0;
             memcpy(&error_code, (char *)packet + header_len, 4);
@@ -798,19 +1193,16 @@ void* HandleConnCassandra(void* td) {
             memset(err, 0, str_len + 1);
             memcpy(err, (char *)packet + header_len + 6, str_len);
 
-            #if DEBUG
-            printf("%u:     Error code: 0x%04X; msg: %s\n", (uint32_t)tid, error_code, err);
-            #endif
+            SESSION_LOG(thread_data, LOG_DEBUG, "%u:     Error code: 0x%04X; msg: %s\n", (uint32_t)tid, error_code, err);
 
-            // Strip out the prefix token from the error string
-            while (strstr(err, thread_data->token) != NULL) {
-                char *p = strstr(err, thread_data->token);
+            // Strip out the prefix token from the error string. Error messages are short, and strstr() on them beats setting up a
+            // scanner (see tests/bench_scan.cpp). Before CREDENTIALS the token is empty, and there is nothing to strip.
+            char *p;
+            while (thread_data->token[0] != '\0' && (p = strstr(err, thread_data->token)) != NULL) {
                 memmove(p, p + TOKEN_LENGTH, 1 + strlen(p + TOKEN_LENGTH));
             }
 
-            #if DEBUG
-            printf("%u:     Error code: 0x%04X; msg: %s\n", (uint32_t)tid, error_code, err);
-            #endif
+            SESSION_LOG(thread_data, LOG_DEBUG, "%u:     Error code: 0x%04X; msg: %s\n", (uint32_t)tid, error_code, err);
 
             // Now, rebuild the packet
             uint16_t new_str_len = strlen(err);
@@ -837,16 +1229,12 @@ void* HandleConnCassandra(void* td) {
                 memset(ks, 0, str_len + 1);
                 memcpy(ks, b + 2, str_len);
 
-                #if DEBUG
-                printf("%u:       Keyspace is '%s'.\n", (uint32_t)tid, ks);
-                #endif
+                SESSION_LOG(thread_data, LOG_DEBUG, "%u:       Keyspace is '%s'.\n", (uint32_t)tid, ks);
 
                 memmove(ks, ks + TOKEN_LENGTH, strlen(ks) - TOKEN_LENGTH + 1);
                 str_len -= TOKEN_LENGTH;
 
-                #if DEBUG
-                printf("%u:       Keyspace changed to '%s'.\n", (uint32_t)tid, ks);
-                #endif
+                SESSION_LOG(thread_data, LOG_DEBUG, "%u:       Keyspace changed to '%s'.\n", (uint32_t)tid, ks);
 
                 str_len = htons(str_len);
                 memcpy(b, &str_len, 2);
@@ -858,69 +1246,52 @@ void* HandleConnCassandra(void* td) {
                 free(ks);
             }
 
-            #if DEBUG
-            printf("%u:   Finished with ERROR, passing to client.\n", (uint32_t)tid);
-            #endif
+            SESSION_LOG(thread_data, LOG_DEBUG, "%u:   Finished with ERROR, passing to client.\n", (uint32_t)tid);
         }
         else if (packet->opcode == CQL_OPCODE_READY) { // CQL READY packet
             // Nothing to do here
 
-            #if DEBUG
-            printf("%u:   Saw READY packet.\n", (uint32_t)tid);
-            #endif
+            SESSION_LOG(thread_data, LOG_DEBUG, "%u:   Saw READY packet.\n", (uint32_t)tid);
         }
         else if (packet->opcode == CQL_OPCODE_AUTHENTICATE) { // Print body of AUTHENTICATE packet
-            #if DEBUG
-            printf("%u:   Handling AUTHENTICATE packet from Cassandra.\n", (uint32_t)tid);
+            SESSION_LOG(thread_data, LOG_DEBUG, "%u:   Handling AUTHENTICATE packet from Cassandra.\n", (uint32_t)tid);
 
             uint16_t str_len = 0;
             memcpy(&str_len, (char *)packet + header_len, 2);
             str_len = ntohs(str_len);
+            SESSION_LOG(thread_data, LOG_DEBUG, "%u:     %.*s\n", (uint32_t)tid, (int)str_len, (char *)packet + header_len + 2);
 
-            char *body = (char *)malloc(str_len + 1);
-            memset(body, 0, str_len + 1);
-            strncpy(body, (char *)packet + header_len + 2, str_len);
-            printf("%u:     %s\n", (uint32_t)tid, body);
-            free(body);
-
-            printf("%u:   Finished with AUTHENTICATE, passing to client.\n", (uint32_t)tid);
-            #endif
+            SESSION_LOG(thread_data, LOG_DEBUG, "%u:   Finished with AUTHENTICATE, passing to client.\n", (uint32_t)tid);
         }
         else if (packet->opcode == CQL_OPCODE_SUPPORTED) { // CQL SUPPORTED packet
-            // Nothing to do here
+            // Kept to answer the next clients' OPTIONS with, see upstream.cpp
+            UpstreamLearnSupported(upstream_node, packet);
 
-            #if DEBUG
-            printf("%u:   Saw SUPPORTED packet.\n", (uint32_t)tid);
-            #endif
+            SESSION_LOG(thread_data, LOG_DEBUG, "%u:   Saw SUPPORTED packet.\n", (uint32_t)tid);
         }
         else if (packet->opcode == CQL_OPCODE_RESULT) { // Process the result of a query and possibly filter if needed
 
             // FIXME need to consider that the tracing flag may be set. If so, there will be a [uuid] before the rest of the packet body
 
-            #if DEBUG
-            printf("%u:   Handling RESULT packet from Cassandra.\n", (uint32_t)tid);
-            #endif
+            SESSION_LOG(thread_data, LOG_DEBUG, "%u:   Handling RESULT packet from Cassandra.\n", (uint32_t)tid);
 
             int32_t result_type = 0;
             memcpy(&result_type, (char *)packet + header_len, 4); // Get the result type
             result_type = ntohl(result_type);
 
             if (result_type == CQL_RESULT_VOID) {
-                #if DEBUG
-                printf("%u:     It is a VOID result.\n", (uint32_t)tid);
-                #endif
+                SESSION_LOG(thread_data, LOG_DEBUG, "%u:     It is a VOID result.\n", (uint32_t)tid);
 
                 // Nothing to do
             }
             else if (result_type == CQL_RESULT_ROWS) {
-                #if DEBUG
-                printf("%u:     It is a ROWS result.\n", (uint32_t)tid);
-                #endif
+                SESSION_LOG(thread_data, LOG_DEBUG, "%u:     It is a ROWS result.\n", (uint32_t)tid);
 
                 uint32_t offset = header_len + 4; // Because there can be a varied number of items before the rows begin, need to keep track of the offset in the packet
 
                 // Begin by getting the metadata for the rows
-                cql_result_metadata_t *metadata = ReadResultMetadata((char *)packet + offset, (uint32_t)tid);
+                cql_result_metadata_t *metadata = ReadResultMetadata((char *)packet + offset);
+                logResultMetadata(thread_data, (uint32_t)tid, metadata);
                 offset += metadata->offset; // Move the offset to the end of the metadata block
 
                 int32_t rows_count = 0;
@@ -928,116 +1299,72 @@ void* HandleConnCassandra(void* td) {
                 rows_count = ntohl(rows_count);
                 offset += 4;
 
-                #if DEBUG
-                printf("%u:       There are %d rows and %d columns.\n", (uint32_t)tid, rows_count, metadata->columns_count);
-                #endif
+                SESSION_LOG(thread_data, LOG_DEBUG, "%u:       There are %d rows and %d columns.\n", (uint32_t)tid, rows_count, metadata->columns_count);
 
-                // Get the actual result data
-                cql_result_cell_t *parsed_table = ReadCQLResults((char *)packet + offset, rows_count, metadata->columns_count);
-                
-                pthread_mutex_lock(&thread_data->mutex); // Acquire the mutex before changing the linked list
                 // An interesting packet was tagged on the way to Cassandra AND impacts a "private table"
-                bool isInterestingPacket = findNode(thread_data->interestingPackets, packet->stream) && isImportantTable(metadata->keyspace, metadata->table);
-                thread_data->interestingPackets = removeNode(thread_data->interestingPackets, packet->stream);
-                pthread_mutex_unlock(&thread_data->mutex); // Release mutex
+                bool isInterestingPacket = interesting && metadata->keyspace != NULL && isImportantTable(metadata->keyspace, metadata->table);
+                if (interesting) {
+                    PROBE3(interesting_cleared, thread_data->id, packet->stream, request_opcode);
+                }
                 
                 if (isInterestingPacket) {
-                    cql_result_cell_t *rowPtr = parsed_table;
-                    cql_result_cell_t *colPtr = parsed_table;
+                    uint64_t stage_ns = StatsStageStart();
+
+                    // Index the actual result data. Cells stay where they are in the packet until the final compaction below.
+                    cql_result_index_t *index = IndexCQLResults((char *)packet + offset, rows_count, metadata->columns_count);
                     cql_column_spec_t *colTypeMap = metadata->column;
-                    #if DEBUG
-                    printf("%u:   Begin filtering interesting packet with stream ID %d.\n", (uint32_t)tid,packet->stream);
-                    #endif
+                    SESSION_LOG(thread_data, LOG_DEBUG, "%u:   Begin filtering interesting packet with stream ID %d.\n", (uint32_t)tid,packet->stream);
                     
                     /*
-                    * Scan row by row and iterate through each col
-                    * As we iterate through each col, iterate through the map of col->type looking for string
+                    * Scan column by column, since each column has a single type
                     * TODO: Should I adhear to the Cassandra system table doc?
                     */
-                    int i = 0;
                     int j = 0;
-                    while(rowPtr != NULL && i < rows_count){
-                        colPtr = rowPtr;
-                        j = 0;
-                        while(colPtr != NULL && j < metadata->columns_count){
-                            if(isImportantColumn(colTypeMap->name)){
-                                char *terminated_content = (char *)malloc(colPtr->len + 1);
-                                memset(terminated_content, 0, colPtr->len + 1);
-                                memcpy(terminated_content, colPtr->content, colPtr->len);
-                                if(!scanForInternalToken(terminated_content, thread_data->token) || scanforRestrictedKeyspaces(terminated_content)){
-                                    // False, so the internal token did not appear in the column data, must remove
-                                    #if DEBUG
-                                    printf("%u:   Found a column that requires removal: %s.\n", (uint32_t)tid, terminated_content);
-                                    #endif
-                                    rowPtr->remove = true;
-                                    //rows_count --;
-                                }
-                                free(terminated_content);
-                            }
-
-                            if ((colTypeMap->type == 0x0001 || colTypeMap->type == 0x0009 || colTypeMap->type == 0x000A || colTypeMap->type == 0x000D) &&
-                                colPtr->len > TOKEN_LENGTH) {
-                                // This is a text-ish string that may need to have the internal token stripped from the front
-                                // Most strings seem to be varchars (0x000D)
-
-                                if (strncmp(thread_data->token, colPtr->content, TOKEN_LENGTH) == 0) {
-                                    memmove(colPtr->content, colPtr->content + TOKEN_LENGTH, colPtr->len - TOKEN_LENGTH);
-                                    colPtr->len -= TOKEN_LENGTH;
-
-                                    #if DEBUG
-                                    char *terminated_content = (char *)malloc(colPtr->len + 1);
-                                    memset(terminated_content, 0, colPtr->len + 1);
-                                    memcpy(terminated_content, colPtr->content, colPtr->len);
-                                    printf("%u:   Stripped prefix from content: %s.\n", (uint32_t)tid, terminated_content);
-                                    free(terminated_content);
-                                    #endif
-                                }
-                            }
-
-                            colTypeMap = colTypeMap->next;
-                            colPtr = colPtr->next_col;
-                            j = j + 1;
+                    while(index != NULL && colTypeMap != NULL && j < metadata->columns_count){
+                        int kind = isImportantColumn(colTypeMap->name);
+                        if(kind != COLUMN_OTHER){
+                            // Rows naming a keyspace or user that isn't the tenant's (or shared) must be removed
+                            TenantFilterColumn(thread_data->tenant, kind, (char *)packet + offset, index, j);
+                        }
+
+                        if ((colTypeMap->type == 0x0001 || colTypeMap->type == 0x0009 || colTypeMap->type == 0x000A || colTypeMap->type == 0x000D) &&
+                            strlen(thread_data->token) == TOKEN_LENGTH) {
+                            // This is a text-ish column whose strings may need to have the internal token stripped from the front
+                            // Most strings seem to be varchars (0x000D)
+                            StripColumnPrefix((char *)packet + offset, index, j, thread_data->token, TOKEN_LENGTH);
                         }
-                        colTypeMap = metadata->column;
-                        rowPtr = rowPtr->next_row;
-                        
-                        i = i + 1;
+
+                        colTypeMap = colTypeMap->next;
+                        j = j + 1;
+                    }
+
+                    // Now, update the packet with the new rows in one sweep. Since we will only ever remove data, we don't have to worry about overflowing allocated memory.
+                    stage_ns = StatsStage(thread_data, STAGE_FILTER, stage_ns);
+                    uint32_t buf_len = CompactCQLResults((char *)packet + offset, index, TOKEN_LENGTH, &rows_count);
+                    StatsStage(thread_data, STAGE_COMPACT, stage_ns);
+
+                    SESSION_LOG(thread_data, LOG_DEBUG, "%u:       After filtering, there are now %d rows and %d columns.\n", (uint32_t)tid, rows_count, metadata->columns_count);
+
+                    rows_count = htonl(rows_count);
+                    memcpy((char *)packet + offset - 4, &rows_count, 4);
+                    packet->length = htonl(offset - header_len + buf_len);
+
+                    FreeResultIndex(index);
+
+                    // Keep the filtered rows of a whole schema table for the next driver that connects as this tenant
+                    if (schema_table != SCHEMA_TABLE_NONE && thread_data->tenant != NULL && !(packet->flags & CQL_FLAG_TRACING)) {
+                        TenantStoreSchemaResult(thread_data->tenant, schema_table, schema_version, (char *)packet + header_len, ntohl(packet->length));
                     }
-                    #if DEBUG
-                    printf("Going to cleanup\n");
-                    #endif
-                    parsed_table = cleanup(parsed_table,(uint32_t)tid);
-                    #if DEBUG
-                    printf("Finished cleanup\n");
-                    #endif
                 }
                 else {
-                    #if DEBUG
-                    printf("%u:   Was not an interesting packet %d.\n", (uint32_t)tid, packet->stream);
-                    #endif
+                    // Nothing is rewritten, so the rows are passed along untouched
+                    SESSION_LOG(thread_data, LOG_DEBUG, "%u:   Was not an interesting packet %d.\n", (uint32_t)tid, packet->stream);
                 }                
-            
-                uint32_t buf_len = 0;
-                char *new_rows = WriteCQLResults(parsed_table, &buf_len, &rows_count);
-
-                #if DEBUG
-                printf("%u:       After filtering, there are now %d rows and %d columns.\n", (uint32_t)tid, rows_count, metadata->columns_count);
-                #endif
-
-                // Now, update the packet with the new rows. Since we will only ever remove them, we don't have to worry about overflowing allocated memory.
-                rows_count = htonl(rows_count);
-                memcpy((char *)packet + offset - 4, &rows_count, 4);
-                memcpy((char *)packet + offset, new_rows, buf_len);
-                packet->length = htonl(offset - header_len + buf_len);
 
-                free(new_rows);
-                FreeCQLResults(parsed_table);
                 FreeResultMetadata(metadata);
             }
             else if (result_type == CQL_RESULT_SET_KEYSPACE) {
-                #if DEBUG
-                printf("%u:     It is a SET_KEYSPACE result.\n", (uint32_t)tid);
-                #endif
+                SESSION_LOG(thread_data, LOG_DEBUG, "%u:     It is a SET_KEYSPACE result.\n", (uint32_t)tid);
 
                 uint32_t offset = header_len + 4;
 
@@ -1051,9 +1378,9 @@ void* HandleConnCassandra(void* td) {
                 memcpy(str, (char *)packet + offset, str_len);
                 offset += str_len;
 
-                #if DEBUG
-                printf("%u:       Before: '%s'.\n", (uint32_t)tid, str);
-                #endif
+                SESSION_LOG(thread_data, LOG_DEBUG, "%u:       Before: '%s'.\n", (uint32_t)tid, str);
+
+                RingKeyspace(thread_data, str); // Statements prepared from now on are prepared in this keyspace
 
                 pthread_mutex_lock(&thread_data->mutex); // Acquire the mutex before reading the token
                 if (strncmp(thread_data->token, str, TOKEN_LENGTH) == 0) { // keyspace begins with the internal token
@@ -1070,16 +1397,12 @@ void* HandleConnCassandra(void* td) {
                 packet->length = 6 + strlen(str);
                 packet->length = htonl(packet->length);
 
-                #if DEBUG
-                printf("%u:       After: '%s'.\n", (uint32_t)tid, str);
-                #endif
+                SESSION_LOG(thread_data, LOG_DEBUG, "%u:       After: '%s'.\n", (uint32_t)tid, str);
 
                 free(str);
             }
             else if (result_type == CQL_RESULT_PREPARED) {
-                #if DEBUG
-                printf("%u:     It is a PREPARED result.\n", (uint32_t)tid);
-                #endif
+                SESSION_LOG(thread_data, LOG_DEBUG, "%u:     It is a PREPARED result.\n", (uint32_t)tid);
 
                 uint32_t offset = header_len + 4; // Because there can be a varied number of items, need to keep track of the offset in the packet
 
@@ -1098,16 +1421,18 @@ void* HandleConnCassandra(void* td) {
 
                 // FIXME now that we have the prepared statement id, store it so future attempts to execute it can be verified to come from the same user
 
-                cql_result_metadata_t *metadata = ReadResultMetadata((char *)packet + offset, (uint32_t)tid);
+                cql_result_metadata_t *metadata = ReadResultMetadata((char *)packet + offset);
+                logResultMetadata(thread_data, (uint32_t)tid, metadata);
                 offset += metadata->offset; // Move the offset to the end of the metadata block
 
+                // Its bound variables give the partition key of its EXECUTEs, to route them by
+                RingPrepared(thread_data, upstream, prepared_id, num_bytes, metadata);
+
                 free(prepared_id);
                 FreeResultMetadata(metadata);
             }
             else if (result_type == CQL_RESULT_SCHEMA_CHANGE) {
-                #if DEBUG
-                printf("%u:     It is a SCHEMA_CHANGE result.\n", (uint32_t)tid);
-                #endif
+                SESSION_LOG(thread_data, LOG_DEBUG, "%u:     It is a SCHEMA_CHANGE result.\n", (uint32_t)tid);
 
                 uint32_t offset = header_len + 4;
 
@@ -1139,9 +1464,9 @@ void* HandleConnCassandra(void* td) {
                 memcpy(table, (char *)packet + offset, str_len);
                 offset += str_len;
 
-                #if DEBUG
-                printf("%u:       Before: %s '%s'.'%s'.\n", (uint32_t)tid, change, keyspace, table);
-                #endif
+                SESSION_LOG(thread_data, LOG_DEBUG, "%u:       Before: %s '%s'.'%s'.\n", (uint32_t)tid, change, keyspace, table);
+
+                TenantSchemaChanged(MakeSpan(keyspace, strlen(keyspace))); // The tenant's cached schema tables are stale now
 
                 pthread_mutex_lock(&thread_data->mutex); // Acquire the mutex before reading the token
                 if (strncmp(thread_data->token, keyspace, TOKEN_LENGTH) == 0) { // keyspace begins with the internal token
@@ -1149,9 +1474,7 @@ void* HandleConnCassandra(void* td) {
                 }
                 pthread_mutex_unlock(&thread_data->mutex); // Release mutex
 
-                #if DEBUG
-                printf("%u:       After: %s '%s'.'%s'.\n", (uint32_t)tid, change, keyspace, table);
-                #endif
+                SESSION_LOG(thread_data, LOG_DEBUG, "%u:       After: %s '%s'.'%s'.\n", (uint32_t)tid, change, keyspace, table);
 
                 // Since we are stripping data from the strings, we don't have to worry about overflowing the packet buffer
                 offset = header_len + 6 + strlen(change);
@@ -1180,109 +1503,16 @@ void* HandleConnCassandra(void* td) {
                 #endif
             }
 
-            #if DEBUG
-            printf("%u:   Finished with RESULT, passing to client.\n", (uint32_t)tid);
-            #endif
+            SESSION_LOG(thread_data, LOG_DEBUG, "%u:   Finished with RESULT, passing to client.\n", (uint32_t)tid);
 
         }
-        else if (packet->opcode == CQL_OPCODE_EVENT) { // Process EVENT packet and possibly forward to client
-            #if DEBUG
-            printf("%u:   Handling EVENT packet from Cassandra.\n", (uint32_t)tid);
-            #endif
-
-            uint16_t str_len = 0;
-            memcpy(&str_len, (char *)packet + header_len, 2);
-            str_len = ntohs(str_len);
-
-            char *event_type = (char *)malloc(str_len + 1);
-            memset(event_type, 0, str_len + 1);
-            strncpy(event_type, (char *)packet + header_len + 2, str_len);
-
-            // We only want a client to know about schema changes that affect their instance. If this is for another tenant, don't send packet to client
-            if (strncmp(event_type, "SCHEMA_CHANGE", 13) == 0) {
-                int offset = header_len + 2 + str_len;
-
-                memcpy(&str_len, (char *)packet + offset, 2);
-                str_len = ntohs(str_len);
-                offset += 2;
-
-                char *change = (char *)malloc(str_len + 1);
-                memset(change, 0, str_len + 1);
-                memcpy(change, (char *)packet + offset, str_len);
-                offset += str_len;
+        else if (packet->opcode == CQL_OPCODE_EVENT) { // Events are only expected on the event connection, see events.cpp
+            SESSION_LOG(thread_data, LOG_DEBUG, "%u:   Dropping EVENT packet, since this connection never registered for events.\n", (uint32_t)tid);
 
-                memcpy(&str_len, (char *)packet + offset, 2);
-                str_len = ntohs(str_len);
-                offset += 2;
-
-                char *keyspace = (char *)malloc(str_len + 1);
-                memset(keyspace, 0, str_len + 1);
-                memcpy(keyspace, (char *)packet + offset, str_len);
-                offset += str_len;
-
-                memcpy(&str_len, (char *)packet + offset, 2);
-                str_len = ntohs(str_len);
-                offset += 2;
- 
-                char *table = (char *)malloc(str_len + 1);
-                memset(table, 0, str_len + 1);
-                memcpy(table, (char *)packet + offset, str_len);
-
-                #if DEBUG
-                printf("%u:     Before: %s '%s'.'%s'.\n", (uint32_t)tid, change, keyspace, table);
-                #endif
-
-                pthread_mutex_lock(&thread_data->mutex); // Acquire the mutex before changing the token
-                if (strncmp(thread_data->token, keyspace, TOKEN_LENGTH) == 0) { // keyspace begins with the internal token, so strip and forward packet to client
-                    memmove(keyspace, keyspace + TOKEN_LENGTH, strlen(keyspace) - TOKEN_LENGTH + 1);
-                }
-                else { // keyspace is not tenant's -- drop packet
-                    #if DEBUG
-                    printf("%u:     This schema change is not for this client -- dropping packet.\n", (uint32_t)tid);
-                    #endif
-
-                    free(change);
-                    free(keyspace);
-                    free(table);
-                    free(event_type);
-
-                    free(packet);
-                    packet = (cql_packet_t *)malloc(header_len);
-
-                    pthread_mutex_unlock(&thread_data->mutex); // Release mutex before continuing next loop iteration
-
-                    continue;
-                }
-                pthread_mutex_unlock(&thread_data->mutex); // Release mutex
-
-                #if DEBUG
-                printf("%u:     After: %s '%s'.'%s'.\n", (uint32_t)tid, change, keyspace, table);
-                #endif
-
-                // Since we are stripping data from the strings, we don't have to worry about overflowing the packet buffer
-                str_len = strlen(keyspace);
-                str_len = htons(str_len);
-                memcpy((char *)packet + header_len + 4 + strlen(event_type) + strlen(change), &str_len, 2);
-                memcpy((char *)packet + header_len + 6 + strlen(event_type) + strlen(change), keyspace, strlen(keyspace));
-
-                str_len = strlen(table);
-                str_len = htons(str_len);
-                memcpy((char *)packet + header_len + 6 + strlen(event_type) + strlen(change) + strlen(keyspace), &str_len, 2);
-                memcpy((char *)packet + header_len + 8 + strlen(event_type) + strlen(change) + strlen(keyspace), table, strlen(table));
-
-                packet->length = 8 + strlen(event_type) + strlen(change) + strlen(keyspace) + strlen(table);
-                packet->length = htonl(packet->length);
-
-                free(change);
-                free(keyspace);
-                free(table);
-            }
-
-            free(event_type);
+            free(packet);
+            packet = (cql_packet_t *)malloc(header_len);
 
-            #if DEBUG
-            printf("%u:   Finished with EVENT, passing to client.\n", (uint32_t)tid);
-            #endif
+            continue;
         }
         else { // This is an error -- we got an unexpected packet from Cassandra
             #if DEBUG
@@ -1299,21 +1529,15 @@ void* HandleConnCassandra(void* td) {
             exit(1);
             #endif
 
-            #if DEBUG
-            printf("%u:   Need to compress packet before sending back to client.\n", (uint32_t)tid);
-            #endif
+            SESSION_LOG(thread_data, LOG_DEBUG, "%u:   Need to compress packet before sending back to client.\n", (uint32_t)tid);
 
             if (thread_data->compression_type == CQL_COMPRESSION_LZ4) {
-                #if DEBUG
-                printf("%u:   Using lz4 compression!\n", (uint32_t)tid);
-                #endif
+                SESSION_LOG(thread_data, LOG_DEBUG, "%u:   Using lz4 compression!\n", (uint32_t)tid);
 
                 // TODO
             }
             else if (thread_data->compression_type == CQL_COMPRESSION_SNAPPY) {
-                #if DEBUG
-                printf("%u:   Using snappy compression!\n", (uint32_t)tid);
-                #endif
+                SESSION_LOG(thread_data, LOG_DEBUG, "%u:   Using snappy compression!\n", (uint32_t)tid);
 
                 // TODO
             }
@@ -1322,30 +1546,72 @@ void* HandleConnCassandra(void* td) {
         }
 
         // Send packet to client (body length may have changed, so re-get value from header)
-        if (send(thread_data->clientfd, packet, header_len + ntohl(packet->length), 0) < 0) { // Packet total size is header + body => 8 + packet->length
-            fprintf(stderr, "%u: Error sending packet to client: %s\n", (uint32_t)tid, strerror(errno));
-            exit(1);
+        if (SendToClient(thread_data, packet) < 0) { // The client went away; its own thread notices and cleans up
+            SESSION_LOG(thread_data, LOG_DEBUG, "%u: Error sending packet to client: %s\n", (uint32_t)tid, strerror(errno));
+        }
+        PROBE4(frame_returned, thread_data->id, packet->stream, packet->opcode, sizeof(cql_packet_t) + ntohl(packet->length));
+        if (received_us != 0) {
+            StatsRequestDone(thread_data, request_opcode, received_us);
         }
+        SlowLogRequestDone(thread_data, slow, received_us, false);
 
         free(packet);
         packet = (cql_packet_t *)malloc(header_len); // Maintain invariant for top of loop
 
-        #if DEBUG
-        printf("%u: Packet successfully sent to client.\n\n", (uint32_t)tid);
-        #endif
+        SESSION_LOG(thread_data, LOG_DEBUG, "%u: Packet successfully sent to client.\n\n", (uint32_t)tid);
     }
 
-    // The client thread will take are of closing sockets and freeing shared memory. We should never reach this point in the Cassandra thread.
+    // The connection to Cassandra was closed or failed, so the node may be going down. Shutting down the client's socket wakes the
+    // client thread to clean up (it takes care of closing sockets and freeing shared memory), and the client's driver reconnects
+    // through the gateway to a node that is up. Losing a route ends the session too, since requests may be waiting on it.
+    const char *why = (recv_ret < 0) ? strerror(errno) : "connection closed";
+    SESSION_LOG(thread_data, LOG_WARN, "%u: Lost the connection to Cassandra node %s: %s\n", (uint32_t)tid, upstream_node->name, why);
+    UpstreamFailed(upstream_node, why);
+    shutdown(thread_data->clientfd, SHUT_RDWR);
 
-    #if DEBUG
-    printf("%u: Unexpectedly reached end of Cassandra processing loop.\n", (uint32_t)tid);
-    exit(1);
-    #endif
-
-    pthread_cleanup_pop(0); // Need a matching pop() to the push() above, since on Linux systems these calls are really macros
+    pthread_cleanup_pop(1); // Need a matching pop() to the push() above, since on Linux systems these calls are really macros. Frees packet.
     return NULL;
 }
 
+/*
+ * This method handles packets from Cassandra, processing and rewriting results as needed, and then forwards new packets back to the client.
+ */
+void* HandleConnCassandra(void* td) {
+    return handleUpstream((cql_thread_t *)td, NULL);
+}
+
+/*
+ * Same as HandleConnCassandra(), for a connection to another node that the client's EXECUTEs are routed to (see ring.cpp).
+ */
+void* HandleConnRoute(void* r) {
+    cql_route_t *route = (cql_route_t *)r;
+    if (!RouteOpen(route)) {
+        return NULL;
+    }
+    return handleUpstream(route->session, route);
+}
+
+/*
+ * Sends a whole packet to the client. Both threads may answer the client, so packets are written under a mutex to keep them from
+ * interleaving. Returns the result of send().
+ */
+int SendToClient(cql_thread_t *thread_data, cql_packet_t *packet) {
+    int ret;
+    uint64_t stage_ns = StatsStageStart();
+
+    pthread_mutex_lock(&thread_data->send_mutex);
+    pthread_cleanup_push(mutex_unlock_cleanup_handler, &thread_data->send_mutex); // The Cassandra thread may be cancelled inside send()
+    ret = send(thread_data->clientfd, packet, sizeof(cql_packet_t) + ntohl(packet->length), 0); // Packet total size is header + body => 8 + packet->length
+    pthread_cleanup_pop(1);
+
+    if (ret >= 0) {
+        StatsPacketOut(thread_data, packet);
+        StatsStage(thread_data, STAGE_SEND_CLIENT, stage_ns);
+    }
+
+    return ret;
+}
+
 using namespace std;
 std::string process_cql_cmd(string st, string prefix) {
 	std::string use("USE");
@@ -1415,9 +1681,7 @@ std::string process_cql_cmd(string st, string prefix) {
 			found = holder.find(sys);
 	                if (found != std::string::npos || 
 (fields.size() == 2 && fields[1].compare(colon) == 0)){
-                                #if DEBUG
-                                cout << "System table found at pos: " << found << endl;
-                                #endif
+                                LOG(LOG_DEBUG, "System table found at pos: %lu\n", (unsigned long)found);
                                 start = what[0].second;
 				continue;
                         }
@@ -1508,9 +1772,7 @@ std::string process_cql_cmd(string st, string prefix) {
 	for (traverser = replacements.begin(); traverser != replacements.end(); ++traverser){	
 		found = traverser->second.find('.');
                         if (found!=std::string::npos){
-                                #if DEBUG
-                                cout << "Dot found" << endl;
-                                #endif
+                                LOG(LOG_DEBUG, "Dot found\n");
                                 // custom_replace(traverser->second, dot, dot+prefix);
                         } 
 		find_and_replace(st, traverser->first, traverser->second);
@@ -1534,34 +1796,3 @@ void find_and_replace(std::string& source, std::string const& find, std::string
         i += replace.length() - find.length() + 1;
     }
 }
-
-bool interestingPacket(std::string st){
-    std::string sys("system");
-    std::string permissions("permissions");
-    std::string users("users");
-    
-    boost::to_lower(st); // for case insensitivity
-    
-    if(strMatch(st.find(sys), st)){
-        return true;
-    }else if(strMatch(st.find(permissions), st)){
-        return true;
-    }else if(strMatch(st.find(users), st)){
-        return true;
-    }else
-        return false;
-}
-
-bool strMatch(std::size_t match, std::string st){
-    if (match == std::string::npos){
-        // The system was not found in the query
-        return false;
-    }
-    (void)st; // Since commenting out below logic, still need to use this variable
-    return true;
-
-    /*else if(st.at(match-1) == ' '){ // this is to prevent similar keyspaces (eg mysystem) from being caught)
-        return true;
-    }else
-        return true;*/
-}
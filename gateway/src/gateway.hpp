@@ -34,25 +34,30 @@ extern "C" {
 #define CASSANDRA_ROOT_USERNAME "cassandra"
 #define CASSANDRA_ROOT_PASSWORD "cassandra"
 
+// Cassandra's authenticator, named when the gateway asks a client for credentials itself, see pool.cpp
+#define CQL_AUTHENTICATOR "org.apache.cassandra.auth.PasswordAuthenticator"
+
 //40 byte tokens will be used
 #define TOKEN_LENGTH 20
 
+// How long the accepting thread waits before trying again when it is out of file descriptors or memory
+#define ACCEPT_RETRY_MS 10
+
+// Client requests use stream ids 0 to 127
+#define CQL_MAX_STREAMS 128
+
 //
 // STRUCTS AND CONSTANTS USED BY THEM
 //
 
-typedef struct {
-  pthread_mutex_t mutex;    // use a mutex to handle concurrency between the two threads
-
-  int  compression_type;    // what type of packet compression (if any) is being used
-  char *token;              // the internal tenant token
-  node *interestingPackets; // a list of interesting packets
-
-  pthread_t cassandra;      // keep track of the cassandra tread to later cancel/join when client leaves
-
-  int clientfd;             // accepted socket to communicate with the client
-  int cassandrafd;          // socket opened to actual Cassandra
-} cql_thread_t;
+struct cql_tenant; // See tenant.hpp
+struct cql_stats;  // See stats.hpp
+struct cql_slow_request; // See slowlog.hpp
+struct cql_node;  // See upstream.hpp
+struct cql_ring_session; // See ring.hpp
+struct cql_route; // See ring.hpp
+struct cql_shard; // See listener.hpp
+struct cql_sched_writer; // See sched.cpp
 
 //
 // Documentation for the CQL binary protocol is avaiable at <https://git-wip-us.apache.org/repos/asf?p=cassandra.git;a=blob_plain;f=doc/native_protocol_v2.spec;hb=29670eb6692f239a3e9b0db05f2d5a1b5d4eb8b0>
@@ -68,6 +73,59 @@ typedef struct {
   //void    *body; The body will need to be allocated right after the fixed length header
 } cql_packet_t;
 
+// What the gateway keeps of a request while Cassandra works on it, by the upstream stream id it was sent on (see timeout.cpp).
+// Each field is set when the stream id is taken, before the request is forwarded.
+typedef struct {
+  bool scheduled;           // sent by the scheduler and not yet answered, see sched.cpp
+  uint64_t sent_us;         // when the request was forwarded, 0 if none, see overload.cpp
+  struct cql_node *sent_node; // the node it was forwarded to
+  uint64_t received_us;     // when the request was read from the client
+  uint8_t opcode;           // the request's opcode
+  struct cql_slow_request *slow; // the request's record for the slow query log, if it is timed for it
+  uint64_t fingerprint;     // the request's statement fingerprint, 0 for none, see hitters.cpp
+  bool interesting;         // its results are filtered for the tenant
+  int8_t schema_table;      // SCHEMA_TABLE_* it reads whole, to fill the tenant's cache with, or SCHEMA_TABLE_NONE
+  uint32_t schema_version;  // version of the tenant's schema when it was sent, see TenantSchemaVersion()
+  bool read;                // a read that may be hedged, see hedge.cpp
+  cql_packet_t *copy;       // copy of the read to hedge with, until it is hedged or answered; protected by the session's mutex
+  struct cql_route *route;  // where to send the hedge
+  int8_t sibling;           // stream id of the other copy of a hedged read, -1 if none; protected by the session's mutex
+  bool hedge;               // this is the copy sent by the gateway
+  bool probe;               // let through to a node whose circuit breaker is half-open, see breaker.cpp; changed atomically
+  uint64_t timed_out_us;    // when the client was answered with a timeout instead, see TimeoutMapStream()
+} cql_inflight_t;
+
+typedef struct {
+  pthread_mutex_t mutex;    // use a mutex to handle concurrency between the two threads
+  pthread_mutex_t send_mutex; // held while writing a whole packet to the client, since both threads may answer it
+
+  int  compression_type;    // what type of packet compression (if any) is being used
+  char *token;              // the internal tenant token
+  struct cql_tenant *tenant; // shared state of the tenant, set once the token has been validated
+  uint8_t events;           // EVENT_* types the client REGISTERed for, see events.cpp
+  struct cql_tenant *events_tenant; // tenant the client was registered under
+  uint32_t events_sending;  // events being sent to the client, which keep the session from being freed, see events.cpp
+
+  // Requests are sent to Cassandra on stream ids chosen by the gateway (see timeout.cpp). These are indexed by that stream id.
+  int8_t client_stream[CQL_MAX_STREAMS]; // the client's stream id for the request, or STREAM_FREE / STREAM_TIMED_OUT
+  uint32_t stream_gen[CQL_MAX_STREAMS];  // bumped whenever the stream id is taken or freed
+  int next_stream;                       // where to start looking for a free stream id
+  cql_inflight_t inflight[CQL_MAX_STREAMS];
+
+  struct cql_stats *stats;  // counters for the stats endpoint, see stats.cpp
+
+  uint32_t id;              // the client thread's id, which identifies the connection in probes (see probes.hpp)
+  pthread_t cassandra;      // keep track of the cassandra tread to later cancel/join when client leaves
+  struct cql_sched_writer *writer; // writes the requests the scheduler picked for this session; NULL until one is, see sched.cpp
+
+  int clientfd;             // accepted socket to communicate with the client
+  struct cql_shard *shard;  // the listening socket clientfd was accepted on, see listener.cpp
+  int cassandrafd;          // socket opened to actual Cassandra
+  struct cql_node *cassandra_node; // the Cassandra node cassandrafd is connected to, see upstream.cpp; NULL until connected
+  cql_packet_t *startup;    // STARTUP answered by the gateway, until the session is connected to Cassandra, see pool.cpp
+  struct cql_ring_session *ring; // connections to other nodes, for EXECUTEs they own; NULL unless configured, see ring.cpp
+} cql_thread_t;
+
 
 #define CQL_V1 1
 #define CQL_v2 2
@@ -129,11 +187,13 @@ typedef struct {
 #define CQL_ERROR_ALREADY_EXISTS        0x2400
 #define CQL_ERROR_UNPREPARED            0x2500
 
+extern const char *printable_opcodes[17];
+
 void* HandleConnClient(void* td);
 void* HandleConnCassandra(void* td);
+void* HandleConnRoute(void* r);
+int SendToClient(cql_thread_t *thread_data, cql_packet_t *packet);
 std::string process_cql_cmd(std::string st, std::string prefix);
 bool custom_replace(std::string& str, const std::string& from, const std::string& to);
 void find_and_replace(std::string& source, std::string const& find, std::string const& replace);
-bool interestingPacket(std::string st);
-bool strMatch(std::size_t match, std::string st);
 #endif
@@ -0,0 +1,260 @@
+/*
+ * hedge.cpp - Sending slow reads to a second node, and answering with whichever response comes first
+ * CSC 652 - 2014
+ *
+ * A tenant with a hedge_percentile has the time its reads (SELECT queries, and EXECUTEs of prepared SELECTs) take to answer kept
+ * in a histogram, and its hedge delay is that percentile of it. A read gets a copy kept with it and a deadline that far off in
+ * the timer wheel (see timeout.cpp). If Cassandra hasn't answered when it passes, the copy goes to another node on one of the
+ * session's routes (see ring.cpp), on a stream id of its own mapped to the same client stream. The two requests are siblings:
+ * the first response is forwarded, and the other request's stream is marked as timed out so its response is dropped when it
+ * comes. CQL has no way to cancel a request, so the loser still runs to completion on its node.
+ *
+ * Only a route that is ready for the read is used: it must have an EXECUTE's statement prepared, or be using the same keyspace as
+ * the session's own connection for a QUERY. Routes are opened and statements prepared on them as reads come, so the first reads
+ * of a statement are never hedged.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include <map>
+#include <vector>
+
+#include "config.hpp"
+#include "hedge.hpp"
+#include "log.hpp"
+#include "overload.hpp"
+#include "ring.hpp"
+#include "slowlog.hpp"
+#include "stats.hpp"
+#include "tenant.hpp"
+#include "timeout.hpp"
+
+/*
+ * Whether any tenant hedges its reads.
+ */
+bool HedgeEnabled() {
+    bool wanted = gateway_config.tenant_defaults.hedge_percentile > 0;
+    std::map<std::string, cql_tenant_config_t>::iterator it;
+    for (it = gateway_config.tenants.begin(); it != gateway_config.tenants.end(); it++) {
+        wanted = wanted || it->second.hedge_percentile > 0;
+    }
+    return wanted;
+}
+
+/*
+ * Sets up the hedging of a request about to be forwarded to sent_node on an upstream stream. A read of a tenant that hedges is
+ * timed, and once the tenant has a hedge delay, it is copied and given a deadline to be hedged at if there is a route ready for
+ * it to another node.
+ */
+void HedgeStart(cql_thread_t *session, cql_packet_t *packet, cql_node_t *sent_node) {
+    cql_inflight_t *f = &session->inflight[packet->stream];
+    f->read = false;
+    f->route = NULL;
+    f->sibling = -1;
+    f->hedge = false;
+
+    cql_tenant_t *t = session->tenant;
+    if (t == NULL || t->config.hedge_percentile <= 0 || !RingIsRead(packet)) {
+        return;
+    }
+    f->read = true;
+
+    uint64_t delay_us = __atomic_load_n(&t->hedge_delay_us, __ATOMIC_RELAXED);
+    if (delay_us == 0) { // Too few reads timed yet
+        return;
+    }
+    cql_route_t *route = RingSpareRoute(session, packet, sent_node);
+    if (route == NULL) {
+        return;
+    }
+    f->route = route;
+
+    size_t len = sizeof(cql_packet_t) + ntohl(packet->length);
+    cql_packet_t *copy = (cql_packet_t *)malloc(len);
+    memcpy(copy, packet, len);
+
+    pthread_mutex_lock(&session->mutex);
+    f->copy = copy;
+    pthread_mutex_unlock(&session->mutex);
+
+    TimeoutHedge(session, packet->stream, delay_us);
+}
+
+/*
+ * Sends the copy of a read that hasn't been answered by its hedge deadline to the node of its route. Called by the timeout thread
+ * with its wheel mutex released; TimeoutSessionClosed() waits for this to return, so the session can't go away meanwhile. gen is
+ * the stream's generation when the deadline was set.
+ */
+void HedgeFire(cql_thread_t *session, int8_t upstream, uint32_t gen) {
+    cql_inflight_t *f = &session->inflight[upstream];
+    cql_packet_t *copy = NULL;
+    pthread_mutex_lock(&session->mutex);
+    int8_t client_stream = session->client_stream[upstream];
+    if (session->stream_gen[upstream] == gen && client_stream >= 0) {
+        copy = f->copy;
+        f->copy = NULL;
+    }
+    pthread_mutex_unlock(&session->mutex);
+
+    if (copy == NULL) { // Answered in time, or timed out
+        return;
+    }
+
+    int8_t hedge = TimeoutMapStream(session, client_stream);
+    if (hedge < 0) {
+        free(copy);
+        return;
+    }
+    cql_inflight_t *h = &session->inflight[hedge];
+    h->received_us = f->received_us;
+    h->opcode = f->opcode;
+    SlowLogDiscard(h->slow); // The slow query log times the request sent by the client
+    h->slow = NULL;
+    h->fingerprint = 0;
+    h->interesting = f->interesting;
+    h->schema_table = f->schema_table;
+    h->schema_version = f->schema_version;
+    h->read = true;
+    h->route = NULL;
+    h->hedge = true;
+    h->probe = false;
+
+    // The first of the two to be answered drops the other one, see HedgeSettled()
+    pthread_mutex_lock(&session->mutex);
+    bool wanted = session->stream_gen[upstream] == gen && session->client_stream[upstream] == client_stream;
+    if (wanted) {
+        f->sibling = hedge;
+        h->sibling = upstream;
+    }
+    else {
+        h->sibling = -1;
+        session->client_stream[hedge] = STREAM_FREE;
+        session->stream_gen[hedge]++;
+    }
+    pthread_mutex_unlock(&session->mutex);
+
+    if (!wanted) { // Answered while the stream id was being taken
+        free(copy);
+        return;
+    }
+
+    cql_route_t *route = f->route;
+    copy->stream = hedge;
+    OverloadRequestSent(session, hedge, route->node);
+    if (!RouteSend(route, copy)) { // The route's reader notices the connection was lost
+        pthread_mutex_lock(&session->mutex);
+        if (f->sibling == hedge) {
+            f->sibling = -1;
+        }
+        h->sibling = -1;
+        session->client_stream[hedge] = STREAM_FREE;
+        session->stream_gen[hedge]++;
+        pthread_mutex_unlock(&session->mutex);
+        OverloadResponseReceived(session, hedge);
+
+        free(copy);
+        return;
+    }
+    __atomic_add_fetch(&session->tenant->reads_hedged, 1, __ATOMIC_RELAXED);
+    SESSION_LOG(session, LOG_DEBUG, "Read on stream %d is slow, sent it to Cassandra node %s as well.\n", client_stream, route->node->name);
+
+    free(copy);
+}
+
+/*
+ * Finishes with the hedging of the request on an upstream stream, which was just answered or timed out: its copy is freed, and a
+ * sibling still waiting on Cassandra has its response dropped. Called with the session's mutex held.
+ */
+void HedgeSettled(cql_thread_t *session, int8_t upstream) {
+    cql_inflight_t *f = &session->inflight[upstream];
+    free(f->copy);
+    f->copy = NULL;
+
+    if (f->sibling >= 0) {
+        if (session->client_stream[f->sibling] >= 0) {
+            session->client_stream[f->sibling] = STREAM_TIMED_OUT; // Keeps the stream id until the response shows up
+            session->inflight[f->sibling].timed_out_us = StatsNowUs();
+        }
+        session->inflight[f->sibling].sibling = -1;
+        f->sibling = -1;
+
+        if (f->hedge) {
+            __atomic_add_fetch(&session->tenant->hedges_won, 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/*
+ * Works out a tenant's hedge delay from its histogram. Called with the tenant's limit_lock held.
+ */
+static void updateDelay(cql_tenant_t *t) {
+    uint64_t rank = (uint64_t)(t->read_samples * t->config.hedge_percentile / 100);
+    uint64_t count = 0;
+    int b = 0;
+    while (b < STATS_BUCKETS - 1 && count + t->read_latency[b] <= rank) {
+        count += t->read_latency[b];
+        b++;
+    }
+    __atomic_store_n(&t->hedge_delay_us, StatsBucketEnd(b), __ATOMIC_RELAXED);
+}
+
+/*
+ * Times a read of a tenant that hedges, which was read from the client at received_us and has just been answered.
+ */
+void HedgeAnswered(cql_thread_t *session, uint64_t received_us) {
+    cql_tenant_t *t = session->tenant;
+    uint64_t us = StatsNowUs() - received_us;
+
+    pthread_mutex_lock(&t->limit_lock);
+    t->read_latency[StatsBucket(us)]++;
+    t->read_samples++;
+    if (t->read_samples >= HEDGE_DECAY_SAMPLES) {
+        t->read_samples = 0;
+        for (int b = 0; b < STATS_BUCKETS; b++) {
+            t->read_latency[b] /= 2;
+            t->read_samples += t->read_latency[b];
+        }
+    }
+    if (t->read_samples >= HEDGE_MIN_SAMPLES && (t->hedge_delay_us == 0 || t->read_samples % HEDGE_RECOMPUTE == 0)) {
+        updateDelay(t);
+    }
+    pthread_mutex_unlock(&t->limit_lock);
+}
+
+/*
+ * Frees the copies of reads that were never answered. Called once nothing can hedge them any more.
+ */
+void HedgeSessionClosed(cql_thread_t *session) {
+    for (int i = 0; i < CQL_MAX_STREAMS; i++) {
+        free(session->inflight[i].copy);
+        session->inflight[i].copy = NULL;
+    }
+}
+
+/*
+ * Returns the hedge delay of every tenant that hedges in the Prometheus text format, for the stats endpoint. How many reads were
+ * hedged is counted with the tenants' other counters.
+ */
+std::string HedgeRender() {
+    if (!HedgeEnabled()) {
+        return "";
+    }
+
+    std::string out = "# HELP cql_gateway_hedge_delay_seconds How long the tenant's reads wait on Cassandra before they are hedged, "
+                      "0 until enough of them were timed.\n# TYPE cql_gateway_hedge_delay_seconds gauge\n";
+    std::vector<cql_tenant_t *> all = AllTenants();
+    char line[128];
+    for (size_t i = 0; i < all.size(); i++) {
+        if (all[i]->config.hedge_percentile > 0) {
+            snprintf(line, sizeof(line), "cql_gateway_hedge_delay_seconds{tenant=\"%s\"} %g\n", all[i]->token,
+                     __atomic_load_n(&all[i]->hedge_delay_us, __ATOMIC_RELAXED) / 1e6);
+            out += line;
+        }
+    }
+
+    return out;
+}
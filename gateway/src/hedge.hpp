@@ -0,0 +1,26 @@
+#ifndef _HEDGE_H
+#define _HEDGE_H
+
+#include <stdint.h>
+
+#include <string>
+
+#include "gateway.hpp"
+#include "upstream.hpp"
+
+// Reads of a tenant timed before any of them is hedged, and how often the tenant's hedge delay is worked out again after that
+#define HEDGE_MIN_SAMPLES 100
+#define HEDGE_RECOMPUTE   64
+
+// When a tenant's latency histogram holds this many reads it is halved, so the delay follows the tenant's recent reads
+#define HEDGE_DECAY_SAMPLES 4096
+
+bool HedgeEnabled();
+void HedgeStart(cql_thread_t *session, cql_packet_t *packet, cql_node_t *sent_node);
+void HedgeFire(cql_thread_t *session, int8_t upstream, uint32_t gen);
+void HedgeSettled(cql_thread_t *session, int8_t upstream);
+void HedgeAnswered(cql_thread_t *session, uint64_t received_us);
+void HedgeSessionClosed(cql_thread_t *session);
+std::string HedgeRender();
+
+#endif
@@ -3,11 +3,13 @@
  * CSC 652 - 2014
  */
 
+#include <ctype.h>
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <pthread.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
 
@@ -15,35 +17,6 @@
 #include "helpers.hpp"
 
 
-/*
- * This method creates an appropriate CQL error packet to send on a specified socket. This does not close the socket before returning.
- */
-void SendCQLError(int sock, uint32_t tid, uint32_t err, char* msg) {
-    int p_len = sizeof(cql_packet_t) + 4 + 2 + strlen(msg); // Header + int + short + msg length
-    cql_packet_t *p = (cql_packet_t *)malloc(p_len);
-    memset(p, 0, p_len);
-
-    p->version = CQL_V1_RESPONSE;
-    p->opcode = CQL_OPCODE_ERROR;
-    p->length = htonl(6 + strlen(msg));
-    err = htonl(err);
-    memcpy((char *)p + sizeof(cql_packet_t), &err, 1);
-    uint16_t str_len = htons(strlen(msg));
-    memcpy((char *)p + sizeof(cql_packet_t) + 4, &str_len, 1);
-    memcpy((char *)p + sizeof(cql_packet_t) + 6, msg, strlen(msg));
-
-    #if DEBUG
-    printf("%u: Sending error to client: '%s'.\n", (uint32_t)tid, msg);
-    #endif
-
-    if (send(sock, p, p_len, 0) < 0) { // Send the packet
-        fprintf(stderr, "%u: Error sending error packet to client: %s\n", tid, strerror(errno));
-        exit(1);
-    }
-
-    free(p);
-}
-
 /*
  * Coverts a CQL string map into a linked list of key/value strings.
  */
@@ -161,150 +134,125 @@ void FreeStringMap(cql_string_map_t *sm) {
 }
 
 /*
- * Coverts a CQL results block of memory into a 2D linked list representation.
+ * Indexes a CQL results block of memory, recording where each cell starts without copying anything.
  */
-cql_result_cell_t* ReadCQLResults(char *buf, int32_t rows, int32_t cols) {
-    if (buf == NULL || rows == 0) {
+cql_result_index_t* IndexCQLResults(char *buf, int32_t rows, int32_t cols) {
+    if (buf == NULL || rows <= 0 || cols <= 0) {
         return NULL;
     }
 
-    cql_result_cell_t *row = (cql_result_cell_t *)malloc(sizeof(cql_result_cell_t));
-    row->remove = false;
-    row->next_row = NULL;
-    cql_result_cell_t *ret = row;
+    cql_result_index_t *index = (cql_result_index_t *)malloc(sizeof(cql_result_index_t));
+    index->rows = rows;
+    index->cols = cols;
+    index->cell = (int32_t *)malloc(sizeof(int32_t) * rows * cols);
+    index->strip = (uint8_t *)malloc(rows * cols);
+    memset(index->strip, 0, rows * cols);
+    index->remove = (bool *)malloc(sizeof(bool) * rows);
+    memset(index->remove, 0, sizeof(bool) * rows);
 
-    uint32_t offset = 0;
-
-    int i,j;
+    int32_t offset = 0;
     int32_t num_bytes = 0;
 
-    for (i = 0; i < rows; i++) {
-        cql_result_cell_t *curr = row;
-
-        for (j = 0; j < cols; j++) {
-            curr->next_col = NULL;
-            curr->next_row = NULL;
+    for (int32_t i = 0; i < rows * cols; i++) {
+        index->cell[i] = offset;
 
-            memcpy(&num_bytes, buf + offset, 4);
-            num_bytes = ntohl(num_bytes);
-            offset += 4;
-
-            if (num_bytes > 0) {
-                curr->content = (char *)malloc(num_bytes);
-                memcpy(curr->content, buf + offset, num_bytes);
-                curr->len = num_bytes;
-                offset += num_bytes;
-            }
-            else {
-                curr->content = NULL;
-                curr->len = 0;
-            }
-
-            if (j + 1 < cols) {
-                curr->next_col = (cql_result_cell_t *)malloc(sizeof(cql_result_cell_t));
-                curr = curr->next_col;
-            }
-        }
+        memcpy(&num_bytes, buf + offset, 4);
+        num_bytes = ntohl(num_bytes);
+        offset += 4;
 
-        if (i + 1 < rows) {
-            row->next_row = (cql_result_cell_t *)malloc(sizeof(cql_result_cell_t));
-            row->next_row->remove = false;
-            row->next_row->next_row = NULL;
-            row = row->next_row;
+        if (num_bytes > 0) { // A negative length is a null value with no contents
+            offset += num_bytes;
         }
     }
 
-    return ret;
+    return index;
 }
 
 /*
- * Coverts a 2D linked list representation of results into a chunk of memory. Returns size of new buffer.
+ * Returns the contents of a single cell. Null cells have a length of 0.
  */
-char* WriteCQLResults(cql_result_cell_t *rows, uint32_t *new_len, int32_t *new_rows) {
-    if (rows == NULL) {
-        *new_len = 0;
-        *new_rows = 0;
-        return NULL;
-    }
-
-    uint32_t offset = 0;
+cql_span_t CellSpan(char *buf, cql_result_index_t *index, int32_t row, int32_t col) {
+    int32_t off = index->cell[row * index->cols + col];
+    int32_t num_bytes = 0;
+    memcpy(&num_bytes, buf + off, 4);
+    num_bytes = ntohl(num_bytes);
 
-    // First, count the number of bytes total we will need to allocate
-    *new_len = 0;
-    *new_rows = 0;
-    cql_result_cell_t *row_head = rows;
-    while (row_head != NULL) {
-        *new_rows = *new_rows + 1; // can't use ++, since that triggers -Werror=unused-value
-        cql_result_cell_t *curr = row_head;
-        cql_result_cell_t *next_row = curr->next_row;
+    return MakeSpan(buf + off + 4, (num_bytes > 0) ? num_bytes : 0);
+}
 
-        while (curr != NULL) {
-            *new_len += 4 + curr->len;
+/*
+ * Marks every cell of a column that begins with the prefix (and has something left after it) to have that prefix stripped.
+ * The whole column is checked in one batch rather than cell by cell.
+ */
+void StripColumnPrefix(char *buf, cql_result_index_t *index, int32_t col, const char *prefix, uint32_t prefix_len) {
+    ScanPrefixColumn(buf, index->cell + col, index->rows, index->cols, prefix, prefix_len, index->strip + col);
+}
 
-            curr = curr->next_col;
-        }
+/*
+ * Rewrites the results block in place in a single sweep, dropping removed rows and stripped prefixes. Since the results only
+ * ever shrink, every cell is moved towards the front of the buffer. Returns the new size of the block.
+ */
+uint32_t CompactCQLResults(char *buf, cql_result_index_t *index, uint32_t prefix_len, int32_t *new_rows) {
+    uint32_t out = 0;
+    *new_rows = 0;
 
-        row_head = next_row;
+    if (index == NULL) {
+        return 0;
     }
 
-    // Make the chunk of memory
-    char *ret = (char *)malloc(*new_len);
-
-    // Set values in memory
-    row_head = rows;
-    while (row_head != NULL) {
-        cql_result_cell_t *curr = row_head;
-        cql_result_cell_t *next_row = curr->next_row;
-
-        while (curr != NULL) {
-
-            int32_t len = htonl(curr->len);
-
-            memcpy(ret + offset, &len, 4);
-            memcpy(ret + offset + 4, curr->content, curr->len);
+    for (int32_t i = 0; i < index->rows; i++) {
+        if (index->remove[i]) {
+            continue;
+        }
+        *new_rows = *new_rows + 1; // can't use ++, since that triggers -Werror=unused-value
 
-            offset += 4 + curr->len;
+        for (int32_t j = 0; j < index->cols; j++) {
+            int32_t c = i * index->cols + j;
+            int32_t off = index->cell[c];
+            int32_t num_bytes = 0;
+            memcpy(&num_bytes, buf + off, 4);
+            num_bytes = ntohl(num_bytes);
 
-            curr = curr->next_col;
+            if (index->strip[c]) {
+                int32_t len = htonl(num_bytes - prefix_len);
+                memcpy(buf + out, &len, 4); // Can only overwrite this cell's own length, which has already been read
+                memmove(buf + out + 4, buf + off + 4 + prefix_len, num_bytes - prefix_len);
+                out += 4 + num_bytes - prefix_len;
+            }
+            else {
+                uint32_t cell_len = 4 + ((num_bytes > 0) ? num_bytes : 0);
+                if (out != (uint32_t)off) {
+                    memmove(buf + out, buf + off, cell_len);
+                }
+                out += cell_len;
+            }
         }
-
-        row_head = next_row;
     }
 
-    return ret;
+    return out;
 }
 
-void FreeCQLResults(cql_result_cell_t *rows) {
-    while (rows != NULL) {
-        cql_result_cell_t *curr_cell = rows;
-        cql_result_cell_t *next_row = curr_cell->next_row;
-
-        while (curr_cell != NULL) {
-            cql_result_cell_t *next_cell = curr_cell->next_col;
-            free(curr_cell->content);
-            free(curr_cell);
-            curr_cell = next_cell;
-        }
-
-        rows = next_row;
+void FreeResultIndex(cql_result_index_t *index) {
+    if (index != NULL) {
+        free(index->cell);
+        free(index->strip);
+        free(index->remove);
+        free(index);
     }
 }
 
 
 /*
- * Reads and parses the metadata of a result packet.
+ * Reads and parses the metadata of a result packet. Nothing is logged here, so the parsing can be benchmarked on its own; callers
+ * log what they need of it.
  */
-cql_result_metadata_t * ReadResultMetadata(char *buf, uint32_t tid) {
+cql_result_metadata_t * ReadResultMetadata(char *buf) {
     if (buf == NULL) {
         return NULL;
     }
 
-    #ifndef DEBUG
-    (void)tid; // Need to reference variable if not debugging to prevent error
-    #endif
-
-    cql_result_metadata_t *m = (cql_result_metadata_t *)malloc(sizeof(cql_result_metadata_t));
-    m->offset = 0;
+    // Zeroed, so that keyspace and table stay NULL and the column list ends when there are no columns to read them from
+    cql_result_metadata_t *m = (cql_result_metadata_t *)calloc(1, sizeof(cql_result_metadata_t));
 
     memcpy(&m->flags, buf, 4);
     m->flags = ntohl(m->flags);
@@ -336,13 +284,9 @@ cql_result_metadata_t * ReadResultMetadata(char *buf, uint32_t tid) {
         memset(m->table, 0, str_len + 1);
         memcpy(m->table, buf + m->offset, str_len);
         m->offset += str_len;
-
-        #if DEBUG
-        printf("%u:       From the global tables spec, keyspace is '%s', table is '%s'.\n", tid, m->keyspace, m->table);
-        #endif
     }
 
-    m->column = (cql_column_spec_t *)malloc(sizeof(cql_column_spec_t));
+    m->column = (cql_column_spec_t *)calloc(1, sizeof(cql_column_spec_t));
     cql_column_spec_t *curr = m->column;
 
     int i;
@@ -368,10 +312,6 @@ cql_result_metadata_t * ReadResultMetadata(char *buf, uint32_t tid) {
             memset(m->table, 0, str_len + 1);
             memcpy(m->table, buf + m->offset, str_len);
             m->offset += str_len;
-
-            #if DEBUG
-            printf("%u:       From the first column, keyspace is '%s', table is '%s'.\n", tid, m->keyspace, m->table);
-            #endif
         }
 
         // Get the column name
@@ -388,10 +328,6 @@ cql_result_metadata_t * ReadResultMetadata(char *buf, uint32_t tid) {
         curr->type = ntohs(curr->type);
         m->offset += 2;
 
-        #if DEBUG
-        printf("%u:       Column name and type: '%s' %d.\n", tid, curr->name, curr->type);
-        #endif
-
         // Currently, we don't really care about what type each column is, but we need to advance the offset
         if (curr->type == 0x0000) { // Custom type
             memcpy(&str_len, buf + m->offset, 2);
@@ -449,7 +385,7 @@ cql_result_metadata_t * ReadResultMetadata(char *buf, uint32_t tid) {
         }
 
         if (i + 1 < m->columns_count) {
-            curr->next = (cql_column_spec_t *)malloc(sizeof(cql_column_spec_t));
+            curr->next = (cql_column_spec_t *)calloc(1, sizeof(cql_column_spec_t));
             curr = curr->next;
         }
         else {
@@ -475,182 +411,30 @@ void FreeResultMetadata(cql_result_metadata_t *m) {
     }
 }
 
-void gracefulExit(int sig) {
-    fprintf(stderr, "\nCaught sig %d -- exiting.\n", sig);
-
-    exit(0);
-}
-
 void cassandra_thread_cleanup_handler(void *arg) {
     cql_packet_t **packet = (cql_packet_t **)arg;
     free(*packet);
 }
 
-
-
-node* addNode(node *head, node *toAdd) {
-    if (toAdd == NULL) {
-        return head;
-    }
-
-    if (head == NULL) {
-        head = toAdd;
-        return head;
-    }
-    else {
-        node *tmp = head;
-        while (tmp->next != NULL) {
-            tmp = tmp->next;
-        }
-        tmp->next = toAdd;
-    }
-    return head;
-}
-
-node* removeNode(node *head, int8_t stream_id) {
-    if (head == NULL) {
-        return NULL;
-    }
-
-    node *tmp;
-    node *tmp2;
-    if(head->id == stream_id){
-
-        if(head->next == NULL){
-
-            free(head);
-            head = NULL;
-            return NULL;
-        }else{
-
-            tmp = head->next;
-            free(head);
-            head = tmp;
-            return head;
-        }
-    }else{
-        tmp = head;
-        while(tmp->next != NULL){
-            if(tmp->next->id == stream_id){
-                tmp2 = tmp->next->next;
-                free(tmp->next);
-                tmp->next = tmp2; // Works even if tmp->next is the end, it will be null
-                return head;
-            }
-            tmp = tmp->next;
-        }
-        // if we got here, we never found it
-        return head;
-    }
-    return head;
-}
-
-bool findNode(node *head, int8_t stream_id) {
-    if (head == NULL) {
-        return false;
-    }
-
-    node *tmp = head;
-    
-    while (tmp != NULL) {
-        #if DEBUG
-        printf("----------- tmp %d stream %d\n", tmp->id, stream_id);
-        #endif
-        if (tmp->id == stream_id) {
-            //head = removeNode(head, tmp);
-            return true;
-        }
-        tmp = tmp->next;
-    }
-    return false;
-}
-
-// Check if the internal token is present in this column data
-bool scanForInternalToken(char *cellInQuestion, char *internalToken){
-    std::string cell(cellInQuestion);
-    std::string iToken(internalToken);
-    
-    std::size_t found = cell.find(iToken);
-    if (found == std::string::npos){
-        // The user's token was not found in the cell data
-        // Apparently there are some exceptions to this rule:
-        std::string system("system"); // FIXME must be case-insensitive equal of "system", "system_auth", or "system_traces"
-        if(cell.find(system) != std::string::npos){
-            return true;
-        }
-        return false;
-    }else{
-        return true;
-    }
+void mutex_unlock_cleanup_handler(void *arg) {
+    pthread_mutex_unlock((pthread_mutex_t *)arg);
 }
 
-bool scanforRestrictedKeyspaces(char *cellInQuestion){
-    std::string cell(cellInQuestion);
-    std::string multiTennant("multitenantcassandra");
-    std::size_t found = cell.find(multiTennant);
-    if(found == std::string::npos){ // FIXME must be case-insensitive equal, not just position match
-        return false;
-    }else{
-        return true;
-    }
+static cql_scanner_t make_interesting_scanner() {
+    const char *needles[3] = {"system", "permissions", "users"};
+    cql_scanner_t s;
+    ScannerInit(&s, needles, 3);
+    return s;
 }
 
-void free_row(cql_result_cell_t *row){
-    cql_result_cell_t *curr;
-    curr = row;
-    while(curr != NULL){
-        row = row->next_col;
-        free(curr->content);
-        free(curr);
-        curr = row;
-    }
-}
+/*
+ * Returns true if a (rewritten) query touches a table whose results may need to be filtered per tenant.
+ */
+bool interestingPacket(cql_span_t query){
+    static const cql_scanner_t interesting_scan = make_interesting_scanner(); // Built once; static local initialization is thread-safe
 
-// Return's a pointer to a new cleaned-up list
-cql_result_cell_t *cleanup(cql_result_cell_t *parsed_table, uint32_t tid){
-    cql_result_cell_t *curr_row = parsed_table;
-    cql_result_cell_t *tmp;
-    #ifndef DEBUG
-    (void)tid; // Need to reference variable if not debugging to prevent error
-    #endif    
-    #if DEBUG
-    printf("%u:   Begin cleanup of table.\n", tid);
-    #endif
-    
-    if(parsed_table == NULL){
-        return NULL;
-    }
-    // First, check the head
-    while(curr_row != NULL && curr_row->remove == true){
-        tmp = curr_row;
-        curr_row = curr_row->next_row;
-        free_row(tmp);
-    }
-    
-    if(curr_row == NULL){
-        return NULL;
-    }
-    
-    // update the head pointer
-    parsed_table = curr_row;
-    
-    
-    // Second, scan and remove the rest
-    tmp = curr_row->next_row; // Walk tmp pointer one ahead
-    while(tmp != NULL){
-        while(tmp != NULL && tmp->remove == true){
-            curr_row->next_row = tmp->next_row;
-            free_row(tmp);
-            tmp = curr_row->next_row;
-        }
-        if(tmp == NULL){
-            break;
-        }
-        curr_row = tmp;
-        tmp = curr_row->next_row;
-    }
-    
-    return parsed_table;
+    size_t pos = 0;
+    return ScanFirst(&interesting_scan, query, SCAN_ANY, &pos) >= 0; // Case-insensitive, so no need to lowercase a copy of the query first
 }
 
 bool isImportantTable(char *keyspace, char *tableName){
@@ -675,14 +459,62 @@ bool isImportantTable(char *keyspace, char *tableName){
     return false;
 }
 
-bool isImportantColumn(char *name){
+int isImportantColumn(char *name){
     if(strcmp(name,"keyspace_name") == 0){
-        return true;
+        return COLUMN_KEYSPACE;
     }else if(strcmp(name, "name") == 0){
-        return true;
+        return COLUMN_USER;
     }else if(strcmp(name, "username") == 0){
-        return true;
+        return COLUMN_USER;
     }else{
-        return false;
+        return COLUMN_OTHER;
+    }
+}
+
+/*
+ * Returns which schema table a query reads in full (e.g. "SELECT * FROM system.schema_keyspaces;", as drivers send on every
+ * connect), or SCHEMA_TABLE_NONE for any other query. Case and runs of whitespace don't matter; anything else, such as a WHERE
+ * clause or a column list, means the query isn't one of these.
+ */
+int schemaBootstrapQuery(cql_span_t query){
+    static const char *queries[SCHEMA_TABLE_COUNT] = {
+        "select * from system.schema_keyspaces",
+        "select * from system.schema_columnfamilies",
+        "select * from system.schema_columns"
+    };
+
+    char normal[64]; // Longer than any of the above, so anything that doesn't fit can't match
+    size_t len = 0;
+    bool space = false;
+    for (size_t i = 0; i < query.len; i++) {
+        char c = query.data[i];
+        if (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+            space = (len > 0);
+            continue;
+        }
+        if (c == ';') { // Only allowed at the very end
+            space = false;
+            for (i++; i < query.len; i++) {
+                if (query.data[i] != ' ' && query.data[i] != '\t' && query.data[i] != '\r' && query.data[i] != '\n') {
+                    return SCHEMA_TABLE_NONE;
+                }
+            }
+            break;
+        }
+        if (len + 2 > sizeof(normal)) {
+            return SCHEMA_TABLE_NONE;
+        }
+        if (space) {
+            normal[len++] = ' ';
+            space = false;
+        }
+        normal[len++] = tolower(c);
+    }
+
+    for (int i = 0; i < SCHEMA_TABLE_COUNT; i++) {
+        if (len == strlen(queries[i]) && memcmp(normal, queries[i], len) == 0) {
+            return i;
+        }
     }
+    return SCHEMA_TABLE_NONE;
 }
@@ -3,6 +3,8 @@
 
 #include <stdint.h>
 
+#include "scan.hpp"
+
 // Represent string maps that CQL uses
 typedef struct cql_string_map {
   char *key;
@@ -10,14 +12,14 @@ typedef struct cql_string_map {
   struct cql_string_map *next;
 } cql_string_map_t;
 
-// Represent the rows / columns of a CQL result
-typedef struct cql_result_cell {
-  char *content; // generic storage of the contents of this particular cell
-  int32_t len;   // length of content buffer
-  bool remove;   // Only used on the head cell of each row
-  struct cql_result_cell *next_col; // pointer to the next column in this row
-  struct cql_result_cell *next_row; // pointer to the next row (first column only)
-} cql_result_cell_t;
+// Index of the rows / columns of a CQL result. Cells are not copied; each one is an offset into the rows content of the packet.
+typedef struct cql_result_index {
+  int32_t rows;
+  int32_t cols;
+  int32_t *cell;  // rows * cols offsets of each cell's [bytes] length, relative to the start of the rows content
+  uint8_t *strip; // one per cell, set if the first TOKEN_LENGTH bytes of the contents are to be dropped
+  bool *remove;   // one per row
+} cql_result_index_t;
 
 // CQL column spec
 typedef struct cql_column_spec_t {
@@ -36,36 +38,38 @@ typedef struct cql_result_metadata_t {
   uint32_t offset;
 } cql_result_metadata_t;
 
-// Node for linked list to keep track of "interesting" packets
-typedef struct node {
-  int8_t id; // Stream filed from cql_packet
-  node *next;
-} node;
-
-void SendCQLError(int sock, uint32_t tid, uint32_t err, char *msg);
-
 cql_string_map_t* ReadStringMap(char *buf);
 char* WriteStringMap(cql_string_map_t *sm, uint32_t *new_len);
 void FreeStringMap(cql_string_map_t *sm);
 
-cql_result_cell_t* ReadCQLResults(char *buf, int32_t rows, int32_t cols);
-char* WriteCQLResults(cql_result_cell_t *rows, uint32_t *new_len, int32_t *new_rows);
-void FreeCQLResults(cql_result_cell_t *rows);
+cql_result_index_t* IndexCQLResults(char *buf, int32_t rows, int32_t cols);
+cql_span_t CellSpan(char *buf, cql_result_index_t *index, int32_t row, int32_t col);
+void StripColumnPrefix(char *buf, cql_result_index_t *index, int32_t col, const char *prefix, uint32_t prefix_len);
+uint32_t CompactCQLResults(char *buf, cql_result_index_t *index, uint32_t prefix_len, int32_t *new_rows);
+void FreeResultIndex(cql_result_index_t *index);
 
-cql_result_metadata_t * ReadResultMetadata(char *buf, uint32_t tid);
+cql_result_metadata_t * ReadResultMetadata(char *buf);
 void FreeResultMetadata(cql_result_metadata_t *m);
 
-void gracefulExit(int sig);
 void cassandra_thread_cleanup_handler(void *arg);
+void mutex_unlock_cleanup_handler(void *arg);
 
-node* addNode(node *head, node *toAdd);
-node* removeNode(node *head, int8_t stream_id);
-bool findNode(node *head, int8_t stream_id);
-
-bool scanForInternalToken(char *cellInQuestion, char *internalToken);
-bool scanforRestrictedKeyspaces(char *cellInQuestion);
-cql_result_cell_t *cleanup(cql_result_cell_t *parsed_table, uint32_t tid);
+bool interestingPacket(cql_span_t query);
 bool isImportantTable(char *keyspace, char *tableName);
-bool isImportantColumn(char *name);
+// Which kind of name a result column holds, as returned by isImportantColumn()
+#define COLUMN_OTHER    0
+#define COLUMN_KEYSPACE 1
+#define COLUMN_USER     2
+
+int isImportantColumn(char *name);
+
+// The driver bootstrap queries on the schema tables, as returned by schemaBootstrapQuery()
+#define SCHEMA_TABLE_NONE          -1
+#define SCHEMA_TABLE_KEYSPACES      0
+#define SCHEMA_TABLE_COLUMNFAMILIES 1
+#define SCHEMA_TABLE_COLUMNS        2
+#define SCHEMA_TABLE_COUNT          3
+
+int schemaBootstrapQuery(cql_span_t query);
 
 #endif
@@ -0,0 +1,342 @@
+/*
+ * hitters.cpp - Finding the tenants and statements behind a load spike
+ * CSC 652 - 2014
+ *
+ * Keeping a counter for every tenant and every statement of every tenant would cost too much, so requests, request bytes and
+ * response bytes are counted in count-min sketches instead: HITTERS_DEPTH rows of HITTERS_WIDTH counters, where a key adds to one
+ * counter per row and its count is the smallest of those. Counts can only be overestimated, by other keys sharing counters. Next
+ * to each sketch, the HITTERS_TOP_K keys with the highest counts are kept by name. Counts start over every hitters_window_s
+ * seconds, and the stats endpoint serves the heaviest keys of the last full window and of the current one at /top.
+ *
+ * Updates add to the sketch with relaxed atomics. Only a key heavier than the lightest of the top keys takes the mutex, and only
+ * if it's free: a key whose update is skipped has the same or a higher count the next time it is seen.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+
+#include "config.hpp"
+#include "hitters.hpp"
+#include "stats.hpp"
+#include "tenant.hpp"
+
+// One of the heaviest keys
+typedef struct {
+  uint64_t key;                         // hash of the tenant, or of the tenant and statement; 0 for an empty slot
+  uint64_t count;                       // the sketch's count for the key when it was last seen
+  uint64_t fingerprint;                 // of the statement, 0 for a tenant
+  char token[TOKEN_LENGTH + 1];
+} cql_hitter_t;
+
+// Text of a statement, in the slot of its fingerprint. A statement replaces whichever one was in its slot before.
+typedef struct {
+  uint64_t fingerprint;
+  char text[HITTERS_TEXT_MAX + 1]; // normalized, see fingerprint.cpp
+} cql_hitter_text_t;
+
+// Sketch and heaviest keys of one measure
+typedef struct {
+  uint64_t cells[HITTERS_DEPTH][HITTERS_WIDTH];
+  uint64_t min;                     // lightest count in top once it is full, 0 before
+  cql_hitter_t top[HITTERS_TOP_K];  // of the current window, in no particular order
+  cql_hitter_t last[HITTERS_TOP_K]; // of the last full window
+} cql_hitters_t;
+
+#define HITTERS_TENANTS    0
+#define HITTERS_STATEMENTS 1
+
+static cql_hitters_t hitters[2][HITTERS_MEASURES];
+static cql_hitter_text_t texts[HITTERS_TEXTS];
+static pthread_mutex_t top_mutex = PTHREAD_MUTEX_INITIALIZER; // protects the top keys, statement texts and the windows below
+static uint32_t window = 0;            // bumped at the start of each window, so counts from the one before aren't carried over
+static uint64_t window_start_us = 0;
+static uint64_t last_window_us = 0;    // length of the last full window, 0 before the first one ends
+
+static const char *kind_names[2] = {"tenant", "statement"};
+static const char *measure_names[HITTERS_MEASURES] = {"requests", "request_bytes", "response_bytes"};
+static const char *measure_help[HITTERS_MEASURES] = {"Requests", "Bytes of requests", "Bytes of responses"};
+
+bool HittersEnabled() {
+    return gateway_config.hitters_window_s > 0;
+}
+
+// splitmix64's finalizer
+static uint64_t mix(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+static uint64_t tenantKey(cql_tenant_t *t) {
+    uint64_t h = 14695981039346656037ULL;
+    for (const char *c = t->token; *c != '\0'; c++) {
+        h = (h ^ (uint8_t)*c) * 1099511628211ULL;
+    }
+    return h | 1; // Never 0, which marks an empty slot
+}
+
+static uint64_t statementKey(uint64_t tenant_key, uint64_t fingerprint) {
+    return mix(tenant_key ^ (fingerprint * 0x9e3779b97f4a7c15ULL)) | 1;
+}
+
+/*
+ * Adds to a key's counters and returns its count.
+ */
+static uint64_t sketchAdd(cql_hitters_t *h, uint64_t key, uint64_t amount) {
+    uint64_t step = mix(key) | 1;
+    uint64_t count = UINT64_MAX;
+    for (int i = 0; i < HITTERS_DEPTH; i++) {
+        uint64_t n = __atomic_add_fetch(&h->cells[i][(key + i * step) % HITTERS_WIDTH], amount, __ATOMIC_RELAXED);
+        count = std::min(count, n);
+    }
+    return count;
+}
+
+/*
+ * Puts a key among the top keys if it is heavy enough, or updates its count if it's already there.
+ */
+static void topUpdate(cql_hitters_t *h, uint32_t seen_window, uint64_t key, uint64_t count, cql_tenant_t *t, uint64_t fingerprint) {
+    if (count <= __atomic_load_n(&h->min, __ATOMIC_RELAXED)) {
+        return;
+    }
+    if (pthread_mutex_trylock(&top_mutex) != 0) {
+        return;
+    }
+    if (seen_window != window) { // Counted in the window before, which is over
+        pthread_mutex_unlock(&top_mutex);
+        return;
+    }
+
+    int slot = -1;
+    int lightest = 0;
+    for (int i = 0; i < HITTERS_TOP_K; i++) {
+        if (h->top[i].key == key) {
+            slot = i;
+            break;
+        }
+        if (h->top[i].count < h->top[lightest].count) {
+            lightest = i;
+        }
+    }
+    if (slot < 0 && h->top[lightest].count < count) {
+        slot = lightest;
+        cql_hitter_t *e = &h->top[slot];
+        e->key = key;
+        e->fingerprint = fingerprint;
+        strcpy(e->token, t->token);
+    }
+    if (slot >= 0) {
+        h->top[slot].count = count;
+
+        uint64_t min = UINT64_MAX;
+        for (int i = 0; i < HITTERS_TOP_K; i++) {
+            min = std::min(min, h->top[i].count); // An empty slot counts 0, so min stays 0 until the top keys are full
+        }
+        __atomic_store_n(&h->min, min, __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_unlock(&top_mutex);
+}
+
+/*
+ * Keeps a statement's text for /top, unless it is there already.
+ */
+static void rememberText(uint64_t fingerprint, const std::string &statement) {
+    cql_hitter_text_t *e = &texts[fingerprint % HITTERS_TEXTS];
+    if (__atomic_load_n(&e->fingerprint, __ATOMIC_RELAXED) == fingerprint || pthread_mutex_trylock(&top_mutex) != 0) {
+        return;
+    }
+    snprintf(e->text, sizeof(e->text), "%s", statement.c_str());
+    __atomic_store_n(&e->fingerprint, fingerprint, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&top_mutex);
+}
+
+static void count(int measure, cql_tenant_t *t, uint64_t fingerprint, uint64_t amount) {
+    uint32_t seen_window = __atomic_load_n(&window, __ATOMIC_RELAXED);
+
+    cql_hitters_t *h = &hitters[HITTERS_TENANTS][measure];
+    uint64_t key = tenantKey(t);
+    topUpdate(h, seen_window, key, sketchAdd(h, key, amount), t, 0);
+
+    if (fingerprint != 0) {
+        h = &hitters[HITTERS_STATEMENTS][measure];
+        uint64_t skey = statementKey(key, fingerprint);
+        topUpdate(h, seen_window, skey, sketchAdd(h, skey, amount), t, fingerprint);
+    }
+}
+
+/*
+ * Counts a request read from the client. fingerprint is its statement's (see fingerprint.cpp), or 0 if it has none.
+ */
+void HittersRequest(cql_thread_t *session, uint64_t fingerprint, const std::string &statement, uint32_t bytes) {
+    if (!HittersEnabled() || session->tenant == NULL) {
+        return;
+    }
+    count(HITTERS_REQUESTS, session->tenant, fingerprint, 1);
+    count(HITTERS_REQUEST_BYTES, session->tenant, fingerprint, bytes);
+    if (fingerprint != 0) {
+        rememberText(fingerprint, statement);
+    }
+}
+
+/*
+ * Counts a response from Cassandra to a request with the given statement fingerprint.
+ */
+void HittersResponse(cql_thread_t *session, uint64_t fingerprint, uint32_t bytes) {
+    if (!HittersEnabled() || session->tenant == NULL) {
+        return;
+    }
+    count(HITTERS_RESPONSE_BYTES, session->tenant, fingerprint, bytes);
+}
+
+/*
+ * Ends the current window: its top keys become the last window's, and every count starts over.
+ */
+static void startWindow() {
+    uint64_t now = StatsNowUs();
+
+    pthread_mutex_lock(&top_mutex);
+    for (int k = 0; k < 2; k++) {
+        for (int m = 0; m < HITTERS_MEASURES; m++) {
+            cql_hitters_t *h = &hitters[k][m];
+            memcpy(h->last, h->top, sizeof(h->top));
+            memset(h->top, 0, sizeof(h->top));
+            __atomic_store_n(&h->min, 0, __ATOMIC_RELAXED);
+            for (int i = 0; i < HITTERS_DEPTH; i++) {
+                for (int j = 0; j < HITTERS_WIDTH; j++) {
+                    __atomic_store_n(&h->cells[i][j], 0, __ATOMIC_RELAXED);
+                }
+            }
+        }
+    }
+    last_window_us = now - window_start_us;
+    window_start_us = now;
+    __atomic_add_fetch(&window, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&top_mutex);
+}
+
+static void* HandleHitters(void *arg) {
+    (void)arg;
+
+    while (1) {
+        sleep(gateway_config.hitters_window_s);
+        startWindow();
+    }
+
+    return NULL;
+}
+
+/*
+ * Starts counting, if hitters_window_s is set.
+ */
+void StartHitters() {
+    if (!HittersEnabled()) {
+        return;
+    }
+
+    window_start_us = StatsNowUs();
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, HandleHitters, NULL) != 0) {
+        fprintf(stderr, "pthread_create failed for heavy hitters thread.\n");
+        exit(1);
+    }
+    pthread_detach(thread);
+}
+
+static bool heavier(const cql_hitter_t &a, const cql_hitter_t &b) {
+    return a.count > b.count;
+}
+
+static void appendLabel(std::string &out, const char *value) {
+    for (; *value != '\0'; value++) {
+        if (*value == '\\' || *value == '"') {
+            out += '\\';
+            out += *value;
+        }
+        else if (*value == '\n') {
+            out += "\\n";
+        }
+        else {
+            out += *value;
+        }
+    }
+}
+
+/*
+ * Returns the heaviest tenants and statements of the last full window and of the current one, in the Prometheus text format.
+ * Counts are estimates, and may be somewhat high.
+ */
+std::string HittersRender() {
+    static cql_hitter_t top[2][HITTERS_MEASURES][2][HITTERS_TOP_K]; // Static, as it's too big for the stack; only the stats thread renders
+    std::map<uint64_t, std::string> texts_kept; // Text of each statement listed, by fingerprint, if it is still kept
+    uint64_t now = StatsNowUs();
+
+    pthread_mutex_lock(&top_mutex);
+    for (int k = 0; k < 2; k++) {
+        for (int m = 0; m < HITTERS_MEASURES; m++) {
+            memcpy(top[k][m][0], hitters[k][m].last, sizeof(hitters[k][m].last));
+            memcpy(top[k][m][1], hitters[k][m].top, sizeof(hitters[k][m].top));
+        }
+    }
+    for (int m = 0; m < HITTERS_MEASURES; m++) {
+        for (int w = 0; w < 2; w++) {
+            for (int i = 0; i < HITTERS_TOP_K; i++) {
+                uint64_t fingerprint = top[HITTERS_STATEMENTS][m][w][i].fingerprint;
+                cql_hitter_text_t *e = &texts[fingerprint % HITTERS_TEXTS];
+                if (fingerprint != 0 && e->fingerprint == fingerprint) {
+                    texts_kept[fingerprint] = e->text;
+                }
+            }
+        }
+    }
+    uint64_t last_us = last_window_us;
+    uint64_t current_us = now - window_start_us;
+    pthread_mutex_unlock(&top_mutex);
+
+    std::string out;
+    char buf[64];
+    out += "# HELP cql_gateway_top_window_seconds Length of the last full window and of the current one so far.\n";
+    out += "# TYPE cql_gateway_top_window_seconds gauge\n";
+    snprintf(buf, sizeof(buf), "%.3f", last_us / 1e6);
+    out += std::string("cql_gateway_top_window_seconds{window=\"last\"} ") + buf + "\n";
+    snprintf(buf, sizeof(buf), "%.3f", current_us / 1e6);
+    out += std::string("cql_gateway_top_window_seconds{window=\"current\"} ") + buf + "\n";
+
+    const char *windows[2] = {"last", "current"};
+    for (int k = 0; k < 2; k++) {
+        for (int m = 0; m < HITTERS_MEASURES; m++) {
+            std::string name = std::string("cql_gateway_top_") + kind_names[k] + "_" + measure_names[m];
+            out += "# HELP " + name + " " + measure_help[m] + " of the heaviest " + kind_names[k] +
+                   "s in the window. Estimated, may be high.\n";
+            out += "# TYPE " + name + " gauge\n";
+            for (int w = 0; w < 2; w++) {
+                cql_hitter_t *list = top[k][m][w];
+                std::sort(list, list + HITTERS_TOP_K, heavier);
+                for (int i = 0; i < HITTERS_TOP_K && list[i].key != 0; i++) {
+                    out += name + "{window=\"" + windows[w] + "\",tenant=\"" + list[i].token + "\"";
+                    if (k == HITTERS_STATEMENTS) {
+                        snprintf(buf, sizeof(buf), "%016lx", (unsigned long)list[i].fingerprint);
+                        out += std::string(",fingerprint=\"") + buf + "\",statement=\"";
+                        appendLabel(out, texts_kept[list[i].fingerprint].c_str());
+                        out += "\"";
+                    }
+                    snprintf(buf, sizeof(buf), "} %lu\n", (unsigned long)list[i].count);
+                    out += buf;
+                }
+            }
+        }
+    }
+
+    return out;
+}
@@ -0,0 +1,31 @@
+#ifndef _HITTERS_H
+#define _HITTERS_H
+
+#include <stdint.h>
+
+#include <string>
+
+#include "gateway.hpp"
+
+// Count-min sketch dimensions. With this width, a key's count is overestimated by at most 0.03% of the window's total
+// (e/width) with probability 1 - e^-depth.
+#define HITTERS_DEPTH 4
+#define HITTERS_WIDTH 8192
+
+#define HITTERS_TOP_K    20   // heaviest keys kept for each measure
+#define HITTERS_TEXTS    4096 // statements whose text is kept for /top, by fingerprint
+#define HITTERS_TEXT_MAX 160  // statement text is cut short after this
+
+// What is counted, for tenants and for statements of a tenant
+#define HITTERS_REQUESTS       0
+#define HITTERS_REQUEST_BYTES  1
+#define HITTERS_RESPONSE_BYTES 2
+#define HITTERS_MEASURES       3
+
+void StartHitters();
+bool HittersEnabled();
+void HittersRequest(cql_thread_t *session, uint64_t fingerprint, const std::string &statement, uint32_t bytes);
+void HittersResponse(cql_thread_t *session, uint64_t fingerprint, uint32_t bytes);
+std::string HittersRender();
+
+#endif
@@ -0,0 +1,145 @@
+/*
+ * listener.cpp - The sockets client connections are accepted on
+ * CSC 652 - 2014
+ *
+ * By default the gateway listens on a single socket, accepted on by the main thread. With listen_shards set above 1, it opens that
+ * many sockets on the same address with SO_REUSEPORT, each accepted on by a thread of its own, and the kernel spreads new
+ * connections over them so that no one thread or accept queue serializes them. A connection belongs to the shard it was
+ * accepted on for its whole life. With shard_cpus, each shard's threads (its accepting thread, and the threads of every
+ * connection it accepts, which inherit it) are pinned to one CPU of that list, in turn, keeping a connection's work on the
+ * same core. Counters of each shard are served on the stats endpoint.
+ */
+
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "config.hpp"
+#include "listener.hpp"
+#include "log.hpp"
+
+static cql_shard_t *shards = NULL; // set up once by OpenListeners(), and never freed
+static uint32_t shard_count = 0;
+
+/*
+ * Opens the listening sockets on the gateway's address, exiting with an error if that fails. Returns the shards, with their
+ * count in *count.
+ */
+cql_shard_t* OpenListeners(const char *ip, uint32_t *count) {
+    shard_count = gateway_config.listen_shards;
+    shards = (cql_shard_t *)calloc(shard_count, sizeof(cql_shard_t));
+
+    // Clear the serv_addr struct
+    struct sockaddr_in serv_addr;
+    memset(&serv_addr, 0, sizeof(serv_addr));
+
+    serv_addr.sin_family = AF_INET;
+
+    // Bind to IP address specified on command line
+    serv_addr.sin_addr.s_addr = inet_addr(ip);
+    serv_addr.sin_port = htons(CASSANDRA_PORT);
+
+    for (uint32_t i = 0; i < shard_count; i++) {
+        cql_shard_t *s = &shards[i];
+        s->id = i;
+        s->cpu = gateway_config.shard_cpus.empty() ? -1 : gateway_config.shard_cpus[i % gateway_config.shard_cpus.size()];
+
+        // Prep the socket
+        s->fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (s->fd < 0) {
+            fprintf(stderr, "Socket creation error: %s\n", strerror(errno));
+            exit(1);
+        }
+
+        // Every shard binds the same address, and the kernel shares connections out between them
+        int on = 1;
+        if (shard_count > 1 && setsockopt(s->fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+            fprintf(stderr, "Socket SO_REUSEPORT error: %s\n", strerror(errno));
+            exit(1);
+        }
+
+        // Bind the socket and port to the name
+        if (bind(s->fd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) {
+            fprintf(stderr, "Socket bind error: %s\n", strerror(errno));
+            exit(1);
+        }
+
+        // Listen for connections, with the configured backlog
+        if (listen(s->fd, gateway_config.listen_backlog) == -1) {
+            fprintf(stderr, "Socket listen error: %s\n", strerror(errno));
+            exit(1);
+        }
+    }
+
+    *count = shard_count;
+    return shards;
+}
+
+/*
+ * Pins the calling thread to its shard's CPU, if it has one. Threads it starts afterwards inherit this.
+ */
+void ShardPin(cql_shard_t *s) {
+    if (s->cpu < 0) {
+        return;
+    }
+
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(s->cpu, &cpus);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (err != 0) {
+        LOG(LOG_WARN, "Could not pin shard %u to CPU %d: %s\n", s->id, s->cpu, strerror(err));
+    }
+}
+
+void ShardAccepted(cql_shard_t *s) {
+    __atomic_add_fetch(&s->accepted, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&s->open, 1, __ATOMIC_RELAXED);
+}
+
+void ShardAcceptFailed(cql_shard_t *s) {
+    __atomic_add_fetch(&s->accept_errors, 1, __ATOMIC_RELAXED);
+}
+
+void ShardClosed(cql_shard_t *s) {
+    __atomic_sub_fetch(&s->open, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Returns the counters of every shard in the Prometheus text format, for the stats endpoint. Nothing with a single listener.
+ */
+std::string ShardRender() {
+    if (shard_count <= 1) {
+        return "";
+    }
+
+    std::string out = "# HELP cql_gateway_shard_connections Client connections of the shard still open.\n"
+                      "# TYPE cql_gateway_shard_connections gauge\n";
+    char line[128];
+    for (uint32_t i = 0; i < shard_count; i++) {
+        snprintf(line, sizeof(line), "cql_gateway_shard_connections{shard=\"%u\"} %u\n", i, __atomic_load_n(&shards[i].open, __ATOMIC_RELAXED));
+        out += line;
+    }
+    out += "# HELP cql_gateway_shard_accepted_total Client connections accepted by the shard.\n"
+           "# TYPE cql_gateway_shard_accepted_total counter\n";
+    for (uint32_t i = 0; i < shard_count; i++) {
+        snprintf(line, sizeof(line), "cql_gateway_shard_accepted_total{shard=\"%u\"} %lu\n", i,
+                 (unsigned long)__atomic_load_n(&shards[i].accepted, __ATOMIC_RELAXED));
+        out += line;
+    }
+    out += "# HELP cql_gateway_shard_accept_errors_total Failed accepts of the shard.\n"
+           "# TYPE cql_gateway_shard_accept_errors_total counter\n";
+    for (uint32_t i = 0; i < shard_count; i++) {
+        snprintf(line, sizeof(line), "cql_gateway_shard_accept_errors_total{shard=\"%u\"} %lu\n", i,
+                 (unsigned long)__atomic_load_n(&shards[i].accept_errors, __ATOMIC_RELAXED));
+        out += line;
+    }
+
+    return out;
+}
@@ -0,0 +1,30 @@
+#ifndef _LISTENER_H
+#define _LISTENER_H
+
+#include <stdint.h>
+
+#include <string>
+
+#include "gateway.hpp"
+
+// Most listening sockets that can be configured
+#define LISTENER_MAX_SHARDS 256
+
+// One listening socket and the thread accepting on it, with the client connections accepted there
+typedef struct cql_shard {
+  uint32_t id;
+  int fd;                 // the listening socket
+  int cpu;                // CPU its threads are pinned to, -1 for none
+  uint64_t accepted;      // connections accepted, added to atomically
+  uint64_t accept_errors; // failed accepts, added to atomically
+  uint32_t open;          // of those connections, how many are still open, changed atomically
+} cql_shard_t;
+
+cql_shard_t* OpenListeners(const char *ip, uint32_t *count);
+void ShardPin(cql_shard_t *s);
+void ShardAccepted(cql_shard_t *s);
+void ShardAcceptFailed(cql_shard_t *s);
+void ShardClosed(cql_shard_t *s);
+std::string ShardRender();
+
+#endif
@@ -0,0 +1,293 @@
+/*
+ * log.cpp - Asynchronous logging through per-thread ring buffers
+ * CSC 652 - 2014
+ *
+ * A thread that logs formats the message into a ring buffer of its own, which only it writes and only the flusher thread reads,
+ * so logging takes no lock and never waits on the terminal or a file. Every LOG_FLUSH_MS the flusher collects the messages of
+ * all threads, puts them in time order and writes them to stderr. If a thread logs faster than that, messages that don't fit
+ * are dropped and counted rather than holding the thread up.
+ *
+ * The level can be changed while the gateway runs: SIGUSR1 logs more, SIGUSR2 logs less, and the stats endpoint takes
+ * /log?level=<level> and /log?trace=<internal token> (see LogAdminCommand()).
+ */
+
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "config.hpp"
+#include "log.hpp"
+#include "tenant.hpp"
+
+typedef struct {
+  uint64_t us;  // wall clock time the message was logged at
+  uint8_t level;
+  uint16_t len;
+  char msg[LOG_MSG_MAX];
+} cql_log_entry_t;
+
+// The messages of one thread. head is only written by the thread, tail only by the flusher.
+typedef struct cql_log_ring {
+  uint64_t head;      // messages written
+  uint64_t tail;      // messages flushed
+  uint64_t dropped;   // messages that didn't fit
+  bool dead;          // the thread has exited; the ring is freed once flushed
+  struct cql_log_ring *next;
+  cql_log_entry_t entries[LOG_RING_SLOTS];
+} cql_log_ring_t;
+
+int log_level = LOG_WARN;
+struct cql_tenant *log_trace_tenant = NULL;
+
+static const char *level_names[4] = {"ERROR", "WARN", "INFO", "DEBUG"};
+
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER; // protects the list of rings
+static pthread_mutex_t flush_mutex = PTHREAD_MUTEX_INITIALIZER; // held while flushing, so only one caller reads the rings at once
+static cql_log_ring_t *rings = NULL;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+static __thread cql_log_ring_t *thread_ring = NULL;
+
+static uint64_t wallUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void ringThreadExited(void *arg) {
+    __atomic_store_n(&((cql_log_ring_t *)arg)->dead, true, __ATOMIC_RELEASE);
+}
+
+static void makeRingKey() {
+    pthread_key_create(&ring_key, ringThreadExited);
+}
+
+/*
+ * Returns the calling thread's ring, creating it the first time the thread logs.
+ */
+static cql_log_ring_t* threadRing() {
+    if (thread_ring == NULL) {
+        pthread_once(&ring_key_once, makeRingKey);
+
+        cql_log_ring_t *r = (cql_log_ring_t *)calloc(1, sizeof(cql_log_ring_t));
+        pthread_setspecific(ring_key, r); // Marks the ring dead when the thread exits, even when it is cancelled
+
+        pthread_mutex_lock(&rings_mutex);
+        r->next = rings;
+        rings = r;
+        pthread_mutex_unlock(&rings_mutex);
+
+        thread_ring = r;
+    }
+    return thread_ring;
+}
+
+static void ringPut(cql_log_ring_t *r, uint64_t us, int level, const char *format, va_list args) {
+    uint64_t head = r->head;
+    if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= LOG_RING_SLOTS) {
+        __atomic_fetch_add(&r->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    cql_log_entry_t *e = &r->entries[head % LOG_RING_SLOTS];
+    e->us = us;
+    e->level = level;
+    int n = vsnprintf(e->msg, LOG_MSG_MAX, format, args);
+    n = (n < 0) ? 0 : (n >= LOG_MSG_MAX) ? LOG_MSG_MAX - 1 : n;
+    while (n > 0 && e->msg[n - 1] == '\n') { // The flusher ends every message with exactly one newline
+        n--;
+    }
+    e->len = n;
+
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void ringPutf(cql_log_ring_t *r, uint64_t us, int level, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    ringPut(r, us, level, format, args);
+    va_end(args);
+}
+
+/*
+ * Queues a message for the flusher. Only log_rate_limit messages a second are taken from each call site (0 for no limit); the
+ * number skipped is logged with the next one that gets through.
+ */
+void LogWrite(cql_log_site_t *site, int level, const char *format, ...) {
+    uint64_t us = wallUs();
+    cql_log_ring_t *r = threadRing();
+
+    uint32_t limit = gateway_config.log_rate_limit;
+    if (limit > 0) {
+        uint64_t second = us / 1000000;
+        uint64_t seen = __atomic_load_n(&site->second, __ATOMIC_RELAXED);
+        if (seen != second && __atomic_compare_exchange_n(&site->second, &seen, second, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&site->count, 0, __ATOMIC_RELAXED);
+            uint32_t suppressed = __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
+            if (suppressed > 0) {
+                ringPutf(r, us, level, "(%u more like the next message were not logged)", suppressed);
+            }
+        }
+        if (__atomic_fetch_add(&site->count, 1, __ATOMIC_RELAXED) >= limit) {
+            __atomic_fetch_add(&site->suppressed, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+
+    va_list args;
+    va_start(args, format);
+    ringPut(r, us, level, format, args);
+    va_end(args);
+}
+
+static bool entryBefore(const cql_log_entry_t *a, const cql_log_entry_t *b) {
+    return a->us < b->us;
+}
+
+/*
+ * Writes out everything the threads have logged, oldest first, and frees the rings of threads that have exited. The rings are
+ * only looked up with rings_mutex held, so a thread logging for the first time doesn't wait on stderr.
+ */
+void LogFlush() {
+    std::vector<cql_log_entry_t *> batch;
+    std::vector<std::pair<cql_log_ring_t *, uint64_t> > flushed; // Each ring, and how far it was read
+    std::vector<cql_log_ring_t *> done;                           // Rings of exited threads, freed once written out
+    uint64_t dropped = 0;
+
+    pthread_mutex_lock(&flush_mutex);
+    pthread_mutex_lock(&rings_mutex);
+
+    cql_log_ring_t **link = &rings;
+    while (*link != NULL) {
+        cql_log_ring_t *r = *link;
+        bool dead = __atomic_load_n(&r->dead, __ATOMIC_ACQUIRE); // Before head, so nothing can be written after it is read
+        uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        for (uint64_t i = r->tail; i < head; i++) {
+            batch.push_back(&r->entries[i % LOG_RING_SLOTS]);
+        }
+        dropped += __atomic_exchange_n(&r->dropped, 0, __ATOMIC_RELAXED);
+
+        if (dead) {
+            *link = r->next;
+            done.push_back(r);
+        }
+        else {
+            flushed.push_back(std::make_pair(r, head));
+            link = &r->next;
+        }
+    }
+    pthread_mutex_unlock(&rings_mutex);
+
+    // The slots read stay untouched until the tails are moved, and the rings taken off the list are only the flusher's now
+    std::stable_sort(batch.begin(), batch.end(), entryBefore);
+    for (size_t i = 0; i < batch.size(); i++) {
+        cql_log_entry_t *e = batch[i];
+        fprintf(stderr, "%lu.%06lu %-5s %.*s\n", (unsigned long)(e->us / 1000000), (unsigned long)(e->us % 1000000),
+                level_names[e->level], e->len, e->msg);
+    }
+    if (dropped > 0) {
+        fprintf(stderr, "%lu log messages were dropped because threads logged faster than they could be written.\n", (unsigned long)dropped);
+    }
+    fflush(stderr);
+
+    // Only now can the threads reuse the slots
+    for (size_t i = 0; i < flushed.size(); i++) {
+        __atomic_store_n(&flushed[i].first->tail, flushed[i].second, __ATOMIC_RELEASE);
+    }
+    for (size_t i = 0; i < done.size(); i++) {
+        free(done[i]);
+    }
+
+    pthread_mutex_unlock(&flush_mutex);
+}
+
+static void* HandleLogFlush(void *arg) {
+    (void)arg;
+
+    while (1) {
+        usleep(LOG_FLUSH_MS * 1000);
+        LogFlush();
+    }
+
+    return NULL;
+}
+
+static void logMore(int sig) {
+    (void)sig;
+    int level = __atomic_load_n(&log_level, __ATOMIC_RELAXED);
+    if (level < LOG_DEBUG) {
+        __atomic_store_n(&log_level, level + 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void logLess(int sig) {
+    (void)sig;
+    int level = __atomic_load_n(&log_level, __ATOMIC_RELAXED);
+    if (level > LOG_ERROR) {
+        __atomic_store_n(&log_level, level - 1, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Sets the configured level and starts the flusher. Messages logged before this are kept until it runs.
+ */
+void StartLogger() {
+    __atomic_store_n(&log_level, gateway_config.log_level, __ATOMIC_RELAXED);
+
+    signal(SIGUSR1, logMore);
+    signal(SIGUSR2, logLess);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, HandleLogFlush, NULL) != 0) {
+        fprintf(stderr, "pthread_create failed for log thread.\n");
+        exit(1);
+    }
+    pthread_detach(thread);
+}
+
+/*
+ * Handles a command from the stats endpoint: "level=<error|warn|info|debug>" to change the level, "trace=<internal token>" to
+ * log everything about one tenant's connections, or "trace=" to stop. Writes a one line answer into reply and returns false if
+ * the command isn't understood.
+ */
+bool LogAdminCommand(const char *command, char *reply, size_t reply_len) {
+    if (strncmp(command, "level=", 6) == 0) {
+        for (int level = LOG_ERROR; level <= LOG_DEBUG; level++) {
+            if (strcasecmp(command + 6, level_names[level]) == 0) {
+                __atomic_store_n(&log_level, level, __ATOMIC_RELAXED);
+                snprintf(reply, reply_len, "log level is now %s\n", level_names[level]);
+                return true;
+            }
+        }
+        snprintf(reply, reply_len, "unknown log level '%s'\n", command + 6);
+        return false;
+    }
+    if (strncmp(command, "trace=", 6) == 0) {
+        const char *token = command + 6;
+        if (*token == '\0') {
+            __atomic_store_n(&log_trace_tenant, (cql_tenant_t *)NULL, __ATOMIC_RELAXED);
+            snprintf(reply, reply_len, "tracing is off\n");
+            return true;
+        }
+        cql_tenant_t *t = (strlen(token) == TOKEN_LENGTH && strspn(token, "0123456789abcdef") == TOKEN_LENGTH) ? GetTenant(token) : NULL;
+        if (t == NULL) {
+            snprintf(reply, reply_len, "'%s' is not an internal token\n", token);
+            return false;
+        }
+        __atomic_store_n(&log_trace_tenant, t, __ATOMIC_RELAXED);
+        snprintf(reply, reply_len, "tracing tenant %s\n", t->token);
+        return true;
+    }
+
+    snprintf(reply, reply_len, "expected level=<error|warn|info|debug> or trace=<internal token>\n");
+    return false;
+}
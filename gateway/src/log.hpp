@@ -0,0 +1,60 @@
+#ifndef _LOG_H
+#define _LOG_H
+
+#include <stdint.h>
+
+#include "gateway.hpp"
+
+struct cql_tenant;
+
+// Log levels, most to least important. Messages above the current level are skipped before their arguments are even formatted.
+#define LOG_ERROR 0
+#define LOG_WARN  1
+#define LOG_INFO  2
+#define LOG_DEBUG 3
+
+#define LOG_RING_SLOTS 64  // messages a thread can have waiting for the flusher; more are dropped and counted
+#define LOG_MSG_MAX    240 // longer messages are cut short
+#define LOG_FLUSH_MS   10  // how often the flusher writes out what threads have logged
+
+// Per call site state for rate limiting, see LogWrite()
+typedef struct {
+  uint64_t second;     // the second being counted
+  uint32_t count;      // messages logged from the site in that second
+  uint32_t suppressed; // messages skipped since the last one logged
+} cql_log_site_t;
+
+extern int log_level;                     // the current level, changed at runtime with signals or the stats endpoint
+extern struct cql_tenant *log_trace_tenant; // a tenant whose connections log at LOG_DEBUG whatever the level, or NULL
+
+/*
+ * Logs a message if its level is enabled. Each use has its own rate limit of log_rate_limit messages per second.
+ */
+#define LOG(level, ...) do { \
+    if ((level) <= __atomic_load_n(&log_level, __ATOMIC_RELAXED)) { \
+        static cql_log_site_t log_site; \
+        LogWrite(&log_site, (level), __VA_ARGS__); \
+    } \
+} while (0)
+
+/*
+ * Same as LOG(), but also logs if the session's tenant is being traced.
+ */
+#define SESSION_LOG(session, level, ...) do { \
+    if ((level) <= __atomic_load_n(&log_level, __ATOMIC_RELAXED) || LogTracing(session)) { \
+        static cql_log_site_t log_site; \
+        LogWrite(&log_site, (level), __VA_ARGS__); \
+    } \
+} while (0)
+
+static inline bool LogTracing(cql_thread_t *session) {
+    struct cql_tenant *t = __atomic_load_n(&log_trace_tenant, __ATOMIC_RELAXED);
+    return t != NULL && session->tenant == t;
+}
+
+void StartLogger();
+void LogWrite(cql_log_site_t *site, int level, const char *format, ...) __attribute__((format(printf, 3, 4)));
+void LogFlush();
+bool LogAdminCommand(const char *command, char *reply, size_t reply_len);
+
+#endif
@@ -0,0 +1,116 @@
+/*
+ * overload.cpp - Sheds requests at the gateway when Cassandra falls behind
+ * CSC 652 - 2014
+ *
+ * Every request forwarded to Cassandra is tracked until it is answered, giving the number of outstanding requests and a moving
+ * average of how long they take (including time spent in the scheduler's queues). Once either goes over its configured limit,
+ * new requests of the lowest priority tenants are answered with an OVERLOADED error instead of being forwarded. Each further 10%
+ * over the limit sheds the next priority up, so the most important tenants are the last to be turned away. The outstanding requests
+ * of each Cassandra node are counted here too, for choosing the node of a new connection (see upstream.cpp).
+ */
+
+#include <stdio.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "config.hpp"
+#include "overload.hpp"
+#include "tenant.hpp"
+#include "upstream.hpp"
+
+static pthread_mutex_t overload_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t outstanding = 0; // requests forwarded and not yet answered
+static double latency_us = 0;    // moving average of the time taken to answer a request
+
+static uint64_t nowUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Starts tracking a request that is about to be forwarded to the given node.
+ */
+void OverloadRequestSent(cql_thread_t *session, int8_t stream, cql_node_t *n) {
+    if (stream < 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&overload_mutex);
+    if (session->inflight[stream].sent_us == 0) {
+        outstanding++;
+        session->inflight[stream].sent_node = n;
+        __atomic_add_fetch(&n->outstanding, 1, __ATOMIC_RELAXED);
+    }
+    session->inflight[stream].sent_us = nowUs();
+    pthread_mutex_unlock(&overload_mutex);
+}
+
+/*
+ * Stops tracking a request once Cassandra answers it, and adds its latency to the average.
+ */
+void OverloadResponseReceived(cql_thread_t *session, int8_t stream) {
+    if (stream < 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&overload_mutex);
+    if (session->inflight[stream].sent_us != 0) {
+        double sample = nowUs() - session->inflight[stream].sent_us;
+        latency_us += (sample - latency_us) / 8; // Same weight as TCP's smoothed round trip time
+        session->inflight[stream].sent_us = 0;
+        outstanding--;
+        __atomic_sub_fetch(&session->inflight[stream].sent_node->outstanding, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&overload_mutex);
+}
+
+/*
+ * Stops tracking the requests of a closing client, which Cassandra will no longer answer.
+ */
+void OverloadSessionClosed(cql_thread_t *session) {
+    pthread_mutex_lock(&overload_mutex);
+    for (int i = 0; i < CQL_MAX_STREAMS; i++) {
+        if (session->inflight[i].sent_us != 0) {
+            session->inflight[i].sent_us = 0;
+            outstanding--;
+            __atomic_sub_fetch(&session->inflight[i].sent_node->outstanding, 1, __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&overload_mutex);
+}
+
+/*
+ * Returns true if a new request from the tenant should be turned away rather than forwarded.
+ */
+bool OverloadShouldShed(cql_tenant_t *t) {
+    uint32_t max_outstanding = gateway_config.shed_max_outstanding;
+    uint32_t max_latency_ms = gateway_config.shed_max_latency_ms;
+    if (max_outstanding == 0 && max_latency_ms == 0) {
+        return false;
+    }
+
+    pthread_mutex_lock(&overload_mutex);
+    double load = 0; // 1.0 is at the limit
+    if (max_outstanding > 0) {
+        load = (double)outstanding / max_outstanding;
+    }
+    if (max_latency_ms > 0 && outstanding > 0) { // With nothing outstanding the average can't be refreshed, so it is ignored
+        double latency_load = latency_us / (max_latency_ms * 1000.0);
+        load = (latency_load > load) ? latency_load : load;
+    }
+    pthread_mutex_unlock(&overload_mutex);
+
+    if (load < 1.0) {
+        return false;
+    }
+
+    // At the limit, priority 0 is shed; at 10% over, priority 1 as well, and so on
+    bool shed = t->config.priority <= (load - 1.0) * 10;
+    if (shed) {
+        pthread_mutex_lock(&t->limit_lock);
+        t->requests_shed++;
+        pthread_mutex_unlock(&t->limit_lock);
+    }
+    return shed;
+}
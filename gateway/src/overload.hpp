@@ -0,0 +1,17 @@
+#ifndef _OVERLOAD_H
+#define _OVERLOAD_H
+
+#include "gateway.hpp"
+
+struct cql_tenant;
+struct cql_node;
+
+// Tenant priorities run from 0 (shed first) to OVERLOAD_MAX_PRIORITY (shed last)
+#define OVERLOAD_MAX_PRIORITY 9
+
+void OverloadRequestSent(cql_thread_t *session, int8_t stream, struct cql_node *n);
+void OverloadResponseReceived(cql_thread_t *session, int8_t stream);
+void OverloadSessionClosed(cql_thread_t *session);
+bool OverloadShouldShed(struct cql_tenant *t);
+
+#endif
@@ -0,0 +1,364 @@
+/*
+ * pool.cpp - Connections to Cassandra kept open and logged in for each tenant, ready for its next client
+ * CSC 652 - 2014
+ *
+ * A client's own connection to Cassandra costs a TCP handshake and two round trips (STARTUP, then CREDENTIALS and the password
+ * check) before its first request, which short-lived clients pay on every connect. A tenant with a session_pool_size keeps that
+ * many connections open and logged in as its own user, "<internal token>cassandra" with session_pool_password. While any tenant
+ * does, client connections get no connection to Cassandra when they are accepted: the gateway answers STARTUP with AUTHENTICATE
+ * itself, and a client whose CREDENTIALS carry a valid token (checked locally, see cassandra.cpp) for its tenant's user and
+ * that password is given a pooled connection and answered READY. Any other client, or one that finds its tenant's pool empty,
+ * is connected as before, with its STARTUP replayed before its CREDENTIALS are forwarded (see PoolConnect()). So is a client
+ * that sends any request before STARTUP other than an OPTIONS the gateway can answer itself (see upstream.cpp).
+ *
+ * Pools are kept for the tenants that asked for a connection in the last POOL_IDLE_S seconds. A thread tops them up every
+ * POOL_REFILL_MS and whenever a connection is taken, drops connections that were closed or whose node is no longer given new
+ * connections (see upstream.cpp), and closes a pool once its tenant stops using it. A pool's connections are started up with the
+ * STARTUP of the first client that asked for one, and are only given to clients sending the same STARTUP.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <deque>
+#include <map>
+#include <vector>
+
+#include "breaker.hpp"
+#include "config.hpp"
+#include "helpers.hpp"
+#include "log.hpp"
+#include "pool.hpp"
+#include "stats.hpp"
+
+// A connection in a pool, logged in and not yet given to a session
+typedef struct {
+  int fd;
+  cql_node_t *node;
+} cql_pooled_t;
+
+// A tenant's pool, protected by pool_mutex
+typedef struct {
+  std::string startup;            // body of the STARTUP its connections are started up with, empty until a session asks
+  std::deque<cql_pooled_t> idle;  // connections ready to be taken
+  uint64_t used_us;               // when a session last asked for a connection
+  uint64_t hits;                  // sessions given a pooled connection
+  uint64_t misses;                // sessions that could have been given one, but found the pool empty
+} cql_pool_t;
+
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER; // protects the pools
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;    // signalled when a connection is taken, to replace it
+static std::map<cql_tenant_t *, cql_pool_t> pools;
+
+/*
+ * Whether any tenant keeps a pool.
+ */
+bool PoolEnabled() {
+    bool wanted = gateway_config.tenant_defaults.session_pool_size > 0;
+    std::map<std::string, cql_tenant_config_t>::iterator it;
+    for (it = gateway_config.tenants.begin(); it != gateway_config.tenants.end(); it++) {
+        wanted = wanted || it->second.session_pool_size > 0;
+    }
+    return wanted;
+}
+
+static void setTimeout(int sock, uint32_t ms) {
+    struct timeval timeout;
+    timeout.tv_sec = ms / 1000;
+    timeout.tv_usec = (ms % 1000) * 1000;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+}
+
+/*
+ * Waits for Cassandra's answer on a connection being set up, returning whether it has the given opcode.
+ */
+static bool expect(int sock, uint8_t opcode) {
+    cql_packet_t *p = UpstreamRecvPacket(sock);
+    bool ok = p != NULL && p->opcode == opcode;
+    free(p);
+    return ok;
+}
+
+static void putString(std::string &out, const std::string &s) {
+    uint16_t len = htons(s.size());
+    out.append((const char *)&len, 2);
+    out += s;
+}
+
+/*
+ * Opens a connection to the least loaded node and logs in as the tenant's user. Returns false if that fails.
+ */
+static bool openPooled(cql_tenant_t *t, const std::string &startup, cql_pooled_t *c) {
+    c->node = UpstreamConnect(&c->fd);
+    if (c->node == NULL) {
+        return false;
+    }
+
+    std::string credentials;
+    uint16_t pairs = htons(2);
+    credentials.append((const char *)&pairs, 2);
+    putString(credentials, "username");
+    putString(credentials, std::string(t->token) + POOL_USER_SUFFIX);
+    putString(credentials, "password");
+    putString(credentials, gateway_config.session_pool_password);
+
+    setTimeout(c->fd, gateway_config.upstream_timeout_ms);
+    bool ok = UpstreamSendRequest(c->fd, CQL_OPCODE_STARTUP, startup.data(), startup.size()) && expect(c->fd, CQL_OPCODE_AUTHENTICATE) &&
+              UpstreamSendRequest(c->fd, CQL_OPCODE_CREDENTIALS, credentials.data(), credentials.size()) && expect(c->fd, CQL_OPCODE_READY);
+    setTimeout(c->fd, 0);
+
+    if (!ok) {
+        LOG(LOG_WARN, "Could not log in to Cassandra node %s as tenant %s's user for its connection pool.\n", c->node->name, t->token);
+        close(c->fd);
+        UpstreamRelease(c->node);
+    }
+    return ok;
+}
+
+/*
+ * Whether a pooled connection can still be given to a session: Cassandra hasn't closed it or sent anything on it, and its node is
+ * still given new connections.
+ */
+static bool usable(const cql_pooled_t &c) {
+    struct pollfd p = {c.fd, POLLIN, 0};
+    return poll(&p, 1, 0) == 0 && __atomic_load_n(&c.node->up, __ATOMIC_RELAXED) && BreakerAllows(c.node);
+}
+
+static void discard(const std::vector<cql_pooled_t> &closing) {
+    for (size_t i = 0; i < closing.size(); i++) {
+        close(closing[i].fd);
+        UpstreamRelease(closing[i].node);
+    }
+}
+
+/*
+ * Keeps the pools of the tenants in use full, and closes the others.
+ */
+static void* HandlePool(void *arg) {
+    (void)arg;
+
+    while (1) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += POOL_REFILL_MS / 1000;
+        deadline.tv_nsec += (POOL_REFILL_MS % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        std::vector<cql_pooled_t> closing;
+        std::vector<cql_tenant_t *> wanting;
+        std::vector<std::string> startups;
+
+        pthread_mutex_lock(&pool_mutex);
+        pthread_cond_timedwait(&pool_cond, &pool_mutex, &deadline);
+        uint64_t now = StatsNowUs();
+        std::map<cql_tenant_t *, cql_pool_t>::iterator it;
+        for (it = pools.begin(); it != pools.end(); it++) {
+            cql_pool_t &pool = it->second;
+            bool in_use = now - pool.used_us < (uint64_t)POOL_IDLE_S * 1000000;
+            std::deque<cql_pooled_t> kept;
+            for (size_t i = 0; i < pool.idle.size(); i++) {
+                if (in_use && usable(pool.idle[i])) {
+                    kept.push_back(pool.idle[i]);
+                }
+                else {
+                    closing.push_back(pool.idle[i]);
+                }
+            }
+            pool.idle.swap(kept);
+
+            if (in_use && !pool.startup.empty() && pool.idle.size() < it->first->config.session_pool_size) {
+                wanting.push_back(it->first);
+                startups.push_back(pool.startup);
+            }
+        }
+        pthread_mutex_unlock(&pool_mutex);
+
+        discard(closing);
+
+        // Connections are opened without the lock, one at a time. A tenant whose connection fails is tried again next round.
+        for (size_t i = 0; i < wanting.size(); i++) {
+            cql_tenant_t *t = wanting[i];
+            while (1) {
+                pthread_mutex_lock(&pool_mutex);
+                bool more = pools[t].idle.size() < t->config.session_pool_size;
+                pthread_mutex_unlock(&pool_mutex);
+
+                cql_pooled_t c;
+                if (!more || !openPooled(t, startups[i], &c)) {
+                    break;
+                }
+
+                pthread_mutex_lock(&pool_mutex);
+                pools[t].idle.push_back(c);
+                pthread_mutex_unlock(&pool_mutex);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+void StartPool() {
+    if (!PoolEnabled()) {
+        return;
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, HandlePool, NULL) != 0) {
+        fprintf(stderr, "pthread_create failed for connection pool thread.\n");
+        exit(1);
+    }
+    pthread_detach(thread);
+}
+
+/*
+ * Whether a client's CREDENTIALS, with the internal token already in the username, are those pooled connections log in with.
+ */
+static bool tenantUser(cql_tenant_t *t, cql_packet_t *credentials) {
+    std::string user = std::string(t->token) + POOL_USER_SUFFIX;
+    bool user_matches = false;
+    bool password_matches = false;
+
+    cql_string_map_t *head = ReadStringMap((char *)credentials + sizeof(cql_packet_t));
+    for (cql_string_map_t *sm = head; sm != NULL; sm = sm->next) {
+        if (strcmp(sm->key, "username") == 0) {
+            user_matches = user == sm->value;
+        }
+        else if (strcmp(sm->key, "password") == 0) {
+            password_matches = gateway_config.session_pool_password == sm->value;
+        }
+    }
+    FreeStringMap(head);
+
+    return user_matches && password_matches;
+}
+
+/*
+ * Takes a connection from a tenant's pool for a session that sent the given STARTUP and (validated) CREDENTIALS. Returns its
+ * node, with the socket in *fd, or NULL if the session can't be given one and must be connected with PoolConnect() instead.
+ * Either way, the tenant's pool is kept open and filled for the sessions to come. UpstreamRelease() must be called once the
+ * socket is closed.
+ */
+cql_node_t* PoolTake(cql_tenant_t *t, cql_packet_t *startup, cql_packet_t *credentials, int *fd) {
+    if (t == NULL || t->config.session_pool_size == 0 || !tenantUser(t, credentials)) {
+        return NULL;
+    }
+
+    std::string body((char *)startup + sizeof(cql_packet_t), ntohl(startup->length));
+    cql_pooled_t taken = {-1, NULL};
+    std::vector<cql_pooled_t> closing;
+
+    pthread_mutex_lock(&pool_mutex);
+    cql_pool_t &pool = pools[t];
+    if (pool.startup.empty()) {
+        pool.startup = body;
+    }
+    pool.used_us = StatsNowUs();
+    if (pool.startup == body) {
+        while (!pool.idle.empty() && taken.node == NULL) {
+            cql_pooled_t c = pool.idle.front();
+            pool.idle.pop_front();
+            if (usable(c)) {
+                taken = c;
+            }
+            else {
+                closing.push_back(c);
+            }
+        }
+        if (taken.node != NULL) {
+            pool.hits++;
+        }
+        else {
+            pool.misses++;
+        }
+    }
+    pthread_cond_signal(&pool_cond);
+    pthread_mutex_unlock(&pool_mutex);
+
+    discard(closing);
+
+    *fd = taken.fd;
+    return taken.node;
+}
+
+/*
+ * Opens a connection of its own to the least loaded node for a session whose STARTUP the gateway answered, and repeats the STARTUP
+ * on it, waiting up to upstream_timeout_ms for Cassandra to ask for credentials. With no STARTUP, the connection is only opened.
+ * Returns the node, with the socket in *fd, or NULL on error. UpstreamRelease() must be called once the socket is closed.
+ */
+cql_node_t* PoolConnect(cql_packet_t *startup, int *fd) {
+    cql_node_t *n = UpstreamConnect(fd);
+    if (n == NULL || startup == NULL) {
+        return n;
+    }
+
+    setTimeout(*fd, gateway_config.upstream_timeout_ms);
+    bool ok = UpstreamSendRequest(*fd, CQL_OPCODE_STARTUP, (char *)startup + sizeof(cql_packet_t), ntohl(startup->length)) &&
+              expect(*fd, CQL_OPCODE_AUTHENTICATE);
+    setTimeout(*fd, 0);
+
+    if (!ok) {
+        LOG(LOG_INFO, "Cassandra node %s did not ask for credentials after STARTUP.\n", n->name);
+        close(*fd);
+        UpstreamRelease(n);
+        return NULL;
+    }
+    return n;
+}
+
+/*
+ * Returns the pools' sizes and use in the Prometheus text format, for the stats endpoint.
+ */
+std::string PoolRender() {
+    if (!PoolEnabled()) {
+        return "";
+    }
+
+    std::vector<std::string> tokens;
+    std::vector<size_t> idle;
+    std::vector<uint64_t> hits;
+    std::vector<uint64_t> misses;
+    pthread_mutex_lock(&pool_mutex);
+    std::map<cql_tenant_t *, cql_pool_t>::iterator it;
+    for (it = pools.begin(); it != pools.end(); it++) {
+        tokens.push_back(it->first->token);
+        idle.push_back(it->second.idle.size());
+        hits.push_back(it->second.hits);
+        misses.push_back(it->second.misses);
+    }
+    pthread_mutex_unlock(&pool_mutex);
+
+    std::string out = "# HELP cql_gateway_session_pool_idle Connections in the tenant's pool, logged in and ready for a client.\n"
+                      "# TYPE cql_gateway_session_pool_idle gauge\n";
+    char line[128];
+    for (size_t i = 0; i < tokens.size(); i++) {
+        snprintf(line, sizeof(line), "cql_gateway_session_pool_idle{tenant=\"%s\"} %lu\n", tokens[i].c_str(), (unsigned long)idle[i]);
+        out += line;
+    }
+    out += "# HELP cql_gateway_session_pool_hits_total Clients given a connection from the tenant's pool.\n"
+           "# TYPE cql_gateway_session_pool_hits_total counter\n";
+    for (size_t i = 0; i < tokens.size(); i++) {
+        snprintf(line, sizeof(line), "cql_gateway_session_pool_hits_total{tenant=\"%s\"} %lu\n", tokens[i].c_str(), (unsigned long)hits[i]);
+        out += line;
+    }
+    out += "# HELP cql_gateway_session_pool_misses_total Clients that found the tenant's pool empty and were connected themselves.\n"
+           "# TYPE cql_gateway_session_pool_misses_total counter\n";
+    for (size_t i = 0; i < tokens.size(); i++) {
+        snprintf(line, sizeof(line), "cql_gateway_session_pool_misses_total{tenant=\"%s\"} %lu\n", tokens[i].c_str(), (unsigned long)misses[i]);
+        out += line;
+    }
+
+    return out;
+}
@@ -0,0 +1,25 @@
+#ifndef _POOL_H
+#define _POOL_H
+
+#include <stdint.h>
+
+#include <string>
+
+#include "gateway.hpp"
+#include "tenant.hpp"
+#include "upstream.hpp"
+
+// A tenant's own Cassandra user is "<internal token>cassandra" (see generate-user-token.py), which pooled connections log in as
+#define POOL_USER_SUFFIX "cassandra"
+
+// How often the pools are topped up, and how long a tenant's pool is kept open after a session last asked it for a connection
+#define POOL_REFILL_MS 200
+#define POOL_IDLE_S    300
+
+bool PoolEnabled();
+void StartPool();
+cql_node_t* PoolTake(cql_tenant_t *t, cql_packet_t *startup, cql_packet_t *credentials, int *fd);
+cql_node_t* PoolConnect(cql_packet_t *startup, int *fd);
+std::string PoolRender();
+
+#endif
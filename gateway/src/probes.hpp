@@ -0,0 +1,53 @@
+#ifndef _PROBES_H
+#define _PROBES_H
+
+/*
+ * USDT probes for perf, bpftrace and SystemTap, under the provider cql_gateway. A probe that nothing is attached to is a single
+ * NOP, and its arguments are values already at hand, so the probes stay in production builds. For example:
+ *
+ *   bpftrace -e 'usdt:./gateway:cql_gateway:query_rewritten { @growth = hist(arg4 - arg3); }'
+ *
+ * Every probe's first argument is the connection's id, the client thread's id as a uint32_t, which is also what the connection
+ * prefixes its log messages with. Frame probes then carry a stream id and the opcode. Requests go to Cassandra on stream ids of the
+ * gateway's own (see timeout.cpp), so stream_mapped gives the upstream stream id that frame_forwarded carries.
+ *
+ *   conn_open(id, clientfd)                                 the client thread has started
+ *   conn_close(id, clientfd)                                the client has gone, and the connection is being torn down
+ *   frame_received(id, stream, opcode, length)              a whole request was read from the client
+ *   auth_checked(id, stream, opcode, valid)                 the token in CREDENTIALS was checked
+ *   query_rewritten(id, stream, opcode, before, after)      a QUERY or PREPARE was rewritten; lengths of the query before and after
+ *   interesting_set(id, stream, opcode)                     the request's results will be filtered for the tenant
+ *   interesting_cleared(id, stream, opcode)                 the ROWS answering such a request arrived
+ *   stream_mapped(id, stream, opcode, upstream)             the request will be sent to Cassandra on stream id upstream
+ *   frame_forwarded(id, upstream, opcode, length)           the request was sent to Cassandra
+ *   frame_returned(id, stream, opcode, length)              the response was sent to the client
+ *
+ * Probes need sys/sdt.h (systemtap-sdt-dev or systemtap-sdt-devel) and are left out without it, or when built with
+ * -DUSDT_PROBES=0.
+ */
+
+#ifndef USDT_PROBES
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define USDT_PROBES 1
+#endif
+#endif
+#endif
+#ifndef USDT_PROBES
+#define USDT_PROBES 0
+#endif
+
+#if USDT_PROBES
+#include <sys/sdt.h>
+#define PROBE2(name, a, b)          DTRACE_PROBE2(cql_gateway, name, a, b)
+#define PROBE3(name, a, b, c)       DTRACE_PROBE3(cql_gateway, name, a, b, c)
+#define PROBE4(name, a, b, c, d)    DTRACE_PROBE4(cql_gateway, name, a, b, c, d)
+#define PROBE5(name, a, b, c, d, e) DTRACE_PROBE5(cql_gateway, name, a, b, c, d, e)
+#else
+#define PROBE2(name, a, b)          do { } while (0)
+#define PROBE3(name, a, b, c)       do { } while (0)
+#define PROBE4(name, a, b, c, d)    do { } while (0)
+#define PROBE5(name, a, b, c, d, e) do { } while (0)
+#endif
+
+#endif
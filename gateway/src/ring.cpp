@@ -0,0 +1,1067 @@
+/*
+ * ring.cpp - Sending EXECUTEs to the node that owns their partition
+ * CSC 652 - 2014
+ *
+ * Every ring_refresh_s seconds, each configured node is asked for its tokens (system.local), and one of them for the partition
+ * key columns of every table (system.schema_columns). When a statement is prepared, its bound variables are remembered by
+ * prepared id. An EXECUTE that binds the whole partition key then has its Murmur3 token computed as Cassandra does, and the node
+ * owning the first ring token at or after it is the partition's primary replica.
+ *
+ * If that isn't the session's own node, the EXECUTE goes on a route: a connection of the session's own to the owner, opened on
+ * first use by replaying the client's STARTUP and CREDENTIALS, so Cassandra sees the same user. The route's reader thread opens it
+ * while EXECUTEs keep going to the session's own node. A statement has to be prepared on
+ * a route before it can be executed there, so the first EXECUTEs of a statement go to the session's own node while the gateway
+ * prepares it on the route (after a USE of the keyspace it was prepared in) on a stream id of its own.
+ *
+ * Routes are also where reads are hedged (see hedge.cpp) and where reads for a node whose circuit breaker is open go instead
+ * (see breaker.cpp), so sessions have them when any tenant hedges or breakers are on, even without ring_refresh_s.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include "breaker.hpp"
+#include "config.hpp"
+#include "hedge.hpp"
+#include "helpers.hpp"
+#include "log.hpp"
+#include "ring.hpp"
+#include "timeout.hpp"
+
+// What the gateway knows of a prepared statement
+typedef struct {
+  std::string keyspace;           // in use when it was prepared, with the internal token; empty for none
+  std::string query;              // as sent to Cassandra
+  std::string table;              // "<keyspace>.<table>" its bound variables belong to
+  std::vector<std::string> bound; // names of its bound variables, in order
+  std::vector<int> key;           // bound variables making up the partition key, in order; empty if it isn't bound in full
+  uint32_t generation;            // of the schema key was worked out from, 0 if it wasn't yet
+  bool read;                      // whether it is a SELECT
+  bool used;                      // looked up since it was last passed over for eviction, see evictStatement()
+} cql_statement_t;
+
+typedef std::vector<std::pair<int64_t, cql_node_t *> > cql_ring_t;
+
+static pthread_rwlock_t ring_lock = PTHREAD_RWLOCK_INITIALIZER; // protects the ring and the schema
+static cql_ring_t ring;                                            // every node's tokens, sorted
+static std::map<std::string, std::vector<std::string> > partition_keys; // partition key columns, by "<keyspace>.<table>"
+static uint32_t generation = 0;                                    // bumped whenever partition_keys is replaced
+
+static pthread_mutex_t statements_mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::map<std::string, cql_statement_t> statements; // by prepared id
+static std::deque<std::string> statement_order;           // the ids in statements, in the order they are looked at for eviction
+
+// How EXECUTEs were sent, for the stats endpoint
+#define ROUTED_REPLICA     0 // on a route, to the node owning the partition
+#define ROUTED_LOCAL       1 // to the session's own node, which owns the partition
+#define ROUTED_COORDINATOR 2 // to the session's own node, which doesn't, or whose owner isn't known
+static uint64_t routed[3];
+
+bool RingEnabled() {
+    return gateway_config.ring_refresh_s > 0;
+}
+
+/*
+ * Reads a [short] of the protocol, which needn't be aligned.
+ */
+static inline uint16_t readShort(const char *p) {
+    uint16_t v;
+    memcpy(&v, p, 2);
+    return ntohs(v);
+}
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t fmix64(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+/*
+ * Murmur3 token of a partition key, as Cassandra's Murmur3Partitioner computes it: the first half of MurmurHash3_x64_128 with a
+ * seed of 0. Cassandra's port sign-extends the bytes of the tail, which changes the hash of some keys, so that is done here too.
+ */
+static int64_t ringToken(const uint8_t *key, size_t len) {
+    const uint64_t c1 = 0x87c37b91114253d5ULL;
+    const uint64_t c2 = 0x4cf5ad432745937fULL;
+    uint64_t h1 = 0;
+    uint64_t h2 = 0;
+
+    size_t nblocks = len / 16;
+    for (size_t i = 0; i < nblocks; i++) {
+        uint64_t k1 = 0;
+        uint64_t k2 = 0;
+        for (int b = 7; b >= 0; b--) { // Little endian, whatever the machine
+            k1 = (k1 << 8) | key[i * 16 + b];
+            k2 = (k2 << 8) | key[i * 16 + 8 + b];
+        }
+
+        k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+        h1 = rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+        k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+        h2 = rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+    }
+
+    const uint8_t *tail = key + nblocks * 16;
+    size_t rest = len & 15;
+    uint64_t k1 = 0;
+    uint64_t k2 = 0;
+    for (size_t i = rest; i > 8; i--) {
+        k2 ^= (uint64_t)(int64_t)(int8_t)tail[i - 1] << ((i - 9) * 8);
+    }
+    if (rest > 8) {
+        k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+    }
+    for (size_t i = std::min(rest, (size_t)8); i > 0; i--) {
+        k1 ^= (uint64_t)(int64_t)(int8_t)tail[i - 1] << ((i - 1) * 8);
+    }
+    if (rest > 0) {
+        k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+    }
+
+    h1 ^= len;
+    h2 ^= len;
+    h1 += h2;
+    h2 += h1;
+    h1 = fmix64(h1);
+    h2 = fmix64(h2);
+    h1 += h2;
+
+    int64_t token = (int64_t)h1;
+    return (token == INT64_MIN) ? INT64_MAX : token; // The minimum token is reserved
+}
+
+/*
+ * Sends a QUERY at consistency ONE on a connection of the gateway's own, and reads its rows. Returns the response, or NULL if
+ * it isn't rows; *metadata and *index are then set, and are freed by the caller along with the response.
+ */
+static cql_packet_t* queryRows(int sock, const char *query, cql_result_metadata_t **metadata, cql_result_index_t **index, char **rows) {
+    uint32_t query_len = strlen(query);
+    std::string body(4 + query_len + 2, '\0');
+    uint32_t n = htonl(query_len);
+    memcpy(&body[0], &n, 4);
+    memcpy(&body[4], query, query_len);
+    uint16_t consistency = htons(0x0001); // ONE
+    memcpy(&body[4 + query_len], &consistency, 2);
+
+    if (!UpstreamSendRequest(sock, CQL_OPCODE_QUERY, body.data(), body.size())) {
+        return NULL;
+    }
+    cql_packet_t *p = UpstreamRecvPacket(sock);
+    if (p == NULL) {
+        return NULL;
+    }
+
+    char *b = (char *)p + sizeof(cql_packet_t);
+    int32_t kind = 0;
+    if (p->opcode == CQL_OPCODE_RESULT && ntohl(p->length) >= 12) {
+        memcpy(&kind, b, 4);
+        kind = ntohl(kind);
+    }
+    if (kind != CQL_RESULT_ROWS) {
+        free(p);
+        return NULL;
+    }
+
+    *metadata = ReadResultMetadata(b + 4);
+    uint32_t offset = 4 + (*metadata)->offset;
+    int32_t rows_count = 0;
+    memcpy(&rows_count, b + offset, 4);
+    rows_count = ntohl(rows_count);
+    *rows = b + offset + 4;
+    *index = IndexCQLResults(*rows, rows_count, (*metadata)->columns_count);
+
+    return p;
+}
+
+/*
+ * Adds a node's tokens to the ring. Returns false if it couldn't be asked for them.
+ */
+static bool readTokens(int sock, cql_node_t *n, cql_ring_t &tokens) {
+    cql_result_metadata_t *metadata = NULL;
+    cql_result_index_t *index = NULL;
+    char *rows = NULL;
+    cql_packet_t *p = queryRows(sock, "SELECT tokens FROM system.local", &metadata, &index, &rows);
+    if (p == NULL) {
+        return false;
+    }
+
+    for (int32_t r = 0; r < index->rows; r++) {
+        cql_span_t set = CellSpan(rows, index, r, 0); // set<varchar>: [short n], then n [short length][bytes]
+        if (set.len < 2) {
+            continue;
+        }
+        uint16_t count = readShort(set.data);
+        size_t at = 2;
+        for (uint16_t i = 0; i < count && at + 2 <= set.len; i++) {
+            uint16_t len = readShort(set.data + at);
+            at += 2;
+            if (at + len > set.len || len >= 24) {
+                break;
+            }
+            char text[24];
+            memcpy(text, set.data + at, len);
+            text[len] = '\0';
+            at += len;
+            tokens.push_back(std::make_pair((int64_t)strtoll(text, NULL, 10), n));
+        }
+    }
+
+    FreeResultIndex(index);
+    FreeResultMetadata(metadata);
+    free(p);
+    return true;
+}
+
+/*
+ * Reads the partition key columns of every table. Returns false if they couldn't be.
+ */
+static bool readPartitionKeys(int sock, std::map<std::string, std::vector<std::string> > &keys) {
+    cql_result_metadata_t *metadata = NULL;
+    cql_result_index_t *index = NULL;
+    char *rows = NULL;
+    cql_packet_t *p = queryRows(sock, "SELECT keyspace_name, columnfamily_name, column_name, component_index, type FROM system.schema_columns",
+                                &metadata, &index, &rows);
+    if (p == NULL) {
+        return false;
+    }
+
+    for (int32_t r = 0; r < index->rows && index->cols == 5; r++) {
+        cql_span_t type = CellSpan(rows, index, r, 4);
+        if (type.len != 13 || memcmp(type.data, "partition_key", 13) != 0) {
+            continue;
+        }
+        cql_span_t ks = CellSpan(rows, index, r, 0);
+        cql_span_t table = CellSpan(rows, index, r, 1);
+        cql_span_t column = CellSpan(rows, index, r, 2);
+        cql_span_t component = CellSpan(rows, index, r, 3); // null when the key has a single column
+        int32_t i = 0;
+        if (component.len == 4) {
+            memcpy(&i, component.data, 4);
+            i = ntohl(i);
+        }
+        if (i < 0 || i >= 64) {
+            continue;
+        }
+
+        std::vector<std::string> &columns = keys[std::string(ks.data, ks.len) + "." + std::string(table.data, table.len)];
+        if ((size_t)i >= columns.size()) {
+            columns.resize(i + 1);
+        }
+        columns[i] = std::string(column.data, column.len);
+    }
+
+    FreeResultIndex(index);
+    FreeResultMetadata(metadata);
+    free(p);
+    return true;
+}
+
+/*
+ * Asks every node for its tokens, and one of them for the partition keys, and replaces what was known. A node that can't be
+ * asked keeps the tokens it had, so its ranges aren't handed to its neighbours in the meantime.
+ */
+static void refreshRing() {
+    uint32_t count = 0;
+    cql_node_t *nodes = UpstreamNodes(&count);
+
+    cql_ring_t tokens;
+    std::map<std::string, std::vector<std::string> > keys;
+    bool have_keys = false;
+    std::vector<cql_node_t *> missing;
+    for (uint32_t i = 0; i < count; i++) {
+        cql_node_t *n = &nodes[i];
+        int sock = -1;
+        bool ok = false;
+        if (UpstreamConnectTo(n, &sock)) {
+            struct timeval timeout;
+            timeout.tv_sec = gateway_config.upstream_timeout_ms / 1000;
+            timeout.tv_usec = (gateway_config.upstream_timeout_ms % 1000) * 1000;
+            setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+            ok = UpstreamStartup(sock) && readTokens(sock, n, tokens);
+            if (ok && !have_keys) {
+                have_keys = readPartitionKeys(sock, keys);
+            }
+            close(sock);
+            UpstreamRelease(n);
+        }
+        if (!ok) {
+            LOG(LOG_INFO, "Could not read the tokens of Cassandra node %s.\n", n->name);
+            missing.push_back(n);
+        }
+    }
+
+    pthread_rwlock_wrlock(&ring_lock);
+    for (size_t i = 0; i < ring.size(); i++) {
+        if (std::find(missing.begin(), missing.end(), ring[i].second) != missing.end()) {
+            tokens.push_back(ring[i]);
+        }
+    }
+    std::sort(tokens.begin(), tokens.end());
+    ring.swap(tokens);
+    if (have_keys) {
+        partition_keys.swap(keys);
+        generation++;
+    }
+    size_t ring_size = ring.size();
+    pthread_rwlock_unlock(&ring_lock);
+
+    LOG(LOG_DEBUG, "Token ring refreshed, %lu tokens over %u nodes.\n", (unsigned long)ring_size, count);
+}
+
+static void* HandleRing(void *arg) {
+    (void)arg;
+
+    while (1) {
+        refreshRing();
+        sleep(gateway_config.ring_refresh_s);
+    }
+
+    return NULL;
+}
+
+/*
+ * Starts learning the ring, if configured.
+ */
+void StartRing() {
+    if (!RingEnabled()) {
+        return;
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, HandleRing, NULL) != 0) {
+        fprintf(stderr, "pthread_create failed for token ring thread.\n");
+        exit(1);
+    }
+    pthread_detach(thread);
+}
+
+void RingSessionOpened(cql_thread_t *session) {
+    session->ring = NULL;
+    if (RingEnabled() || HedgeEnabled() || BreakerEnabled()) {
+        session->ring = (cql_ring_session_t *)calloc(1, sizeof(cql_ring_session_t));
+    }
+}
+
+static cql_packet_t* copyPacket(cql_packet_t *packet) {
+    size_t len = sizeof(cql_packet_t) + ntohl(packet->length);
+    cql_packet_t *copy = (cql_packet_t *)malloc(len);
+    memcpy(copy, packet, len);
+    return copy;
+}
+
+/*
+ * Keeps what routes need from a request as it is forwarded to the session's own node: the handshake, to repeat it on routes, and
+ * the query of a PREPARE, for RingPrepared().
+ */
+void RingRequestSent(cql_thread_t *session, cql_packet_t *packet) {
+    cql_ring_session_t *rs = session->ring;
+    if (rs == NULL) {
+        return;
+    }
+
+    if (packet->opcode == CQL_OPCODE_STARTUP) {
+        free(rs->startup);
+        rs->startup = copyPacket(packet);
+    }
+    else if (packet->opcode == CQL_OPCODE_CREDENTIALS) {
+        free(rs->credentials);
+        rs->credentials = copyPacket(packet);
+    }
+    else if (packet->opcode == CQL_OPCODE_PREPARE && ntohl(packet->length) >= 4) {
+        int32_t len = 0;
+        memcpy(&len, (char *)packet + sizeof(cql_packet_t), 4);
+        len = ntohl(len);
+        if (len < 0 || (uint32_t)len > ntohl(packet->length) - 4) {
+            return;
+        }
+        free(rs->prepare_query[packet->stream]);
+        rs->prepare_query[packet->stream] = strndup((char *)packet + sizeof(cql_packet_t) + 4, len);
+    }
+}
+
+/*
+ * Notes the keyspace a USE set on the session's own connection. Called by the Cassandra thread, while the client thread may be
+ * reading it to check a route.
+ */
+void RingKeyspace(cql_thread_t *session, const char *keyspace) {
+    cql_ring_session_t *rs = session->ring;
+    if (rs == NULL) {
+        return;
+    }
+
+    char *copy = strdup(keyspace);
+    pthread_mutex_lock(&session->mutex);
+    char *old = rs->keyspace;
+    rs->keyspace = copy;
+    pthread_mutex_unlock(&session->mutex);
+    free(old);
+}
+
+/*
+ * Returns the keyspace in use on the session's own connection, empty for none.
+ */
+static std::string sessionKeyspace(cql_thread_t *session) {
+    cql_ring_session_t *rs = session->ring;
+    pthread_mutex_lock(&session->mutex);
+    std::string keyspace = (rs->keyspace != NULL) ? rs->keyspace : "";
+    pthread_mutex_unlock(&session->mutex);
+    return keyspace;
+}
+
+/*
+ * Whether a query is a SELECT.
+ */
+static bool isSelect(const char *q, size_t len) {
+    const char *end = q + len;
+    while (q < end && isspace((unsigned char)*q)) {
+        q++;
+    }
+    return end - q >= 6 && strncasecmp(q, "SELECT", 6) == 0;
+}
+
+/*
+ * Forgets one statement to make room for another: the first in line that wasn't used since it was last passed over, which gets
+ * the statements in use kept without ordering them on every lookup. Called with statements_mutex held.
+ */
+static void evictStatement() {
+    while (!statement_order.empty()) {
+        std::string id = statement_order.front();
+        statement_order.pop_front();
+        std::map<std::string, cql_statement_t>::iterator s = statements.find(id);
+        if (s == statements.end()) {
+            continue;
+        }
+        if (s->second.used) { // A second chance, at the back of the line
+            s->second.used = false;
+            statement_order.push_back(id);
+            continue;
+        }
+        statements.erase(s);
+        return;
+    }
+}
+
+/*
+ * Remembers a statement prepared on the session's own connection, from the PREPARED result that answered the PREPARE sent on the
+ * given upstream stream.
+ */
+void RingPrepared(cql_thread_t *session, int8_t upstream, const char *id, uint16_t id_len, cql_result_metadata_t *metadata) {
+    cql_ring_session_t *rs = session->ring;
+    if (rs == NULL || upstream < 0 || rs->prepare_query[upstream] == NULL) {
+        return;
+    }
+    if (metadata == NULL || metadata->columns_count == 0 || metadata->keyspace == NULL) { // No bound variables to route it by
+        free(rs->prepare_query[upstream]);
+        rs->prepare_query[upstream] = NULL;
+        return;
+    }
+
+    cql_statement_t s;
+    s.keyspace = sessionKeyspace(session);
+    s.query = rs->prepare_query[upstream];
+    s.table = std::string(metadata->keyspace) + "." + metadata->table;
+    for (cql_column_spec_t *c = metadata->column; c != NULL && s.bound.size() < (size_t)metadata->columns_count; c = c->next) {
+        s.bound.push_back(c->name);
+    }
+    s.generation = 0;
+    s.read = isSelect(s.query.data(), s.query.size());
+    s.used = false;
+
+    free(rs->prepare_query[upstream]);
+    rs->prepare_query[upstream] = NULL;
+
+    std::string key(id, id_len);
+    pthread_mutex_lock(&statements_mutex);
+    std::map<std::string, cql_statement_t>::iterator known = statements.find(key);
+    if (known != statements.end()) { // Prepared again, by another session or after a schema change
+        known->second = s;
+    }
+    else {
+        if (statements.size() >= RING_MAX_STATEMENTS) {
+            evictStatement();
+        }
+        statements[key] = s;
+        statement_order.push_back(key);
+    }
+    pthread_mutex_unlock(&statements_mutex);
+}
+
+/*
+ * Returns the bound variables making up a statement's partition key, working them out again if the schema changed since. Called
+ * with statements_mutex held.
+ */
+static const std::vector<int>& partitionKey(cql_statement_t &s) {
+    pthread_rwlock_rdlock(&ring_lock);
+    if (s.generation != generation) {
+        s.generation = generation;
+        s.key.clear();
+        std::map<std::string, std::vector<std::string> >::const_iterator columns = partition_keys.find(s.table);
+        if (columns != partition_keys.end()) {
+            for (size_t i = 0; i < columns->second.size(); i++) {
+                std::vector<std::string>::const_iterator b = std::find(s.bound.begin(), s.bound.end(), columns->second[i]);
+                if (b == s.bound.end()) { // Given in the query rather than bound, or the schema read had a gap
+                    s.key.clear();
+                    break;
+                }
+                s.key.push_back(b - s.bound.begin());
+            }
+        }
+    }
+    pthread_rwlock_unlock(&ring_lock);
+
+    return s.key;
+}
+
+/*
+ * Returns the node owning an EXECUTE's partition, or NULL if it can't be told.
+ */
+static cql_node_t* ownerOf(cql_packet_t *packet) {
+    const char *body = (char *)packet + sizeof(cql_packet_t);
+    uint32_t body_len = ntohl(packet->length);
+    if (body_len < 2) {
+        return NULL;
+    }
+    uint16_t id_len = readShort(body);
+    if (2 + (uint32_t)id_len + 2 > body_len) {
+        return NULL;
+    }
+
+    std::vector<int> key;
+    pthread_mutex_lock(&statements_mutex);
+    std::map<std::string, cql_statement_t>::iterator s = statements.find(std::string(body + 2, id_len));
+    if (s != statements.end()) {
+        s->second.used = true;
+        key = partitionKey(s->second);
+    }
+    pthread_mutex_unlock(&statements_mutex);
+    if (key.empty()) {
+        return NULL;
+    }
+
+    // The values: [short n], then n [int length][bytes]
+    uint32_t at = 2 + id_len;
+    uint16_t count = readShort(body + at);
+    at += 2;
+    std::vector<cql_span_t> values;
+    for (uint16_t i = 0; i < count; i++) {
+        if (at + 4 > body_len) {
+            return NULL;
+        }
+        int32_t len;
+        memcpy(&len, body + at, 4);
+        len = ntohl(len);
+        at += 4;
+        if (len < 0 || at + len > body_len) { // A null key has no token
+            return NULL;
+        }
+        values.push_back(MakeSpan(body + at, len));
+        at += len;
+    }
+
+    // A key of several columns is hashed as each one's [short length][bytes][0]
+    std::string composite;
+    cql_span_t k;
+    if (key.size() == 1) {
+        if ((size_t)key[0] >= values.size()) {
+            return NULL;
+        }
+        k = values[key[0]];
+    }
+    else {
+        for (size_t i = 0; i < key.size(); i++) {
+            if ((size_t)key[i] >= values.size() || values[key[i]].len > 0xFFFF) {
+                return NULL;
+            }
+            uint16_t len = htons(values[key[i]].len);
+            composite.append((const char *)&len, 2);
+            composite.append(values[key[i]].data, values[key[i]].len);
+            composite += '\0';
+        }
+        k = MakeSpan(composite.data(), composite.size());
+    }
+    int64_t token = ringToken((const uint8_t *)k.data, k.len);
+
+    cql_node_t *owner = NULL;
+    pthread_rwlock_rdlock(&ring_lock);
+    if (!ring.empty()) {
+        cql_ring_t::const_iterator t = std::lower_bound(ring.begin(), ring.end(), std::make_pair(token, (cql_node_t *)NULL));
+        owner = (t != ring.end()) ? t->second : ring.front().second; // Past the last token, the ring wraps around
+    }
+    pthread_rwlock_unlock(&ring_lock);
+
+    return owner;
+}
+
+/*
+ * Sends a request of the gateway's own on a route. Called with the route's mutex held.
+ */
+static bool sendInternal(cql_route_t *route, uint8_t opcode, const std::string &body) {
+    std::string p(sizeof(cql_packet_t), '\0');
+    cql_packet_t *header = (cql_packet_t *)&p[0];
+    header->version = CQL_V1_REQUEST;
+    header->flags = CQL_FLAG_NONE;
+    header->stream = route->internal_stream;
+    header->opcode = opcode;
+    header->length = htonl(body.size());
+    p += body;
+
+    return send(route->fd, p.data(), p.size(), 0) == (ssize_t)p.size();
+}
+
+/*
+ * Starts preparing the next statement waiting for it on a route, if nothing else is in progress. Called with the route's mutex
+ * held.
+ */
+static void prepareNext(cql_route_t *route) {
+    while (route->busy == ROUTE_IDLE && !route->to_prepare.empty()) {
+        const std::string &id = route->to_prepare.front();
+
+        bool known = false;
+        std::string keyspace;
+        std::string query;
+        pthread_mutex_lock(&statements_mutex);
+        std::map<std::string, cql_statement_t>::const_iterator s = statements.find(id);
+        if (s != statements.end()) {
+            known = true;
+            keyspace = s->second.keyspace;
+            query = s->second.query;
+        }
+        pthread_mutex_unlock(&statements_mutex);
+
+        // Prepared ids depend on the connection's keyspace, so the statement's has to be in use first
+        bool sent = false;
+        if (known && keyspace != route->keyspace && !keyspace.empty()) {
+            std::string use = "USE \"" + keyspace + "\"";
+            uint32_t len = htonl(use.size());
+            uint16_t consistency = htons(0x0001);
+            sent = sendInternal(route, CQL_OPCODE_QUERY, std::string((const char *)&len, 4) + use + std::string((const char *)&consistency, 2));
+            route->busy = ROUTE_USE;
+            route->using_keyspace = keyspace;
+        }
+        else if (known && keyspace == route->keyspace) {
+            uint32_t len = htonl(query.size());
+            sent = sendInternal(route, CQL_OPCODE_PREPARE, std::string((const char *)&len, 4) + query);
+            route->busy = ROUTE_PREPARE;
+        }
+
+        if (!sent) { // Forgotten, or can't be prepared here; the reader notices if the connection was lost
+            route->busy = ROUTE_IDLE;
+            route->failed.insert(id);
+            route->to_prepare.pop_front();
+        }
+    }
+}
+
+/*
+ * Handles the answer to a request of the gateway's own on a route, read by its reader thread.
+ */
+void RouteInternal(cql_route_t *route, cql_packet_t *packet) {
+    const char *body = (char *)packet + sizeof(cql_packet_t);
+    uint32_t body_len = ntohl(packet->length);
+    int32_t kind = 0;
+    if (packet->opcode == CQL_OPCODE_RESULT && body_len >= 4) {
+        memcpy(&kind, body, 4);
+        kind = ntohl(kind);
+    }
+
+    pthread_mutex_lock(&route->mutex);
+    pthread_cleanup_push(mutex_unlock_cleanup_handler, &route->mutex); // The reader may be cancelled inside send()
+    if (route->busy != ROUTE_IDLE && !route->to_prepare.empty()) {
+        const std::string id = route->to_prepare.front();
+        bool next = true; // Done with this statement, one way or the other
+        if (route->busy == ROUTE_USE && kind == CQL_RESULT_SET_KEYSPACE) {
+            route->keyspace = route->using_keyspace;
+            next = false; // Now it can be prepared
+        }
+        else if (route->busy == ROUTE_PREPARE && kind == CQL_RESULT_PREPARED && body_len >= 6) {
+            uint16_t id_len = readShort(body + 4);
+            if (6 + (uint32_t)id_len <= body_len && id.compare(0, std::string::npos, body + 6, id_len) == 0) {
+                route->prepared.insert(id);
+            }
+            else {
+                route->failed.insert(id); // Prepared under another id, so EXECUTEs of this one would fail here
+            }
+        }
+        else {
+            route->failed.insert(id);
+        }
+
+        if (next) {
+            route->to_prepare.pop_front();
+        }
+        route->busy = ROUTE_IDLE;
+        prepareNext(route);
+    }
+    pthread_cleanup_pop(1);
+}
+
+/*
+ * Repeats a request of the client's handshake on a new route. Returns the answer, or NULL.
+ */
+static cql_packet_t* replay(int sock, cql_packet_t *request) {
+    if (!UpstreamSendRequest(sock, request->opcode, (char *)request + sizeof(cql_packet_t), ntohl(request->length))) {
+        return NULL;
+    }
+    return UpstreamRecvPacket(sock);
+}
+
+/*
+ * Adds a route from a session to a node, and starts its reader thread, which opens the connection (see RouteOpen()) so the client
+ * thread doesn't wait for it. Nothing is routed to the node until then. A route that fails is kept, so the node isn't tried
+ * again for this session.
+ */
+static cql_route_t* openRoute(cql_thread_t *session, cql_node_t *n) {
+    cql_ring_session_t *rs = session->ring;
+
+    cql_route_t *route = new cql_route_t();
+    route->session = session;
+    route->node = n;
+    route->started = false;
+    route->startup = NULL;
+    route->credentials = NULL;
+    pthread_mutex_init(&route->mutex, NULL);
+    route->fd = -1;
+    route->opening = false;
+    route->internal_stream = -1;
+    route->busy = ROUTE_IDLE;
+    route->next = rs->routes;
+    rs->routes = route;
+
+    if (rs->startup == NULL) {
+        return route;
+    }
+    route->startup = copyPacket(rs->startup);
+    route->credentials = (rs->credentials != NULL) ? copyPacket(rs->credentials) : NULL;
+    route->opening = true;
+
+    if (pthread_create(&route->reader, NULL, HandleConnRoute, (void *)route) != 0) {
+        fprintf(stderr, "pthread_create failed for route thread.\n");
+        exit(1);
+    }
+    route->started = true;
+
+    return route;
+}
+
+/*
+ * Connects a route to its node and replays the client's handshake on it, waiting up to upstream_timeout_ms per round trip. Run
+ * by the route's reader before it starts reading; it can't be cancelled meanwhile, so a closing session waits for this to end.
+ * Returns false if the route could not be opened.
+ */
+bool RouteOpen(cql_route_t *route) {
+    cql_thread_t *session = route->session;
+    cql_node_t *n = route->node;
+    int cancel_state;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancel_state);
+
+    int sock = -1;
+    bool connected = UpstreamConnectTo(n, &sock);
+    bool ready = false;
+    struct timeval timeout;
+    if (connected) {
+        timeout.tv_sec = gateway_config.upstream_timeout_ms / 1000;
+        timeout.tv_usec = (gateway_config.upstream_timeout_ms % 1000) * 1000;
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        cql_packet_t *p = replay(sock, route->startup);
+        if (p != NULL && p->opcode == CQL_OPCODE_AUTHENTICATE && route->credentials != NULL) {
+            free(p);
+            p = replay(sock, route->credentials);
+        }
+        ready = p != NULL && p->opcode == CQL_OPCODE_READY;
+        free(p);
+    }
+    free(route->startup);
+    route->startup = NULL;
+    free(route->credentials);
+    route->credentials = NULL;
+
+    int8_t internal_stream = ready ? TimeoutMapStream(session, STREAM_INTERNAL) : -1;
+    if (connected && internal_stream < 0) {
+        SESSION_LOG(session, LOG_INFO, "%u: Could not open a connection to Cassandra node %s for routing.\n", session->id, n->name);
+        close(sock);
+        UpstreamRelease(n);
+    }
+    if (internal_stream < 0) {
+        pthread_mutex_lock(&route->mutex);
+        route->opening = false;
+        pthread_mutex_unlock(&route->mutex);
+        pthread_setcancelstate(cancel_state, NULL);
+        return false;
+    }
+
+    timeout.tv_sec = 0;
+    timeout.tv_usec = 0;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    pthread_mutex_lock(&route->mutex);
+    route->internal_stream = internal_stream;
+    route->fd = sock;
+    route->opening = false;
+    prepareNext(route); // The statements EXECUTEd meanwhile
+    pthread_mutex_unlock(&route->mutex);
+    SESSION_LOG(session, LOG_DEBUG, "%u: Opened a connection to Cassandra node %s for routing.\n", session->id, n->name);
+
+    pthread_setcancelstate(cancel_state, NULL);
+    return true;
+}
+
+/*
+ * Returns whether a QUERY or EXECUTE can be sent on a route as it is. An EXECUTE's statement must have been prepared there, and is
+ * queued to be if it wasn't tried yet. A QUERY must find the keyspace of the session's own connection in use.
+ */
+static bool routeReady(cql_route_t *route, cql_packet_t *packet) {
+    const char *body = (char *)packet + sizeof(cql_packet_t);
+    uint32_t body_len = ntohl(packet->length);
+    bool ready = false;
+    std::string keyspace;
+    if (packet->opcode == CQL_OPCODE_QUERY) { // Copied first, so that the session's mutex is never taken under the route's
+        keyspace = sessionKeyspace(route->session);
+    }
+    pthread_mutex_lock(&route->mutex);
+    bool open = route->fd >= 0;
+    if (!open && !route->opening) { // It couldn't be opened
+        ready = false;
+    }
+    else if (packet->opcode == CQL_OPCODE_EXECUTE && body_len >= 2 && 2 + (uint32_t)readShort(body) <= body_len) {
+        std::string id(body + 2, readShort(body));
+        ready = open && route->prepared.count(id) > 0;
+        if (!ready && route->failed.count(id) == 0 && std::find(route->to_prepare.begin(), route->to_prepare.end(), id) == route->to_prepare.end()) {
+            route->to_prepare.push_back(id);
+            if (open) { // Otherwise RouteOpen() starts on it
+                prepareNext(route);
+            }
+        }
+    }
+    else if (packet->opcode == CQL_OPCODE_QUERY) {
+        ready = open && route->keyspace == keyspace;
+    }
+    pthread_mutex_unlock(&route->mutex);
+
+    return ready;
+}
+
+/*
+ * Returns the route an EXECUTE is to be sent on, or NULL to send it to the session's own node as usual.
+ */
+cql_route_t* RingRoute(cql_thread_t *session, cql_packet_t *packet) {
+    cql_ring_session_t *rs = session->ring;
+    if (rs == NULL || !RingEnabled() || packet->opcode != CQL_OPCODE_EXECUTE) {
+        return NULL;
+    }
+
+    cql_node_t *owner = ownerOf(packet);
+    if (owner == session->cassandra_node) {
+        __atomic_add_fetch(&routed[ROUTED_LOCAL], 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    if (owner == NULL) {
+        __atomic_add_fetch(&routed[ROUTED_COORDINATOR], 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    cql_route_t *route = rs->routes;
+    while (route != NULL && route->node != owner) {
+        route = route->next;
+    }
+    if (route == NULL) {
+        route = openRoute(session, owner);
+    }
+
+    bool ready = routeReady(route, packet);
+    __atomic_add_fetch(&routed[ready ? ROUTED_REPLICA : ROUTED_COORDINATOR], 1, __ATOMIC_RELAXED);
+    return ready ? route : NULL;
+}
+
+/*
+ * Returns a route a read sent to exclude could be hedged on: one to another node than exclude and the session's own, that is up
+ * (with its circuit breaker letting it be used) and ready for the read (the least busy, if there are several). Otherwise opens a route to such a node that has none, and
+ * returns NULL unless it is ready straight away; statements get prepared on routes as reads come, for later ones.
+ */
+cql_route_t* RingSpareRoute(cql_thread_t *session, cql_packet_t *packet, cql_node_t *exclude) {
+    cql_ring_session_t *rs = session->ring;
+    if (rs == NULL) {
+        return NULL;
+    }
+
+    cql_route_t *spare = NULL;
+    for (cql_route_t *route = rs->routes; route != NULL; route = route->next) {
+        cql_node_t *n = route->node;
+        if (n == exclude || n == session->cassandra_node || !n->up || !BreakerAllows(n) || !routeReady(route, packet)) {
+            continue;
+        }
+        if (spare == NULL || n->outstanding < spare->node->outstanding) {
+            spare = route;
+        }
+    }
+    if (spare != NULL) {
+        return spare;
+    }
+
+    uint32_t count;
+    cql_node_t *nodes = UpstreamNodes(&count);
+    cql_node_t *best = NULL;
+    for (uint32_t i = 0; i < count; i++) {
+        cql_node_t *n = &nodes[i];
+        if (n == exclude || n == session->cassandra_node || !n->up || !BreakerAllows(n)) {
+            continue;
+        }
+        cql_route_t *route = rs->routes;
+        while (route != NULL && route->node != n) {
+            route = route->next;
+        }
+        if (route == NULL && (best == NULL || n->outstanding < best->outstanding)) {
+            best = n;
+        }
+    }
+    if (best != NULL) {
+        cql_route_t *route = openRoute(session, best);
+        if (routeReady(route, packet)) {
+            return route;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Returns whether a QUERY or EXECUTE only reads, so that sending it twice is harmless: a SELECT, or the EXECUTE of a statement
+ * known to be one.
+ */
+bool RingIsRead(cql_packet_t *packet) {
+    const char *body = (char *)packet + sizeof(cql_packet_t);
+    uint32_t body_len = ntohl(packet->length);
+    if (packet->opcode == CQL_OPCODE_QUERY && body_len >= 6) {
+        return isSelect(body + 4, body_len - 6); // Up to the consistency
+    }
+    if (packet->opcode != CQL_OPCODE_EXECUTE || body_len < 2 || 2 + (uint32_t)readShort(body) > body_len) {
+        return false;
+    }
+
+    bool read = false;
+    pthread_mutex_lock(&statements_mutex);
+    std::map<std::string, cql_statement_t>::iterator s = statements.find(std::string(body + 2, readShort(body)));
+    if (s != statements.end()) {
+        s->second.used = true;
+        read = s->second.read;
+    }
+    pthread_mutex_unlock(&statements_mutex);
+
+    return read;
+}
+
+/*
+ * Sends a client's request on a route. Returns false on error.
+ */
+bool RouteSend(cql_route_t *route, cql_packet_t *packet) {
+    size_t len = sizeof(cql_packet_t) + ntohl(packet->length);
+    bool ok;
+    pthread_mutex_lock(&route->mutex);
+    pthread_cleanup_push(mutex_unlock_cleanup_handler, &route->mutex); // The scheduler's writer may be cancelled inside send()
+    ok = send(route->fd, packet, len, 0) == (ssize_t)len;
+    pthread_cleanup_pop(1);
+    return ok;
+}
+
+/*
+ * Stops the reader threads of a closing session's routes, and shuts the connections down so that a hedge or scheduled request
+ * still being sent on one fails rather than blocking. Must be called before the session's requests are cleaned up, like the
+ * session's own Cassandra thread.
+ */
+void RingStopRoutes(cql_thread_t *session) {
+    if (session->ring == NULL) {
+        return;
+    }
+
+    for (cql_route_t *route = session->ring->routes; route != NULL; route = route->next) {
+        if (route->started) {
+            pthread_cancel(route->reader);
+            pthread_join(route->reader, NULL);
+        }
+        if (route->fd >= 0) {
+            shutdown(route->fd, SHUT_RDWR);
+        }
+    }
+}
+
+/*
+ * Closes a closing session's routes and frees its routing state, once nothing can send on them any more.
+ */
+void RingSessionClosed(cql_thread_t *session) {
+    cql_ring_session_t *rs = session->ring;
+    if (rs == NULL) {
+        return;
+    }
+
+    cql_route_t *route = rs->routes;
+    while (route != NULL) {
+        cql_route_t *next = route->next;
+        if (route->fd >= 0) {
+            close(route->fd);
+            UpstreamRelease(route->node);
+        }
+        pthread_mutex_destroy(&route->mutex);
+        delete route;
+        route = next;
+    }
+
+    free(rs->startup);
+    free(rs->credentials);
+    free(rs->keyspace);
+    for (int i = 0; i < CQL_MAX_STREAMS; i++) {
+        free(rs->prepare_query[i]);
+    }
+    free(rs);
+    session->ring = NULL;
+}
+
+/*
+ * Returns how EXECUTEs were sent in the Prometheus text format, for the stats endpoint.
+ */
+std::string RingRender() {
+    if (!RingEnabled()) {
+        return "";
+    }
+
+    const char *outcomes[3] = {"replica", "local", "coordinator"};
+    std::string out = "# HELP cql_gateway_token_aware_requests_total EXECUTEs sent to the node owning the partition on a connection of "
+                      "their own (replica), to the connection's node which owns it (local), or to the connection's node although it "
+                      "doesn't, or the owner isn't known (coordinator).\n# TYPE cql_gateway_token_aware_requests_total counter\n";
+    char line[128];
+    for (int i = 0; i < 3; i++) {
+        snprintf(line, sizeof(line), "cql_gateway_token_aware_requests_total{outcome=\"%s\"} %lu\n", outcomes[i],
+                 (unsigned long)__atomic_load_n(&routed[i], __ATOMIC_RELAXED));
+        out += line;
+    }
+    pthread_rwlock_rdlock(&ring_lock);
+    snprintf(line, sizeof(line), "# HELP cql_gateway_ring_tokens Tokens known in the ring.\n# TYPE cql_gateway_ring_tokens gauge\n"
+             "cql_gateway_ring_tokens %lu\n", (unsigned long)ring.size());
+    pthread_rwlock_unlock(&ring_lock);
+    out += line;
+
+    return out;
+}
@@ -0,0 +1,73 @@
+#ifndef _RING_H
+#define _RING_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include <deque>
+#include <set>
+#include <string>
+
+#include "gateway.hpp"
+#include "upstream.hpp"
+
+// Most prepared statements remembered, for all tenants; past that, one that isn't being used is forgotten for each new one
+#define RING_MAX_STATEMENTS 65536
+
+// Which request of the gateway's own is in flight on a route, see ring.cpp
+#define ROUTE_IDLE    0
+#define ROUTE_USE     1
+#define ROUTE_PREPARE 2
+
+// A client connection's connection to another node than its own, for EXECUTEs whose partition that node owns and for hedged reads.
+// That thread (HandleConnRoute()) opens the connection first, see RouteOpen(), then reads responses and handles them as on the
+// session's own connection.
+typedef struct cql_route {
+  cql_thread_t *session;
+  cql_node_t *node;
+  pthread_t reader;
+  bool started;                     // whether the reader was started; it isn't if the session has no handshake to replay
+  cql_packet_t *startup;            // copies of the session's handshake for the reader to replay, freed once it has
+  cql_packet_t *credentials;
+
+  pthread_mutex_t mutex;            // held while writing a packet, and protects what follows
+  int fd;                           // -1 until the connection is opened, and for good if it couldn't be; nothing is routed meanwhile
+  bool opening;                     // the reader is still opening it; statements are queued to be prepared once it is open
+  int8_t internal_stream;           // stream id of the gateway's own requests, reserved from the session's with STREAM_INTERNAL
+  std::set<std::string> prepared;   // ids of the statements prepared on the connection
+  std::set<std::string> failed;     // ids of the statements that could not be, which are never routed here
+  std::deque<std::string> to_prepare; // ids waiting to be prepared; the first one is in progress unless busy is ROUTE_IDLE
+  int busy;                         // ROUTE_*
+  std::string keyspace;             // set by the gateway's last USE on the connection
+  std::string using_keyspace;       // of the USE in flight
+
+  struct cql_route *next;
+} cql_route_t;
+
+// A session's state for routing, allocated only when ring_refresh_s is set, reads are hedged or circuit breakers are on
+typedef struct cql_ring_session {
+  cql_packet_t *startup;            // as forwarded to the session's own node, to open routes with
+  cql_packet_t *credentials;        // likewise, NULL if the client never sent any
+  char *keyspace;                   // in use on the session's own connection, with the internal token, NULL for none; protected
+                                    // by the session's mutex, since the client thread checks routes against it
+  char *prepare_query[CQL_MAX_STREAMS]; // query of the PREPARE sent on each upstream stream
+  cql_route_t *routes;
+} cql_ring_session_t;
+
+void StartRing();
+bool RingEnabled();
+void RingSessionOpened(cql_thread_t *session);
+void RingRequestSent(cql_thread_t *session, cql_packet_t *packet);
+void RingKeyspace(cql_thread_t *session, const char *keyspace);
+void RingPrepared(cql_thread_t *session, int8_t upstream, const char *id, uint16_t id_len, cql_result_metadata_t *metadata);
+cql_route_t* RingRoute(cql_thread_t *session, cql_packet_t *packet);
+cql_route_t* RingSpareRoute(cql_thread_t *session, cql_packet_t *packet, cql_node_t *exclude);
+bool RingIsRead(cql_packet_t *packet);
+bool RouteOpen(cql_route_t *route);
+bool RouteSend(cql_route_t *route, cql_packet_t *packet);
+void RouteInternal(cql_route_t *route, cql_packet_t *packet);
+void RingStopRoutes(cql_thread_t *session);
+void RingSessionClosed(cql_thread_t *session);
+std::string RingRender();
+
+#endif
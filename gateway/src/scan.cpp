@@ -0,0 +1,354 @@
+/*
+ * scan.cpp - Case-insensitive multi-needle search over packet data
+ * CSC 652 - 2014
+ */
+
+#include <string.h>
+#include <immintrin.h>
+
+#include "scan.hpp"
+
+// Every kernel has the same contract. If 'first' is set, stop at the leftmost match of any wanted needle, store its offset in 'pos' and
+// return that needle's bit. Otherwise, return the mask of all wanted needles that appear anywhere in the buffer.
+typedef uint32_t (*scan_kernel_t)(const cql_scanner_t *s, const char *p, size_t n, uint32_t want, bool first, size_t *pos);
+
+static inline unsigned char fold(char c) {
+    unsigned char u = (unsigned char)c;
+    return (u >= 'A' && u <= 'Z') ? (u | 0x20) : u;
+}
+
+/*
+ * Checks every wanted needle against the bytes starting at offset i. Returns the mask of needles that match there.
+ */
+static inline uint32_t matches_at(const cql_scanner_t *s, const char *p, size_t n, size_t i, uint32_t want) {
+    uint32_t hits = 0;
+    unsigned char c = fold(p[i]);
+
+    for (int k = 0; k < s->count; k++) {
+        if (!(want & (1u << k)) || s->len[k] == 0 || (unsigned char)s->needle[k][0] != c || i + s->len[k] > n) {
+            continue;
+        }
+
+        size_t j = 1;
+        while (j < s->len[k] && fold(p[i + j]) == (unsigned char)s->needle[k][j]) {
+            j++;
+        }
+        if (j == s->len[k]) {
+            hits |= 1u << k;
+        }
+    }
+
+    return hits;
+}
+
+/*
+ * Verifies a candidate position produced by one of the kernels. Returns true when the kernel can stop scanning, in which case
+ * 'result' holds the kernel's return value.
+ */
+static inline bool check_candidate(const cql_scanner_t *s, const char *p, size_t n, size_t i, uint32_t *want, bool first, size_t *pos, uint32_t *result) {
+    uint32_t hits = matches_at(s, p, n, i, *want);
+    if (hits == 0) {
+        return false;
+    }
+
+    if (first) {
+        *pos = i;
+        *result = hits & (~hits + 1); // Lowest needle index wins a tie at the same offset
+        return true;
+    }
+
+    *result |= hits;
+    *want &= ~hits;
+    return *want == 0;
+}
+
+static uint32_t scan_scalar_from(const cql_scanner_t *s, const char *p, size_t n, size_t start, uint32_t want, bool first, size_t *pos, uint32_t result) {
+    for (size_t i = start; i < n; i++) {
+        if (s->first_byte[(unsigned char)p[i]] && check_candidate(s, p, n, i, &want, first, pos, &result)) {
+            return result;
+        }
+    }
+
+    return first ? 0 : result;
+}
+
+static uint32_t scan_scalar(const cql_scanner_t *s, const char *p, size_t n, uint32_t want, bool first, size_t *pos) {
+    return scan_scalar_from(s, p, n, 0, want, first, pos, 0);
+}
+
+/*
+ * SSE4.2 kernel. PCMPESTRM compares 16 bytes of the buffer against the set of needle first bytes in one instruction, giving a
+ * bitmask of candidate offsets that are then verified.
+ */
+__attribute__((target("sse4.2")))
+static uint32_t scan_sse42(const cql_scanner_t *s, const char *p, size_t n, uint32_t want, bool first, size_t *pos) {
+    uint32_t result = 0;
+    size_t i = 0;
+
+    if (s->first_set_len == 0) {
+        return 0;
+    }
+
+    const __m128i set = _mm_loadu_si128((const __m128i *)s->first_set);
+
+    for (; i + 16 <= n; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i mask = _mm_cmpestrm(set, s->first_set_len, block, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_BIT_MASK);
+        uint32_t candidates = (uint32_t)_mm_cvtsi128_si32(mask);
+
+        while (candidates != 0) {
+            size_t c = i + __builtin_ctz(candidates);
+            candidates &= candidates - 1;
+
+            if (check_candidate(s, p, n, c, &want, first, pos, &result)) {
+                return result;
+            }
+        }
+    }
+
+    return scan_scalar_from(s, p, n, i, want, first, pos, result);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i fold_avx2(__m256i v) {
+    const __m256i lo = _mm256_set1_epi8('A' - 1);
+    const __m256i hi = _mm256_set1_epi8('Z' + 1);
+    const __m256i case_bit = _mm256_set1_epi8(0x20);
+
+    // Bytes >= 0x80 compare as negative, so they are never treated as upper case letters
+    __m256i upper = _mm256_and_si256(_mm256_cmpgt_epi8(v, lo), _mm256_cmpgt_epi8(hi, v));
+    return _mm256_or_si256(v, _mm256_and_si256(upper, case_bit));
+}
+
+/*
+ * AVX2 kernel. Folds 32 bytes to lower case and, for each needle, compares both its first and last byte at the matching offsets.
+ * Requiring both ends to match removes most false candidates before the (scalar) verification step.
+ */
+__attribute__((target("avx2")))
+static uint32_t scan_avx2(const cql_scanner_t *s, const char *p, size_t n, uint32_t want, bool first, size_t *pos) {
+    __m256i firsts[SCAN_MAX_NEEDLES];
+    __m256i lasts[SCAN_MAX_NEEDLES];
+    size_t last_off[SCAN_MAX_NEEDLES];
+    int active = 0;
+    size_t max_len = 1;
+    uint32_t result = 0;
+    size_t i = 0;
+
+    // Too short for a single 32 byte block plus the needle tails, so the setup below would be wasted
+    if (n < 64) {
+        return scan_sse42(s, p, n, want, first, pos);
+    }
+
+    for (int k = 0; k < s->count; k++) {
+        if (!(want & (1u << k)) || s->len[k] == 0) {
+            continue;
+        }
+        firsts[active] = _mm256_set1_epi8(s->needle[k][0]);
+        lasts[active] = _mm256_set1_epi8(s->needle[k][s->len[k] - 1]);
+        last_off[active] = s->len[k] - 1;
+        if (s->len[k] > max_len) {
+            max_len = s->len[k];
+        }
+        active++;
+    }
+
+    if (active == 0) {
+        return 0;
+    }
+
+    // The last-byte loads reach up to max_len - 1 bytes past the block
+    for (; i + 32 + max_len - 1 <= n; i += 32) {
+        __m256i block = fold_avx2(_mm256_loadu_si256((const __m256i *)(p + i)));
+        uint32_t candidates = 0;
+
+        for (int k = 0; k < active; k++) {
+            __m256i tail = fold_avx2(_mm256_loadu_si256((const __m256i *)(p + i + last_off[k])));
+            __m256i both = _mm256_and_si256(_mm256_cmpeq_epi8(block, firsts[k]), _mm256_cmpeq_epi8(tail, lasts[k]));
+            candidates |= (uint32_t)_mm256_movemask_epi8(both);
+        }
+
+        while (candidates != 0) {
+            size_t c = i + __builtin_ctz(candidates);
+            candidates &= candidates - 1;
+
+            if (check_candidate(s, p, n, c, &want, first, pos, &result)) {
+                return result;
+            }
+        }
+    }
+
+    return scan_scalar_from(s, p, n, i, want, first, pos, result);
+}
+
+// Kernels for ScanPrefixColumn(). 'cell' holds offsets (relative to 'base') of each cell's 4 byte big-endian length, which is
+// immediately followed by the cell's contents. A negative length is a null cell.
+typedef void (*prefix_kernel_t)(const char *base, const int32_t *cell, size_t count, size_t stride, const char *prefix, size_t prefix_len, uint8_t *match);
+
+static inline int32_t cell_len(const char *base, int32_t off) {
+    uint32_t len;
+    memcpy(&len, base + off, 4);
+    return (int32_t)__builtin_bswap32(len);
+}
+
+static void prefix_scalar(const char *base, const int32_t *cell, size_t count, size_t stride, const char *prefix, size_t prefix_len, uint8_t *match) {
+    for (size_t i = 0; i < count; i++) {
+        int32_t off = cell[i * stride];
+        match[i * stride] = cell_len(base, off) > (int32_t)prefix_len && memcmp(base + off + 4, prefix, prefix_len) == 0;
+    }
+}
+
+/*
+ * SSE4.2 prefix kernel. Covers a 16 to 32 byte prefix with two (possibly overlapping) 16 byte compares per cell. Only the
+ * prefix bytes are loaded, so a cell at the very end of the buffer is never read past.
+ */
+__attribute__((target("sse4.2")))
+static void prefix_sse42(const char *base, const int32_t *cell, size_t count, size_t stride, const char *prefix, size_t prefix_len, uint8_t *match) {
+    if (prefix_len < 16 || prefix_len > 32) {
+        prefix_scalar(base, cell, count, stride, prefix, prefix_len, match);
+        return;
+    }
+
+    const __m128i head = _mm_loadu_si128((const __m128i *)prefix);
+    const __m128i tail = _mm_loadu_si128((const __m128i *)(prefix + prefix_len - 16));
+
+    for (size_t i = 0; i < count; i++) {
+        int32_t off = cell[i * stride];
+        if (cell_len(base, off) <= (int32_t)prefix_len) {
+            match[i * stride] = 0;
+            continue;
+        }
+
+        const char *content = base + off + 4;
+        __m128i a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)content), head);
+        __m128i b = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(content + prefix_len - 16)), tail);
+        match[i * stride] = _mm_movemask_epi8(_mm_and_si128(a, b)) == 0xFFFF;
+    }
+}
+
+// There is no AVX2 prefix kernel: gathering the prefixes of eight cells at a time measured slower than the two 16 byte compares
+// per cell done by the SSE4.2 kernel (see tests/bench_scan.cpp), so AVX2 machines use that one too
+static prefix_kernel_t prefix_kernels[3] = {prefix_scalar, prefix_sse42, prefix_sse42};
+
+static scan_kernel_t scan_kernels[3] = {scan_scalar, scan_sse42, scan_avx2};
+static const char *scan_impl_names[3] = {"scalar", "sse4.2", "avx2"};
+
+static bool scan_impl_supported(int impl) {
+    __builtin_cpu_init(); // Required before __builtin_cpu_supports when run from a static initializer
+
+    if (impl == SCAN_IMPL_AVX2) {
+        return __builtin_cpu_supports("avx2");
+    }
+    else if (impl == SCAN_IMPL_SSE42) {
+        return __builtin_cpu_supports("sse4.2");
+    }
+    return impl == SCAN_IMPL_SCALAR;
+}
+
+static int scan_pick_impl() {
+    if (scan_impl_supported(SCAN_IMPL_AVX2)) {
+        return SCAN_IMPL_AVX2;
+    }
+    else if (scan_impl_supported(SCAN_IMPL_SSE42)) {
+        return SCAN_IMPL_SSE42;
+    }
+    return SCAN_IMPL_SCALAR;
+}
+
+static int scan_impl = scan_pick_impl();
+
+cql_span_t MakeSpan(const char *data, size_t len) {
+    cql_span_t span;
+    span.data = data;
+    span.len = len;
+    return span;
+}
+
+/*
+ * Compiles a set of needles for scanning. Needles are matched case-insensitively (ASCII only). Empty needles are kept so that
+ * indexes stay stable, but never match.
+ */
+void ScannerInit(cql_scanner_t *s, const char **needles, int count) {
+    memset(s, 0, sizeof(cql_scanner_t));
+
+    if (count > SCAN_MAX_NEEDLES) {
+        count = SCAN_MAX_NEEDLES;
+    }
+    s->count = count;
+
+    for (int k = 0; k < count; k++) {
+        size_t len = (needles[k] == NULL) ? 0 : strlen(needles[k]);
+        if (len >= SCAN_MAX_NEEDLE_LEN) {
+            len = SCAN_MAX_NEEDLE_LEN - 1;
+        }
+
+        for (size_t j = 0; j < len; j++) {
+            s->needle[k][j] = (char)fold(needles[k][j]);
+        }
+        s->len[k] = (uint8_t)len;
+
+        if (len == 0) {
+            continue;
+        }
+
+        unsigned char lower = (unsigned char)s->needle[k][0];
+        unsigned char upper = (lower >= 'a' && lower <= 'z') ? (lower & ~0x20) : lower;
+
+        if (!s->first_byte[lower]) {
+            s->first_byte[lower] = true;
+            s->first_set[s->first_set_len++] = (char)lower;
+        }
+        if (!s->first_byte[upper]) {
+            s->first_byte[upper] = true;
+            s->first_set[s->first_set_len++] = (char)upper;
+        }
+    }
+}
+
+/*
+ * Finds the leftmost occurrence of any wanted needle in the span. Returns the needle's index and sets 'pos' to its offset, or
+ * returns -1 if none of them appear.
+ */
+int ScanFirst(const cql_scanner_t *s, cql_span_t span, uint32_t want, size_t *pos) {
+    if (span.data == NULL || span.len == 0) {
+        return -1;
+    }
+
+    uint32_t hit = scan_kernels[scan_impl](s, span.data, span.len, want, true, pos);
+    return (hit == 0) ? -1 : __builtin_ctz(hit);
+}
+
+/*
+ * Returns the mask of wanted needles that appear anywhere in the span. Scanning stops as soon as all of them have been found.
+ */
+uint32_t ScanAll(const cql_scanner_t *s, cql_span_t span, uint32_t want) {
+    if (span.data == NULL || span.len == 0) {
+        return 0;
+    }
+
+    size_t pos = 0;
+    return scan_kernels[scan_impl](s, span.data, span.len, want, false, &pos);
+}
+
+/*
+ * Checks a whole text column of a result at once. For each of the 'count' cells (every 'stride'th entry of 'cell'), sets the
+ * matching entry of 'match' to 1 if the cell is longer than the prefix and begins with it (case-sensitive), or 0 otherwise.
+ */
+void ScanPrefixColumn(const char *base, const int32_t *cell, size_t count, size_t stride, const char *prefix, size_t prefix_len, uint8_t *match) {
+    prefix_kernels[scan_impl](base, cell, count, stride, prefix, prefix_len, match);
+}
+
+/*
+ * Overrides the kernel picked at startup. Only meant for benchmarks and tests; returns false if the CPU lacks support.
+ */
+bool ScanForceImpl(int impl) {
+    if (impl < SCAN_IMPL_SCALAR || impl > SCAN_IMPL_AVX2 || !scan_impl_supported(impl)) {
+        return false;
+    }
+
+    scan_impl = impl;
+    return true;
+}
+
+const char* ScanImplName() {
+    return scan_impl_names[scan_impl];
+}
@@ -0,0 +1,46 @@
+#ifndef _SCAN_H
+#define _SCAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A scanner can look for up to 8 needles at once. This keeps the set of first bytes (in both cases) within the 16 bytes that a single SSE4.2 PCMPESTRM can compare against.
+#define SCAN_MAX_NEEDLES    8
+#define SCAN_MAX_NEEDLE_LEN 64
+
+// Pass as the "want" mask to consider every needle in the scanner
+#define SCAN_ANY 0xFFFFFFFFu
+
+// Which kernel is used to scan. The best one supported by the CPU is picked at startup.
+#define SCAN_IMPL_SCALAR 0
+#define SCAN_IMPL_SSE42  1
+#define SCAN_IMPL_AVX2   2
+
+// Non-owning view of a run of bytes, such as a cell or string inside a packet buffer. Not NUL-terminated.
+typedef struct {
+  const char *data;
+  size_t len;
+} cql_span_t;
+
+// A compiled set of needles that are searched for case-insensitively in one pass over a span
+typedef struct {
+  int count;
+  char needle[SCAN_MAX_NEEDLES][SCAN_MAX_NEEDLE_LEN]; // lowercased copies of the needles
+  uint8_t len[SCAN_MAX_NEEDLES];                     // a length of 0 never matches
+  char first_set[16];                                // first byte of every needle, in both cases
+  int first_set_len;
+  bool first_byte[256];                              // same set as a lookup table, for the scalar kernel
+} cql_scanner_t;
+
+cql_span_t MakeSpan(const char *data, size_t len);
+
+void ScannerInit(cql_scanner_t *s, const char **needles, int count);
+int ScanFirst(const cql_scanner_t *s, cql_span_t span, uint32_t want, size_t *pos);
+uint32_t ScanAll(const cql_scanner_t *s, cql_span_t span, uint32_t want);
+
+void ScanPrefixColumn(const char *base, const int32_t *cell, size_t count, size_t stride, const char *prefix, size_t prefix_len, uint8_t *match);
+
+bool ScanForceImpl(int impl);
+const char* ScanImplName();
+
+#endif
@@ -0,0 +1,280 @@
+/*
+ * sched.cpp - Fair scheduling of requests to Cassandra between tenants
+ * CSC 652 - 2014
+ *
+ * With max_in_flight set, requests aren't written to Cassandra by the client threads. Each tenant gets a queue, and one dispatcher
+ * thread takes from the queues in deficit round robin order (each tenant may send weight * SCHED_QUANTUM bytes per round) for as
+ * long as fewer than max_in_flight requests are waiting on Cassandra. A tenant with a burst of queries then only delays its own
+ * queue, while other tenants keep getting their share.
+ *
+ * The dispatcher only picks requests. Each session has a writer thread of its own, started with its first scheduled request,
+ * which sends them in the order they were picked, so a Cassandra node that is slow to read only holds up the sessions using it.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include <deque>
+
+#include "config.hpp"
+#include "sched.hpp"
+#include "overload.hpp"
+#include "tenant.hpp"
+#include "log.hpp"
+#include "probes.hpp"
+#include "ring.hpp"
+#include "slowlog.hpp"
+#include "stats.hpp"
+#include "timeout.hpp"
+
+// The thread sending a session's scheduled requests, and those it has yet to send
+typedef struct cql_sched_writer {
+  pthread_t thread;
+  pthread_cond_t cond;                     // signalled when a request is picked for the session, or the writer is to stop
+  std::deque<cql_queued_request_t> outbox; // picked and not yet sent, protected by sched_mutex
+  cql_packet_t *writing;                   // being sent with the mutex released; freed by SchedulerCancel() if cancelled
+  bool stopping;
+} cql_sched_writer_t;
+
+static pthread_mutex_t sched_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sched_cond = PTHREAD_COND_INITIALIZER; // signalled when there is work to do
+
+static std::deque<cql_tenant_t *> active; // tenants with queued requests, in round robin order
+static uint32_t in_flight = 0;            // requests sent and not yet answered, for all tenants
+static bool quantum_given = false;        // whether the tenant at the front of "active" already got its quantum this round
+
+bool SchedulerEnabled() {
+    return gateway_config.max_in_flight > 0;
+}
+
+/*
+ * Sends the requests picked for a session. Cancellation is only let in while writing to Cassandra, where the thread may be
+ * stuck behind a node that stopped reading.
+ */
+static void* HandleWriter(void *arg) {
+    cql_thread_t *session = (cql_thread_t *)arg;
+    cql_sched_writer_t *w = session->writer;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+    pthread_mutex_lock(&sched_mutex);
+    while (1) {
+        if (w->stopping) {
+            break;
+        }
+        if (w->outbox.empty()) {
+            pthread_cond_wait(&w->cond, &sched_mutex);
+            continue;
+        }
+
+        cql_queued_request_t r = w->outbox.front();
+        w->outbox.pop_front();
+        w->writing = r.packet;
+        pthread_mutex_unlock(&sched_mutex);
+
+        uint32_t len = sizeof(cql_packet_t) + ntohl(r.packet->length);
+        uint64_t stage_ns = StatsStageStart();
+        uint64_t cpu_ns = StatsThreadCpuNs(); // The send is charged to the tenant; deciding what to send is shared overhead
+        SlowLogForwarding(session, r.packet->stream);
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        bool sent = (r.route != NULL) ? RouteSend(r.route, r.packet) : send(session->cassandrafd, r.packet, len, 0) >= 0;
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        if (!sent) { // The session's Cassandra thread, or the route's reader, notices the connection was lost
+            SESSION_LOG(session, LOG_ERROR, "%u: Error sending scheduled packet to Cassandra: %s\n", session->id, strerror(errno));
+        }
+        StatsStage(session, STAGE_SEND_UPSTREAM, stage_ns);
+        StatsChargeCpu(session, CPU_SCHEDULER, &cpu_ns);
+        PROBE4(frame_forwarded, session->id, r.packet->stream, r.packet->opcode, len);
+
+        pthread_mutex_lock(&sched_mutex);
+        w->writing = NULL;
+        free(r.packet);
+    }
+    pthread_mutex_unlock(&sched_mutex);
+
+    return NULL;
+}
+
+/*
+ * Returns the writer of a session, starting it if this is the session's first scheduled request. Called with the mutex held.
+ */
+static cql_sched_writer_t* writerOf(cql_thread_t *session) {
+    if (session->writer != NULL) {
+        return session->writer;
+    }
+
+    cql_sched_writer_t *w = new cql_sched_writer_t();
+    pthread_cond_init(&w->cond, NULL);
+    w->writing = NULL;
+    w->stopping = false;
+    session->writer = w;
+    if (pthread_create(&w->thread, NULL, HandleWriter, (void *)session) != 0) {
+        fprintf(stderr, "pthread_create failed for scheduler writer thread.\n");
+        exit(1);
+    }
+
+    return w;
+}
+
+/*
+ * Sends requests until every queue is empty or the in-flight cap is reached.
+ */
+static void* HandleScheduler(void *arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&sched_mutex);
+    while (1) {
+        if (active.empty() || in_flight >= gateway_config.max_in_flight) {
+            pthread_cond_wait(&sched_cond, &sched_mutex);
+            continue;
+        }
+
+        cql_tenant_t *t = active.front();
+        if (!quantum_given) {
+            t->deficit += t->config.weight * SCHED_QUANTUM;
+            quantum_given = true;
+        }
+
+        if (t->queue.empty()) { // An idle tenant doesn't keep its deficit
+            t->deficit = 0;
+            t->active = false;
+            active.pop_front();
+            quantum_given = false;
+            continue;
+        }
+
+        cql_queued_request_t r = t->queue.front();
+        uint32_t len = sizeof(cql_packet_t) + ntohl(r.packet->length);
+        if (len > t->deficit) { // Round is over for this tenant
+            active.pop_front();
+            active.push_back(t);
+            quantum_given = false;
+            continue;
+        }
+
+        t->queue.pop_front();
+
+        if (!TimeoutStillWanted(r.session, r.packet->stream)) { // The client was already told it timed out
+            OverloadResponseReceived(r.session, r.packet->stream);
+            free(r.packet);
+            continue;
+        }
+
+        t->deficit -= len;
+        in_flight++;
+        r.session->inflight[r.packet->stream].scheduled = true;
+
+        cql_sched_writer_t *w = writerOf(r.session);
+        w->outbox.push_back(r);
+        pthread_cond_signal(&w->cond);
+    }
+
+    return NULL;
+}
+
+/*
+ * Starts the dispatcher thread, if scheduling is enabled.
+ */
+void StartScheduler() {
+    if (!SchedulerEnabled()) {
+        return;
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, HandleScheduler, NULL) != 0) {
+        fprintf(stderr, "pthread_create failed for scheduler thread.\n");
+        exit(1);
+    }
+    pthread_detach(thread);
+}
+
+/*
+ * Queues a request from an authenticated client for Cassandra, to be sent on the given route or, if NULL, on the session's own
+ * connection. The scheduler takes ownership of the packet.
+ */
+void SchedulerSubmit(cql_thread_t *session, cql_packet_t *packet, struct cql_route *route) {
+    cql_tenant_t *t = session->tenant;
+    cql_queued_request_t r = {session, packet, route};
+
+    pthread_mutex_lock(&sched_mutex);
+    if (!t->active) {
+        t->active = true;
+        active.push_back(t);
+    }
+    t->queue.push_back(r);
+    pthread_cond_broadcast(&sched_cond);
+    pthread_mutex_unlock(&sched_mutex);
+}
+
+/*
+ * Called for every response from Cassandra, to free up the in-flight slot of the request it answers.
+ */
+void SchedulerComplete(cql_thread_t *session, int8_t stream) {
+    if (stream < 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&sched_mutex);
+    if (session->inflight[stream].scheduled) {
+        session->inflight[stream].scheduled = false;
+        in_flight--;
+        pthread_cond_broadcast(&sched_cond);
+    }
+    pthread_mutex_unlock(&sched_mutex);
+}
+
+/*
+ * Drops a closing client's queued requests, stops its writer, and frees the in-flight slots of those Cassandra will no longer
+ * answer. Must be called after the session's Cassandra thread has stopped, and before its sockets to Cassandra are closed.
+ */
+void SchedulerCancel(cql_thread_t *session) {
+    pthread_mutex_lock(&sched_mutex);
+    cql_tenant_t *t = session->tenant;
+    if (t != NULL) {
+        std::deque<cql_queued_request_t>::iterator it = t->queue.begin();
+        while (it != t->queue.end()) {
+            if (it->session == session) {
+                free(it->packet);
+                it = t->queue.erase(it);
+            }
+            else {
+                it++;
+            }
+        }
+    }
+
+    cql_sched_writer_t *w = session->writer;
+    if (w != NULL) {
+        for (size_t i = 0; i < w->outbox.size(); i++) {
+            free(w->outbox[i].packet);
+        }
+        w->outbox.clear();
+        w->stopping = true;
+        pthread_cond_signal(&w->cond);
+    }
+    pthread_mutex_unlock(&sched_mutex);
+
+    // A writer stuck sending to Cassandra is cancelled; otherwise it sees it is stopping and returns
+    if (w != NULL) {
+        pthread_cancel(w->thread);
+        pthread_join(w->thread, NULL);
+        free(w->writing);
+        pthread_cond_destroy(&w->cond);
+        delete w;
+        session->writer = NULL;
+    }
+
+    pthread_mutex_lock(&sched_mutex);
+    for (int i = 0; i < CQL_MAX_STREAMS; i++) {
+        if (session->inflight[i].scheduled) {
+            session->inflight[i].scheduled = false;
+            in_flight--;
+        }
+    }
+    pthread_cond_broadcast(&sched_cond);
+    pthread_mutex_unlock(&sched_mutex);
+}
@@ -0,0 +1,17 @@
+#ifndef _SCHEDULER_H
+#define _SCHEDULER_H
+
+#include "gateway.hpp"
+
+struct cql_route;
+
+// Bytes a tenant of weight 1 may send per round of the deficit round robin. Tenants get weight times this per round.
+#define SCHED_QUANTUM 4096
+
+void StartScheduler();
+bool SchedulerEnabled();
+void SchedulerSubmit(cql_thread_t *session, cql_packet_t *packet, struct cql_route *route);
+void SchedulerComplete(cql_thread_t *session, int8_t stream);
+void SchedulerCancel(cql_thread_t *session);
+
+#endif
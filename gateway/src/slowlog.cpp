@@ -0,0 +1,280 @@
+/*
+ * slowlog.cpp - Log of requests that took longer than their tenant's slow_query_ms
+ * CSC 652 - 2014
+ *
+ * For tenants with a threshold, the text of every QUERY (and the id of every EXECUTE) is kept with the request until it is
+ * answered. If it took longer than the threshold, it is queued for a writer thread, which appends it to slow_query_log as one
+ * line of JSON, so a connection thread never waits on the file. Each entry has the query as the client sent it and as it was
+ * sent to Cassandra, the consistency, where the time went (in the gateway before Cassandra, in Cassandra, in the gateway after),
+ * and a fingerprint: the query with its literals replaced by '?', and a hash of that, so entries can be grouped by statement to
+ * find what is slow for a tenant, e.g.
+ *
+ *   jq -r '[.tenant, .fingerprint, .normalized] | @tsv' slow.log | sort | uniq -c | sort -rn | head
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include <deque>
+#include <string>
+
+#include "config.hpp"
+#include "fingerprint.hpp"
+#include "log.hpp"
+#include "slowlog.hpp"
+
+// A slow request waiting to be written
+typedef struct {
+  cql_slow_request_t *r;
+  cql_tenant_t *tenant;
+  uint64_t received_us;
+  uint64_t done_us;
+  bool timed_out;
+} cql_slow_entry_t;
+
+static pthread_mutex_t slow_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t slow_cond = PTHREAD_COND_INITIALIZER; // signalled when entries are queued
+static std::deque<cql_slow_entry_t> slow_queue;
+static uint64_t slow_dropped = 0; // entries dropped because the writer fell behind, since it last wrote
+static FILE *slow_file = NULL;
+
+static const char *consistency_names[8] = {"ANY", "ONE", "TWO", "THREE", "QUORUM", "ALL", "LOCAL_QUORUM", "EACH_QUORUM"};
+
+/*
+ * Starts a record for a QUERY. Takes ownership of query, which must have been malloc()ed.
+ */
+cql_slow_request_t* SlowLogQuery(char *query, const char *rewritten, uint16_t consistency) {
+    cql_slow_request_t *r = (cql_slow_request_t *)calloc(1, sizeof(cql_slow_request_t));
+    r->query = query;
+    r->rewritten = strdup(rewritten);
+    r->opcode = CQL_OPCODE_QUERY;
+    r->consistency = consistency;
+    return r;
+}
+
+/*
+ * Starts a record for an EXECUTE from its body. Returns NULL if the body is malformed, in which case Cassandra will say so.
+ */
+cql_slow_request_t* SlowLogExecute(const char *body, uint32_t len) {
+    // <id: short bytes><n: short><n values: [bytes]><consistency: short>
+    uint16_t id_len;
+    if (len < 2) {
+        return NULL;
+    }
+    memcpy(&id_len, body, 2);
+    id_len = ntohs(id_len);
+    uint32_t offset = 2 + id_len;
+    if (offset + 2 > len) {
+        return NULL;
+    }
+
+    uint16_t values;
+    memcpy(&values, body + offset, 2);
+    offset += 2;
+    for (uint16_t i = 0; i < ntohs(values); i++) {
+        int32_t value_len;
+        if (offset + 4 > len) {
+            return NULL;
+        }
+        memcpy(&value_len, body + offset, 4);
+        value_len = ntohl(value_len);
+        offset += 4 + ((value_len > 0) ? value_len : 0); // A negative length is a null value
+        if (offset > len) {
+            return NULL;
+        }
+    }
+    uint16_t consistency;
+    if (offset + 2 > len) {
+        return NULL;
+    }
+    memcpy(&consistency, body + offset, 2);
+
+    cql_slow_request_t *r = (cql_slow_request_t *)calloc(1, sizeof(cql_slow_request_t));
+    r->query = (char *)malloc(2 * id_len + 3);
+    strcpy(r->query, "0x");
+    for (uint16_t i = 0; i < id_len; i++) {
+        sprintf(r->query + 2 + 2 * i, "%02x", (uint8_t)body[2 + i]);
+    }
+    r->opcode = CQL_OPCODE_EXECUTE;
+    r->consistency = ntohs(consistency);
+    return r;
+}
+
+void SlowLogDiscard(cql_slow_request_t *r) {
+    if (r != NULL) {
+        free(r->query);
+        free(r->rewritten);
+        free(r);
+    }
+}
+
+/*
+ * Takes the record of the request on an upstream stream, if there is one, as its response is read from Cassandra.
+ */
+cql_slow_request_t* SlowLogAnswered(cql_thread_t *session, int8_t stream) {
+    cql_slow_request_t *r = session->inflight[stream].slow;
+    if (r != NULL) {
+        session->inflight[stream].slow = NULL;
+        r->answered_us = StatsNowUs();
+    }
+    return r;
+}
+
+/*
+ * Called when a request has been answered (or dropped after timing out). Queues it for the log if it was slow and sampled, and
+ * frees it otherwise. r may be NULL.
+ */
+void SlowLogRequestDone(cql_thread_t *session, cql_slow_request_t *r, uint64_t received_us, bool timed_out) {
+    if (r == NULL) {
+        return;
+    }
+
+    cql_tenant_t *t = session->tenant;
+    uint64_t now = StatsNowUs();
+    if (now - received_us < (uint64_t)t->config.slow_query_ms * 1000) {
+        SlowLogDiscard(r);
+        return;
+    }
+
+    // Every slow request is counted, but only one in slow_query_sample is logged
+    pthread_mutex_lock(&t->limit_lock);
+    uint64_t n = ++t->slow_queries;
+    pthread_mutex_unlock(&t->limit_lock);
+    if (n % gateway_config.slow_query_sample != 0) {
+        SlowLogDiscard(r);
+        return;
+    }
+
+    cql_slow_entry_t e = {r, t, received_us, now, timed_out};
+    pthread_mutex_lock(&slow_mutex);
+    if (slow_queue.size() >= SLOW_LOG_QUEUE) {
+        slow_dropped++;
+        r = NULL;
+    }
+    else {
+        slow_queue.push_back(e);
+        pthread_cond_signal(&slow_cond);
+    }
+    pthread_mutex_unlock(&slow_mutex);
+
+    if (r == NULL) {
+        SlowLogDiscard(e.r);
+    }
+}
+
+/*
+ * Frees the records of requests that were never answered. Called once neither of the session's threads can touch them.
+ */
+void SlowLogSessionClosed(cql_thread_t *session) {
+    for (int i = 0; i < CQL_MAX_STREAMS; i++) {
+        SlowLogDiscard(session->inflight[i].slow);
+        session->inflight[i].slow = NULL;
+    }
+}
+
+static void writeJSONString(FILE *f, const char *s) {
+    fputc('"', f);
+    for (; *s != '\0'; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            fprintf(f, "\\%c", c);
+        }
+        else if (c < 0x20) {
+            fprintf(f, "\\u%04x", c);
+        }
+        else {
+            fputc(c, f);
+        }
+    }
+    fputc('"', f);
+}
+
+static void writeEntry(FILE *f, cql_slow_entry_t *e) {
+    cql_slow_request_t *r = e->r;
+    std::string normalized = (r->opcode == CQL_OPCODE_QUERY) ? NormalizeQuery(r->query, strlen(r->query)) : std::string("execute ") + r->query;
+
+    // Time in the gateway before Cassandra (including rate limiting and scheduling), in Cassandra, and in the gateway after
+    uint64_t forwarded = (r->forwarded_us != 0) ? r->forwarded_us : e->done_us;
+    uint64_t answered = (r->answered_us != 0) ? r->answered_us : e->done_us;
+
+    fprintf(f, "{\"time\":%lu.%06lu,\"tenant\":\"%s\",\"opcode\":\"%s\",\"fingerprint\":\"%016lx\",\"normalized\":",
+            (unsigned long)(e->done_us / 1000000), (unsigned long)(e->done_us % 1000000), e->tenant->token,
+            printable_opcodes[r->opcode], (unsigned long)FingerprintOf(normalized));
+    writeJSONString(f, normalized.c_str());
+    fprintf(f, ",\"query\":");
+    writeJSONString(f, r->query);
+    if (r->rewritten != NULL) {
+        fprintf(f, ",\"rewritten\":");
+        writeJSONString(f, r->rewritten);
+    }
+    if (r->consistency < 8) {
+        fprintf(f, ",\"consistency\":\"%s\"", consistency_names[r->consistency]);
+    }
+    else {
+        fprintf(f, ",\"consistency\":%u", r->consistency);
+    }
+    fprintf(f, ",\"total_ms\":%.3f,\"gateway_in_ms\":%.3f,\"cassandra_ms\":%.3f,\"gateway_out_ms\":%.3f,\"timed_out\":%s}\n",
+            (e->done_us - e->received_us) / 1000.0, (forwarded - e->received_us) / 1000.0, (answered - forwarded) / 1000.0,
+            (e->done_us - answered) / 1000.0, e->timed_out ? "true" : "false");
+}
+
+static void* HandleSlowLog(void *arg) {
+    (void)arg;
+
+    std::deque<cql_slow_entry_t> batch;
+    while (1) {
+        pthread_mutex_lock(&slow_mutex);
+        while (slow_queue.empty()) {
+            pthread_cond_wait(&slow_cond, &slow_mutex);
+        }
+        batch.swap(slow_queue);
+        uint64_t dropped = slow_dropped;
+        slow_dropped = 0;
+        pthread_mutex_unlock(&slow_mutex);
+
+        for (size_t i = 0; i < batch.size(); i++) {
+            writeEntry(slow_file, &batch[i]);
+            SlowLogDiscard(batch[i].r);
+        }
+        batch.clear();
+        if (fflush(slow_file) != 0) {
+            LOG(LOG_ERROR, "Error writing the slow query log: %s\n", strerror(errno));
+        }
+        if (dropped > 0) {
+            LOG(LOG_WARN, "%lu slow queries were not logged because the slow query log fell behind.\n", (unsigned long)dropped);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Opens the slow query log and starts its writer, if any tenant has a slow_query_ms.
+ */
+void StartSlowLog() {
+    bool wanted = gateway_config.tenant_defaults.slow_query_ms > 0;
+    std::map<std::string, cql_tenant_config_t>::iterator it;
+    for (it = gateway_config.tenants.begin(); it != gateway_config.tenants.end(); it++) {
+        wanted = wanted || it->second.slow_query_ms > 0;
+    }
+    if (!wanted) {
+        return;
+    }
+
+    slow_file = fopen(gateway_config.slow_query_log.c_str(), "a");
+    if (slow_file == NULL) {
+        fprintf(stderr, "Could not open slow query log '%s': %s\n", gateway_config.slow_query_log.c_str(), strerror(errno));
+        exit(1);
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, HandleSlowLog, NULL) != 0) {
+        fprintf(stderr, "pthread_create failed for slow query log thread.\n");
+        exit(1);
+    }
+    pthread_detach(thread);
+}
@@ -0,0 +1,47 @@
+#ifndef _SLOWLOG_H
+#define _SLOWLOG_H
+
+#include <stdint.h>
+
+#include "gateway.hpp"
+#include "stats.hpp"
+#include "tenant.hpp"
+
+// Slow requests waiting for the writer thread; when it falls this far behind, more are dropped and counted
+#define SLOW_LOG_QUEUE 1024
+
+// A QUERY or EXECUTE timed for the slow query log, from when it is read from the client until it is answered
+typedef struct cql_slow_request {
+  char *query;           // as the client sent it, before process_cql_cmd(); for EXECUTE, the prepared statement's id in hex
+  char *rewritten;       // as sent to Cassandra, NULL if the request isn't rewritten
+  uint8_t opcode;
+  uint16_t consistency;
+  uint64_t forwarded_us; // when it was sent to Cassandra, 0 if it never was
+  uint64_t answered_us;  // when Cassandra's response was read, 0 if none was
+} cql_slow_request_t;
+
+void StartSlowLog();
+cql_slow_request_t* SlowLogQuery(char *query, const char *rewritten, uint16_t consistency);
+cql_slow_request_t* SlowLogExecute(const char *body, uint32_t len);
+cql_slow_request_t* SlowLogAnswered(cql_thread_t *session, int8_t stream);
+void SlowLogRequestDone(cql_thread_t *session, cql_slow_request_t *r, uint64_t received_us, bool timed_out);
+void SlowLogDiscard(cql_slow_request_t *r);
+void SlowLogSessionClosed(cql_thread_t *session);
+
+/*
+ * Whether the session's requests are timed for the slow query log. Only this is paid on the hot path when the log is off.
+ */
+static inline bool SlowLogWanted(cql_thread_t *session) {
+    return session->tenant != NULL && session->tenant->config.slow_query_ms > 0;
+}
+
+/*
+ * Notes that the request on an upstream stream is being sent to Cassandra now.
+ */
+static inline void SlowLogForwarding(cql_thread_t *session, int8_t stream) {
+    if (session->inflight[stream].slow != NULL) {
+        session->inflight[stream].slow->forwarded_us = StatsNowUs();
+    }
+}
+
+#endif
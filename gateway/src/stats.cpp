@@ -0,0 +1,517 @@
+/*
+ * stats.cpp - Per-tenant counters and latency histograms, served in Prometheus text format
+ * CSC 652 - 2014
+ *
+ * Each client connection records into its own cql_stats_t without taking any lock. When the stats endpoint is scraped, the
+ * counters of the open connections are added up by tenant, together with what closed connections left behind, and written out
+ * in the Prometheus text format. The endpoint only listens on the loopback interface, on stats_port.
+ */
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "config.hpp"
+#include "hitters.hpp"
+#include "log.hpp"
+#include "stats.hpp"
+#include "tenant.hpp"
+#include "upstream.hpp"
+#include "ring.hpp"
+#include "hedge.hpp"
+#include "breaker.hpp"
+#include "pool.hpp"
+#include "listener.hpp"
+
+// Histogram buckets exported to Prometheus, as powers of two microseconds: 16 us to about 33 s
+#define STATS_EXPORT_FIRST 4
+#define STATS_EXPORT_LAST  25
+
+// The same for stage times, as powers of two nanoseconds: 128 ns to about 67 ms
+#define STAGE_EXPORT_FIRST 7
+#define STAGE_EXPORT_LAST  26
+
+static const char *cpu_threads[STATS_CPU] = {"client", "cassandra", "scheduler"};
+
+static const char *stage_names[STATS_STAGES] = {"read", "auth", "rewrite", "classify", "send_upstream", "filter", "compact", "send_client"};
+
+static const uint32_t error_codes[STATS_ERROR_CODES - 1] = {
+    CQL_ERROR_SERVER_ERROR, CQL_ERROR_PROTOCOL_ERROR, CQL_ERROR_BAD_CREDENTIALS, CQL_ERROR_UNAVAILABLE_EXCEPTION,
+    CQL_ERROR_OVERLOADED, CQL_ERROR_IS_BOOTSTRAPPING, CQL_ERROR_TRUNCATE_ERROR, CQL_ERROR_WRITE_TIMEOUT, CQL_ERROR_READ_TIMEOUT,
+    CQL_ERROR_SYNTAX_ERROR, CQL_ERROR_UNAUTHORIZED, CQL_ERROR_INVALID, CQL_ERROR_CONFIG_ERROR, CQL_ERROR_ALREADY_EXISTS,
+    CQL_ERROR_UNPREPARED
+};
+
+// Counters of a tenant, added up over its connections
+typedef struct {
+  cql_stats_t stats;
+  uint32_t connections; // currently open
+} cql_tenant_stats_t;
+
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER; // protects everything below
+static std::set<cql_thread_t *> sessions;                     // open connections
+static std::map<std::string, cql_stats_t> closed;             // what closed connections recorded, by internal token
+static uint64_t connections_accepted = 0;
+
+uint64_t StatsNowUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static inline void add(uint64_t *counter, uint64_t n) {
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t load(const uint64_t *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static int bucketOf(uint64_t us) {
+    if (us < STATS_SUB_BUCKETS) {
+        return us;
+    }
+    int e = 63 - __builtin_clzll(us); // At least 2
+    if (e > 31) {
+        return STATS_BUCKETS - 1;
+    }
+    return (e - 1) * STATS_SUB_BUCKETS + ((us >> (e - 2)) & (STATS_SUB_BUCKETS - 1));
+}
+
+/*
+ * Returns the histogram bucket of a value, for histograms kept in the same buckets outside the connections' stats.
+ */
+int StatsBucket(uint64_t v) {
+    return bucketOf(v);
+}
+
+/*
+ * Returns the smallest value past a bucket's values.
+ */
+uint64_t StatsBucketEnd(int b) {
+    if (b < STATS_SUB_BUCKETS) {
+        return b + 1;
+    }
+    int e = b / STATS_SUB_BUCKETS + 1;
+    return (1ULL << e) + (uint64_t)(b % STATS_SUB_BUCKETS + 1) * (1ULL << (e - 2));
+}
+
+static int errorIndex(uint32_t code) {
+    for (int i = 0; i < STATS_ERROR_CODES - 1; i++) {
+        if (error_codes[i] == code) {
+            return i;
+        }
+    }
+    return STATS_ERROR_CODES - 1;
+}
+
+/*
+ * Starts keeping counters for a new client connection.
+ */
+void StatsSessionOpened(cql_thread_t *session) {
+    session->stats = (cql_stats_t *)calloc(1, sizeof(cql_stats_t));
+
+    pthread_mutex_lock(&stats_mutex);
+    sessions.insert(session);
+    connections_accepted++;
+    pthread_mutex_unlock(&stats_mutex);
+}
+
+static void addStats(cql_stats_t *to, const cql_stats_t *from) {
+    for (int op = 0; op < STATS_OPCODES; op++) {
+        for (int b = 0; b < STATS_BUCKETS; b++) {
+            to->latency[op][b] += load(&from->latency[op][b]);
+        }
+        to->latency_sum_us[op] += load(&from->latency_sum_us[op]);
+    }
+    to->bytes_in += load(&from->bytes_in);
+    to->bytes_out += load(&from->bytes_out);
+    for (int i = 0; i < STATS_ERROR_CODES; i++) {
+        to->errors[i] += load(&from->errors[i]);
+    }
+    for (int s = 0; s < STATS_STAGES; s++) {
+        for (int b = 0; b < STATS_BUCKETS; b++) {
+            to->stages[s][b] += load(&from->stages[s][b]);
+        }
+        to->stage_sum_ns[s] += load(&from->stage_sum_ns[s]);
+    }
+    for (int c = 0; c < STATS_CPU; c++) {
+        to->cpu_ns[c] += load(&from->cpu_ns[c]);
+    }
+}
+
+/*
+ * Keeps the counters of a closing connection under its tenant and frees them. Must be called once its threads are done.
+ */
+void StatsSessionClosed(cql_thread_t *session) {
+    std::string token = (session->tenant != NULL) ? session->tenant->token : "";
+
+    pthread_mutex_lock(&stats_mutex);
+    sessions.erase(session);
+    addStats(&closed[token], session->stats);
+    pthread_mutex_unlock(&stats_mutex);
+
+    free(session->stats);
+    session->stats = NULL;
+}
+
+/*
+ * Records the answer to a request, which was read from the client at received_us.
+ */
+void StatsRequestDone(cql_thread_t *session, uint8_t opcode, uint64_t received_us) {
+    if (opcode >= STATS_OPCODES) {
+        return;
+    }
+    uint64_t us = StatsNowUs() - received_us;
+    add(&session->stats->latency[opcode][bucketOf(us)], 1);
+    add(&session->stats->latency_sum_us[opcode], us);
+}
+
+void StatsRecordStage(cql_thread_t *session, int stage, uint64_t ns) {
+    add(&session->stats->stages[stage][bucketOf(ns)], 1);
+    add(&session->stats->stage_sum_ns[stage], ns);
+}
+
+void StatsAddCpu(cql_thread_t *session, int thread, uint64_t ns) {
+    add(&session->stats->cpu_ns[thread], ns);
+}
+
+void StatsBytesIn(cql_thread_t *session, uint32_t bytes) {
+    add(&session->stats->bytes_in, bytes);
+}
+
+/*
+ * Counts an ERROR sent to the client, of the given total size.
+ */
+void StatsErrorOut(cql_thread_t *session, uint32_t code, uint32_t bytes) {
+    add(&session->stats->bytes_out, bytes);
+    add(&session->stats->errors[errorIndex(code)], 1);
+}
+
+/*
+ * Counts a packet sent to the client, and its error code if it is an ERROR.
+ */
+void StatsPacketOut(cql_thread_t *session, cql_packet_t *packet) {
+    uint32_t body_len = ntohl(packet->length);
+    if (packet->opcode == CQL_OPCODE_ERROR && body_len >= 4) {
+        uint32_t code;
+        memcpy(&code, (char *)packet + sizeof(cql_packet_t), 4);
+        StatsErrorOut(session, ntohl(code), sizeof(cql_packet_t) + body_len);
+    }
+    else {
+        add(&session->stats->bytes_out, sizeof(cql_packet_t) + body_len);
+    }
+}
+
+static void appendf(std::string &out, const char *format, ...) {
+    char buf[512];
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(buf, sizeof(buf), format, args);
+    va_end(args);
+    out.append(buf, (n < (int)sizeof(buf)) ? n : sizeof(buf) - 1);
+}
+
+/*
+ * Writes out one histogram, with cumulative buckets at every power of two from 2^first to 2^last units, where there are
+ * units_per_second units in a second. Nothing is written for a histogram that is empty.
+ */
+static void appendHistogram(std::string &out, const char *name, const char *labels, const uint64_t *buckets, uint64_t sum,
+                            int first, int last, double units_per_second) {
+    uint64_t total = 0;
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+        total += buckets[b];
+    }
+    if (total == 0) {
+        return;
+    }
+
+    uint64_t count = 0;
+    int b = 0;
+    for (int k = first; k <= last; k++) {
+        for (; b < (k - 1) * STATS_SUB_BUCKETS; b++) { // The buckets below 2^k
+            count += buckets[b];
+        }
+        appendf(out, "%s_bucket{%s,le=\"%g\"} %lu\n", name, labels, (double)(1UL << k) / units_per_second, (unsigned long)count);
+    }
+    appendf(out, "%s_bucket{%s,le=\"+Inf\"} %lu\n", name, labels, (unsigned long)total);
+    appendf(out, "%s_sum{%s} %g\n", name, labels, sum / units_per_second);
+    appendf(out, "%s_count{%s} %lu\n", name, labels, (unsigned long)total);
+}
+
+/*
+ * Adds up the counters of every tenant and writes them out in the Prometheus text format.
+ */
+static std::string renderStats() {
+    std::map<std::string, cql_tenant_stats_t> tenants;
+    uint64_t accepted;
+
+    pthread_mutex_lock(&stats_mutex);
+    for (std::map<std::string, cql_stats_t>::iterator it = closed.begin(); it != closed.end(); it++) {
+        cql_tenant_stats_t &ts = tenants[it->first];
+        addStats(&ts.stats, &it->second);
+    }
+    for (std::set<cql_thread_t *>::iterator it = sessions.begin(); it != sessions.end(); it++) {
+        pthread_mutex_lock(&(*it)->mutex); // The tenant is set under the session's mutex
+        std::string token = ((*it)->tenant != NULL) ? (*it)->tenant->token : "";
+        pthread_mutex_unlock(&(*it)->mutex);
+
+        cql_tenant_stats_t &ts = tenants[token];
+        addStats(&ts.stats, (*it)->stats);
+        ts.connections++;
+    }
+    accepted = connections_accepted;
+    pthread_mutex_unlock(&stats_mutex);
+
+    std::string out;
+    std::map<std::string, cql_tenant_stats_t>::iterator it;
+
+    out += "# HELP cql_gateway_request_duration_seconds Time from reading a request from the client to answering it.\n";
+    out += "# TYPE cql_gateway_request_duration_seconds histogram\n";
+    for (it = tenants.begin(); it != tenants.end(); it++) {
+        for (int op = 0; op < STATS_OPCODES; op++) {
+            char labels[128];
+            snprintf(labels, sizeof(labels), "tenant=\"%s\",opcode=\"%s\"", it->first.c_str(), printable_opcodes[op]);
+            appendHistogram(out, "cql_gateway_request_duration_seconds", labels, it->second.stats.latency[op],
+                            it->second.stats.latency_sum_us[op], STATS_EXPORT_FIRST, STATS_EXPORT_LAST, 1e6);
+        }
+    }
+
+    // Stages are added up over every tenant, since they depend on the gateway more than on the tenant
+    cql_stats_t all_stages;
+    memset(&all_stages, 0, sizeof(all_stages));
+    for (it = tenants.begin(); it != tenants.end(); it++) {
+        for (int st = 0; st < STATS_STAGES; st++) {
+            for (int b = 0; b < STATS_BUCKETS; b++) {
+                all_stages.stages[st][b] += it->second.stats.stages[st][b];
+            }
+            all_stages.stage_sum_ns[st] += it->second.stats.stage_sum_ns[st];
+        }
+    }
+    out += "# HELP cql_gateway_stage_duration_seconds Time spent in each stage of handling requests and responses.\n";
+    out += "# TYPE cql_gateway_stage_duration_seconds histogram\n";
+    for (int st = 0; st < STATS_STAGES; st++) {
+        char labels[64];
+        snprintf(labels, sizeof(labels), "stage=\"%s\"", stage_names[st]);
+        appendHistogram(out, "cql_gateway_stage_duration_seconds", labels, all_stages.stages[st], all_stages.stage_sum_ns[st],
+                        STAGE_EXPORT_FIRST, STAGE_EXPORT_LAST, 1e9);
+    }
+
+    out += "# HELP cql_gateway_client_bytes_received_total Bytes of requests read from clients.\n";
+    out += "# TYPE cql_gateway_client_bytes_received_total counter\n";
+    for (it = tenants.begin(); it != tenants.end(); it++) {
+        appendf(out, "cql_gateway_client_bytes_received_total{tenant=\"%s\"} %lu\n", it->first.c_str(), (unsigned long)it->second.stats.bytes_in);
+    }
+    out += "# HELP cql_gateway_client_bytes_sent_total Bytes of responses and events sent to clients.\n";
+    out += "# TYPE cql_gateway_client_bytes_sent_total counter\n";
+    for (it = tenants.begin(); it != tenants.end(); it++) {
+        appendf(out, "cql_gateway_client_bytes_sent_total{tenant=\"%s\"} %lu\n", it->first.c_str(), (unsigned long)it->second.stats.bytes_out);
+    }
+
+    out += "# HELP cql_gateway_cpu_seconds_total CPU time spent on the tenant's connections, by gateway thread.\n";
+    out += "# TYPE cql_gateway_cpu_seconds_total counter\n";
+    for (it = tenants.begin(); it != tenants.end(); it++) {
+        for (int c = 0; c < STATS_CPU; c++) {
+            appendf(out, "cql_gateway_cpu_seconds_total{tenant=\"%s\",thread=\"%s\"} %.6f\n", it->first.c_str(), cpu_threads[c],
+                    it->second.stats.cpu_ns[c] / 1e9);
+        }
+    }
+
+    out += "# HELP cql_gateway_errors_total ERROR responses sent to clients, by error code.\n";
+    out += "# TYPE cql_gateway_errors_total counter\n";
+    for (it = tenants.begin(); it != tenants.end(); it++) {
+        for (int i = 0; i < STATS_ERROR_CODES; i++) {
+            if (it->second.stats.errors[i] == 0) {
+                continue;
+            }
+            char code[8];
+            if (i < STATS_ERROR_CODES - 1) {
+                snprintf(code, sizeof(code), "0x%04X", error_codes[i]);
+            }
+            else {
+                snprintf(code, sizeof(code), "other");
+            }
+            appendf(out, "cql_gateway_errors_total{tenant=\"%s\",code=\"%s\"} %lu\n", it->first.c_str(), code, (unsigned long)it->second.stats.errors[i]);
+        }
+    }
+
+    out += "# HELP cql_gateway_connections Client connections currently open.\n";
+    out += "# TYPE cql_gateway_connections gauge\n";
+    for (it = tenants.begin(); it != tenants.end(); it++) {
+        appendf(out, "cql_gateway_connections{tenant=\"%s\"} %u\n", it->first.c_str(), it->second.connections);
+    }
+    out += "# HELP cql_gateway_connections_accepted_total Client connections accepted since the gateway started.\n";
+    out += "# TYPE cql_gateway_connections_accepted_total counter\n";
+    appendf(out, "cql_gateway_connections_accepted_total %lu\n", (unsigned long)accepted);
+
+    // Counters kept by the tenants themselves
+    std::vector<cql_tenant_t *> all = AllTenants();
+    const char *names[10] = {"requests_delayed", "requests_rejected", "requests_shed", "slow_queries", "schema_cache_hits",
+                             "schema_cache_misses", "schema_events", "schema_events_merged", "reads_hedged", "hedges_won"};
+    const char *help[10] = {"Requests held back by the tenant's rate limits.", "Requests rejected by the tenant's rate limits.",
+                            "Requests turned away because Cassandra was overloaded.", "Requests slower than the tenant's slow_query_ms.",
+                            "Schema table queries answered from the cache.", "Schema table queries sent to Cassandra.",
+                            "SCHEMA_CHANGE events for the tenant's keyspaces.", "SCHEMA_CHANGE events merged into another one rather than sent.",
+                            "Reads sent to a second node after waiting longer than the tenant's hedge_percentile.",
+                            "Hedged reads answered first by the second node."};
+    std::vector<uint64_t> values(all.size() * 10);
+    for (size_t i = 0; i < all.size(); i++) {
+        cql_tenant_t *t = all[i];
+        pthread_mutex_lock(&t->limit_lock);
+        values[i * 10 + 0] = t->requests_delayed;
+        values[i * 10 + 1] = t->requests_rejected;
+        values[i * 10 + 2] = t->requests_shed;
+        values[i * 10 + 3] = t->slow_queries;
+        pthread_mutex_unlock(&t->limit_lock);
+        pthread_mutex_lock(&t->cache_lock);
+        values[i * 10 + 4] = t->schema_cache_hits;
+        values[i * 10 + 5] = t->schema_cache_misses;
+        values[i * 10 + 6] = t->schema_events;
+        values[i * 10 + 7] = t->schema_events_merged;
+        pthread_mutex_unlock(&t->cache_lock);
+        values[i * 10 + 8] = load(&t->reads_hedged);
+        values[i * 10 + 9] = load(&t->hedges_won);
+    }
+    for (int n = 0; n < 10; n++) {
+        appendf(out, "# HELP cql_gateway_%s_total %s\n# TYPE cql_gateway_%s_total counter\n", names[n], help[n], names[n]);
+        for (size_t i = 0; i < all.size(); i++) {
+            appendf(out, "cql_gateway_%s_total{tenant=\"%s\"} %lu\n", names[n], all[i]->token, (unsigned long)values[i * 10 + n]);
+        }
+    }
+
+    out += UpstreamRender();
+    out += RingRender();
+    out += HedgeRender();
+    out += BreakerRender();
+    out += PoolRender();
+    out += ShardRender();
+
+    return out;
+}
+
+/*
+ * Answers one HTTP request: GET /log?<command> is passed to LogAdminCommand(), GET /top gets the heaviest tenants and statements
+ * (see hitters.cpp), and anything else gets the stats.
+ */
+static void serveScrape(int sock) {
+    // Read the request headers; only the request line is looked at
+    char buf[1024];
+    size_t len = 0;
+    while (len < sizeof(buf) - 1) {
+        int ret = recv(sock, buf + len, sizeof(buf) - 1 - len, 0);
+        if (ret <= 0) {
+            return;
+        }
+        len += ret;
+        buf[len] = '\0';
+        if (strstr(buf, "\r\n\r\n") != NULL || strstr(buf, "\n\n") != NULL) {
+            break;
+        }
+    }
+
+    std::string out;
+    if (strncmp(buf, "GET /log?", 9) == 0) {
+        char *command = buf + 9;
+        command[strcspn(command, " \r\n")] = '\0';
+
+        char reply[256];
+        bool ok = LogAdminCommand(command, reply, sizeof(reply));
+        appendf(out, "HTTP/1.0 %s\r\nContent-Type: text/plain\r\nContent-Length: %lu\r\nConnection: close\r\n\r\n",
+                ok ? "200 OK" : "400 Bad Request", (unsigned long)strlen(reply));
+        out += reply;
+    }
+    else if (strncmp(buf, "GET /top ", 9) == 0 && HittersEnabled()) {
+        std::string body = HittersRender();
+        appendf(out, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %lu\r\nConnection: close\r\n\r\n",
+                (unsigned long)body.size());
+        out += body;
+    }
+    else {
+        std::string body = renderStats();
+        appendf(out, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %lu\r\nConnection: close\r\n\r\n",
+                (unsigned long)body.size());
+        out += body;
+    }
+
+    size_t sent = 0;
+    while (sent < out.size()) {
+        int ret = send(sock, out.data() + sent, out.size() - sent, MSG_NOSIGNAL);
+        if (ret <= 0) {
+            return;
+        }
+        sent += ret;
+    }
+}
+
+static void* HandleStats(void *arg) {
+    int listenfd = (int)(intptr_t)arg;
+
+    while (1) {
+        int sock = accept(listenfd, NULL, NULL);
+        if (sock < 0) {
+            LOG(LOG_WARN, "Error accepting stats connection: %s\n", strerror(errno));
+            continue;
+        }
+
+        struct timeval tv = {5, 0}; // Don't let a stuck scraper hold up the next one
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+        serveScrape(sock);
+        close(sock);
+    }
+
+    return NULL;
+}
+
+/*
+ * Starts serving the stats over HTTP on 127.0.0.1:stats_port, if stats_port is set.
+ */
+void StartStatsListener() {
+    if (gateway_config.stats_port == 0) {
+        return;
+    }
+
+    int listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listenfd < 0) {
+        fprintf(stderr, "Socket creation error for stats: %s\n", strerror(errno));
+        exit(1);
+    }
+    int on = 1;
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(gateway_config.stats_port);
+
+    if (bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "Socket bind error for stats on port %u: %s\n", gateway_config.stats_port, strerror(errno));
+        exit(1);
+    }
+    if (listen(listenfd, 10) == -1) {
+        fprintf(stderr, "Socket listen error for stats: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, HandleStats, (void *)(intptr_t)listenfd) != 0) {
+        fprintf(stderr, "pthread_create failed for stats thread.\n");
+        exit(1);
+    }
+    pthread_detach(thread);
+}
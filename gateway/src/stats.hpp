@@ -0,0 +1,116 @@
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "gateway.hpp"
+
+// Request opcodes are all below this
+#define STATS_OPCODES 16
+
+// Latency histogram buckets, in microseconds. Values under 4 us get a bucket each; above that every power of two is split into
+// STATS_SUB_BUCKETS buckets, so a bucket is never wider than 25% of its values, up to 2^32 us.
+#define STATS_SUB_BUCKETS 4
+#define STATS_BUCKETS     (STATS_SUB_BUCKETS * 31)
+
+// Stages of handling a request that are timed, see StatsStage()
+#define STAGE_READ          0 // reading the request from the client
+#define STAGE_AUTH          1 // handling STARTUP and CREDENTIALS, including checking the token
+#define STAGE_REWRITE       2 // process_cql_cmd()
+#define STAGE_CLASSIFY      3 // interestingPacket()
+#define STAGE_SEND_UPSTREAM 4 // sending the request to Cassandra
+#define STAGE_FILTER        5 // indexing ROWS results and filtering them for the tenant
+#define STAGE_COMPACT       6 // CompactCQLResults()
+#define STAGE_SEND_CLIENT   7 // sending to the client, including waiting for the connection's send mutex
+#define STATS_STAGES        8
+
+// Stage timing is compiled in unless built with -DSTAGE_TIMING=0
+#ifndef STAGE_TIMING
+#define STAGE_TIMING 1
+#endif
+
+// Threads whose CPU time is charged to the connections they work for, see StatsChargeCpu()
+#define CPU_CLIENT    0 // the connection's client thread
+#define CPU_CASSANDRA 1 // the connection's Cassandra thread
+#define CPU_SCHEDULER 2 // the scheduler's dispatcher, sending the connection's requests
+#define STATS_CPU     3
+
+// Error codes counted separately; anything else is counted as "other"
+#define STATS_ERROR_CODES 16
+
+// Counters of one client connection. They are only ever added to, with relaxed atomics, by the connection's own threads (and the
+// timeout thread), so recording never takes a lock; the stats endpoint reads them while they are being written.
+typedef struct cql_stats {
+  uint64_t latency[STATS_OPCODES][STATS_BUCKETS]; // requests by opcode and time from receiving them to answering them
+  uint64_t latency_sum_us[STATS_OPCODES];
+  uint64_t bytes_in;                              // bytes of requests read from the client
+  uint64_t bytes_out;                             // bytes of responses and events sent to the client
+  uint64_t errors[STATS_ERROR_CODES];             // ERROR responses sent to the client, by error code, see stats.cpp
+  uint64_t stages[STATS_STAGES][STATS_BUCKETS];   // time spent in each stage, in the same buckets but in nanoseconds
+  uint64_t stage_sum_ns[STATS_STAGES];
+  uint64_t cpu_ns[STATS_CPU];                     // CPU time spent on the connection, by thread
+} cql_stats_t;
+
+uint64_t StatsNowUs();
+int StatsBucket(uint64_t v);
+uint64_t StatsBucketEnd(int b);
+void StartStatsListener();
+void StatsSessionOpened(cql_thread_t *session);
+void StatsSessionClosed(cql_thread_t *session);
+void StatsRequestDone(cql_thread_t *session, uint8_t opcode, uint64_t received_us);
+void StatsBytesIn(cql_thread_t *session, uint32_t bytes);
+void StatsPacketOut(cql_thread_t *session, cql_packet_t *packet);
+void StatsErrorOut(cql_thread_t *session, uint32_t code, uint32_t bytes);
+void StatsRecordStage(cql_thread_t *session, int stage, uint64_t ns);
+void StatsAddCpu(cql_thread_t *session, int thread, uint64_t ns);
+
+/*
+ * Returns the time a stage starts at, for StatsStage().
+ */
+static inline uint64_t StatsStageStart() {
+#if STAGE_TIMING
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts); // Served from the vDSO, so no system call
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+    return 0;
+#endif
+}
+
+/*
+ * Records a stage that started at start_ns as ending now. Returns the time now, so the next stage can start from it.
+ */
+static inline uint64_t StatsStage(cql_thread_t *session, int stage, uint64_t start_ns) {
+#if STAGE_TIMING
+    uint64_t now = StatsStageStart();
+    StatsRecordStage(session, stage, now - start_ns);
+    return now;
+#else
+    (void)session;
+    (void)stage;
+    (void)start_ns;
+    return 0;
+#endif
+}
+
+/*
+ * Returns the CPU time the calling thread has used. Unlike CLOCK_MONOTONIC, this clock is not served from the vDSO.
+ */
+static inline uint64_t StatsThreadCpuNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Charges the CPU time the calling thread has used since *since_ns to the connection, and moves *since_ns up to now. Time
+ * blocked in recv() or send() uses no CPU, so calling this once per frame charges only the work done for the frame.
+ */
+static inline void StatsChargeCpu(cql_thread_t *session, int thread, uint64_t *since_ns) {
+    uint64_t now = StatsThreadCpuNs();
+    StatsAddCpu(session, thread, now - *since_ns);
+    *since_ns = now;
+}
+
+#endif
@@ -0,0 +1,286 @@
+/*
+ * tenant.cpp - Per-tenant state shared by all of a tenant's connections
+ * CSC 652 - 2014
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <arpa/inet.h>
+
+#include <vector>
+#include <boost/unordered_map.hpp>
+
+#include "log.hpp"
+#include "tenant.hpp"
+
+typedef boost::unordered_map<std::string, cql_tenant_t *, cql_name_hash, cql_name_eq> cql_tenant_map_t;
+
+static pthread_mutex_t tenants_mutex = PTHREAD_MUTEX_INITIALIZER;
+static cql_tenant_map_t tenants;
+
+// Keyspaces that every tenant may see. Anything else must begin with the tenant's token.
+static const char *shared_keyspaces[3] = {"system", "system_auth", "system_traces"};
+
+static bool isSharedKeyspace(cql_span_t name) {
+    for (int i = 0; i < 3; i++) {
+        if (name.len == strlen(shared_keyspaces[i]) && memcmp(name.data, shared_keyspaces[i], name.len) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool hasTokenPrefix(cql_tenant_t *t, cql_span_t name) {
+    return name.len > TOKEN_LENGTH && memcmp(name.data, t->token, TOKEN_LENGTH) == 0;
+}
+
+/*
+ * Returns the tenant for an internal token, creating it on first use. Returns NULL if the token isn't a full token.
+ */
+cql_tenant_t* GetTenant(const char *token) {
+    if (token == NULL || strlen(token) != TOKEN_LENGTH) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&tenants_mutex);
+
+    cql_tenant_map_t::iterator it = tenants.find(MakeSpan(token, TOKEN_LENGTH), cql_name_hash(), cql_name_eq());
+    cql_tenant_t *t;
+    if (it != tenants.end()) {
+        t = it->second;
+    }
+    else {
+        t = new cql_tenant_t();
+        memcpy(t->token, token, TOKEN_LENGTH + 1);
+        t->config = TenantConfig(token);
+        pthread_mutex_init(&t->limit_lock, NULL);
+        t->request_bucket.rate = t->request_bucket.tokens = t->config.requests_per_second;
+        t->byte_bucket.rate = t->byte_bucket.tokens = t->config.bytes_per_second;
+        pthread_mutex_init(&t->cache_lock, NULL);
+        tenants[std::string(token)] = t;
+
+        LOG(LOG_INFO, "New tenant %s.\n", token);
+    }
+
+    pthread_mutex_unlock(&tenants_mutex);
+    return t;
+}
+
+/*
+ * Returns the already known tenant whose token prefixes the given keyspace or user name, or NULL if there is none.
+ */
+cql_tenant_t* FindTenantByPrefix(cql_span_t name) {
+    if (name.len <= TOKEN_LENGTH) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&tenants_mutex);
+    cql_tenant_map_t::iterator it = tenants.find(MakeSpan(name.data, TOKEN_LENGTH), cql_name_hash(), cql_name_eq());
+    cql_tenant_t *t = (it != tenants.end()) ? it->second : NULL;
+    pthread_mutex_unlock(&tenants_mutex);
+
+    return t;
+}
+
+static uint64_t nowUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Adds the tokens earned since the bucket was last used. Returns how many microseconds it will take until the bucket can cover
+ * "amount" (or a full bucket, for amounts larger than that), or 0 if it already can.
+ */
+static uint64_t bucketWait(cql_bucket_t *b, double amount, uint64_t now) {
+    if (b->rate == 0) {
+        return 0;
+    }
+
+    b->tokens += (now - b->last_us) * b->rate / 1000000.0;
+    if (b->tokens > b->rate) {
+        b->tokens = b->rate;
+    }
+    b->last_us = now;
+
+    double need = (amount < b->rate) ? amount : b->rate;
+    return (b->tokens >= need) ? 0 : (uint64_t)((need - b->tokens) * 1000000.0 / b->rate) + 1;
+}
+
+/*
+ * Checks a request of the given size against the tenant's rate limits, which are shared by all of its connections. Returns false
+ * if it must be rejected. Otherwise the request is counted against the limits and *delay_us says how long the caller must hold it
+ * before forwarding it (0 if it can go right away).
+ */
+bool TenantAdmitRequest(cql_tenant_t *t, uint32_t bytes, uint64_t *delay_us) {
+    *delay_us = 0;
+    if (t->request_bucket.rate == 0 && t->byte_bucket.rate == 0) {
+        return true;
+    }
+
+    pthread_mutex_lock(&t->limit_lock);
+
+    uint64_t now = nowUs();
+    uint64_t wait = bucketWait(&t->request_bucket, 1, now);
+    uint64_t byte_wait = bucketWait(&t->byte_bucket, bytes, now);
+    if (byte_wait > wait) {
+        wait = byte_wait;
+    }
+
+    bool admit = (wait == 0) || (gateway_config.rate_limit_mode == RATE_LIMIT_DELAY && wait <= gateway_config.rate_limit_max_delay_ms * 1000ull);
+    if (admit) {
+        // Taken now even if the request has to wait, so requests that come after it wait their turn
+        if (t->request_bucket.rate != 0) {
+            t->request_bucket.tokens -= 1;
+        }
+        if (t->byte_bucket.rate != 0) {
+            t->byte_bucket.tokens -= bytes;
+        }
+        if (wait > 0) {
+            t->requests_delayed++;
+        }
+        *delay_us = wait;
+    }
+    else {
+        t->requests_rejected++;
+    }
+
+    pthread_mutex_unlock(&t->limit_lock);
+    return admit;
+}
+
+/*
+ * Marks every row of a result whose name in the given column isn't visible to the tenant for removal. The shared keyspaces are
+ * matched exactly, and anything else must begin with the tenant's token, so e.g. another tenant's "mysystem" keyspace or a name
+ * merely containing our token is hidden. Before the client has logged in (t is NULL) only the shared keyspaces are visible.
+ */
+void TenantFilterColumn(cql_tenant_t *t, int kind, char *buf, cql_result_index_t *index, int32_t col) {
+    for (int32_t i = 0; i < index->rows; i++) {
+        if (index->remove[i]) {
+            continue;
+        }
+
+        cql_span_t name = CellSpan(buf, index, i, col);
+        if (kind == COLUMN_KEYSPACE && isSharedKeyspace(name)) {
+            continue;
+        }
+        if (t != NULL && hasTokenPrefix(t, name)) {
+            continue;
+        }
+
+        index->remove[i] = true;
+    }
+}
+
+/*
+ * Returns the current version of the tenant's schema. Record it before sending a query whose result may be cached, and pass it
+ * back to TenantStoreSchemaResult().
+ */
+uint32_t TenantSchemaVersion(cql_tenant_t *t) {
+    pthread_mutex_lock(&t->cache_lock);
+    uint32_t version = t->schema_version;
+    pthread_mutex_unlock(&t->cache_lock);
+    return version;
+}
+
+/*
+ * Drops every cached schema table result of the tenant, and makes sure results already in flight won't be stored.
+ */
+void TenantInvalidateSchemaCache(cql_tenant_t *t) {
+    pthread_mutex_lock(&t->cache_lock);
+    t->schema_version++;
+    for (int i = 0; i < SCHEMA_TABLE_COUNT; i++) {
+        free(t->schema_cache[i].body);
+        t->schema_cache[i].body = NULL;
+        t->schema_cache[i].len = 0;
+    }
+    pthread_mutex_unlock(&t->cache_lock);
+}
+
+/*
+ * Returns every tenant seen so far. Tenants are never freed, so the pointers stay good.
+ */
+std::vector<cql_tenant_t*> AllTenants() {
+    std::vector<cql_tenant_t*> all;
+
+    pthread_mutex_lock(&tenants_mutex);
+    for (cql_tenant_map_t::iterator it = tenants.begin(); it != tenants.end(); it++) {
+        all.push_back(it->second);
+    }
+    pthread_mutex_unlock(&tenants_mutex);
+
+    return all;
+}
+
+/*
+ * Drops the cached schema tables of every tenant, e.g. when schema changes may have been missed.
+ */
+void InvalidateAllSchemaCaches() {
+    pthread_mutex_lock(&tenants_mutex);
+    for (cql_tenant_map_t::iterator it = tenants.begin(); it != tenants.end(); it++) {
+        TenantInvalidateSchemaCache(it->second);
+    }
+    pthread_mutex_unlock(&tenants_mutex);
+}
+
+/*
+ * Returns a complete RESULT packet for one of the schema tables, with the given stream id, built from the tenant's cached rows.
+ * Returns NULL if nothing (fresh) is cached, in which case the query goes to Cassandra as usual. The caller frees the packet.
+ */
+cql_packet_t* TenantCachedSchemaResult(cql_tenant_t *t, int table, int8_t stream) {
+    cql_packet_t *p = NULL;
+
+    pthread_mutex_lock(&t->cache_lock);
+    cql_schema_cache_t *c = &t->schema_cache[table];
+    if (c->body != NULL && time(NULL) - c->filled >= SCHEMA_CACHE_TTL) {
+        free(c->body);
+        c->body = NULL;
+        c->len = 0;
+    }
+    if (c->body != NULL) {
+        p = (cql_packet_t *)malloc(sizeof(cql_packet_t) + c->len);
+        p->version = CQL_V1_RESPONSE;
+        p->flags = CQL_FLAG_NONE;
+        p->stream = stream;
+        p->opcode = CQL_OPCODE_RESULT;
+        p->length = htonl(c->len);
+        memcpy((char *)p + sizeof(cql_packet_t), c->body, c->len);
+        t->schema_cache_hits++;
+    }
+    else {
+        t->schema_cache_misses++;
+    }
+    pthread_mutex_unlock(&t->cache_lock);
+
+    return p;
+}
+
+/*
+ * Stores the body of a filtered RESULT for one of the schema tables. It is ignored if the schema changed since the query was sent.
+ */
+void TenantStoreSchemaResult(cql_tenant_t *t, int table, uint32_t version, const char *body, uint32_t len) {
+    pthread_mutex_lock(&t->cache_lock);
+    if (version == t->schema_version) {
+        cql_schema_cache_t *c = &t->schema_cache[table];
+        free(c->body);
+        c->body = (char *)malloc(len);
+        memcpy(c->body, body, len);
+        c->len = len;
+        c->filled = time(NULL);
+    }
+    pthread_mutex_unlock(&t->cache_lock);
+}
+
+/*
+ * Drops the cached schema tables of the tenant owning a keyspace, after a SCHEMA_CHANGE result or event for it. The name is the
+ * full one sent by Cassandra, before the token is stripped. Tenants this gateway hasn't seen yet have nothing cached.
+ */
+void TenantSchemaChanged(cql_span_t keyspace) {
+    cql_tenant_t *t = FindTenantByPrefix(keyspace);
+    if (t != NULL) {
+        TenantInvalidateSchemaCache(t);
+    }
+}
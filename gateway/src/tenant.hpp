@@ -0,0 +1,101 @@
+#ifndef _TENANT_H
+#define _TENANT_H
+
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <deque>
+#include <vector>
+
+#include <boost/functional/hash.hpp>
+
+#include "config.hpp"
+#include "gateway.hpp"
+#include "helpers.hpp"
+#include "stats.hpp"
+
+// Hash and equality for maps keyed by name that can be probed with a span straight out of a packet, without building a std::string
+struct cql_name_hash {
+  size_t operator()(const std::string &s) const { return boost::hash_range(s.begin(), s.end()); }
+  size_t operator()(const cql_span_t &s) const { return boost::hash_range(s.data, s.data + s.len); }
+};
+struct cql_name_eq {
+  bool operator()(const std::string &a, const std::string &b) const { return a == b; }
+  bool operator()(const cql_span_t &a, const std::string &b) const { return a.len == b.size() && memcmp(a.data, b.data(), a.len) == 0; }
+  bool operator()(const std::string &a, const cql_span_t &b) const { return (*this)(b, a); }
+};
+
+// Cached schema table results are also dropped after this many seconds, in case the schema was changed through another gateway
+#define SCHEMA_CACHE_TTL 30
+
+// The tenant's filtered view of one schema table, as the body of a ROWS RESULT frame ready to be sent to a client
+typedef struct {
+  char *body;       // NULL if nothing is cached
+  uint32_t len;
+  time_t filled;    // when the body was stored
+} cql_schema_cache_t;
+
+// Token bucket for rate limiting. It holds up to one second's worth of tokens, so a tenant can burst to twice its rate briefly.
+typedef struct {
+  double tokens;   // may go negative when requests are delayed, which then holds back the requests after them
+  double rate;     // tokens added per second, 0 for no limit
+  uint64_t last_us; // when tokens were last added
+} cql_bucket_t;
+
+// A request waiting in a tenant's queue for the scheduler, see sched.cpp
+typedef struct {
+  cql_thread_t *session;
+  cql_packet_t *packet;
+  struct cql_route *route; // to send it on, NULL for the session's own connection, see ring.cpp
+} cql_queued_request_t;
+
+// State kept per tenant, shared by all of that tenant's connections. Tenants are created on first use and live for the life of the gateway.
+typedef struct cql_tenant {
+  char token[TOKEN_LENGTH + 1]; // the internal tenant token
+  cql_tenant_config_t config;   // settings from the configuration file
+
+  pthread_mutex_t limit_lock;   // protects the rate limiting state below
+  cql_bucket_t request_bucket;
+  cql_bucket_t byte_bucket;
+  uint64_t requests_delayed;
+  uint64_t requests_rejected;
+  uint64_t requests_shed;       // turned away because Cassandra was overloaded, see overload.cpp
+  uint64_t slow_queries;        // requests over the tenant's slow_query_ms, see slowlog.cpp
+  uint64_t read_latency[STATS_BUCKETS]; // the tenant's recent reads, by time to answer them, see hedge.cpp
+  uint64_t read_samples;        // reads in read_latency
+  uint64_t hedge_delay_us;      // how long a read waits before it is hedged, 0 until enough reads were timed; read without the lock
+  uint64_t reads_hedged;        // reads sent to a second node, added to atomically
+  uint64_t hedges_won;          // of those, how many the second node answered first, added to atomically
+
+  // Scheduling state, protected by the scheduler's mutex
+  std::deque<cql_queued_request_t> queue; // requests waiting to be sent to Cassandra
+  uint32_t deficit;                       // bytes the tenant may still send this round
+  bool active;                            // whether the tenant is in the scheduler's round robin
+
+  pthread_mutex_t cache_lock;   // protects everything below
+  uint32_t schema_version;      // bumped on every change to the tenant's schema, so results that were in flight aren't cached
+  cql_schema_cache_t schema_cache[SCHEMA_TABLE_COUNT];
+  uint64_t schema_cache_hits;
+  uint64_t schema_cache_misses;
+  uint64_t schema_events;        // SCHEMA_CHANGE events received for the tenant's keyspaces
+  uint64_t schema_events_merged; // of those, how many were merged into another one rather than sent, see events.cpp
+} cql_tenant_t;
+
+cql_tenant_t* GetTenant(const char *token);
+cql_tenant_t* FindTenantByPrefix(cql_span_t name);
+std::vector<cql_tenant_t*> AllTenants();
+
+bool TenantAdmitRequest(cql_tenant_t *t, uint32_t bytes, uint64_t *delay_us);
+
+void TenantFilterColumn(cql_tenant_t *t, int kind, char *buf, cql_result_index_t *index, int32_t col);
+
+uint32_t TenantSchemaVersion(cql_tenant_t *t);
+void TenantInvalidateSchemaCache(cql_tenant_t *t);
+void InvalidateAllSchemaCaches();
+cql_packet_t* TenantCachedSchemaResult(cql_tenant_t *t, int table, int8_t stream);
+void TenantStoreSchemaResult(cql_tenant_t *t, int table, uint32_t version, const char *body, uint32_t len);
+
+void TenantSchemaChanged(cql_span_t keyspace);
+
+#endif
@@ -0,0 +1,411 @@
+/*
+ * timeout.cpp - Deadlines for requests forwarded to Cassandra
+ * CSC 652 - 2014
+ *
+ * Requests are sent to Cassandra on stream ids of the gateway's choosing, so that once a request has timed out and the client
+ * has been answered (and may reuse its stream id), the late response can still be told apart and dropped. Each QUERY and
+ * EXECUTE gets a deadline of request_timeout_ms in a timer wheel, and when it passes the client gets a READ_TIMEOUT or
+ * WRITE_TIMEOUT error built by the gateway, and the timeout counts against the node's circuit breaker (see breaker.cpp). Reads to be
+ * hedged get a second deadline in the same wheel, see hedge.cpp.
+ *
+ * A timed out request keeps its stream id until Cassandra answers it. One still unanswered after STREAM_RECLAIM_MS, far longer
+ * than Cassandra's own timeouts, isn't waited on any more, and its stream id is reused when the session runs out of free ones.
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include <vector>
+
+#include "breaker.hpp"
+#include "config.hpp"
+#include "hedge.hpp"
+#include "log.hpp"
+#include "overload.hpp"
+#include "sched.hpp"
+#include "slowlog.hpp"
+#include "stats.hpp"
+#include "timeout.hpp"
+
+// What kind of timeout error a request gets
+#define TIMEOUT_READ  0
+#define TIMEOUT_WRITE 1
+#define TIMEOUT_BATCH 2
+#define TIMEOUT_HEDGE 3 // not a timeout: the request is hedged if it hasn't been answered yet
+
+typedef struct {
+  cql_thread_t *session;
+  int8_t upstream;    // stream id used with Cassandra
+  uint32_t gen;       // cql_thread_t.stream_gen[upstream] when the deadline was set; the request was answered if it changed
+  uint64_t tick;      // deadline, in ticks
+  uint16_t consistency;
+  uint8_t kind;       // TIMEOUT_*
+} cql_deadline_t;
+
+static pthread_mutex_t wheel_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fired_cond = PTHREAD_COND_INITIALIZER; // signalled when a deadline is done firing
+static std::vector<cql_deadline_t> wheel[TIMEOUT_SLOTS];
+static std::vector<cql_deadline_t> due;     // passed, and yet to be fired with the mutex released
+static cql_thread_t *firing = NULL;         // session of the deadline being fired, which TimeoutSessionClosed() waits for
+
+static uint64_t nowTick() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000) / TIMEOUT_TICK_MS;
+}
+
+/*
+ * Picks a free stream id to send a client's request to Cassandra on. If there is none, the stream id of a request that timed out
+ * STREAM_RECLAIM_MS ago and still hasn't been answered is taken back. Returns -1 if every one is in use, which can only happen
+ * when requests that timed out are still holding theirs.
+ */
+int8_t TimeoutMapStream(cql_thread_t *session, int8_t client_stream) {
+    int8_t upstream = -1;
+    bool reclaimed = false;
+    uint64_t now = StatsNowUs();
+
+    pthread_mutex_lock(&session->mutex);
+    for (int i = 0; i < CQL_MAX_STREAMS; i++) {
+        int s = (session->next_stream + i) % CQL_MAX_STREAMS;
+        if (session->client_stream[s] == STREAM_FREE) {
+            upstream = s;
+            break;
+        }
+    }
+    for (int s = 0; upstream < 0 && s < CQL_MAX_STREAMS; s++) {
+        if (session->client_stream[s] == STREAM_TIMED_OUT &&
+            now - session->inflight[s].timed_out_us >= (uint64_t)STREAM_RECLAIM_MS * 1000) {
+            upstream = s;
+            reclaimed = true;
+        }
+    }
+    if (upstream >= 0) {
+        session->client_stream[upstream] = client_stream;
+        session->stream_gen[upstream]++;
+        session->next_stream = (upstream + 1) % CQL_MAX_STREAMS;
+    }
+    pthread_mutex_unlock(&session->mutex);
+
+    // The request that had it is given up on, as if it had been answered late. Done before the caller sets up the new one.
+    if (reclaimed) {
+        SESSION_LOG(session, LOG_INFO, "%u: Reusing stream %d, whose request timed out and was never answered.\n", session->id, upstream);
+        SlowLogRequestDone(session, SlowLogAnswered(session, upstream), session->inflight[upstream].received_us, true);
+        SchedulerComplete(session, upstream);
+        OverloadResponseReceived(session, upstream);
+    }
+
+    return upstream;
+}
+
+/*
+ * Frees the stream id of a response from Cassandra and gives the client's stream id for it. Returns false if the response is
+ * for a request that already timed out (or for no request at all), in which case it must be dropped.
+ */
+bool TimeoutUnmapStream(cql_thread_t *session, int8_t upstream, int8_t *client_stream) {
+    pthread_mutex_lock(&session->mutex);
+    int8_t s = session->client_stream[upstream];
+    if (s >= 0) {
+        HedgeSettled(session, upstream);
+    }
+    session->client_stream[upstream] = STREAM_FREE;
+    session->stream_gen[upstream]++;
+    pthread_mutex_unlock(&session->mutex);
+
+    *client_stream = s;
+    return s >= 0;
+}
+
+/*
+ * Returns true if a request waiting to be sent on the given stream still should be. If it timed out while queued, its stream id
+ * is freed instead, since Cassandra won't be answering it.
+ */
+bool TimeoutStillWanted(cql_thread_t *session, int8_t upstream) {
+    pthread_mutex_lock(&session->mutex);
+    bool wanted = session->client_stream[upstream] != STREAM_TIMED_OUT;
+    if (!wanted) {
+        session->client_stream[upstream] = STREAM_FREE;
+        session->stream_gen[upstream]++;
+    }
+    pthread_mutex_unlock(&session->mutex);
+
+    return wanted;
+}
+
+/*
+ * Sets the deadline of a request just before it is forwarded to Cassandra. Only QUERY and EXECUTE requests have one, since those
+ * are what Cassandra itself can time out on.
+ */
+void TimeoutStart(cql_thread_t *session, cql_packet_t *packet) {
+    uint32_t timeout_ms = gateway_config.request_timeout_ms;
+    uint32_t body_len = ntohl(packet->length);
+    if (timeout_ms == 0 || (packet->opcode != CQL_OPCODE_QUERY && packet->opcode != CQL_OPCODE_EXECUTE) || body_len < 4) {
+        return;
+    }
+
+    cql_deadline_t d;
+    d.session = session;
+    d.upstream = packet->stream;
+    d.tick = nowTick() + (timeout_ms + TIMEOUT_TICK_MS - 1) / TIMEOUT_TICK_MS;
+
+    // A QUERY has its consistency right after the [long string] query. So does an EXECUTE after its [short bytes] id from v2 on,
+    // while in v1 it ends the body. A request too short for it is left to Cassandra to turn down.
+    const char *body = (char *)packet + sizeof(cql_packet_t);
+    uint64_t at;
+    if (packet->opcode == CQL_OPCODE_QUERY) {
+        uint32_t query_len;
+        memcpy(&query_len, body, 4);
+        at = 4 + (uint64_t)ntohl(query_len);
+    }
+    else if ((packet->version & 0x7F) == CQL_V1) {
+        at = body_len - 2;
+    }
+    else {
+        uint16_t id_len;
+        memcpy(&id_len, body, 2);
+        at = 2 + (uint64_t)ntohs(id_len);
+    }
+    if (at + 2 > body_len) {
+        return;
+    }
+    memcpy(&d.consistency, body + at, 2);
+    d.consistency = ntohs(d.consistency);
+
+    // A query that isn't a SELECT is a write. The statement behind an EXECUTE isn't known here, so it is reported as a read.
+    d.kind = TIMEOUT_READ;
+    if (packet->opcode == CQL_OPCODE_QUERY) {
+        const char *q = body + 4;
+        const char *end = body + at;
+        while (q < end && isspace((unsigned char)*q)) {
+            q++;
+        }
+        if (end - q >= 6 && strncasecmp(q, "SELECT", 6) == 0) {
+            d.kind = TIMEOUT_READ;
+        }
+        else if (end - q >= 5 && strncasecmp(q, "BEGIN", 5) == 0) {
+            d.kind = TIMEOUT_BATCH;
+        }
+        else {
+            d.kind = TIMEOUT_WRITE;
+        }
+    }
+
+    pthread_mutex_lock(&session->mutex);
+    d.gen = session->stream_gen[d.upstream];
+    pthread_mutex_unlock(&session->mutex);
+
+    pthread_mutex_lock(&wheel_mutex);
+    wheel[d.tick % TIMEOUT_SLOTS].push_back(d);
+    pthread_mutex_unlock(&wheel_mutex);
+}
+
+/*
+ * Sets the deadline at which a read is hedged, delay_us from now.
+ */
+void TimeoutHedge(cql_thread_t *session, int8_t upstream, uint64_t delay_us) {
+    cql_deadline_t d;
+    d.session = session;
+    d.upstream = upstream;
+    d.tick = nowTick() + (delay_us + TIMEOUT_TICK_MS * 1000 - 1) / (TIMEOUT_TICK_MS * 1000);
+    d.consistency = 0;
+    d.kind = TIMEOUT_HEDGE;
+
+    pthread_mutex_lock(&session->mutex);
+    d.gen = session->stream_gen[d.upstream];
+    pthread_mutex_unlock(&session->mutex);
+
+    pthread_mutex_lock(&wheel_mutex);
+    wheel[d.tick % TIMEOUT_SLOTS].push_back(d);
+    pthread_mutex_unlock(&wheel_mutex);
+}
+
+/*
+ * Answers a timed out request with a READ_TIMEOUT or WRITE_TIMEOUT error. Cassandra didn't say how many replicas it was waiting
+ * for, so the error claims 0 of 1 responded.
+ */
+static void sendTimeout(cql_thread_t *session, int8_t client_stream, const cql_deadline_t &d) {
+    static const char msg[] = "Operation timed out in the gateway - received only 0 responses.";
+    const char *write_type = (d.kind == TIMEOUT_BATCH) ? "BATCH" : "SIMPLE";
+
+    uint32_t body_len = 4 + 2 + strlen(msg) + 2 + 4 + 4 + ((d.kind == TIMEOUT_READ) ? 1 : 2 + strlen(write_type));
+    cql_packet_t *p = (cql_packet_t *)malloc(sizeof(cql_packet_t) + body_len);
+    p->version = CQL_V1_RESPONSE;
+    p->flags = CQL_FLAG_NONE;
+    p->stream = client_stream;
+    p->opcode = CQL_OPCODE_ERROR;
+    p->length = htonl(body_len);
+
+    char *b = (char *)p + sizeof(cql_packet_t);
+    uint32_t i32 = htonl((d.kind == TIMEOUT_READ) ? CQL_ERROR_READ_TIMEOUT : CQL_ERROR_WRITE_TIMEOUT);
+    memcpy(b, &i32, 4);
+    uint16_t i16 = htons(strlen(msg));
+    memcpy(b + 4, &i16, 2);
+    memcpy(b + 6, msg, strlen(msg));
+    b += 6 + strlen(msg);
+
+    i16 = htons(d.consistency);
+    memcpy(b, &i16, 2);
+    i32 = htonl(0); // received
+    memcpy(b + 2, &i32, 4);
+    i32 = htonl(1); // blockfor
+    memcpy(b + 6, &i32, 4);
+    b += 10;
+
+    if (d.kind == TIMEOUT_READ) {
+        *b = 0; // data_present
+    }
+    else {
+        i16 = htons(strlen(write_type));
+        memcpy(b, &i16, 2);
+        memcpy(b + 2, write_type, strlen(write_type));
+    }
+
+    if (SendToClient(session, p) < 0) {
+        SESSION_LOG(session, LOG_DEBUG, "Error sending timeout to client.\n"); // The client's own thread will notice and clean up
+    }
+    free(p);
+}
+
+/*
+ * Answers a request that timed out, or hedges a read, unless it was answered meanwhile. Called with the wheel mutex released;
+ * TimeoutSessionClosed() waits for this to return before the session can be freed.
+ */
+static void fire(const cql_deadline_t &d) {
+    cql_thread_t *session = d.session;
+    if (d.kind == TIMEOUT_HEDGE) {
+        HedgeFire(session, d.upstream, d.gen);
+        return;
+    }
+
+    pthread_mutex_lock(&session->mutex);
+    int8_t client_stream = -1;
+    uint64_t received_us = 0;
+    uint8_t opcode = 0;
+    cql_node_t *node = NULL;
+    bool probe = false;
+    if (session->stream_gen[d.upstream] == d.gen && session->client_stream[d.upstream] >= 0) {
+        client_stream = session->client_stream[d.upstream];
+        received_us = session->inflight[d.upstream].received_us;
+        opcode = session->inflight[d.upstream].opcode;
+        node = session->inflight[d.upstream].sent_node; // Set before the request was sent, a tick or more ago
+        probe = __atomic_exchange_n(&session->inflight[d.upstream].probe, false, __ATOMIC_RELAXED);
+        session->client_stream[d.upstream] = STREAM_TIMED_OUT; // Keeps the stream id until the late response shows up
+        session->inflight[d.upstream].timed_out_us = StatsNowUs();
+        HedgeSettled(session, d.upstream);
+    }
+    pthread_mutex_unlock(&session->mutex);
+
+    if (client_stream < 0) { // Answered in time
+        return;
+    }
+
+    SESSION_LOG(session, LOG_INFO, "Request on stream %d timed out, answering the client.\n", client_stream);
+
+    sendTimeout(session, client_stream, d);
+    StatsRequestDone(session, opcode, received_us);
+    BreakerTimedOut(node, probe);
+}
+
+/*
+ * Takes the deadlines of one tick out of the wheel, to be fired once the wheel mutex is released. Called with the wheel mutex
+ * held.
+ */
+static void expire(uint64_t tick) {
+    std::vector<cql_deadline_t> &slot = wheel[tick % TIMEOUT_SLOTS];
+    for (size_t i = 0; i < slot.size(); ) {
+        cql_deadline_t d = slot[i];
+        if (d.tick > tick) { // Due on a later turn of the wheel
+            i++;
+            continue;
+        }
+        slot[i] = slot.back();
+        slot.pop_back();
+        due.push_back(d);
+    }
+}
+
+static void* HandleTimeouts(void *arg) {
+    (void)arg;
+
+    uint64_t done = nowTick();
+    while (1) {
+        usleep(TIMEOUT_TICK_MS * 1000);
+
+        uint64_t now = nowTick();
+        pthread_mutex_lock(&wheel_mutex);
+        for (uint64_t tick = done + 1; tick <= now; tick++) {
+            expire(tick);
+        }
+
+        // Answering a client or sending a hedge may block, so it is done with the mutex released, one deadline at a time
+        while (!due.empty()) {
+            cql_deadline_t d = due.back();
+            due.pop_back();
+            firing = d.session;
+            pthread_mutex_unlock(&wheel_mutex);
+
+            fire(d);
+
+            pthread_mutex_lock(&wheel_mutex);
+            firing = NULL;
+            pthread_cond_broadcast(&fired_cond);
+        }
+        pthread_mutex_unlock(&wheel_mutex);
+        done = now;
+    }
+
+    return NULL;
+}
+
+/*
+ * Starts the thread that fires request deadlines, if request_timeout_ms is set or reads are hedged.
+ */
+void StartTimeouts() {
+    if (gateway_config.request_timeout_ms == 0 && !HedgeEnabled()) {
+        return;
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, HandleTimeouts, NULL) != 0) {
+        fprintf(stderr, "pthread_create failed for timeout thread.\n");
+        exit(1);
+    }
+    pthread_detach(thread);
+}
+
+/*
+ * Removes the deadlines of a session from a list of them. Called with the wheel mutex held.
+ */
+static void dropDeadlines(std::vector<cql_deadline_t> &list, cql_thread_t *session) {
+    for (size_t j = 0; j < list.size(); ) {
+        if (list[j].session == session) {
+            list[j] = list.back();
+            list.pop_back();
+        }
+        else {
+            j++;
+        }
+    }
+}
+
+/*
+ * Removes the deadlines of a closing client, and waits for one being fired to finish. Must be called before the session is
+ * freed, and after its client socket is shut down, so that a timeout being sent to it can't block.
+ */
+void TimeoutSessionClosed(cql_thread_t *session) {
+    pthread_mutex_lock(&wheel_mutex);
+    for (int i = 0; i < TIMEOUT_SLOTS; i++) {
+        dropDeadlines(wheel[i], session);
+    }
+    dropDeadlines(due, session);
+    while (firing == session) {
+        pthread_cond_wait(&fired_cond, &wheel_mutex);
+    }
+    pthread_mutex_unlock(&wheel_mutex);
+}
@@ -0,0 +1,26 @@
+#ifndef _TIMEOUT_H
+#define _TIMEOUT_H
+
+#include "gateway.hpp"
+
+// Resolution of request deadlines, and the number of slots in the timer wheel (one turn covers TIMEOUT_TICK_MS * TIMEOUT_SLOTS)
+#define TIMEOUT_TICK_MS 10
+#define TIMEOUT_SLOTS   512
+
+// Values of cql_thread_t.client_stream[] for an upstream stream that isn't carrying a request
+#define STREAM_FREE      -1
+#define STREAM_TIMED_OUT -2 // the client was answered with a timeout; the late response from Cassandra will be dropped
+#define STREAM_INTERNAL  -3 // kept for the gateway's own requests on a route, see ring.cpp
+
+// How long a timed out request may hold its stream id waiting for Cassandra's answer, before the stream id can be reused
+#define STREAM_RECLAIM_MS 60000
+
+void StartTimeouts();
+int8_t TimeoutMapStream(cql_thread_t *session, int8_t client_stream);
+bool TimeoutUnmapStream(cql_thread_t *session, int8_t upstream, int8_t *client_stream);
+bool TimeoutStillWanted(cql_thread_t *session, int8_t upstream);
+void TimeoutStart(cql_thread_t *session, cql_packet_t *packet);
+void TimeoutHedge(cql_thread_t *session, int8_t upstream, uint64_t delay_us);
+void TimeoutSessionClosed(cql_thread_t *session);
+
+#endif
@@ -0,0 +1,467 @@
+/*
+ * upstream.cpp - The Cassandra nodes the gateway connects to, and their health
+ * CSC 652 - 2014
+ *
+ * Every client connection gets a connection of its own to one of the nodes in cassandra_nodes: the node with the fewest requests
+ * outstanding (as counted in overload.cpp), then the one with the fewest connections, so that a slow or busy node is given fewer
+ * new clients. A thread sends every node an OPTIONS request each health_check_interval_ms. A node that fails health_check_failures
+ * checks or connections in a row is ejected and gets no new connections until it answers a check again, and neither does a node
+ * whose circuit breaker is open (see breaker.cpp). Should every node be kept out, they are all tried anyway, since the checks may
+ * be behind.
+ *
+ * A node's answer to OPTIONS stays the same for as long as it runs, so the gateway keeps the SUPPORTED frame of every node, from
+ * its health checks and from any OPTIONS forwarded to it, and answers clients' OPTIONS from it. A node's frame is dropped when it
+ * is ejected, and learned again once it answers, in case it was restarted with another version.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <vector>
+
+#include "breaker.hpp"
+#include "config.hpp"
+#include "helpers.hpp"
+#include "log.hpp"
+#include "upstream.hpp"
+
+static pthread_mutex_t upstream_mutex = PTHREAD_MUTEX_INITIALIZER; // protects the nodes' state, but not outstanding
+static cql_node_t *nodes = NULL; // set up once by StartUpstream(), and never freed
+static uint32_t node_count = 0;
+static uint32_t next_node = 0;   // where the search for the least loaded node starts, so that ties are shared out
+
+/*
+ * Reads one whole packet from a connection to Cassandra. Returns NULL if the connection was closed, failed or timed out. The caller
+ * frees the packet.
+ */
+cql_packet_t* UpstreamRecvPacket(int sock) {
+    cql_packet_t header;
+    uint32_t read = 0;
+    while (read < sizeof(cql_packet_t)) {
+        int ret = recv(sock, (char *)&header + read, sizeof(cql_packet_t) - read, 0);
+        if (ret <= 0) {
+            return NULL;
+        }
+        read += ret;
+    }
+
+    uint32_t body_len = ntohl(header.length);
+    cql_packet_t *packet = (cql_packet_t *)malloc(sizeof(cql_packet_t) + body_len);
+    memcpy(packet, &header, sizeof(cql_packet_t));
+
+    read = 0;
+    while (read < body_len) {
+        int ret = recv(sock, (char *)packet + sizeof(cql_packet_t) + read, body_len - read, 0);
+        if (ret <= 0) {
+            free(packet);
+            return NULL;
+        }
+        read += ret;
+    }
+
+    return packet;
+}
+
+/*
+ * Sends a request of the gateway's own to Cassandra, on stream 0. Returns false on error.
+ */
+bool UpstreamSendRequest(int sock, uint8_t opcode, const char *body, uint32_t body_len) {
+    cql_packet_t *p = (cql_packet_t *)malloc(sizeof(cql_packet_t) + body_len);
+    p->version = CQL_V1_REQUEST;
+    p->flags = CQL_FLAG_NONE;
+    p->stream = 0;
+    p->opcode = opcode;
+    p->length = htonl(body_len);
+    if (body_len > 0) {
+        memcpy((char *)p + sizeof(cql_packet_t), body, body_len);
+    }
+
+    bool ok = send(sock, p, sizeof(cql_packet_t) + body_len, 0) == (ssize_t)(sizeof(cql_packet_t) + body_len);
+    free(p);
+    return ok;
+}
+
+static cql_string_map_t* makePair(const char *key, const char *value, cql_string_map_t *next) {
+    cql_string_map_t *sm = (cql_string_map_t *)malloc(sizeof(cql_string_map_t));
+    sm->key = strdup(key);
+    sm->value = strdup(value);
+    sm->next = next;
+    return sm;
+}
+
+static bool sendStringMap(int sock, uint8_t opcode, cql_string_map_t *sm) {
+    uint32_t len = 0;
+    char *body = WriteStringMap(sm, &len);
+    bool ok = UpstreamSendRequest(sock, opcode, body, len);
+    free(body);
+    FreeStringMap(sm);
+    return ok;
+}
+
+/*
+ * Waits for READY from Cassandra, logging in as "root" if Cassandra asks for credentials first. Returns false on any other reply.
+ */
+bool UpstreamWaitReady(int sock) {
+    cql_packet_t *p = UpstreamRecvPacket(sock);
+    if (p != NULL && p->opcode == CQL_OPCODE_AUTHENTICATE) {
+        free(p);
+        if (!sendStringMap(sock, CQL_OPCODE_CREDENTIALS, makePair("username", CASSANDRA_ROOT_USERNAME, makePair("password", CASSANDRA_ROOT_PASSWORD, NULL)))) {
+            return false;
+        }
+        p = UpstreamRecvPacket(sock);
+    }
+
+    bool ready = (p != NULL && p->opcode == CQL_OPCODE_READY);
+    free(p);
+    return ready;
+}
+
+/*
+ * Starts up a connection of the gateway's own, as "root". Returns false on error.
+ */
+bool UpstreamStartup(int sock) {
+    return sendStringMap(sock, CQL_OPCODE_STARTUP, makePair("CQL_VERSION", "3.0.0", NULL)) && UpstreamWaitReady(sock);
+}
+
+/*
+ * Connects to a node, giving up after upstream_timeout_ms rather than waiting out TCP's retries on a node that is down. Returns
+ * the socket, or -1 with errno set.
+ */
+static int connectNode(const struct sockaddr_in *addr) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        return -1;
+    }
+
+    int flags = fcntl(sock, F_GETFL, 0);
+    fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+    if (connect(sock, (const struct sockaddr *)addr, sizeof(*addr)) < 0) {
+        int err = errno;
+        if (err == EINPROGRESS) {
+            struct pollfd p = {sock, POLLOUT, 0};
+            int ready = poll(&p, 1, gateway_config.upstream_timeout_ms);
+            socklen_t len = sizeof(err);
+            if (ready == 0) {
+                err = ETIMEDOUT;
+            }
+            else if (ready < 0) {
+                err = errno;
+            }
+            else if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
+                err = errno;
+            }
+        }
+        if (err != 0) {
+            close(sock);
+            errno = err;
+            return -1;
+        }
+    }
+    fcntl(sock, F_SETFL, flags); // The connection threads use blocking calls
+
+    return sock;
+}
+
+/*
+ * Resets a node's failures after a good health check or connection, and puts it back in service if it was ejected.
+ */
+static void nodeSucceeded(cql_node_t *n) {
+    pthread_mutex_lock(&upstream_mutex);
+    n->failures = 0;
+    bool reinstated = !n->up;
+    n->up = true;
+    pthread_mutex_unlock(&upstream_mutex);
+
+    if (reinstated) {
+        LOG(LOG_WARN, "Cassandra node %s is answering again, giving it new connections.\n", n->name);
+    }
+}
+
+/*
+ * Counts a failed health check or connection against a node, ejecting it after health_check_failures in a row. Without health
+ * checks nothing would put it back, so nodes are then never ejected.
+ */
+void UpstreamFailed(cql_node_t *n, const char *why) {
+    pthread_mutex_lock(&upstream_mutex);
+    n->failures++;
+    n->checks_failed++;
+    bool ejected = n->up && n->failures >= gateway_config.health_check_failures && gateway_config.health_check_interval_ms > 0;
+    cql_packet_t *supported = NULL;
+    if (ejected) {
+        n->up = false;
+        n->ejections++;
+        supported = n->supported;
+        n->supported = NULL;
+    }
+    uint32_t failures = n->failures;
+    pthread_mutex_unlock(&upstream_mutex);
+    free(supported);
+
+    if (ejected) {
+        LOG(LOG_WARN, "Cassandra node %s failed %u times in a row (%s), giving it no new connections.\n", n->name, failures, why);
+    }
+    else {
+        LOG(LOG_INFO, "Cassandra node %s failed (%s).\n", n->name, why);
+    }
+}
+
+/*
+ * Returns the node a new connection should go to, of those not yet tried, or NULL if all have been. Called with upstream_mutex held.
+ */
+static cql_node_t* pickNode(const std::vector<bool> &tried) {
+    std::vector<bool> usable(node_count, false); // in service, and not kept out by its circuit breaker
+    bool any_usable = false;
+    for (uint32_t i = 0; i < node_count; i++) {
+        usable[i] = nodes[i].up && BreakerAllows(&nodes[i]);
+        any_usable = any_usable || (!tried[i] && usable[i]);
+    }
+
+    cql_node_t *best = NULL;
+    uint32_t best_outstanding = 0;
+    for (uint32_t k = 0; k < node_count; k++) {
+        uint32_t i = (next_node + k) % node_count;
+        cql_node_t *n = &nodes[i];
+        if (tried[i] || (any_usable && !usable[i])) {
+            continue;
+        }
+
+        uint32_t outstanding = __atomic_load_n(&n->outstanding, __ATOMIC_RELAXED);
+        if (best == NULL || outstanding < best_outstanding || (outstanding == best_outstanding && n->connections < best->connections)) {
+            best = n;
+            best_outstanding = outstanding;
+        }
+    }
+    next_node = (next_node + 1) % node_count;
+
+    return best;
+}
+
+/*
+ * Opens a connection to a given node. Returns false if it can't be reached. UpstreamRelease() must be called once the socket in
+ * *fd is closed.
+ */
+bool UpstreamConnectTo(cql_node_t *n, int *fd) {
+    pthread_mutex_lock(&upstream_mutex);
+    n->connections++; // Counted straight away, so connections opened meanwhile go elsewhere
+    pthread_mutex_unlock(&upstream_mutex);
+
+    LOG(LOG_DEBUG, "Establishing connection to Cassandra node %s.\n", n->name);
+    *fd = connectNode(&n->addr);
+    if (*fd >= 0) {
+        nodeSucceeded(n);
+        return true;
+    }
+
+    const char *why = strerror(errno);
+    UpstreamRelease(n);
+    UpstreamFailed(n, why);
+    return false;
+}
+
+/*
+ * Opens a connection to the least loaded node that will take one, trying the others in turn if it can't be reached. Returns the
+ * node, with the socket in *fd, or NULL if no node could be reached. UpstreamRelease() must be called once the socket is closed.
+ */
+cql_node_t* UpstreamConnect(int *fd) {
+    std::vector<bool> tried(node_count, false);
+    while (1) {
+        pthread_mutex_lock(&upstream_mutex);
+        cql_node_t *n = pickNode(tried);
+        pthread_mutex_unlock(&upstream_mutex);
+        if (n == NULL) {
+            return NULL;
+        }
+        tried[n - nodes] = true;
+
+        if (UpstreamConnectTo(n, fd)) {
+            return n;
+        }
+    }
+}
+
+/*
+ * Returns the configured nodes, which never change once the gateway has started.
+ */
+cql_node_t* UpstreamNodes(uint32_t *count) {
+    *count = node_count;
+    return nodes;
+}
+
+/*
+ * Notes that a connection opened by UpstreamConnect() was closed.
+ */
+void UpstreamRelease(cql_node_t *n) {
+    pthread_mutex_lock(&upstream_mutex);
+    n->connections--;
+    pthread_mutex_unlock(&upstream_mutex);
+}
+
+/*
+ * Sends a node OPTIONS on a connection of its own, and waits for SUPPORTED. Returns false, with the reason in *why, if it doesn't
+ * come within upstream_timeout_ms.
+ */
+static bool checkNode(cql_node_t *n, const char **why) {
+    int sock = connectNode(&n->addr);
+    if (sock < 0) {
+        *why = strerror(errno);
+        return false;
+    }
+
+    struct timeval timeout;
+    timeout.tv_sec = gateway_config.upstream_timeout_ms / 1000;
+    timeout.tv_usec = (gateway_config.upstream_timeout_ms % 1000) * 1000;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    bool ok = false;
+    if (!UpstreamSendRequest(sock, CQL_OPCODE_OPTIONS, NULL, 0)) {
+        *why = "could not send OPTIONS";
+    }
+    else {
+        cql_packet_t *p = UpstreamRecvPacket(sock);
+        if (p == NULL) {
+            *why = "no answer to OPTIONS";
+        }
+        else if (p->opcode != CQL_OPCODE_SUPPORTED) {
+            *why = "unexpected answer to OPTIONS";
+        }
+        else {
+            UpstreamLearnSupported(n, p);
+            ok = true;
+        }
+        free(p);
+    }
+    close(sock);
+
+    return ok;
+}
+
+static void* HandleHealthChecks(void *arg) {
+    (void)arg;
+
+    while (1) {
+        for (uint32_t i = 0; i < node_count; i++) {
+            const char *why = NULL;
+            if (checkNode(&nodes[i], &why)) {
+                nodeSucceeded(&nodes[i]);
+            }
+            else {
+                UpstreamFailed(&nodes[i], why);
+            }
+        }
+        usleep(gateway_config.health_check_interval_ms * 1000);
+    }
+
+    return NULL;
+}
+
+/*
+ * Sets up the configured nodes, all in service to begin with, and starts checking their health if configured.
+ */
+void StartUpstream() {
+    node_count = gateway_config.cassandra_nodes.size();
+    nodes = (cql_node_t *)calloc(node_count, sizeof(cql_node_t));
+    for (uint32_t i = 0; i < node_count; i++) {
+        nodes[i].addr = gateway_config.cassandra_nodes[i];
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &nodes[i].addr.sin_addr, ip, sizeof(ip));
+        snprintf(nodes[i].name, sizeof(nodes[i].name), "%s:%u", ip, ntohs(nodes[i].addr.sin_port));
+        nodes[i].up = true;
+        LOG(LOG_INFO, "Cassandra node %s configured.\n", nodes[i].name);
+    }
+
+    if (gateway_config.health_check_interval_ms == 0) {
+        return;
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, HandleHealthChecks, NULL) != 0) {
+        fprintf(stderr, "pthread_create failed for health check thread.\n");
+        exit(1);
+    }
+    pthread_detach(thread);
+}
+
+/*
+ * Keeps a SUPPORTED frame a node answered OPTIONS with, to answer clients' OPTIONS with.
+ */
+void UpstreamLearnSupported(cql_node_t *n, cql_packet_t *packet) {
+    size_t len = sizeof(cql_packet_t) + ntohl(packet->length);
+    cql_packet_t *copy = (cql_packet_t *)malloc(len);
+    memcpy(copy, packet, len);
+    copy->version = CQL_V1_RESPONSE;
+    copy->flags = CQL_FLAG_NONE;
+    copy->stream = 0;
+
+    pthread_mutex_lock(&upstream_mutex);
+    cql_packet_t *old = n->supported;
+    n->supported = copy;
+    pthread_mutex_unlock(&upstream_mutex);
+    free(old);
+}
+
+/*
+ * Returns a client's answer to OPTIONS on the given stream, from the SUPPORTED frame of a node: the given one if it has one, or
+ * else any other, since a cluster's nodes run the same version. Returns NULL if no node has answered OPTIONS yet. The caller
+ * frees the packet.
+ */
+cql_packet_t* UpstreamCachedSupported(cql_node_t *n, int8_t stream) {
+    cql_packet_t *copy = NULL;
+    pthread_mutex_lock(&upstream_mutex);
+    uint32_t first = (n != NULL) ? n - nodes : 0;
+    for (uint32_t k = 0; k < node_count && copy == NULL; k++) {
+        cql_packet_t *supported = nodes[(first + k) % node_count].supported;
+        if (supported != NULL) {
+            size_t len = sizeof(cql_packet_t) + ntohl(supported->length);
+            copy = (cql_packet_t *)malloc(len);
+            memcpy(copy, supported, len);
+            copy->stream = stream;
+        }
+    }
+    pthread_mutex_unlock(&upstream_mutex);
+    return copy;
+}
+
+/*
+ * Returns the state of every node in the Prometheus text format, for the stats endpoint.
+ */
+std::string UpstreamRender() {
+    const char *names[5] = {"upstream_up", "upstream_outstanding_requests", "upstream_connections", "upstream_failures_total",
+                            "upstream_ejections_total"};
+    const char *types[5] = {"gauge", "gauge", "gauge", "counter", "counter"};
+    const char *help[5] = {"Whether the Cassandra node is given new connections.", "Requests forwarded to the node and not yet answered.",
+                           "Connections open to the node.", "Failed health checks and connections of the node.",
+                           "Times the node was taken out of service."};
+    std::vector<uint64_t> values(node_count * 5);
+    pthread_mutex_lock(&upstream_mutex);
+    for (uint32_t i = 0; i < node_count; i++) {
+        values[i * 5 + 0] = nodes[i].up;
+        values[i * 5 + 1] = __atomic_load_n(&nodes[i].outstanding, __ATOMIC_RELAXED);
+        values[i * 5 + 2] = nodes[i].connections;
+        values[i * 5 + 3] = nodes[i].checks_failed;
+        values[i * 5 + 4] = nodes[i].ejections;
+    }
+    pthread_mutex_unlock(&upstream_mutex);
+
+    std::string out;
+    char line[256];
+    for (int m = 0; m < 5; m++) {
+        snprintf(line, sizeof(line), "# HELP cql_gateway_%s %s\n# TYPE cql_gateway_%s %s\n", names[m], help[m], names[m], types[m]);
+        out += line;
+        for (uint32_t i = 0; i < node_count; i++) {
+            snprintf(line, sizeof(line), "cql_gateway_%s{node=\"%s\"} %lu\n", names[m], nodes[i].name, (unsigned long)values[i * 5 + m]);
+            out += line;
+        }
+    }
+
+    return out;
+}
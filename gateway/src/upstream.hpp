@@ -0,0 +1,48 @@
+#ifndef _UPSTREAM_H
+#define _UPSTREAM_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include <string>
+
+#include "gateway.hpp"
+
+// A Cassandra node the gateway connects to
+typedef struct cql_node {
+  struct sockaddr_in addr;
+  char name[24];          // "<address>:<port>", for logs and stats
+  uint32_t outstanding;   // requests forwarded to the node and not yet answered, see overload.cpp
+  uint32_t connections;   // connections open to the node, not counting health checks
+  bool up;                // whether the node is given new connections
+  uint32_t failures;      // failed health checks and connections in a row
+  uint64_t checks_failed; // failed health checks and connections, ever
+  uint64_t ejections;     // times the node was taken out of service
+  cql_packet_t *supported; // SUPPORTED frame the node last answered OPTIONS with, NULL until it has or once it is ejected
+
+  // Its circuit breaker, protected by the breaker's own mutex, see breaker.cpp
+  int breaker;            // BREAKER_*
+  uint64_t breaker_opened_us; // when it last opened
+  uint64_t window_start_us; // requests answered since then count towards opening it
+  uint32_t window_requests;
+  uint32_t window_failures;
+  uint32_t probes;        // requests answered in time since it went half-open
+  uint32_t probes_in_flight; // requests let through while half-open and not yet answered, at most breaker_probes
+  uint64_t trips;         // times it opened
+} cql_node_t;
+
+void StartUpstream();
+cql_node_t* UpstreamNodes(uint32_t *count);
+cql_node_t* UpstreamConnect(int *fd);
+bool UpstreamConnectTo(cql_node_t *n, int *fd);
+void UpstreamRelease(cql_node_t *n);
+void UpstreamFailed(cql_node_t *n, const char *why);
+cql_packet_t* UpstreamRecvPacket(int sock);
+bool UpstreamSendRequest(int sock, uint8_t opcode, const char *body, uint32_t body_len);
+bool UpstreamWaitReady(int sock);
+bool UpstreamStartup(int sock);
+void UpstreamLearnSupported(cql_node_t *n, cql_packet_t *packet);
+cql_packet_t* UpstreamCachedSupported(cql_node_t *n, int8_t stream);
+std::string UpstreamRender();
+
+#endif
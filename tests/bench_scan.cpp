@@ -0,0 +1,211 @@
+/*
+ * bench_scan.cpp - Benchmarks the scanning kernels in gateway/src/scan.cpp against the per-cell string code they replaced
+ * CSC 652 - 2014
+ *
+ * Build with `make bench` and run `./bench_scan`. Every kernel the CPU supports is checked against the old code for the same
+ * answers before it is timed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include <string>
+#include <vector>
+#include <boost/algorithm/string.hpp>
+
+#include "../gateway/src/gateway.hpp"
+#include "../gateway/src/helpers.hpp"
+#include "../gateway/src/scan.hpp"
+
+#define TOKEN "a1b2c3d4e5f6a7b8c9d0"
+
+// The previous implementations, kept here as the baseline
+
+static bool legacy_interestingPacket(std::string st) {
+    boost::to_lower(st);
+    return st.find("system") != std::string::npos || st.find("permissions") != std::string::npos || st.find("users") != std::string::npos;
+}
+
+// Still what gateway.cpp does for ERROR strings: on messages this short, setting up a scan cost more than strstr() saved
+static size_t legacy_strip(char *err, const char *token) {
+    while (strstr(err, token) != NULL) {
+        char *p = strstr(err, token);
+        memmove(p, p + TOKEN_LENGTH, 1 + strlen(p + TOKEN_LENGTH));
+    }
+    return strlen(err);
+}
+
+// Per-cell prefix stripping as the ROWS loop used to do it: copy every cell out, strncmp/memmove the text ones, write back
+static uint32_t legacy_strip_rows(char *buf, int32_t rows, int32_t cols, const char *token) {
+    std::vector<std::pair<char *, int32_t> > cells;
+    uint32_t offset = 0;
+    for (int32_t i = 0; i < rows * cols; i++) {
+        int32_t num_bytes;
+        memcpy(&num_bytes, buf + offset, 4);
+        num_bytes = ntohl(num_bytes);
+        offset += 4;
+        char *content = (char *)malloc(num_bytes);
+        memcpy(content, buf + offset, num_bytes);
+        offset += num_bytes;
+        if (num_bytes > TOKEN_LENGTH && strncmp(token, content, TOKEN_LENGTH) == 0) {
+            memmove(content, content + TOKEN_LENGTH, num_bytes - TOKEN_LENGTH);
+            num_bytes -= TOKEN_LENGTH;
+        }
+        cells.push_back(std::make_pair(content, num_bytes));
+    }
+    offset = 0;
+    for (size_t i = 0; i < cells.size(); i++) {
+        int32_t len = htonl(cells[i].second);
+        memcpy(buf + offset, &len, 4);
+        memcpy(buf + offset + 4, cells[i].first, cells[i].second);
+        offset += 4 + cells[i].second;
+        free(cells[i].first);
+    }
+    return offset;
+}
+
+// The new code paths, as used in gateway.cpp
+
+static uint32_t index_strip_rows(char *buf, int32_t rows, int32_t cols, const char *token) {
+    cql_result_index_t *index = IndexCQLResults(buf, rows, cols);
+    for (int32_t j = 0; j < cols; j++) {
+        StripColumnPrefix(buf, index, j, token, TOKEN_LENGTH);
+    }
+    int32_t new_rows = 0;
+    uint32_t len = CompactCQLResults(buf, index, TOKEN_LENGTH, &new_rows);
+    FreeResultIndex(index);
+    return len;
+}
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static std::vector<std::string> make_queries() {
+    std::vector<std::string> q;
+    q.push_back("SELECT * FROM " TOKEN "mykeyspace.users WHERE id = 42;");
+    q.push_back("INSERT INTO " TOKEN "mykeyspace.events (id, ts, payload) VALUES (1, 2, 'hello world');");
+    q.push_back("SELECT * FROM system.schema_columnfamilies WHERE keyspace_name = '" TOKEN "mykeyspace';");
+    q.push_back("UPDATE " TOKEN "app.counters SET hits = hits + 1 WHERE page = 'index';");
+
+    std::string big("BEGIN BATCH ");
+    for (int i = 0; i < 64; i++) {
+        big += "INSERT INTO " TOKEN "metrics.samples (host, ts, value) VALUES ('host-17', 1400000000, 3.25); ";
+    }
+    big += "APPLY BATCH;";
+    q.push_back(big);
+    return q;
+}
+
+static std::vector<std::string> make_errors() {
+    std::vector<std::string> e;
+    e.push_back("Keyspace '" TOKEN "test1' does not exist");
+    e.push_back("Cannot add already existing column family \"users\" to keyspace \"" TOKEN "app\"");
+    e.push_back("unconfigured columnfamily missing in keyspace " TOKEN "app (referenced from " TOKEN "app.view)");
+    e.push_back("Undefined name value in where clause ('value = 1')");
+    return e;
+}
+
+// Rows as returned for system.schema_columnfamilies: keyspace, table and comment, most of them prefixed with a token
+static std::string make_rows(int32_t rows) {
+    std::string out;
+    const char *tokens[] = {TOKEN, TOKEN, "f00dbabe0123456789ab"};
+    for (int32_t i = 0; i < rows; i++) {
+        char table[32];
+        snprintf(table, sizeof(table), "table_%d", i);
+        std::string cols[3] = {std::string(tokens[i % 3]) + "app", table, std::string(TOKEN) + "ignored unless it is a prefix"};
+        for (int c = 0; c < 3; c++) {
+            int32_t len = htonl(cols[c].size());
+            out.append((char *)&len, 4);
+            out += cols[c];
+        }
+    }
+    return out;
+}
+
+static bool verify(const std::vector<std::string> &queries) {
+    for (size_t i = 0; i < queries.size(); i++) {
+        if (interestingPacket(MakeSpan(queries[i].data(), queries[i].size())) != legacy_interestingPacket(queries[i])) {
+            fprintf(stderr, "interestingPacket mismatch on query %zu\n", i);
+            return false;
+        }
+    }
+
+    std::string rows = make_rows(500);
+    std::string a(rows);
+    std::string b(rows);
+    uint32_t a_len = legacy_strip_rows(&a[0], 500, 3, TOKEN);
+    uint32_t b_len = index_strip_rows(&b[0], 500, 3, TOKEN);
+    if (a_len != b_len || memcmp(a.data(), b.data(), a_len) != 0) {
+        fprintf(stderr, "column strip mismatch\n");
+        return false;
+    }
+    return true;
+}
+
+template <typename F>
+static void run(const char *name, const char *impl, long iterations, F f) {
+    volatile long sink = 0;
+    double start = now_ns();
+    for (long i = 0; i < iterations; i++) {
+        sink += f();
+    }
+    double elapsed = now_ns() - start;
+    printf("%-22s %-8s %10.1f ns/op\n", name, impl, elapsed / iterations);
+}
+
+int main(int argc, char **argv) {
+    long iterations = (argc > 1) ? atol(argv[1]) : 200000;
+
+    std::vector<std::string> queries = make_queries();
+    std::vector<std::string> errors = make_errors();
+    std::string rows = make_rows(2000);
+    std::string scratch(rows);
+
+    // Baseline
+    run("interestingPacket", "legacy", iterations, [&]() {
+        long n = 0;
+        for (size_t i = 0; i < queries.size(); i++) n += legacy_interestingPacket(queries[i]);
+        return n;
+    });
+    run("strip token (ERROR)", "legacy", iterations, [&]() {
+        long n = 0;
+        char buf[256];
+        for (size_t i = 0; i < errors.size(); i++) {
+            memcpy(buf, errors[i].c_str(), errors[i].size() + 1);
+            n += legacy_strip(buf, TOKEN);
+        }
+        return n;
+    });
+    run("strip rows (2000x3)", "legacy", iterations / 1000, [&]() {
+        memcpy(&scratch[0], rows.data(), rows.size());
+        return (long)legacy_strip_rows(&scratch[0], 2000, 3, TOKEN);
+    });
+
+    for (int impl = SCAN_IMPL_SCALAR; impl <= SCAN_IMPL_AVX2; impl++) {
+        if (!ScanForceImpl(impl)) {
+            continue;
+        }
+        if (!verify(queries)) {
+            fprintf(stderr, "%s kernel disagrees with the legacy helpers!\n", ScanImplName());
+            return 1;
+        }
+
+        run("interestingPacket", ScanImplName(), iterations, [&]() {
+            long n = 0;
+            for (size_t i = 0; i < queries.size(); i++) n += interestingPacket(MakeSpan(queries[i].data(), queries[i].size()));
+            return n;
+        });
+        run("strip rows (2000x3)", ScanImplName(), iterations / 1000, [&]() {
+            memcpy(&scratch[0], rows.data(), rows.size());
+            return (long)index_strip_rows(&scratch[0], 2000, 3, TOKEN);
+        });
+    }
+
+    return 0;
+}
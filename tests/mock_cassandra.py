@@ -0,0 +1,102 @@
+#!/usr/bin/python2
+
+# A mock Cassandra node for the tests that run the gateway without Cassandra (test_upstream.py and test_ring.py), and the helpers
+# to read and write protocol frames with. MockNode answers every request with READY; the tests subclass it and override answer()
+# for what they need.
+
+import socket
+import struct
+import threading
+
+OPCODE_ERROR = 0x00
+OPCODE_STARTUP = 0x01
+OPCODE_READY = 0x02
+OPCODE_CREDENTIALS = 0x04
+OPCODE_OPTIONS = 0x05
+OPCODE_SUPPORTED = 0x06
+OPCODE_QUERY = 0x07
+OPCODE_RESULT = 0x08
+OPCODE_PREPARE = 0x09
+OPCODE_EXECUTE = 0x0A
+OPCODE_REGISTER = 0x0B
+OPCODE_EVENT = 0x0C
+
+def recv_exactly(sock, n):
+    data = ''
+    while len(data) < n:
+        chunk = sock.recv(n - len(data))
+        if not chunk:
+            return None
+        data += chunk
+    return data
+
+def recv_versioned_frame(sock):
+    header = recv_exactly(sock, 8)
+    if header is None:
+        return None
+    version, flags, stream, opcode, length = struct.unpack('>BBbBi', header)
+    body = recv_exactly(sock, length) if length > 0 else ''
+    return (version, stream, opcode, body)
+
+def recv_frame(sock):
+    request = recv_versioned_frame(sock)
+    return request[1:] if request is not None else None
+
+def frame(version, stream, opcode, body=''):
+    return struct.pack('>BBbBi', version, 0, stream, opcode, len(body)) + body
+
+def string(s):
+    return struct.pack('>H', len(s)) + s
+
+def string_map(pairs):
+    return struct.pack('>H', len(pairs)) + ''.join([string(k) + string(v) for k, v in pairs])
+
+class MockNode(object):
+    # A Cassandra node listening on 127.0.0.1, which remembers the opcodes it was sent on each connection
+
+    def __init__(self, port):
+        self.port = port
+        self.connections = [] # opcodes received, one list per connection
+        self.lock = threading.Lock()
+        self.listener = None
+
+    def start(self):
+        self.listener = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        self.listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        self.listener.bind(('127.0.0.1', self.port))
+        self.listener.listen(64)
+        thread = threading.Thread(target=self.accept, args=(self.listener,))
+        thread.daemon = True
+        thread.start()
+
+    def stop(self):
+        self.listener.shutdown(socket.SHUT_RDWR)
+        self.listener.close()
+
+    def accept(self, listener):
+        while True:
+            try:
+                conn, addr = listener.accept()
+            except socket.error:
+                return
+            opcodes = []
+            with self.lock:
+                self.connections.append(opcodes)
+            thread = threading.Thread(target=self.serve, args=(conn, opcodes))
+            thread.daemon = True
+            thread.start()
+
+    def answer(self, conn, version, opcode, body):
+        # Returns the opcode and body to answer a request with. Called on the connection's own thread, which it may hold up
+        return OPCODE_READY, ''
+
+    def serve(self, conn, opcodes):
+        while True:
+            request = recv_versioned_frame(conn)
+            if request is None:
+                conn.close()
+                return
+            version, stream, opcode, body = request
+            opcodes.append(opcode)
+            answer, answer_body = self.answer(conn, version, opcode, body)
+            conn.sendall(frame(0x80 | version, stream, answer, answer_body)) # In the version asked, for the gateway's driver
@@ -0,0 +1,91 @@
+/*
+ * test_fingerprint.cpp - Checks the statement normalization in gateway/src/fingerprint.cpp, which slow queries are grouped by
+ * CSC 652 - 2014
+ *
+ * Build with `make fingerprint` and run `./test_fingerprint`. Prints each statement that doesn't normalize as expected, and exits
+ * with 1 if there was any.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+
+#include "../gateway/src/fingerprint.hpp"
+
+typedef struct {
+    const char *query;
+    const char *normalized;
+} normalize_case_t;
+
+static const normalize_case_t cases[] = {
+    // Whitespace and case
+    {"SELECT * FROM ks.t", "select * from ks.t"},
+    {"  SELECT  *\n\tFROM ks.t ;  ", "select * from ks.t"},
+
+    // String literals, with '' for a quote inside one
+    {"SELECT * FROM t WHERE name = 'bob'", "select * from t where name = ?"},
+    {"SELECT * FROM t WHERE name = 'O''Brien'", "select * from t where name = ?"},
+    {"SELECT * FROM t WHERE name = ''''", "select * from t where name = ?"},
+    {"SELECT * FROM t WHERE name = '' AND x = 1", "select * from t where name = ? and x = ?"},
+    {"INSERT INTO t (a) VALUES ('a;b WHERE c')", "insert into t (a) values (?)"},
+
+    // Uuids, but not identifiers that merely contain digits
+    {"SELECT * FROM t WHERE id = 123e4567-e89b-12d3-a456-426655440000", "select * from t where id = ?"},
+    {"SELECT * FROM t WHERE id = 123E4567-E89B-12D3-A456-426655440000", "select * from t where id = ?"},
+    {"SELECT * FROM t2 WHERE c3 = 4", "select * from t2 where c3 = ?"},
+
+    // Numbers: negative, decimal, with an exponent, and blobs
+    {"SELECT * FROM t WHERE x = -42", "select * from t where x = ?"},
+    {"SELECT * FROM t WHERE x = 3.14", "select * from t where x = ?"},
+    {"SELECT * FROM t WHERE x = 6.02e23", "select * from t where x = ?"},
+    {"SELECT * FROM t WHERE x = 1.5E-10", "select * from t where x = ?"},
+    {"SELECT * FROM t WHERE x = -2e+5", "select * from t where x = ?"},
+    {"SELECT * FROM t WHERE b = 0xCAFE", "select * from t where b = ?"},
+    {"SELECT * FROM t WHERE x=-1", "select * from t where x=?"},
+
+    // Booleans, as whole words only
+    {"SELECT * FROM t WHERE ok = TRUE AND no = false", "select * from t where ok = ? and no = ?"},
+    {"SELECT * FROM t WHERE trueish = 1", "select * from t where trueish = ?"},
+
+    // IN lists of any length fold to one
+    {"SELECT * FROM t WHERE id IN (1, 2, 3)", "select * from t where id in (?)"},
+    {"SELECT * FROM t WHERE id IN (1,2,3,4,5,6)", "select * from t where id in (?)"},
+    {"SELECT * FROM t WHERE id IN ('a' , 'b')", "select * from t where id in (?)"},
+    {"SELECT * FROM t WHERE (a, b) = (1, 2)", "select * from t where (a, b) = (?)"},
+    {"SELECT a, b FROM t WHERE x = 1", "select a, b from t where x = ?"},
+
+    // Quoted identifiers keep their case and whatever they contain
+    {"SELECT \"MyColumn\" FROM \"MyKs\".\"MyTable\"", "select \"MyColumn\" from \"MyKs\".\"MyTable\""},
+    {"SELECT \"a 'b' 1\" FROM t", "select \"a 'b' 1\" from t"},
+    {"SELECT \"unterminated", "select \"unterminated"},
+
+    // Literals cut off at the end of the query
+    {"SELECT * FROM t WHERE name = 'unterminated", "select * from t where name = ?"},
+    {"SELECT * FROM t WHERE x = -", "select * from t where x = -"},
+};
+
+int main() {
+    int failed = 0;
+    size_t count = sizeof(cases) / sizeof(cases[0]);
+    for (size_t i = 0; i < count; i++) {
+        std::string normalized = NormalizeQuery(cases[i].query, strlen(cases[i].query));
+        if (normalized != cases[i].normalized) {
+            printf("FAIL: %s\n  expected: %s\n  got:      %s\n", cases[i].query, cases[i].normalized, normalized.c_str());
+            failed++;
+        }
+    }
+
+    // Statements that normalize the same share a fingerprint
+    if (FingerprintOf(NormalizeQuery("SELECT 1", 8)) != FingerprintOf(NormalizeQuery("select  2", 9))) {
+        printf("FAIL: equal statements have different fingerprints\n");
+        failed++;
+    }
+    if (NormalizeExecute("\x01\xab", 2) != "execute 0x01ab") {
+        printf("FAIL: execute id\n");
+        failed++;
+    }
+
+    printf("%d of %d checks failed.\n", failed, (int)count + 2);
+    return failed > 0 ? 1 : 0;
+}
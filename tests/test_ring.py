@@ -0,0 +1,218 @@
+#!/usr/bin/python2
+
+# Tests of token-aware routing: with ring_refresh_s set, an EXECUTE whose partition key is bound goes to the node owning its
+# partition. Cassandra is not needed: each node is a mock that owns one token, knows one table (ks.t, partitioned by an int "id"),
+# and records the keys of the EXECUTEs it was sent.
+#
+# Build the gateway first, then run this from the tests directory. Nothing else may be listening on 127.0.0.1:9042 (the gateway)
+# or on the ports below. The path of the gateway can be given in $GATEWAY.
+
+import hashlib
+import os
+import socket
+import struct
+import subprocess
+import tempfile
+import time
+import unittest
+import urllib2
+
+import mock_cassandra
+from mock_cassandra import (OPCODE_STARTUP, OPCODE_READY, OPCODE_OPTIONS, OPCODE_SUPPORTED, OPCODE_QUERY, OPCODE_RESULT,
+                            OPCODE_PREPARE, OPCODE_EXECUTE, recv_frame, frame, string, string_map)
+
+GATEWAY = os.environ.get('GATEWAY', '../gateway/src/gateway')
+NODE_PORTS = [19143, 19144, 19145]
+NODE_TOKENS = [-3000000000000000000, 0, 3000000000000000000]
+STATS_PORT = 19190
+
+QUERY = 'SELECT * FROM ks.t WHERE id = ?'
+
+MASK = (1 << 64) - 1
+
+def rotl(x, r):
+    return ((x << r) | (x >> (64 - r))) & MASK
+
+def fmix(k):
+    k ^= k >> 33
+    k = (k * 0xff51afd7ed558ccd) & MASK
+    k ^= k >> 33
+    k = (k * 0xc4ceb9fe1a85ec53) & MASK
+    k ^= k >> 33
+    return k
+
+def token(key):
+    # Cassandra's Murmur3Partitioner, for keys of up to 8 bytes
+    c1, c2 = 0x87c37b91114253d5, 0x4cf5ad432745937f
+    k1 = 0
+    for i in range(len(key)):
+        b = ord(key[i])
+        k1 ^= ((b - 256 if b > 127 else b) << (i * 8)) & MASK
+    h1, h2 = 0, 0
+    if key:
+        k1 = (k1 * c1) & MASK
+        k1 = rotl(k1, 31)
+        h1 ^= (k1 * c2) & MASK
+    h1 ^= len(key)
+    h2 ^= len(key)
+    h1 = (h1 + h2) & MASK
+    h2 = (h2 + h1) & MASK
+    h1 = (fmix(h1) + fmix(h2)) & MASK
+    return h1 - (1 << 64) if h1 >= (1 << 63) else h1
+
+def owner(key):
+    t = token(key)
+    for i, node_token in enumerate(NODE_TOKENS):
+        if t <= node_token:
+            return i
+    return 0
+
+def cell(value):
+    return struct.pack('>i', len(value)) + value
+
+def rows(columns, values):
+    # A ROWS result with columns given as (name, type option), and every value already serialized
+    body = struct.pack('>iii', 2, 1, len(columns)) + string('system') + string('t')
+    for name, type_id in columns:
+        body += string(name) + type_id
+    body += struct.pack('>i', len(values))
+    for row in values:
+        body += ''.join([cell(v) for v in row])
+    return body
+
+class MockNode(mock_cassandra.MockNode):
+    # A Cassandra node that answers just enough of the protocol for routing
+
+    def __init__(self, port, token):
+        mock_cassandra.MockNode.__init__(self, port)
+        self.token = token
+        self.executed = [] # keys of the EXECUTEs received
+        self.prepared = 0  # PREPAREs received
+        self.uses = 0      # USEs received
+
+    def answer(self, conn, version, opcode, body):
+        if opcode == OPCODE_OPTIONS:
+            return OPCODE_SUPPORTED, string_map([])
+        if opcode == OPCODE_QUERY:
+            query = body[4:4 + struct.unpack('>i', body[:4])[0]]
+            if query == 'SELECT tokens FROM system.local':
+                tokens = struct.pack('>H', 1) + string(str(self.token))
+                return OPCODE_RESULT, rows([('tokens', struct.pack('>HH', 0x22, 0x0D))], [[tokens]])
+            if query.startswith('SELECT keyspace_name, columnfamily_name, column_name, component_index, type'):
+                text = struct.pack('>H', 0x0D)
+                columns = [('keyspace_name', text), ('columnfamily_name', text), ('column_name', text),
+                           ('component_index', struct.pack('>H', 0x09)), ('type', text)]
+                return OPCODE_RESULT, rows(columns, [['ks', 't', 'id', '', 'partition_key'], ['ks', 't', 'v', '', 'regular']])
+            if query.startswith('USE '):
+                with self.lock:
+                    self.uses += 1
+                return OPCODE_RESULT, struct.pack('>i', 3) + string(query[4:].strip('"; '))
+            return OPCODE_RESULT, struct.pack('>i', 1)
+        if opcode == OPCODE_PREPARE:
+            with self.lock:
+                self.prepared += 1
+            query = body[4:4 + struct.unpack('>i', body[:4])[0]]
+            metadata = struct.pack('>ii', 1, 1) + string('ks') + string('t') + string('id') + struct.pack('>H', 0x09)
+            return OPCODE_RESULT, struct.pack('>i', 4) + string(hashlib.md5(query).digest()) + metadata
+        if opcode == OPCODE_EXECUTE:
+            id_len = struct.unpack('>H', body[:2])[0]
+            at = 2 + id_len + 2
+            key_len = struct.unpack('>i', body[at:at + 4])[0]
+            with self.lock:
+                self.executed.append(body[at + 4:at + 4 + key_len])
+            return OPCODE_RESULT, struct.pack('>i', 1)
+        return OPCODE_READY, ''
+
+class TestTokenAwareRouting(unittest.TestCase):
+
+    def setUp(self):
+        self.nodes = [MockNode(port, t) for port, t in zip(NODE_PORTS, NODE_TOKENS)]
+        for node in self.nodes:
+            node.start()
+
+        self.config = tempfile.NamedTemporaryFile(suffix='.conf')
+        self.config.write('cassandra_nodes = %s\n' % ', '.join(['127.0.0.1:%d' % port for port in NODE_PORTS]))
+        self.config.write('ring_refresh_s = 1\nstats_port = %d\n' % STATS_PORT)
+        self.config.flush()
+
+        self.gateway = subprocess.Popen([GATEWAY, '127.0.0.1', self.config.name])
+        time.sleep(1.5)
+
+        self.client = socket.create_connection(('127.0.0.1', 9042))
+        self.client.settimeout(2)
+        self.request(OPCODE_STARTUP, string_map([('CQL_VERSION', '3.0.0')]))
+
+    def tearDown(self):
+        self.client.close()
+        self.gateway.terminate()
+        self.gateway.wait()
+        for node in self.nodes:
+            node.stop()
+        self.config.close()
+
+    def request(self, opcode, body):
+        self.client.sendall(frame(0x01, 1, opcode, body))
+        answer = recv_frame(self.client)
+        self.assertIsNotNone(answer)
+        return answer
+
+    def execute(self, prepared_id, key):
+        stream, opcode, body = self.request(OPCODE_EXECUTE, string(prepared_id) + struct.pack('>H', 1) + cell(key) + struct.pack('>H', 1))
+        self.assertEqual(opcode, OPCODE_RESULT)
+
+    def metric(self, outcome):
+        stats = urllib2.urlopen('http://127.0.0.1:%d/' % STATS_PORT).read()
+        line = 'cql_gateway_token_aware_requests_total{outcome="%s"} ' % outcome
+        for l in stats.splitlines():
+            if l.startswith(line):
+                return int(l[len(line):])
+        self.fail('%s missing from the stats' % line)
+
+    def prepare(self, query):
+        stream, opcode, body = self.request(OPCODE_PREPARE, struct.pack('>i', len(query)) + query)
+        self.assertEqual(opcode, OPCODE_RESULT)
+        return hashlib.md5(query).digest()
+
+    def test_executes_go_to_the_owner(self):
+        prepared_id = self.prepare(QUERY)
+
+        keys = [struct.pack('>i', i) for i in range(30)]
+        self.assertEqual(len(set([owner(k) for k in keys])), 3) # The keys are spread over every node
+
+        # The first EXECUTEs prepare the statement on the other nodes
+        for key in keys:
+            self.execute(prepared_id, key)
+        time.sleep(0.2)
+        for node in self.nodes:
+            node.executed = []
+
+        for key in keys:
+            self.execute(prepared_id, key)
+        for i, node in enumerate(self.nodes):
+            self.assertEqual(sorted(node.executed), sorted([k for k in keys if owner(k) == i]))
+        self.assertEqual(sum([node.prepared for node in self.nodes]), 3) # Once on each node
+
+        self.assertEqual(self.metric('replica') + self.metric('local') + self.metric('coordinator'), 60)
+        self.assertGreaterEqual(self.metric('replica') + self.metric('local'), 30)
+
+    def test_statement_is_prepared_in_its_keyspace(self):
+        use = 'USE ks'
+        stream, opcode, body = self.request(OPCODE_QUERY, struct.pack('>i', len(use)) + use + struct.pack('>H', 1))
+        self.assertEqual(opcode, OPCODE_RESULT)
+        prepared_id = self.prepare('SELECT * FROM t WHERE id = ?')
+
+        keys = [struct.pack('>i', i) for i in range(30)]
+        for key in keys:
+            self.execute(prepared_id, key)
+        time.sleep(0.2)
+        for node in self.nodes:
+            node.executed = []
+
+        for key in keys:
+            self.execute(prepared_id, key)
+        for i, node in enumerate(self.nodes):
+            self.assertEqual(sorted(node.executed), sorted([k for k in keys if owner(k) == i]))
+        self.assertEqual(sum([node.uses for node in self.nodes]), 3) # The client's, then the gateway's on the other two nodes
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,437 @@
+#!/usr/bin/python2
+
+# Tests of how the gateway spreads connections over several Cassandra nodes, ejects and reinstates nodes as they fail and recover,
+# opens and closes their circuit breakers, times out and hedges requests, answers OPTIONS from what the nodes support, sends
+# events, and accepts clients on several sockets.
+# Cassandra is not needed: each node is a mock that answers OPTIONS with SUPPORTED, QUERY with an OVERLOADED error while it is set
+# to fail, the gateway's token lookup with a tenant of its own, and anything else with READY. It remembers the opcodes it was
+# sent on each connection, and can push an EVENT on the connection the gateway registered for events on.
+#
+# Build the gateway first, then run this from the tests directory. Nothing else may be listening on 127.0.0.1:9042 (the gateway)
+# or on the ports below. The path of the gateway can be given in $GATEWAY.
+
+import os
+import socket
+import struct
+import subprocess
+import tempfile
+import threading
+import time
+import unittest
+import urllib2
+
+import mock_cassandra
+from mock_cassandra import (OPCODE_ERROR, OPCODE_STARTUP, OPCODE_READY, OPCODE_CREDENTIALS, OPCODE_OPTIONS, OPCODE_SUPPORTED,
+                            OPCODE_QUERY, OPCODE_RESULT, OPCODE_PREPARE, OPCODE_EXECUTE, OPCODE_REGISTER, OPCODE_EVENT,
+                            recv_frame, frame, string, string_map)
+
+GATEWAY = os.environ.get('GATEWAY', '../gateway/src/gateway')
+NODE_PORTS = [19043, 19044, 19045]
+STATS_PORT = 19090
+
+ERROR_OVERLOADED = 0x1001
+ERROR_WRITE_TIMEOUT = 0x1100
+ERROR_READ_TIMEOUT = 0x1200
+
+# What the mock nodes answer OPTIONS with: a string multimap of CQL_VERSION to ['3.0.5']
+SUPPORTED = struct.pack('>HH', 1, 11) + 'CQL_VERSION' + struct.pack('>HH', 1, 5) + '3.0.5'
+
+# The tenant every user token is looked up as, when the gateway checks one on a node (see cassandra.cpp)
+INTERNAL_TOKEN = '0123456789abcdef0123'
+USER_TOKEN = 'u' * 20
+
+def token_rows():
+    # The ROWS result of the token lookup: the internal token, and an expiration of 0 for never, followed by a space since the
+    # gateway reads it with atoi() from a cell that isn't NUL-terminated
+    varchar = struct.pack('>H', 0x0D)
+    metadata = struct.pack('>ii', 1, 2) + string('multiTenantCassandra') + string('tokenTable')
+    metadata += string('internalToken') + varchar + string('expiration') + varchar
+    cells = ''.join([struct.pack('>i', len(v)) + v for v in [INTERNAL_TOKEN, '0 ']])
+    return struct.pack('>i', 2) + metadata + struct.pack('>i', 1) + cells
+
+class MockNode(mock_cassandra.MockNode):
+    # A Cassandra node that answers just enough of the protocol for the gateway
+
+    def __init__(self, port):
+        mock_cassandra.MockNode.__init__(self, port)
+        self.failing = False  # whether queries are answered with OVERLOADED
+        self.answering = threading.Event() # cleared to hold the answers to queries until it is set again
+        self.answering.set()
+        self.event_connection = None # the connection the gateway registered for events on, if it chose this node
+
+    def answer(self, conn, version, opcode, body):
+        if opcode == OPCODE_REGISTER:
+            with self.lock:
+                self.event_connection = conn
+        if opcode == OPCODE_QUERY:
+            self.answering.wait()
+        if opcode == OPCODE_OPTIONS:
+            return OPCODE_SUPPORTED, SUPPORTED
+        if opcode == OPCODE_QUERY and self.failing:
+            message = 'Overloaded'
+            return OPCODE_ERROR, struct.pack('>iH', ERROR_OVERLOADED, len(message)) + message
+        if opcode == OPCODE_QUERY and body[4:].startswith('USE '):
+            return OPCODE_RESULT, struct.pack('>i', 3) + string('multiTenantCassandra')
+        if opcode == OPCODE_PREPARE: # Only the token lookup is ever prepared here
+            metadata = struct.pack('>ii', 1, 1) + string('multiTenantCassandra') + string('tokenTable')
+            metadata += string('userToken') + struct.pack('>H', 0x0D)
+            if version >= 2: # From v2 on, followed by the result's metadata, left out since each ROWS carries its own
+                metadata += struct.pack('>ii', 0x0004, 2)
+            return OPCODE_RESULT, struct.pack('>i', 4) + string('token lookup') + metadata
+        if opcode == OPCODE_EXECUTE:
+            return OPCODE_RESULT, token_rows()
+        return OPCODE_READY, ''
+
+    def send_event(self, body):
+        # Pushes an EVENT on the event connection. Returns False if the gateway didn't open it on this node
+        with self.lock:
+            if self.event_connection is None:
+                return False
+            self.event_connection.sendall(frame(0x81, -1, OPCODE_EVENT, body))
+            return True
+
+    def clients(self):
+        # Connections opened for clients, which only ever see the client's STARTUP here; the event connection also sends
+        # REGISTER, and health checks only OPTIONS
+        with self.lock:
+            return len([c for c in self.connections if c == [OPCODE_STARTUP]])
+
+    def started(self):
+        # Connections that were started up, whatever was sent on them since
+        with self.lock:
+            return len([c for c in self.connections if c[:1] == [OPCODE_STARTUP]])
+
+class GatewayTestCase(unittest.TestCase):
+    # Runs the gateway in front of mock nodes, with settings of the test's own in extra_config
+
+    extra_config = ''
+
+    def setUp(self):
+        self.nodes = [MockNode(port) for port in NODE_PORTS]
+        for node in self.nodes:
+            node.start()
+
+        self.config = tempfile.NamedTemporaryFile(suffix='.conf')
+        self.config.write('cassandra_nodes = %s\n' % ', '.join(['127.0.0.1:%d' % port for port in NODE_PORTS]))
+        self.config.write('health_check_interval_ms = 100\nhealth_check_failures = 2\nupstream_timeout_ms = 200\n')
+        self.config.write('stats_port = %d\n' % STATS_PORT)
+        self.config.write(self.extra_config)
+        self.config.flush()
+
+        self.gateway = subprocess.Popen([GATEWAY, '127.0.0.1', self.config.name])
+        time.sleep(1)
+        self.clients = []
+
+    def tearDown(self):
+        for client in self.clients:
+            client.close()
+        self.gateway.terminate()
+        self.gateway.wait()
+        for node in self.nodes:
+            try:
+                node.stop()
+            except socket.error:
+                pass
+        self.config.close()
+
+    def connect_client(self):
+        # Opens a client connection through the gateway and starts it up. Returns the socket, or None if the gateway closed it
+        # instead.
+        client = socket.create_connection(('127.0.0.1', 9042))
+        client.settimeout(2)
+        self.clients.append(client)
+        client.sendall(frame(0x01, 1, OPCODE_STARTUP, string_map([('CQL_VERSION', '3.0.0')])))
+        try:
+            answer = recv_frame(client)
+        except socket.error:
+            return None
+        return client if answer is not None and answer[1] == OPCODE_READY else None
+
+    def query(self, client, query):
+        # Sends a QUERY and returns the opcode of the answer
+        client.sendall(frame(0x01, 1, OPCODE_QUERY, struct.pack('>i', len(query)) + query + struct.pack('>H', 1)))
+        answer = recv_frame(client)
+        self.assertIsNotNone(answer)
+        return answer[1]
+
+    def metric(self, name, node=None):
+        stats = urllib2.urlopen('http://127.0.0.1:%d/' % STATS_PORT).read()
+        line = ('%s{node="127.0.0.1:%d"} ' % (name, node.port)) if node is not None else name + ' '
+        for l in stats.splitlines():
+            if l.startswith(line):
+                return int(l[len(line):])
+        self.fail('%s missing from the stats' % line)
+
+class TestUpstreamNodes(GatewayTestCase):
+
+    def test_connections_are_spread_over_nodes(self):
+        for i in range(6):
+            self.assertTrue(self.connect_client())
+        time.sleep(0.2)
+
+        # Nothing is outstanding, so connections go to the node with the fewest
+        self.assertEqual([node.clients() for node in self.nodes], [2, 2, 2])
+        self.assertEqual(sum([self.metric('cql_gateway_upstream_connections', node) for node in self.nodes]), 6 + 1) # and events
+
+    def test_failed_node_is_ejected_and_reinstated(self):
+        down = self.nodes[2]
+        down.stop()
+        time.sleep(0.5)
+        self.assertEqual(self.metric('cql_gateway_upstream_up', down), 0)
+        self.assertEqual(self.metric('cql_gateway_upstream_ejections_total', down), 1)
+
+        for i in range(4):
+            self.assertTrue(self.connect_client())
+        self.assertEqual(self.nodes[0].clients() + self.nodes[1].clients(), 4)
+
+        down.start()
+        time.sleep(0.5)
+        self.assertEqual(self.metric('cql_gateway_upstream_up', down), 1)
+
+        # The recovered node has the fewest connections, so it gets the next one
+        self.assertTrue(self.connect_client())
+        time.sleep(0.2)
+        self.assertEqual(down.clients(), 1)
+
+    def test_gateway_survives_all_nodes_down(self):
+        for node in self.nodes:
+            node.stop()
+        time.sleep(0.5)
+
+        # The client is turned away, but the gateway keeps running
+        self.assertFalse(self.connect_client())
+        self.assertIsNone(self.gateway.poll())
+
+        self.nodes[0].start()
+        time.sleep(0.5)
+        self.assertTrue(self.connect_client())
+
+class TestCircuitBreaker(GatewayTestCase):
+
+    extra_config = 'breaker_failure_percent = 50\nbreaker_min_requests = 4\nbreaker_open_ms = 1000\nbreaker_probes = 2\n'
+
+    def test_failing_node_is_avoided_until_it_recovers(self):
+        sick = self.nodes[0]
+        sick.failing = True
+        clients = [self.connect_client() for i in range(3)]
+        time.sleep(0.2)
+        self.assertEqual([node.clients() for node in self.nodes], [1, 1, 1])
+
+        # Only the client connected to the sick node gets errors
+        write = 'INSERT INTO ks.t (id) VALUES (1)'
+        failing = [c for c in clients if self.query(c, write) == OPCODE_ERROR]
+        self.assertEqual(len(failing), 1)
+        client = failing[0]
+        self.assertEqual(self.metric('cql_gateway_upstream_breaker_state', sick), 0)
+
+        # Four failures out of four open its breaker
+        for i in range(3):
+            self.assertEqual(self.query(client, write), OPCODE_ERROR)
+        self.assertEqual(self.metric('cql_gateway_upstream_breaker_state', sick), 1)
+        self.assertEqual(self.metric('cql_gateway_upstream_breaker_trips_total', sick), 1)
+
+        # New clients go elsewhere, and so do reads of the client already connected to it, once it has a connection open to
+        # another node. The first read still goes to the sick node while that connection is opened.
+        started = sick.started()
+        for i in range(3):
+            self.assertTrue(self.connect_client())
+        self.assertEqual(sick.started(), started)
+        self.query(client, 'SELECT * FROM ks.t')
+        time.sleep(0.2)
+        self.assertNotEqual(self.query(client, 'SELECT * FROM ks.t'), OPCODE_ERROR)
+        self.assertEqual(self.metric('cql_gateway_breaker_rerouted_total'), 1)
+
+        # Once it has been open long enough, requests answered in time close it
+        sick.failing = False
+        time.sleep(1.2)
+        for i in range(2):
+            self.assertNotEqual(self.query(client, write), OPCODE_ERROR)
+        self.assertEqual(self.metric('cql_gateway_upstream_breaker_state', sick), 0)
+
+    def test_half_open_node_gets_only_breaker_probes_requests_at_a_time(self):
+        sick = self.nodes[0]
+        sick.failing = True
+        clients = [self.connect_client() for i in range(3)]
+        time.sleep(0.2)
+        write = 'INSERT INTO ks.t (id) VALUES (1)'
+        client = [c for c in clients if self.query(c, write) == OPCODE_ERROR][0]
+        for i in range(3):
+            self.query(client, write)
+        self.assertEqual(self.metric('cql_gateway_upstream_breaker_state', sick), 1)
+
+        # Opens the client's connection to another node, for the reads kept off the sick one
+        self.query(client, 'SELECT * FROM ks.t')
+        time.sleep(0.2)
+
+        # Once half-open, two reads are let through to it, and the third goes elsewhere while they wait
+        sick.failing = False
+        sick.answering.clear()
+        time.sleep(1.2)
+        rerouted = self.metric('cql_gateway_breaker_rerouted_total')
+        read = 'SELECT * FROM ks.t'
+        for stream in range(1, 4):
+            client.sendall(frame(0x01, stream, OPCODE_QUERY, struct.pack('>i', len(read)) + read + struct.pack('>H', 1)))
+        self.assertEqual(recv_frame(client)[0], 3)
+        self.assertEqual(self.metric('cql_gateway_upstream_breaker_state', sick), 2)
+        self.assertEqual(self.metric('cql_gateway_breaker_rerouted_total'), rerouted + 1)
+
+        sick.answering.set()
+        self.assertEqual(sorted([recv_frame(client)[0] for i in range(2)]), [1, 2])
+        self.assertEqual(self.metric('cql_gateway_upstream_breaker_state', sick), 0)
+
+class TestTimeouts(GatewayTestCase):
+
+    extra_config = 'request_timeout_ms = 300\n'
+
+    def test_held_requests_are_answered_with_a_timeout_and_late_answers_dropped(self):
+        client = self.connect_client()
+        self.assertTrue(client)
+        for node in self.nodes:
+            node.answering.clear()
+
+        requests = {5: 'SELECT * FROM ks.t', 6: "INSERT INTO ks.t (id) VALUES (1)"}
+        for stream, query in requests.items():
+            client.sendall(frame(0x01, stream, OPCODE_QUERY, struct.pack('>i', len(query)) + query + struct.pack('>H', 1)))
+
+        # Each is answered on its own stream id, by the gateway
+        errors = {}
+        for i in range(len(requests)):
+            answer = recv_frame(client)
+            self.assertIsNotNone(answer)
+            self.assertEqual(answer[1], OPCODE_ERROR)
+            errors[answer[0]] = struct.unpack('>i', answer[2][:4])[0]
+        self.assertEqual(errors, {5: ERROR_READ_TIMEOUT, 6: ERROR_WRITE_TIMEOUT})
+
+        # The nodes' answers come too late and are dropped, so the next answer the client sees is to its next request
+        for node in self.nodes:
+            node.answering.set()
+        query = 'SELECT * FROM ks.t'
+        client.sendall(frame(0x01, 7, OPCODE_QUERY, struct.pack('>i', len(query)) + query + struct.pack('>H', 1)))
+        self.assertEqual(recv_frame(client), (7, OPCODE_READY, ''))
+        time.sleep(0.2)
+        client.settimeout(0.2)
+        self.assertRaises(socket.timeout, client.recv, 1)
+        self.assertIsNone(self.gateway.poll())
+
+class TestHedging(GatewayTestCase):
+
+    extra_config = 'hedge_percentile = 50\n'
+
+    def send_read(self, client, stream):
+        query = 'SELECT * FROM ks.t'
+        client.sendall(frame(0x01, stream, OPCODE_QUERY, struct.pack('>i', len(query)) + query + struct.pack('>H', 1)))
+
+    def queries(self, node):
+        with node.lock:
+            return sum([c.count(OPCODE_QUERY) for c in node.connections])
+
+    def test_held_read_is_hedged_on_another_node(self):
+        # Only a tenant's reads are hedged, so the client logs in as one
+        client = socket.create_connection(('127.0.0.1', 9042))
+        client.settimeout(2)
+        self.clients.append(client)
+        client.sendall(frame(0x01, 1, OPCODE_STARTUP, string_map([('CQL_VERSION', '3.0.0')])))
+        self.assertEqual(recv_frame(client)[1], OPCODE_READY)
+        client.sendall(frame(0x01, 1, OPCODE_CREDENTIALS, string_map([('username', USER_TOKEN + 'user'), ('password', 'secret')])))
+        self.assertEqual(recv_frame(client)[1], OPCODE_READY)
+
+        # Enough reads for the tenant to have a hedge delay, and for a route to another node to be opened
+        for i in range(120):
+            self.send_read(client, 2)
+            self.assertEqual(recv_frame(client), (2, OPCODE_READY, ''))
+        time.sleep(0.5)
+        for i in range(10):
+            self.send_read(client, 2)
+            self.assertEqual(recv_frame(client), (2, OPCODE_READY, ''))
+
+        own = max(self.nodes, key=self.queries) # The node of the session's own connection got nearly every read
+        others = [node for node in self.nodes if node is not own]
+        before = sum([self.queries(node) for node in others])
+
+        own.answering.clear()
+        self.send_read(client, 5)
+        self.assertEqual(recv_frame(client), (5, OPCODE_READY, '')) # From the other node, while its own holds on to it
+        self.assertGreater(sum([self.queries(node) for node in others]), before)
+
+        # Once released, the answer of the node that lost is dropped
+        own.answering.set()
+        time.sleep(0.2)
+        self.send_read(client, 6)
+        self.assertEqual(recv_frame(client), (6, OPCODE_READY, ''))
+        time.sleep(0.2)
+        client.settimeout(0.2)
+        self.assertRaises(socket.timeout, client.recv, 1)
+        self.assertIsNone(self.gateway.poll())
+
+class TestSupported(GatewayTestCase):
+
+    def test_options_is_answered_by_the_gateway(self):
+        time.sleep(0.2) # The health checks have asked every node
+
+        client = socket.create_connection(('127.0.0.1', 9042))
+        client.settimeout(2)
+        self.clients.append(client)
+        client.sendall(frame(0x01, 3, OPCODE_OPTIONS))
+        self.assertEqual(recv_frame(client), (3, OPCODE_SUPPORTED, SUPPORTED))
+        client.sendall(frame(0x01, 1, OPCODE_STARTUP, string_map([('CQL_VERSION', '3.0.5')])))
+        self.assertEqual(recv_frame(client)[1], OPCODE_READY)
+
+        # The client's own connection only saw its STARTUP
+        time.sleep(0.2)
+        self.assertEqual(sum([node.clients() for node in self.nodes]), 1)
+
+class TestEvents(GatewayTestCase):
+
+    def register(self, client, types):
+        body = struct.pack('>H', len(types)) + ''.join([struct.pack('>H', len(t)) + t for t in types])
+        client.sendall(frame(0x01, 1, OPCODE_REGISTER, body))
+        answer = recv_frame(client)
+        self.assertIsNotNone(answer)
+        self.assertEqual(answer[1], OPCODE_READY)
+
+    def test_client_registered_for_nothing_can_go_away(self):
+        gone = self.connect_client()
+        self.assertTrue(gone)
+        self.register(gone, [])
+        gone.close()
+        self.clients.remove(gone)
+
+        listening = self.connect_client()
+        self.assertTrue(listening)
+        self.register(listening, ['STATUS_CHANGE'])
+        time.sleep(0.2) # for the closed client's thread to clean up
+
+        # These clients never authenticated, so they are sent status rather than schema changes, from the same list
+        address = struct.pack('>B', 4) + socket.inet_aton('127.0.0.1') + struct.pack('>i', 9042)
+        event = struct.pack('>H', 13) + 'STATUS_CHANGE' + struct.pack('>H', 2) + 'UP' + address
+        self.assertTrue(any([node.send_event(event) for node in self.nodes]))
+
+        answer = recv_frame(listening)
+        self.assertIsNotNone(answer)
+        self.assertEqual(answer[:2], (-1, OPCODE_EVENT))
+        self.assertIsNone(self.gateway.poll())
+
+class TestShards(GatewayTestCase):
+
+    extra_config = 'listen_shards = 4\n'
+
+    def shard_metric(self, name):
+        stats = urllib2.urlopen('http://127.0.0.1:%d/' % STATS_PORT).read()
+        return [int(l.split(' ')[1]) for l in stats.splitlines() if l.startswith(name + '{shard=')]
+
+    def test_connections_are_accepted_on_every_shard(self):
+        for i in range(12):
+            self.assertTrue(self.connect_client())
+
+        self.assertEqual(len(self.shard_metric('cql_gateway_shard_accepted_total')), 4)
+        self.assertEqual(sum(self.shard_metric('cql_gateway_shard_accepted_total')), 12)
+        self.assertEqual(sum(self.shard_metric('cql_gateway_shard_connections')), 12)
+
+        for client in self.clients:
+            client.close()
+        self.clients = []
+        time.sleep(0.2)
+        self.assertEqual(sum(self.shard_metric('cql_gateway_shard_connections')), 0)
+
+if __name__ == '__main__':
+    unittest.main()
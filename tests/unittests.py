@@ -18,7 +18,10 @@
 #              names are in that order.
 #              If a test fails, there might be leftover keyspaces or tables that weren't properly cleaned up. This may cause
 #              subsequent tests to fail!
+#              To also check that one tenant's keyspaces aren't visible to another, set $OTHER_TENANT_USER (and
+#              $OTHER_TENANT_PASSWORD, if it isn't 'cassandra') to the user name of a second tenant.
 
+import os
 import unittest
 
 from cassandra.cluster import Cluster
@@ -82,6 +85,54 @@ class TestCassandraQueries(unittest.TestCase):
         for row in rows:
             self.assertTrue(row.keyspace_name in ["system", "system_auth", "system_traces"], "Got unexpected keyspace '%s'" % row.keyspace_name)
 
+    def test_connect_4_schema_tables_after_change(self):
+        ########## Test that the gateway's cached copy of the schema tables follows schema changes ##########
+
+        rows = self._session.execute("SELECT * FROM system.schema_keyspaces;")
+        self.assertEqual(len(rows), 3)
+
+        # Asking again is answered by the gateway itself, and must give the same rows
+        rows = self._session.execute("SELECT * FROM system.schema_keyspaces;")
+        self.assertEqual(len(rows), 3)
+
+        self._session.execute("CREATE KEYSPACE cached WITH replication = {'class': 'SimpleStrategy', 'replication_factor' : 1};")
+        rows = self._session.execute("SELECT * FROM system.schema_keyspaces;")
+        self.assertEqual(len(rows), 4)
+        self.assertTrue("cached" in [row.keyspace_name for row in rows])
+
+        self._session.execute("CREATE TABLE cached.t (id int PRIMARY KEY);")
+        rows = self._session.execute("SELECT * FROM system.schema_columnfamilies;")
+        self.assertTrue("t" in [row.columnfamily_name for row in rows if row.keyspace_name == "cached"])
+
+        self._session.execute("DROP KEYSPACE cached;")
+        rows = self._session.execute("SELECT * FROM system.schema_keyspaces;")
+        self.assertEqual(len(rows), 3)
+
+    def test_connect_5_prefix_collision(self):
+        ########## Test that a keyspace whose name merely contains "system" isn't taken for a shared one ##########
+
+        self._session.execute("CREATE KEYSPACE mysystem WITH replication = {'class': 'SimpleStrategy', 'replication_factor' : 1};")
+        try:
+            rows = self._session.execute("SELECT * FROM system.schema_keyspaces;")
+            self.assertEqual(sorted([row.keyspace_name for row in rows]), ["mysystem", "system", "system_auth", "system_traces"])
+
+            other_user = os.environ.get('OTHER_TENANT_USER')
+            if other_user is None:
+                return
+
+            # Another tenant sees only the shared keyspaces, not ours
+            password = os.environ.get('OTHER_TENANT_PASSWORD', 'cassandra')
+            cluster = Cluster(['127.0.0.1'], port=self._cluster.port, compression=False, auth_provider=lambda ip: {'username': other_user, 'password': password})
+            session = cluster.connect()
+            try:
+                rows = session.execute("SELECT * FROM system.schema_keyspaces;")
+                self.assertFalse("mysystem" in [row.keyspace_name for row in rows], "Another tenant's 'mysystem' keyspace is visible")
+            finally:
+                session.shutdown()
+                cluster.shutdown()
+        finally:
+            self._session.execute("DROP KEYSPACE mysystem;")
+
     def test_tenant_users(self):
         ########## Test that the only users we see are ours ##########
 